@@ -55,22 +55,28 @@
 #define MULTIPLY_AS_A_FUNCTION 0
 #endif
 
+// Storage class of the private variables below. Define AES_TLS as __thread (or _Thread_local)
+// when several threads encrypt or decrypt at the same time, e.g. in a multi-threaded server.
+#ifndef AES_TLS
+#define AES_TLS
+#endif
+
 /*****************************************************************************/
 /* Private variables:                                                        */
 /*****************************************************************************/
 // state - array holding the intermediate results during decryption.
 typedef uint8_t state_t[4][4];
-static state_t* state;
+static AES_TLS state_t* state;
 
 // The array that stores the round keys.
-static uint8_t RoundKey[176];
+static AES_TLS uint8_t RoundKey[176];
 
 // The Key input to the AES Program
-static const uint8_t* Key;
+static AES_TLS const uint8_t* Key;
 
 #if defined(CBC) && CBC
 // Initial Vector used only for CBC mode
-static uint8_t* Iv;
+static AES_TLS uint8_t* Iv;
 #endif
 
 // The lookup-tables are marked const so they can be placed in read-only storage instead of RAM
@@ -9,15 +9,40 @@
 const char *SKYHOOK_ELG_SERVER_URL = "elg.skyhook.com";
 /* Skyhook ELG server port */
 #define SKYHOOK_ELG_SERVER_PORT 9755
+// the server above is used when the preferences list no servers ("host:port" each, see add_config_server())
+
+// a query which takes longer than usual for its server is hedged to the next fastest server,
+// after a delay within these bounds (the upper one while the server's latency is unknown)
+#define HEDGE_MIN_DELAY 300 // ms
+#define HEDGE_MAX_DELAY 3000 // ms
+
+// RTC user memory offset (in 4 byte blocks) of the server statistics, which survive resets;
+// the first 32 blocks are used by OTA updates
+#define RTC_ENDPOINTS_OFFSET 32
+// RTC user memory offset of the last WiFi connection, after the server statistics (14 blocks); it is
+// tried first on a reconnect, polled every FAST_CONNECT_POLL_RATE ms for up to FAST_CONNECT_TIMEOUT ms
+// (FAST_CONNECT_DHCP_TIMEOUT with DHCP), before the scan of all known aps. A wake reuses its DHCP
+// address without DHCP until half the lease has passed, for FAST_CONNECT_MAX_REUSES wakes at most
+#define RTC_WIFI_OFFSET 48
+#define FAST_CONNECT_POLL_RATE 10 // ms
+#define FAST_CONNECT_TIMEOUT 1500 // ms
+#define FAST_CONNECT_DHCP_TIMEOUT 5000 // ms
+#define FAST_CONNECT_MAX_REUSES 50
+// RTC user memory offset of the duty cycle of the low-power clnt mode, after the WiFi connection (34 blocks)
+#define RTC_SLEEP_OFFSET 82
 
 // access point ap name
 const char *AP_SSID = "Skyhook ELG";
 // access point port number
 #define AP_PORT 80
-// wait for packet reception
-#define WIFI_RX_WAIT_TIME 10000 // ms
-
 #define SOCKET_TIMEOUT 10000 // ms
+// the scanned aps are sent in compact form (DATA_TYPE_AP_COMPACT, sky_protocol.h) when it is smaller,
+// to servers which decode it only: 1 when the server above does, servers of the preferences opt in
+// with "host:port+compact"
+#define AP_COMPACT 0
+// 1 when the server above decodes version 2 requests, the batch uploads of the offline scans (see
+// SCANLOG_SECTORS); servers of the preferences opt in with "host:port+v2"
+#define SERVER_V2 0
 
 // user button
 #define AP              1
@@ -37,6 +62,62 @@ const char *AP_SSID = "Skyhook ELG";
 // defines how frequently the device refreshes voltage readings, rssi readings, etc
 #define DEVICE_UPDATE_RATE 1000
 
+// how often the tasks of the scheduler (sky_sched.h) run
+#define BUTTON_POLL_RATE 20 // ms
+#define QUERY_POLL_RATE 10 // ms, while a scan or location query is in progress
+#define SERVER_POLL_RATE 5 // ms, web server in ap mode
+#define WIFI_RETRY_RATE 1000 // ms between attempts to connect to the known aps in clnt mode
+
+// loop() sleeps until the next task is due, for up to MAX_IDLE_SLEEP ms at a time; in clnt mode
+// the WiFi may light sleep meanwhile
+#define MAX_IDLE_SLEEP 100 // ms
+#define IDLE_LIGHT_SLEEP 1
+
+// low-power clnt mode: with DEEP_SLEEP and a scan_frq of DEEP_SLEEP_MIN_PERIOD or more, each wake
+// connects, scans, queries, shows the location for DEEP_SLEEP_DISPLAY_TIME ms (DEEP_SLEEP_MAX_AWAKE ms
+// at most) and deep sleeps until the next scan. Needs GPIO16 wired to RST; the reset button boots
+// normally, with DEEP_SLEEP_FIRST_AWAKE ms for the user button to switch to ap mode
+#define DEEP_SLEEP 0
+#define DEEP_SLEEP_MIN_PERIOD 10000 // ms
+#define DEEP_SLEEP_MIN_SLEEP 1000 // ms
+#define DEEP_SLEEP_DISPLAY_TIME 3000 // ms
+#define DEEP_SLEEP_MAX_AWAKE 15000 // ms
+#define DEEP_SLEEP_FIRST_AWAKE 30000 // ms
+
+// clnt mode keeps a scan every SCANLOG_INTERVAL ms while WiFi is disconnected, with its
+// SKY_SCANLOG_MAX_APS strongest aps, in a flash ring of SCANLOG_SECTORS sectors (sky_scanlog.h), and
+// uploads them once connected in batch requests of SCANLOG_BATCH scans (MAX_BATCH_SCANS at most), to
+// servers which decode version 2 requests only (SERVER_V2); a failed upload is retried UPLOAD_BACKOFF ms
+// later, twice as long after every further failure up to UPLOAD_BACKOFF_MAX
+#define SCANLOG_SECTORS 4
+#define SCANLOG_INTERVAL 10000 // ms
+#define SCANLOG_BATCH 8
+#define UPLOAD_BACKOFF 30000 // ms
+#define UPLOAD_BACKOFF_MAX 600000 // ms
+
+// every location query response is kept in a flash ring of HISTORY_SECTORS pages (sky_history.h, about
+// 100 fixes a page), which /skyhookclient/history streams in chunks of about HISTORY_CHUNK bytes
+#define HISTORY_SECTORS 8
+#define HISTORY_CHUNK 1024 // bytes
+
+// memory headroom (with SKY_METRICS, see sky_metrics.h): the heap is sampled every MEM_SAMPLE_RATE
+// ms, and the stack and heap report printed to serial every MEM_REPORT_RATE ms when DEBUG
+#define MEM_SAMPLE_RATE 1000 // ms
+#define MEM_REPORT_RATE 60000 // ms, a multiple of MEM_SAMPLE_RATE
+
+// log records (sky_log.h, SKY_LOG_LEVEL) are sent to serial every LOG_DRAIN_RATE ms, as far as they
+// fit in the uart's tx fifo of LOG_SERIAL_FIFO bytes; tools/elg_logdecode decodes them. The SDK's
+// debug output is off while they are sent, as it would split them
+#define LOG_DRAIN_RATE 20 // ms
+#define LOG_SERIAL_FIFO 128 // bytes
+
+// the preferences are saved in a flash area of CONFIG_SECTORS sectors (sky_config.h), two or more so
+// that a save never erases the current record
+#define CONFIG_SECTORS 2
+
+// web clients which may subscribe to /skyhookclient/locationevents at a time
+#define MAX_LOCATION_SUBSCRIBERS 4
+
 // max number of successfully connected AP's that are saved into AP.json
 #define MAX_AUTOJOIN_APS 5
 
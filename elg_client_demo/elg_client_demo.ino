@@ -16,10 +16,24 @@
 #include <EEPROM.h>
 #include "sky_crypt.h"
 #include "sky_protocol.h"
+#include "sky_sched.h"
+#include "sky_metrics.h"
+#include "sky_mem.h"
+#include "sky_log.h"
+#include "sky_config.h"
+#include "sky_scanlog.h"
+#include "sky_history.h"
 #include "config.h"
 #include <math.h>
 #include <Wire.h>
 #include <LiFuelGauge.h>
+#include <cont.h>
+extern "C" {
+#include "spi_flash.h"
+#include "user_interface.h"
+#include <lwip/netif.h>
+#include <lwip/dhcp.h>
+}
 
 //startup logo
 static const unsigned char PROGMEM skyhook_logo [] = {
@@ -57,7 +71,7 @@ static const unsigned char PROGMEM skyhook_logo [] = {
 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
 };
 
-// globals for preferences
+// globals for preferences, set from config by apply_config()
 bool reverse_geo = true;
 bool HPE = true;
 int scan_frq;
@@ -67,6 +81,11 @@ unsigned long esp_start_time = 0;
 struct sky_key_t key;
 struct location_rq_t rq;
 struct location_rsp_t resp;
+// encoded MAC and IP entries of the request, re-encoded only when the ip address or key changes
+sky_rq_prefix_t rq_prefix;
+uint32_t rq_prefix_ip = 0;
+// ELG servers of the preferences, ranked by their round trip times
+sky_endpoints_t endpoints;
 
 // function type
 typedef void (*functiontype)();
@@ -88,9 +107,60 @@ class APWiFiWrapper;
 class deviceInfo;
 class ClientWiFiWrapper;
 
-// reads preferences settings (preferences.json) and loads their values
+// reads the preferences from the config store (sky_config.h), importing preferences.json on the
+// first boot with the store, and applies them
 void load_config();
 
+// sets the globals, the key and the servers from config
+void apply_config();
+
+// sets cfg to the defaults, and to preferences.json (of earlier versions) if there is one
+// returns false when there is none
+bool import_preferences_json(sky_config_t *cfg);
+
+// adds a server ("host:port", or "host" for the default port, followed by the capabilities of the server
+// beyond plain version 1 requests, "+compact" or "+v2") to cfg, returns false when it does not fit
+bool add_config_server(sky_config_t *cfg, String server_str);
+String config_server_string(const sky_config_server_t *server);
+
+// flash callbacks of the config store, which takes the last sectors before the file system
+bool config_flash_read(uint32_t offset, void *buff, uint32_t len, void *ctx);
+bool config_flash_write(uint32_t offset, const void *buff, uint32_t len, void *ctx);
+bool config_flash_erase(uint32_t offset, void *ctx);
+
+// flash callbacks of the offline scan log, which takes the sectors before the config store
+bool scanlog_flash_read(uint32_t offset, void *buff, uint32_t len, void *ctx);
+bool scanlog_flash_write(uint32_t offset, const void *buff, uint32_t len, void *ctx);
+bool scanlog_flash_erase(uint32_t offset, void *ctx);
+
+// finds the offline scans to upload in the scan log (sky_scanlog.h)
+void load_scanlog();
+
+// clock of the offline scans (ms): since the boot, across the deep sleeps of the low-power clnt mode
+uint32_t scan_clock();
+
+// schedules upload_task at time at (ms) when there are offline scans to upload
+void schedule_upload(uint32_t at);
+
+// flash callbacks of the location history, which takes the sectors before the offline scan log
+bool history_flash_read(uint32_t offset, void *buff, uint32_t len, void *ctx);
+bool history_flash_write(uint32_t offset, const void *buff, uint32_t len, void *ctx);
+bool history_flash_erase(uint32_t offset, void *ctx);
+
+// reads the page summaries of the location history (sky_history.h)
+void load_history();
+
+// clock of the location history (s): continues from its newest fix at a boot, and follows the time
+// of the server from its responses on
+uint32_t history_clock();
+
+// time of the server in the response (s since the epoch), or 0 when it has none
+uint32_t server_time(const struct location_rsp_t *rsp);
+
+// appends the response of a location query of ap_count aps to the location history, at the time of
+// the server, or of history_clock() when the response has none
+void save_history(struct location_rsp_t *rsp, uint8_t ap_count);
+
 // establish connection to WiFi
 void connect_to_wifi();
 
@@ -109,20 +179,113 @@ bool string_to_bool(String a);
 // stores the file contents into a String
 bool file_to_string(String path, const char* type, String& ret_buf);
 
-// prints binary array in HEX
-void print_buff(uint8_t *buff, int32_t len);
+// clock of the log records (ms)
+uint32_t log_clock();
+
+// send and receive callbacks of sky_client_t over the WiFiClient in rpc_handle; wifi_recv() does not
+// block, wifi_send() blocks in the connect (see there) and the write to the socket
+int32_t wifi_send(uint8_t *buff, uint32_t buff_len, char *host, uint16_t port, void *rpc_handle);
+int32_t wifi_recv(uint8_t *buff, uint32_t buff_len, void *rpc_handle);
+
+// completion callback of the location queries
+void elg_query_done(sky_client_t *query, struct location_rsp_t *rsp, enum SKY_STATUS status);
+
+// keeps the server statistics in RTC memory, so that the fastest server is known after a reset
+void save_endpoints_rtc();
+void load_endpoints_rtc();
+
+// last connection in RTC memory, which keeps it across resets and deep sleep (not power loss)
+struct rtc_wifi_t {
+  uint32_t magic;
+  uint16_t checksum;      // fletcher16 of the members after it
+  uint8_t channel;
+  uint8_t bssid[WL_MAC_ADDR_LENGTH];
+  uint8_t reuses;         // wakes which reused ip without DHCP since the lease
+  uint32_t renew_at;      // scan_clock() (ms) at half the lease, from when a wake gets ip by DHCP again
+  uint32_t ip;            // the DHCP lease, used as a static address
+  uint32_t gateway;
+  uint32_t netmask;
+  uint32_t dns;
+  char ssid[33];
+  char pw[65];
+};
+
+// keeps the ap, channel and ip address of the last connection in RTC memory, for the fast connect
+void save_wifi_rtc();
+bool load_wifi_rtc(struct rtc_wifi_t *rtc);
+void clear_wifi_rtc();
+// true when a wake may reuse the address of the connection without DHCP
+bool wifi_lease_valid(const struct rtc_wifi_t *rtc);
+// seconds of the DHCP lease of the station's address, 0 when it was not leased (e.g. a reused one)
+uint32_t dhcp_lease();
+
+// progress of the fast connect, see ClientWiFiWrapper::fast_connect()
+enum FAST_CONNECT {
+  FAST_CONNECT_NONE = 0,  // no last connection, or it failed
+  FAST_CONNECT_RUNNING,
+  FAST_CONNECT_DONE,
+};
+
+// duty cycle of the low-power clnt mode (DEEP_SLEEP) in RTC memory, which keeps it across the deep
+// sleeps (and resets, not power loss)
+struct rtc_sleep_t {
+  uint32_t magic;
+  uint16_t checksum;        // fletcher16 of the members after it
+  uint16_t reserved;
+  uint32_t wakes;           // # of wakes from deep sleep
+  uint32_t awake_ms;        // total time awake and asleep in the low-power mode
+  uint32_t asleep_ms;
+  struct location_t location; // of the last location query, shown at the wake until the next one arrives
+  uint8_t has_location;
+  uint8_t reserved2[3];
+  uint32_t scans_first;     // sequence # of the first offline scan since the boot, the ones before have no known age
+  uint32_t history_base;    // history_clock() - scan_clock() (s)
+  sky_histogram_t wake_to_fix; // SKY_STAGE_WAKE of the metrics
+};
+
+// restores the duty cycle, or starts it over when RTC memory holds none
+void load_sleep_rtc();
+void save_sleep_rtc();
+
+// low-power clnt mode: true when the device deep sleeps between the scans
+bool can_deep_sleep();
+
+// low-power clnt mode: schedules sleep_task, the deep sleep until the next scan is due, at time at (ms)
+void schedule_sleep(uint32_t at);
+
+// keeps the location, and records the time from the wake to it (SKY_STAGE_WAKE)
+void fix_displayed(uint32_t now);
+
+// starts the soft AP of ap mode, which a wake from deep sleep skips
+void start_soft_ap();
 
 // prints a and message b on msgArea specified by oled feather library in seperate lines
 void print_to_oled(String a, String b);
 
-// prints the currently location in location_rsp_t struct to oled
+// prints the currently location in location_rsp_t struct to oled, and schedules the address page
 void print_location_oled();
 
+// prints the address of the location to oled (display_task)
+void print_address_oled();
+
 // returns number of result bytes that were successfully parsed
 uint32_t hex2bin(const char *hexstr, uint32_t hexlen, uint8_t *result, uint32_t reslen);
 
-// make it easier for device to receive the mode flipping signal
-void yield_wait(int ms);
+// run functions of the scheduler's tasks
+void run_button(sky_task_t *task, uint32_t now);
+void run_device(sky_task_t *task, uint32_t now);
+void run_wifi(sky_task_t *task, uint32_t now);
+void run_scan(sky_task_t *task, uint32_t now);
+void run_query(sky_task_t *task, uint32_t now);
+void run_display(sky_task_t *task, uint32_t now);
+void run_server(sky_task_t *task, uint32_t now);
+void run_memory(sky_task_t *task, uint32_t now);
+void run_log(sky_task_t *task, uint32_t now);
+void run_sleep(sky_task_t *task, uint32_t now);
+void run_upload(sky_task_t *task, uint32_t now);
+
+// schedules the tasks of the device state (AP or client mode)
+void schedule_mode_tasks();
 
 // sends the index.htm page to the client
 void handleRoot();
@@ -148,14 +311,33 @@ void handleChangePreferences();
 // if file not found send 404
 void handleNotFound();
 
-// handles a single location request in AP mode, returns info via json
+// handles a location request in AP mode, returns the latest location and its age via json
 void handleLocation();
 
+// subscribes the web client to the locations as they arrive, as server-sent events
+void handleLocationEvents();
+
+// streams the fixes of the location history from time from to time to (s of history_clock(), the
+// whole history without them) via json
+void handleHistory();
+
+#if SKY_METRICS
+// returns the latency histograms of the stages of a fix, the statistics of the tasks and the memory
+// headroom via json
+void handleMetrics();
+#endif
+
+// samples the free heap, its largest free block and its fragmentation (with SKY_METRICS)
+void sample_heap();
+
+// prints the stack high-water marks and the heap samples to serial (with SKY_METRICS)
+void print_memory();
+
 void insert_bssid_info(JsonObject& info, int index);
 
+// sets error to the response type of a location response which is an error, and returns true
 bool get_error(String& error);
 int get_max(int buf[], int len);
-void print64(uint64_t value);
 
 void print_saved_networks();
 void print_saved_preferences();
@@ -167,6 +349,57 @@ const char *password = "";
 
 ESP8266WebServer server(80);
 WiFiClient client;
+// second connection for queries hedged (or failed over) to another server
+WiFiClient hedge_client;
+// location queries: [0] to the fastest server on client, [1] to the next fastest on hedge_client
+sky_client_t elg_query[2];
+// frames of the location queries, both receive at once when hedged; query_buff[1] holds the batch of
+// an offline scan upload as well, which runs on elg_query[0] alone
+uint8_t query_buff[2][SKY_PROT_BUFF_LEN];
+// responses of the location queries, the one of the query done first is copied to resp
+struct location_rsp_t query_resp[2];
+// preferences, saved in binary with a CRC (sky_config.h); json only at the web server
+sky_config_t config;
+sky_config_store_t config_store = {CONFIG_SECTORS * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE, config_flash_read,
+    config_flash_write, config_flash_erase, NULL, 0, 0};
+// the sketch leaves room for the config store (see load_config())
+bool config_flash_free = false;
+// scans taken while offline, uploaded in batches once connected
+sky_scanlog_t scanlog = {SCANLOG_SECTORS * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE, scanlog_flash_read,
+    scanlog_flash_write, scanlog_flash_erase, NULL, 0, 0, 0, 0, 0};
+bool scanlog_ready = false;
+// every location query response, with the page summaries of its flash pages
+sky_history_page_t history_pages[HISTORY_SECTORS];
+sky_history_t history = {HISTORY_SECTORS * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE, history_flash_read,
+    history_flash_write, history_flash_erase, NULL, history_pages, 0, 0, 0};
+bool history_ready = false;
+// cooperative scheduler which runs the tasks below from loop(), see setup()
+sky_sched_t sched;
+sky_task_t button_task;   // reads the user button
+sky_task_t device_task;   // battery, rssi and ip address on the oled
+sky_task_t wifi_task;     // clnt mode: reconnects to the known aps
+sky_task_t scan_task;     // starts a scan every scan_frq ms (ap mode: while web clients subscribe)
+sky_task_t query_task;    // waits for the scan, then polls the location query
+sky_task_t display_task;  // clnt mode: second page of the location on the oled
+sky_task_t server_task;   // ap mode: web server
+sky_task_t memory_task;   // samples the heap, and reports the memory headroom to serial
+sky_task_t log_task;      // sends the log records (sky_log.h) to serial, as they fit
+sky_task_t sleep_task;    // low-power clnt mode: deep sleeps until the next scan
+sky_task_t upload_task;   // uploads the offline scans in batches once connected
+// low-power clnt mode: the reset was a wake from deep sleep, and the duty cycle so far
+bool woke_from_sleep = false;
+struct rtc_sleep_t sleep_state;
+#if SKY_METRICS
+// deepest stack use of the heaviest functions, the tasks' are in their sky_task_t
+sky_stack_probe_t send_scan_probe = {"send_scan", 0, 0};
+sky_stack_probe_t poll_probe = {"poll", 0, 0};
+sky_stack_probe_t update_fix_probe = {"update_fix", 0, 0};
+sky_stack_probe_t display_probe = {"print_location_oled", 0, 0};
+// heap samples, see sample_heap()
+uint32_t heap_min_free = UINT32_MAX;
+uint32_t heap_min_block = UINT32_MAX;
+uint8_t heap_max_frag = 0;
+#endif
 Adafruit_FeatherOLED_WiFi oled = Adafruit_FeatherOLED_WiFi();
 LiFuelGauge gauge(MAX17043);
 
@@ -333,6 +566,7 @@ class APWiFiWrapper {
       char* responseJSON = (char*)malloc((obj.measureLength() + 1) * sizeof(char));
       obj.printTo(responseJSON, obj.measureLength() + 1);
       // obj.prettyPrintTo(Serial);
+      sample_heap(); // with the json buffers at their largest
       server.send(200, "application/json", responseJSON);
       optimistic_yield(200);
       free(responseJSON);
@@ -342,26 +576,18 @@ class APWiFiWrapper {
 APWiFiWrapper main_wifi;
 
 class deviceInfo{
-  unsigned long now;
-  unsigned long last_update;
   int esp_state;
   
   public:
     deviceInfo(){
-      now = millis();
-      last_update = 0;
       esp_state = INITIAL_STARTUP_STATE;
     }
 
-  // updates OLED and device info every 
+  // updates OLED and device info, run by device_task every DEVICE_UPDATE_RATE ms in ap mode and
+  // while the WiFi is disconnected (the location is displayed otherwise)
   void handle(){
-    if(state.update()){
-      return;
-    }
-    now = millis();
-    if(now - last_update > DEVICE_UPDATE_RATE){
-      update_oled(); 
-      last_update = now;
+    if(esp_state == AP || WiFi.status() != WL_CONNECTED){
+      update_oled();
     }
   }
 
@@ -418,6 +644,7 @@ class deviceInfo{
     oled.clearDisplay();
     esp_state = !esp_state;
     set_state_settings();
+    schedule_mode_tasks();
     Serial.println("---------- Device State Changed ----------");
   }
 
@@ -434,39 +661,100 @@ ESP8266WiFiMulti WiFiMulti;
 // class used when on Client mode
 class ClientWiFiWrapper{
   bool sent;
-  // access point array
-  struct ap_t aps[MAX_APS];
-  // stores response
-  unsigned long txTimer;
-  unsigned long rxTimer;
-  int check_time;
+  bool scanning;
+  // latest location (json members, or an error) and the time it arrived, see update_fix()
+  String fix;
+  unsigned long fix_time;
+  bool has_fix;
+  // web clients of /skyhookclient/locationevents
+  WiFiClient subscribers[MAX_LOCATION_SUBSCRIBERS];
+#if SKY_METRICS
+  uint32_t scan_start;
+#endif
+  // location query in progress: result is -1 until it completes, then its SKY_STATUS
+  int result;
+  int last_error;
+  bool hedged;
+  uint32_t frame_len;
+  uint8_t frame_caps;       // SKY_ENDPOINT_* a server needs for the encoded request
+  int query_endpoint[2];
+  int connected_endpoint[2];
+  unsigned long query_start[2];
+  // aps of the scan of the location query
+  uint8_t query_aps;
+  // batch request of offline scans in progress (see handle_upload()): status is -1 until it completes
+  bool uploading;
+  int upload_status;
+  uint8_t upload_count;
+  uint32_t upload_age[SCANLOG_BATCH];
+  sky_scanlog_cursor_t upload_cursor;
+  // back-off of the uploads while they fail: 0, or the wait (ms) after the last failure and its end
+  uint32_t upload_backoff;
+  uint32_t upload_retry_at;
+  // scan_clock() of the last offline scan saved
+  uint32_t saved_at;
+  // fast connect in progress (see fast_connect()): its start and timeout (ms)
+  bool fast_connecting;
+  unsigned long fast_connect_start;
+  unsigned long fast_connect_timeout;
   
   public:
     ClientWiFiWrapper(){
       sent = false;
-      txTimer = 0;
-      rxTimer = 0;
-      check_time = 0;
+      scanning = false;
+      fix_time = 0;
+      has_fix = false;
+      result = -1;
+      last_error = -1;
+      hedged = false;
+      frame_len = 0;
+      frame_caps = 0;
+      query_aps = 0;
+      for(int i = 0; i < 2; i++){
+        query_endpoint[i] = -1;
+        connected_endpoint[i] = -1;
+        query_start[i] = 0;
+      }
+      uploading = false;
+      upload_status = -1;
+      upload_count = 0;
+      upload_backoff = 0;
+      upload_retry_at = 0;
+      saved_at = 0;
+      fast_connecting = false;
+      fast_connect_start = 0;
+      fast_connect_timeout = 0;
     }
 
-  // loads AP's from AP.json and attempts to connect to one of them
-  void conn_known_ap(){
+  // loads AP's from AP.json and attempts to connect to one of them; returns false while the fast
+  // connect to the ap of the last connection is in progress, and is called again until it returns true
+  bool conn_known_ap(){
     unsigned long now = millis();
     int check_times = 0;
     bool init_check_finish = false;
 
+    // the ap of the last connection first, the scan of all known aps only when it fails
+    switch (fast_connect()) {
+      case FAST_CONNECT_RUNNING:
+        return false;
+      case FAST_CONNECT_DONE:
+        return true;
+      default:
+        break;
+    }
+
     String APjson;
     // write existing data to a buffer
     if (!file_to_string("/resources/AP.json","r",APjson)) {
       // if there is no AP.json file then no AP's to load
-      return;
+      return true;
     }
 
     DynamicJsonBuffer bssid_obj_buf;
     JsonObject& bssid_obj = bssid_obj_buf.parseObject(APjson);
 
     if (bssid_obj.size() == 0) {
-      return; // no known access point
+      return true; // no known access point
     }
 
     for (JsonObject::iterator it=bssid_obj.begin(); it!=bssid_obj.end(); ++it)
@@ -482,29 +770,131 @@ class ClientWiFiWrapper{
     yield();
     Serial.println(str_status[WiFiMulti.run()]);
     WiFi.scanDelete();
+    return true;
+  }
+
+  // connects to the ap of the last connection (RTC memory) without a scan, on its channel and bssid;
+  // a wake within half the DHCP lease reuses its ip address without DHCP (wifi_lease_valid()), other
+  // connects get one by DHCP. It does not wait for the connection, the first call starts it and the
+  // later ones poll it
+  enum FAST_CONNECT fast_connect(){
+    struct rtc_wifi_t rtc;
+    if (!load_wifi_rtc(&rtc)) {
+      fast_connecting = false;
+      return FAST_CONNECT_NONE;
+    }
+    if (!fast_connecting) {
+      if (wifi_lease_valid(&rtc)) {
+        WiFi.config(IPAddress(rtc.ip), IPAddress(rtc.gateway), IPAddress(rtc.netmask), IPAddress(rtc.dns));
+        fast_connect_timeout = FAST_CONNECT_TIMEOUT;
+      }
+      else {
+        WiFi.config(0U, 0U, 0U);
+        fast_connect_timeout = FAST_CONNECT_DHCP_TIMEOUT;
+      }
+      WiFi.begin(rtc.ssid, rtc.pw, rtc.channel, rtc.bssid);
+      fast_connecting = true;
+      fast_connect_start = millis();
+      return FAST_CONNECT_RUNNING;
+    }
+    unsigned long elapsed = millis() - fast_connect_start;
+    int status = WiFi.status();
+    if (status == WL_CONNECTED) {
+      fast_connecting = false;
+      Serial.println("fast connect to " + String(rtc.ssid) + " in " + String(elapsed) + " ms");
+      return FAST_CONNECT_DONE;
+    }
+    if (status != WL_CONNECT_FAILED && elapsed < fast_connect_timeout) {
+      return FAST_CONNECT_RUNNING;
+    }
+    // the ap moved or is gone: the next connection is found by the scan, and gets its address by DHCP
+    fast_connecting = false;
+    Serial.println("fast connect to " + String(rtc.ssid) + " failed");
+    clear_wifi_rtc();
+    WiFi.disconnect();
+    WiFi.config(0U, 0U, 0U);
+    return FAST_CONNECT_NONE;
   }
 
-  // scans surrounding AP's and sends info to elg server
-  void scan(){
-    uint8_t * buff = NULL;
-    SKY_LOCAL_BYTE_BUFF_32(buff,SKY_PROT_BUFF_LEN);
+  bool is_fast_connecting(){
+    return fast_connecting;
+  }
 
-    yield();
-    int n = WiFi.scanNetworks(false,true);
-    yield();
+  // starts a scan of the surrounding AP's in the background, see scan_complete()
+  void start_scan(){
+    SKY_METRICS_MARK(scan_start);
+    WiFi.scanNetworks(true,true);
+    scanning = true;
+  }
 
-    if (n > MAX_APS){
-      n = MAX_APS;
+  // returns false while the background scan runs, or sends its info to elg server and returns true
+  bool scan_complete(){
+    int n = WiFi.scanComplete();
+    if(n == WIFI_SCAN_RUNNING){
+      return false;
     }
-  
-    for (int i = 0; i < n; ++i)
-    {
-        if(state.update()) return;
-        aps[i].rssi = (int8_t)WiFi.RSSI(i);
-        memcpy(aps[i].MAC, WiFi.BSSID(i), sizeof(aps[i].MAC));
-        // delay(10);
-        yield();
+    SKY_METRICS_STOP(SKY_STAGE_SCAN, scan_start);
+    scanning = false;
+    if(WiFi.status() != WL_CONNECTED){
+      save_scan(n < 0 ? 0 : n);
+      return true;
+    }
+    SKY_STACK_PROBE(send_scan_probe, send_scan(n < 0 ? 0 : n));
+    return true;
+  }
+
+  bool is_busy(){
+    return scanning || sent || uploading;
+  }
+
+  bool is_scanning(){
+    return scanning;
+  }
+
+  // keeps the strongest of the n scanned AP's in the offline scan log, for the upload once connected
+  void save_scan(int n){
+    sky_scan_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.time = scan_clock();
+    for(int i = 0; i < n; i++){
+      struct ap_t ap;
+      ap.rssi = (int8_t)WiFi.RSSI(i);
+      ap.flag = 0;
+      memcpy(ap.MAC, WiFi.BSSID(i), sizeof(ap.MAC));
+      sky_scan_record_add_ap(&record, &ap);
+    }
+    WiFi.scanDelete();
+    saved_at = record.time;
+    if(record.ap_count == 0){
+      return; // nothing to locate
+    }
+    if(!sky_scanlog_append(&scanlog, &record)){
+      Serial.println("failed to save the offline scan");
+      return;
+    }
+    uint32_t pending = sky_scanlog_pending(&scanlog);
+    Serial.println("offline scan " + String(record.seq) + " saved, " + String(pending) + " to upload");
+    oled.clearDisplay();
+    device.update_oled();
+    print_to_oled("Wifi Disconnected", "scan saved, " + String(pending) + " to upload");
+    oled.display();
+    schedule_sleep(millis() + DEEP_SLEEP_DISPLAY_TIME);
+  }
+
+  // sends the info of the n scanned AP's to elg server
+  void send_scan(int n){
+    // the request is encoded in place for the first query
+    uint8_t * buff = query_buff[0];
+    result = -1;
+
+    // the fastest server, whose capabilities the request may use; hedging and failing over need them too
+    int ep = sky_endpoints_select(&endpoints, millis(), -1, 0);
+    if (ep < 0){
+        Serial.println("failed to start query");
+        WiFi.scanDelete();
+        return;
     }
+    frame_caps = endpoints.endpoints[ep].caps & SKY_ENDPOINT_AP_COMPACT;
 
     // create location request
       rq.key = key; // assign key
@@ -516,15 +906,14 @@ class ClientWiFiWrapper{
   
       // set protocol version
       rq.header.version = SKY_PROTOCOL_VERSION;
+      rq.ap_type = (frame_caps & SKY_ENDPOINT_AP_COMPACT) ? DATA_TYPE_AP_COMPACT : DATA_TYPE_AP;
 
       rq.payload_ext.payload.sw_version = 1;
   
       //rq.payload_ext.payload.type = LOCATION_RQ; // simple location request
       rq.payload_ext.payload.type = LOCATION_RQ_ADDR; // full address lookup
       //rq.version = SKY_SOFTWARE_VERSION; // skyhook client library version
-      rq.ap_count = n & 0xFF; // set the number of scanned access points
-  
-      rq.aps = aps; // assign aps
+
       // in this demo we are not using cell, ble or gps
       // zero counts
       uint8_t tmp_ip[4];
@@ -541,389 +930,1064 @@ class ClientWiFiWrapper{
       rq.ip_count = 1;
       rq.mac_count = 1;
 
-      Serial.println("\n########### Location Request ###########");
+      if ((uint32_t)WiFi.localIP() != rq_prefix_ip) {
+        rq_prefix_ip = (uint32_t)WiFi.localIP();
+        sky_rq_prefix_invalidate(&rq_prefix);
+      }
+
+    // scanned access points are written straight into the request buffer
+    SKY_METRICS_START(start);
+    struct ap_t * aps = sky_encode_req_aps_begin(buff, SKY_PROT_BUFF_LEN, &rq, &rq_prefix);
+    if (aps == NULL){
+        Serial.println("failed to encode request");
+        WiFi.scanDelete();
+        return;
+    }
+#if SKY_METRICS
+    uint32_t encode_cycles = sky_cycles() - start; // with the aps encoded by sky_encode_req_aps_end()
+#endif
+
+    SKY_METRICS_MARK(start);
+    if (n > MAX_APS){
+      n = MAX_APS;
+    }
+    query_aps = n;
+  
+    for (int i = 0; i < n; ++i)
+    {
+        if(state.update()) return;
+        aps[i].rssi = (int8_t)WiFi.RSSI(i);
+        aps[i].flag = 0;
+        memcpy(aps[i].MAC, WiFi.BSSID(i), sizeof(aps[i].MAC));
+        // delay(10);
+        yield();
+    }
+    SKY_METRICS_STOP(SKY_STAGE_SELECT, start);
 
-      Serial.println("Protocol: " + String(rq.header.version));
-      Serial.println("Num APs: " + String(rq.ap_count));
-      Serial.println(sizeof(buff));
-      int cnt = sky_encode_req_bin(buff, SKY_PROT_BUFF_LEN, &rq);
+      SKY_LOG_DEBUG("location request: protocol %u, %d aps", rq.header.version, n);
+      SKY_METRICS_MARK(start);
+      int cnt = sky_encode_req_aps_end(buff, SKY_PROT_BUFF_LEN, &rq, &rq_prefix, n & 0xFF);
   
       if (cnt == -1){
           Serial.println("failed to encode request");
           return;
       }
-
-      Serial.println("ENCODING DONE");
+#if SKY_METRICS
+      sky_metrics_record(SKY_STAGE_ENCODE, encode_cycles + sky_cycles() - start);
+#endif
   
       /* encrypt buffer, use hardware encryption when available */
-      Serial.println(cnt);
-      print_buff(buff, cnt);
-      Serial.println(cnt - sizeof(sky_rq_header_t));
-      int r = sky_aes_encrypt(buff + sizeof(sky_rq_header_t), cnt - sizeof(sky_rq_header_t) - sizeof(sky_checksum_t), key.aes_key, buff + sizeof(sky_rq_header_t) - sizeof(rq.header.iv));
+      uint32_t header_len = 0;
+      sky_get_frame_len(buff, cnt, true, &header_len);
+      SKY_LOG_DUMP(SKY_LOG_LEVEL_DEBUG, "encoded request", buff, cnt);
+      SKY_METRICS_MARK(start);
+      int r = sky_aes_encrypt(buff + header_len, cnt - header_len - sizeof(sky_checksum_t), key.aes_key, buff + header_len - sizeof(rq.header.iv));
   
       if (r == -1){
           Serial.println("failed to encrypt");
           return;
       }
-  
-      // close any connection
-      yield();
-      client.stop();
-      yield();
-  
-      Serial.print("connecting to ");
-      Serial.print(SKYHOOK_ELG_SERVER_URL);
-      Serial.print(":");
-      Serial.println(SKYHOOK_ELG_SERVER_PORT);
-
-      // on failure to connect to elg server
-      yield();
-      if (!client.connect(SKYHOOK_ELG_SERVER_URL, SKYHOOK_ELG_SERVER_PORT))
-      {
-          yield();
-          Serial.println("connection failed");
-          oled.clearDisplay();
-          device.update_oled();
-          print_to_oled("connection failed", "retrying...");
-          oled.display();
-          unsigned long now = millis();
-
-          // "delay" for a second
-          while(true){
-            yield();
-            if(now - millis() > 1000){
-              break;
-            }
-            if(state.update()){return;}
-          }
+      SKY_METRICS_STOP(SKY_STAGE_ENCRYPT, start);
+      WiFi.scanDelete();
+
+      // kept for hedging or failing over, as the first query receives its response into buff
+      frame_len = cnt;
+      memcpy(query_buff[1], buff, frame_len);
+
+      memset(&resp.location_ext, 0, sizeof(resp.location_ext)); // clear the values
+      hedged = false;
+      last_error = -1;
+
+      // poll() sends the request to the fastest server and receives the response
+      if (!start_query(0, ep)){
+          Serial.println("failed to start query");
           return;
       }
-      yield();
-  
-      size_t wcnt = client.write((const uint8_t *)buff, (size_t)cnt);
-      Serial.print("sent:");
-      Serial.println(wcnt);
       sent = true;
-      WiFi.scanDelete();
       Serial.println("########################################\n");
   }
 
-  // rx() receives a location response from skyhook
-  bool rx(){
-    uint8_t * buff = NULL;
-    SKY_LOCAL_BYTE_BUFF_32(buff,SKY_PROT_BUFF_LEN);
+  // starts query i (0 or 1) of the encoded request to server ep
+  bool start_query(int i, int ep){
+    if(ep < 0){
+      return false;
+    }
+    // a connection to another server is closed first
+    WiFiClient *c = (WiFiClient *)elg_query[i].rpc_handle;
+    if(connected_endpoint[i] != ep){
+      c->stop();
+      connected_endpoint[i] = ep;
+    }
+    Serial.print("query " + String(i) + " to ");
+    Serial.println(endpoints.endpoints[ep].url);
+    query_endpoint[i] = ep;
+    query_start[i] = millis();
+    query_resp[i].key = key; // assign decryption key
+    return sky_client_start_encoded(&elg_query[i], frame_len, &query_resp[i], endpoints.endpoints[ep].url, query_start[i], SOCKET_TIMEOUT);
+  }
 
-    int n = client.available();
-    while(n = client.available()){
-      // check for button interrupt
-      if(state.update()){
-        Serial.println("rx() failed due to state change");
-        return false;
-      }
+  // moves the location query on; returns true when it has completed, with its SKY_STATUS in result
+  bool poll(){
+    unsigned long now = millis();
+    sky_client_poll(&elg_query[0], now);
 
-      
-      // trim to buff size
-      if (n > SKY_PROT_BUFF_LEN){
-          n = SKY_PROT_BUFF_LEN;
+    // hedge a query which takes longer than usual for its server to the next fastest server
+    if(!hedged && result < 0 && elg_query[0].state != SKY_CLIENT_IDLE){
+      unsigned long hedge_delay = sky_endpoints_hedge_delay(&endpoints, query_endpoint[0]);
+      if(hedge_delay == 0 || hedge_delay > HEDGE_MAX_DELAY){
+        hedge_delay = HEDGE_MAX_DELAY;
       }
-      Serial.println("\n########### Location Response ###########");
-      //Serial.println(buff);
-      yield();
-      n = client.read(buff, n);
-      yield();
-      Serial.print("read bytes: ");
-      Serial.println(n);
-
-      memset(&resp.location_ext, 0, sizeof(resp.location_ext)); // clear the values
-      resp.key = key; // assign decryption key
-
-      if (sky_aes_decrypt(buff + sizeof(sky_rsp_header_t), n - sizeof(sky_rsp_header_t) - sizeof(sky_checksum_t), key.aes_key, buff + sizeof(sky_rsp_header_t) - sizeof(resp.header.iv)) != 0){
-          Serial.println("failed to decrypt response");
-          return false;
+      else if(hedge_delay < HEDGE_MIN_DELAY){
+        hedge_delay = HEDGE_MIN_DELAY;
+      }
+      if(now - query_start[0] > hedge_delay){
+        hedged = true;
+        start_query(1, sky_endpoints_select(&endpoints, now, query_endpoint[0], frame_caps));
       }
+    }
+    sky_client_poll(&elg_query[1], now);
 
-      print_buff(buff, n);
+    if(elg_query[0].state != SKY_CLIENT_IDLE || elg_query[1].state != SKY_CLIENT_IDLE){
+      return false;
+    }
+    if(result < 0){
+      result = last_error;
+    }
+    sent = false;
+    save_endpoints_rtc();
+    return true;
+  }
 
-      int res = sky_decode_resp_bin(buff, SKY_PROT_BUFF_LEN, &resp);
+  // completion of query (elg_query[0] or [1])
+  void query_done(sky_client_t *query, enum SKY_STATUS status){
+    if(uploading){
+      upload_status = status; // see handle_upload()
+      return;
+    }
+    int i = (query == &elg_query[0]) ? 0 : 1;
+    int other = 1 - i;
+    unsigned long now = millis();
 
-      if (res == -1){
-          Serial.println("failed to decode response");
-          return false;
+    if(status == SKY_OK){
+      Serial.println("query " + String(i) + " done in " + String(now - query_start[i]) + " ms");
+      sky_endpoints_report(&endpoints, query_endpoint[i], now, true, now - query_start[i]);
+      resp = query_resp[i]; // its location_ext points into query_buff[i], untouched until the next scan
+      result = SKY_OK;
+      if(elg_query[other].state != SKY_CLIENT_IDLE){
+        // the slower server's time so far is a lower bound of its round trip time
+        sky_endpoints_report(&endpoints, query_endpoint[other], now, true, now - query_start[other]);
+        sky_client_cancel(&elg_query[other]);
+        ((WiFiClient *)elg_query[other].rpc_handle)->stop();
       }
+      return;
+    }
 
-      print_location_resp(&resp);
-      sent = false;
-      return true;
+    Serial.println("query " + String(i) + " failed: " + String(status));
+    sky_endpoints_report(&endpoints, query_endpoint[i], now, false, 0);
+    last_error = status;
+    ((WiFiClient *)query->rpc_handle)->stop();
+    // fail over to the next fastest server unless the query is hedged already
+    if(!hedged && result < 0){
+      hedged = true;
+      start_query(1, sky_endpoints_select(&endpoints, now, query_endpoint[i], frame_caps));
     }
-    Serial.println("rx() failed due to no data available");
-    return false;
   }
 
-  // ONLY FOR DEBUGGING IN SERIAL
+  // logs the location response (sky_log.h)
   void print_location_resp(struct location_rsp_t *cr)
   {
-    Serial.println();
-    Serial.print("timestamp: ");
-
-    uint64_t timestamp = 0;
-    strncpy((char *)&timestamp, (const char *)cr->payload_ext.payload.timestamp, sizeof(cr->payload_ext.payload.timestamp));
-    print64(timestamp);
-    Serial.println();
-
-/*
-    char str[100];
-    sprintf(str, "%" PRIu64, cr->timestamp);
-    Serial.println(str);
-*/
-    Serial.print("protocol: "); Serial.println(cr->header.version);
-    //Serial.print("server version: "); Serial.println(cr->version);
-    Serial.print("payload type no: "); Serial.println(cr->payload_ext.payload.type);
-    
-    // http codes
-    // if (cr->payload_ext.payload.type < HTTP_UNKNOWN && cr->payload_ext.payload.type >= HTTP_200)
-    // {
-    //     int err;
-    //     if (cr->payload_ext.payload.type > HTTP_505) err = HTTP_UNKNOWN;
-    //     else if (cr->payload_ext.payload.type >= HTTP_500) err = cr->payload_ext.payload.type - HTTP_500 + 500;
-    //     else if (cr->payload_ext.payload.type > HTTP_417) err = HTTP_UNKNOWN;
-    //     else if (cr->payload_ext.payload.type >= HTTP_400) err = cr->payload_ext.payload.type - HTTP_400 + 400;
-    //     else if (cr->payload_ext.payload.type > HTTP_307) err = HTTP_UNKNOWN;
-    //     else if (cr->payload_ext.payload.type >= HTTP_300) err = cr->payload_ext.payload.type - HTTP_300 + 300;
-    //     else if (cr->payload_ext.payload.type > HTTP_206) err = HTTP_UNKNOWN;
-    //     else if (cr->payload_ext.payload.type >= HTTP_200) err = cr->payload_ext.payload.type - HTTP_200 + 200;
-    //     else err = HTTP_UNKNOWN;
-
-    //     Serial.print("HTTP "); Serial.println(err);
-    // }
-    // else
-    // {
-        switch (cr->payload_ext.payload.type)
-        {
-            case LOCATION_RQ_SUCCESS: Serial.println("LOCATION_RQ_SUCCESS"); break;
-            case LOCATION_RQ_ADDR_SUCCESS: Serial.println("LOCATION_RQ_ADDR_SUCCESS"); break;
-            case PROBE_REQUEST_SUCCESS: Serial.println("PROBE_REQUEST_SUCCESS"); break;
-            case LOCATION_RQ_ERROR: Serial.println("LOCATION_RQ_ERROR"); break;
-            case LOCATION_GATEWAY_ERROR: Serial.println("LOCATION_GATEWAY_ERROR"); break;
-            case LOCATION_API_ERROR: Serial.println("LOCATION_API_ERROR"); break;
-            case LOCATION_UNKNOWN: Serial.println("LOCATION_UNKNOWN"); break;
-            case LOCATION_UNABLE_TO_DETERMINE: Serial.println("LOCATION_UNABLE_TO_DETERMINE"); break;
-        }
-    // }
+    uint32_t timestamp[2] = {0, 0};
+    memcpy(timestamp, cr->payload_ext.payload.timestamp, sizeof(cr->payload_ext.payload.timestamp));
+    SKY_LOG_INFO("location response: protocol %u, payload type %u, timestamp 0x%08x%08x",
+        cr->header.version, cr->payload_ext.payload.type, timestamp[1], timestamp[0]);
 
     if (cr->payload_ext.payload.type != LOCATION_RQ_SUCCESS &&
         cr->payload_ext.payload.type != LOCATION_RQ_ADDR_SUCCESS) return;
 
-    Serial.println("LOCATION_RQ_SUCCESS");
-    Serial.print("latitude: "); Serial.println(cr->location.lat, 6);
-    Serial.print("longitude: "); Serial.println(cr->location.lon, 6);
-    Serial.print("hpe: "); Serial.println(cr->location.hpe);
-    Serial.print("distance_to_point: "); Serial.println(cr->location.distance_to_point);
+    SKY_LOG_INFO("latitude: %.6lf longitude: %.6lf hpe: %.1f distance_to_point: %.1f", SKY_LOG_DOUBLE(cr->location.lat),
+        SKY_LOG_DOUBLE(cr->location.lon), SKY_LOG_FLOAT(cr->location.hpe), SKY_LOG_FLOAT(cr->location.distance_to_point));
     
     if (cr->payload_ext.payload.type == LOCATION_RQ_ADDR_SUCCESS)
     {
-        Serial.println("LOCATION_RQ_ADDR_SUCCESS");
-        Serial.print("street num: "); print_s(cr->location_ext.street_num, cr->location_ext.street_num_len);
-        Serial.print("address: "); print_s(cr->location_ext.address, cr->location_ext.address_len);
-        Serial.print("city: "); print_s(cr->location_ext.city, cr->location_ext.city_len);
-        Serial.print("state: "); print_s(cr->location_ext.state, cr->location_ext.state_len);
-        Serial.print("state code: "); print_s(cr->location_ext.state_code, cr->location_ext.state_code_len);
-        Serial.print("postal code: "); print_s(cr->location_ext.postal_code, cr->location_ext.postal_code_len);
-        Serial.print("county: "); print_s(cr->location_ext.county, cr->location_ext.county_len);
-        Serial.print("country: "); print_s(cr->location_ext.country, cr->location_ext.country_len);
-        Serial.print("country code: "); print_s(cr->location_ext.country_code, cr->location_ext.country_code_len);
-        Serial.print("metro1: "); print_s(cr->location_ext.metro1, cr->location_ext.metro1_len);
-        Serial.print("metro2: "); print_s(cr->location_ext.metro2, cr->location_ext.metro2_len);
-        Serial.print("ip: "); print_ip(cr->location_ext.ip_addr, cr->location_ext.ip_type);
-        Serial.println("#########################################\n");
-    }
-  }
-  // ONLY FOR DEBUGGING IN SERIAL
-  void print_s(char *buff, int len)
-  {
-      int i;
-      for (i = 0; i < len; i++)
-      {
-          Serial.print(buff[i]);
-      }
-  
-      Serial.println();
+        SKY_LOG_TEXT(SKY_LOG_LEVEL_INFO, "street num: ", cr->location_ext.street_num, cr->location_ext.street_num_len);
+        SKY_LOG_TEXT(SKY_LOG_LEVEL_INFO, "address: ", cr->location_ext.address, cr->location_ext.address_len);
+        SKY_LOG_TEXT(SKY_LOG_LEVEL_INFO, "city: ", cr->location_ext.city, cr->location_ext.city_len);
+        SKY_LOG_TEXT(SKY_LOG_LEVEL_INFO, "state: ", cr->location_ext.state, cr->location_ext.state_len);
+        SKY_LOG_TEXT(SKY_LOG_LEVEL_INFO, "state code: ", cr->location_ext.state_code, cr->location_ext.state_code_len);
+        SKY_LOG_TEXT(SKY_LOG_LEVEL_INFO, "postal code: ", cr->location_ext.postal_code, cr->location_ext.postal_code_len);
+        SKY_LOG_TEXT(SKY_LOG_LEVEL_INFO, "county: ", cr->location_ext.county, cr->location_ext.county_len);
+        SKY_LOG_TEXT(SKY_LOG_LEVEL_INFO, "country: ", cr->location_ext.country, cr->location_ext.country_len);
+        SKY_LOG_TEXT(SKY_LOG_LEVEL_INFO, "country code: ", cr->location_ext.country_code, cr->location_ext.country_code_len);
+        SKY_LOG_TEXT(SKY_LOG_LEVEL_INFO, "metro1: ", cr->location_ext.metro1, cr->location_ext.metro1_len);
+        SKY_LOG_TEXT(SKY_LOG_LEVEL_INFO, "metro2: ", cr->location_ext.metro2, cr->location_ext.metro2_len);
+        if (cr->location_ext.ip_addr != NULL)
+        {
+            SKY_LOG_DUMP(SKY_LOG_LEVEL_INFO, "ip", cr->location_ext.ip_addr,
+                cr->location_ext.ip_type == DATA_TYPE_IPV6 ? 16 : 4);
+        }
+    }
   }
-  // ONLY FOR DEBUGGING IN SERIAL
-  void print_ip(unsigned char *ip, unsigned char ip_type)
-  {
-      if (ip == NULL) return;
-  
-      int i;
-  
-      if (ip_type == DATA_TYPE_IPV6)
-      {
-          char z = 0;
-  
-          for (i = 0; i < 8; i++)
-          {
-              if (ip[i] == 0 && ip[i+1] == 0)
-              {
-                  z = 1;
-                  continue;
-              }
-  
-              if (z) Serial.print(":");
-              Serial.print(ip[i], HEX);
-              Serial.print(ip[i+1], HEX);
-              Serial.print(":");
-              z = 0;
-          }
+
+  // clnt mode: scan_task starts a scan every scan_frq ms, and handle_query() (run by query_task)
+  // sends it once it completes, polls the location query until its response arrives, and displays it
+  // on the oled
+  void handle_scan(uint32_t now){
+    if(device.getDeviceState() == AP && !has_subscribers()){
+      return; // ap mode scans for the web clients only
+    }
+    request_fix(now);
+  }
+
+  // starts a scan and location query unless one is in progress; offline, clnt mode saves a scan every
+  // SCANLOG_INTERVAL ms for the upload once connected, when a server takes the uploads
+  void request_fix(uint32_t now){
+    if(is_busy()){
+      return; // the next scan is one scan_frq later
+    }
+    if(WiFi.status() != WL_CONNECTED && (!scanlog_ready || device.getDeviceState() != CLIENT
+        || sky_endpoints_select(&endpoints, now, -1, SKY_ENDPOINT_V2) < 0
+        || (saved_at != 0 && scan_clock() - saved_at < SCANLOG_INTERVAL))){
+      return;
+    }
+    start_scan();
+    sky_sched_add(&sched, &query_task, now + QUERY_POLL_RATE);
+  }
+
+  void handle_query(uint32_t now){
+    if(scanning && !scan_complete()){
+      sky_sched_add(&sched, &query_task, now + QUERY_POLL_RATE);
+      return;
+    }
+    if(!sent){
+      return; // the scan failed to encode
+    }
+    bool done;
+    SKY_STACK_PROBE(poll_probe, done = poll());
+    if(!done){
+      sky_sched_add(&sched, &query_task, now + QUERY_POLL_RATE);
+      return;
+    }
+    SKY_STACK_PROBE(update_fix_probe, update_fix());
+    if(device.getDeviceState() == AP){
+      return; // the location is for the web client
+    }
+    if(result == SKY_OK){
+      print_location_resp(&resp);
+      // SERIAL DEBUGGING
+      SKY_METRICS_START(start);
+      SKY_STACK_PROBE(display_probe, print_location_oled());
+      SKY_METRICS_STOP(SKY_STAGE_DISPLAY, start);
+      fix_displayed(now);
+      schedule_upload(now);
+    }
+    else{
+      Serial.println("clnt mode: location query failed: " + String(result));
+      oled.clearDisplay();
+      device.update_oled();
+      print_to_oled("connection failed", "retrying...");
+      oled.display();
+    }
+    schedule_sleep(now + DEEP_SLEEP_DISPLAY_TIME);
+  }
+
+  // uploads the offline scans (upload_task): batch requests of SCANLOG_BATCH scans, one after the other over
+  // the connection of the location queries, while connected and no location query is in progress
+  void handle_upload(uint32_t now){
+    if(uploading){
+      sky_client_poll(&elg_query[0], now);
+      if(elg_query[0].state != SKY_CLIENT_IDLE){
+        sky_sched_add(&sched, &upload_task, now + QUERY_POLL_RATE);
+        return;
       }
-      else
-      {
-          for (i = 0; i < 4; i++)
-          {
-              Serial.print(ip[i]);
-              if (i < 3) Serial.print(".");
-          }
+      uploading = false;
+      if(!upload_done()){
+        upload_backoff = (upload_backoff == 0) ? UPLOAD_BACKOFF
+            : (upload_backoff < UPLOAD_BACKOFF_MAX / 2) ? 2 * upload_backoff : UPLOAD_BACKOFF_MAX;
+        upload_retry_at = now + upload_backoff;
+        sky_sched_add(&sched, &upload_task, upload_retry_at);
+        return;
+      }
+      upload_backoff = 0;
+    }
+    if(!scanlog_ready || WiFi.status() != WL_CONNECTED || is_busy() || sky_scanlog_pending(&scanlog) == 0){
+      return;
+    }
+    // a connect or location does not cut the back-off short
+    if(upload_backoff != 0 && (int32_t)(now - upload_retry_at) < 0){
+      sky_sched_add(&sched, &upload_task, upload_retry_at);
+      return;
+    }
+    // the address page of the last location reads the buffer of its response, which the upload reuses;
+    // the low-power mode sleeps before the page is due
+    if(display_task.state != SKY_TASK_IDLE){
+      if(!can_deep_sleep()){
+        sky_sched_add(&sched, &upload_task, display_task.due + 1);
+        return;
       }
-      Serial.println();
+      sky_sched_cancel(&sched, &display_task);
+    }
+    if(start_upload(now)){
+      uploading = true;
+      sky_sched_add(&sched, &upload_task, now + QUERY_POLL_RATE);
+    }
   }
 
-  // clnt mode: handle() sends and receives location request and response within the timeframe of [10s,20s],
-  // and displays on the oled
-  void handle(){
-    unsigned long now = millis();
-    if(WiFi.status() == WL_CONNECTED){
-      if(!sent){
-        // 10000
-        if(now-txTimer > scan_frq){
-          scan();
-          txTimer = now;
-          rxTimer = now;
-        }
+  // starts the batch request of the oldest offline scans not uploaded yet
+  bool start_upload(uint32_t now){
+    uint8_t *batch = query_buff[1]; // not used by elg_query[1] during the upload
+    static uint8_t mac[WL_MAC_ADDR_LENGTH];
+    sky_scan_record_t record;
+    int32_t len = 0;
+    uint32_t clock = scan_clock();
+
+    upload_count = 0;
+    sky_scanlog_rewind(&scanlog, &upload_cursor);
+    while(upload_count < SCANLOG_BATCH && sky_scanlog_read(&scanlog, &upload_cursor, &record)){
+      // the clock starts over at a boot other than a wake from deep sleep
+      uint32_t age = ((int32_t)(record.seq - sleep_state.scans_first) >= 0) ? clock - record.time : SKY_BATCH_AGE_UNKNOWN;
+      len = sky_add_batch_scan(batch, sizeof(query_buff[1]), len, age, record.aps, record.ap_count);
+      if(len < 0){
+        return false;
       }
-      else{
-        if(now - rxTimer > WIFI_RX_WAIT_TIME){
-          if(now - rxTimer < SOCKET_TIMEOUT + WIFI_RX_WAIT_TIME){
-            if(rx()){
-              rxTimer = now;
-              // SERIAL DEBUGGING
-              print_location_oled();
-              check_time = 0;
-            }
-            else {
-              Serial.println("clnt mode: rx() failed at time "+String(now - rxTimer));
-              sent = false;
-            }
-          }
-          else{
-            Serial.println("Socket Timeout "+String(now - rxTimer));
-            client.stop();
-            sent = false;
-          }
-        }
+      upload_age[upload_count++] = age;
+    }
+    int ep = sky_endpoints_select(&endpoints, now, -1, SKY_ENDPOINT_V2);
+    if(upload_count == 0 || ep < 0){
+      return false;
+    }
+
+    // a version 2 request of its own, send_scan() sets up rq again
+    rq.key = key;
+    WiFi.macAddress(mac);
+    rq.mac = mac;
+    rq.mac_count = 1;
+    rq.ip_count = 0;
+    rq.ap_count = 0;
+    rq.header.version = SKY_PROTOCOL_VERSION_2;
+    rq.flags = 0;
+    rq.request_id = 0;
+    rq.payload_ext.payload.sw_version = 1;
+    rq.payload_ext.payload.type = LOCATION_RQ_BATCH;
+    rq.batch = batch;
+    rq.batch_len = len;
+    rq.batch_count = upload_count;
+    resp.key = key;
+
+    // the connection of the location queries to the fastest server
+    if(connected_endpoint[0] != ep){
+      client.stop();
+      connected_endpoint[0] = ep;
+    }
+    Serial.println("uploading " + String(upload_count) + " offline scans to " + endpoints.endpoints[ep].url);
+    upload_status = -1;
+    if(!sky_client_start(&elg_query[0], &rq, &resp, endpoints.endpoints[ep].url, now, SOCKET_TIMEOUT)){
+      rq.batch_count = 0;
+      return false;
+    }
+    return true;
+  }
+
+  // marks the scans of the batch request uploaded when its response arrived, and returns true
+  bool upload_done(){
+    rq.batch_count = 0; // the location queries send version 1 requests
+    if(upload_status != SKY_OK || resp.payload_ext.payload.type != LOCATION_RQ_BATCH_SUCCESS
+        || resp.batch_count != upload_count){
+      Serial.println("offline scan upload failed: " + String(upload_status));
+      client.stop();
+      return false;
+    }
+    struct batch_location_t location;
+    for(uint32_t i = 0; sky_get_batch_location(&resp, i, &location); i++){
+      SKY_LOG_INFO("offline scan, age %u ms: type %u latitude: %.6lf longitude: %.6lf hpe: %.1f", upload_age[i],
+          location.type, SKY_LOG_DOUBLE(location.location.lat), SKY_LOG_DOUBLE(location.location.lon),
+          SKY_LOG_FLOAT(location.location.hpe));
+    }
+    if(!sky_scanlog_ack(&scanlog, &upload_cursor)){
+      Serial.println("failed to mark the offline scans uploaded");
+    }
+    Serial.println(String(upload_count) + " offline scans uploaded, " + String(sky_scanlog_pending(&scanlog)) + " to upload");
+    return true;
+  }
+
+  // keeps the result of the location query which completed as the latest location, and sends it to
+  // the subscribed web clients; a failed query leaves the last location (which ages). Every response
+  // goes to the location history
+  void update_fix(){
+    String error = "";
+    if(result == SKY_OK){
+      save_history(&resp, query_aps);
+    }
+    if(result != SKY_OK){
+      if(has_fix){
+        return;
       }
+      fix = "\"error\":\"No Response\"";
+    }
+    else if(get_error(error)){
+      fix = "\"error\":\"" + error + "\"";
     }
     else{
-      oled.clearMsgArea();
-      print_to_oled("Wifi Disconnected","");
-      device.handle();
+      String address = "";
+      if(reverse_geo && resp.payload_ext.payload.type == LOCATION_RQ_ADDR)
+      {
+        int loc_req_arr[5]={resp.location_ext.street_num_len,resp.location_ext.address_len,resp.location_ext.metro1_len,resp.location_ext.state_code_len,resp.location_ext.postal_code_len};
+        char buf[get_max(loc_req_arr,5)+1];
+        address = "\"";
+        snprintf(buf, resp.location_ext.street_num_len+1, "%s", resp.location_ext.street_num);
+        address += String(buf) + " ";
+        snprintf(buf, resp.location_ext.address_len+1, "%s", resp.location_ext.address);
+        address += String(buf) + ", ";
+        snprintf(buf, resp.location_ext.metro1_len+1, "%s", resp.location_ext.metro1);
+        address += String(buf) + ", ";
+        snprintf(buf, resp.location_ext.state_code_len+1, "%s", resp.location_ext.state_code);
+        address += String(buf) + ", ";
+        snprintf(buf, resp.location_ext.postal_code_len+1, "%s", resp.location_ext.postal_code);
+        address += String(buf)+"\"";
+      }
+      else{
+        address = "\"\"";
+      }
+      fix = "\"LAT\": "+String(resp.location.lat,5)+", \"LON\":"+String(resp.location.lon,5)+",\"HPE\":"+resp.location.hpe+",\"reverse_geo\":"+address;
     }
+    fix_time = millis();
+    has_fix = true;
+    sample_heap();
+    publish_fix();
+  }
+
+  // the latest location as json, with its age in ms
+  String fix_json(){
+    return "{" + fix + ",\"age\":" + String(millis() - fix_time) + "}";
   }
 
   // location_json() serves ap mode (web server) to respond to the web client "Locate Me" request
-  // within the timeframe of [10s,20s], and returns a single location response in a form of a json
-  // from web server to web client.
+  // right away with the latest location and its age. A location older than scan_frq is refreshed in
+  // the background, and the web client receives it from /skyhookclient/locationevents.
   void location_json(){
-    String error = "";
-    while(true){
-      unsigned long now = millis();
-      if(WiFi.status() == WL_CONNECTED){
-        if(!sent){
-          if(now-txTimer > scan_frq){
-            scan();
-            txTimer = now;
-            rxTimer = now;
-          }
-        }
-        else{
-          if(now - rxTimer > WIFI_RX_WAIT_TIME){
-            if(now - rxTimer < SOCKET_TIMEOUT + WIFI_RX_WAIT_TIME){
-              if(rx()){
-                if(get_error(error)){
-                  Serial.println(error);
-                  server.send(200,"application/json","{\"error\": \""+error+"\"}");
-                  print_to_oled("Location error",error);
-                }
-                rxTimer = now;
-                check_time = 0;
-                String address = "";
-                if(reverse_geo)
-                {
-                  int loc_req_arr[5]={resp.location_ext.street_num_len,resp.location_ext.address_len,resp.location_ext.metro1_len,resp.location_ext.state_code_len,resp.location_ext.postal_code_len};
-                  char buf[get_max(loc_req_arr,5)+1];
-                  address = "\"";
-                  snprintf(buf, resp.location_ext.street_num_len+1, "%s", resp.location_ext.street_num);
-                  address += String(buf) + " ";
-                  snprintf(buf, resp.location_ext.address_len+1, "%s", resp.location_ext.address);
-                  address += String(buf) + ", ";
-                  snprintf(buf, resp.location_ext.metro1_len+1, "%s", resp.location_ext.metro1);
-                  address += String(buf) + ", ";
-                  snprintf(buf, resp.location_ext.state_code_len+1, "%s", resp.location_ext.state_code);
-                  address += String(buf) + ", ";
-                  snprintf(buf, resp.location_ext.postal_code_len+1, "%s", resp.location_ext.postal_code);
-                  address += String(buf)+"\"";
-                }
-                else{
-                  address = "\"\"";
-                }
-                server.send(200,"application/json","{\"LAT\": "+String(resp.location.lat,5)+", \"LON\":"+String(resp.location.lon,5)+",\"HPE\":"+resp.location.hpe+",\"reverse_geo\":"+address+"}");
-                return;
-              }
-              else{
-                sent = false;
-                server.send(200,"application/json","{\"error\":\"No Response\"}");
-                return;
-              }
-            }
-            sent = false;
-          }
-        }
+    unsigned long now = millis();
+    if(!has_fix || now - fix_time > (unsigned long)scan_frq){
+      request_fix(now);
+    }
+    if(has_fix){
+      server.send(200,"application/json",fix_json());
+    }
+    else if(WiFi.status() != WL_CONNECTED){
+      server.send(200,"application/json","{\"error\":\"WiFi Disconnected\"}");
+    }
+    else{
+      server.send(200,"application/json","{\"error\":\"No Location Yet\",\"pending\":true}");
+    }
+  }
+
+  bool has_subscribers(){
+    for(int i = 0; i < MAX_LOCATION_SUBSCRIBERS; i++){
+      if(subscribers[i].connected()){
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // keeps the connection of the web client for server-sent events: an event "location" with the
+  // json of location_json() for every location which arrives, starting with the latest one
+  void subscribe_events(){
+    int i;
+    for(i = 0; i < MAX_LOCATION_SUBSCRIBERS && subscribers[i].connected(); i++);
+    if(i == MAX_LOCATION_SUBSCRIBERS){
+      server.send(503,"application/json","{\"error\":\"Too Many Subscribers\"}");
+      return;
+    }
+    // the web server drops its reference to the client when the handler returns, this one keeps it open
+    subscribers[i].stop();
+    subscribers[i] = server.client();
+    subscribers[i].setNoDelay(true);
+    subscribers[i].print("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: keep-alive\r\n\r\nretry: " + String(SOCKET_TIMEOUT) + "\n\n");
+    if(has_fix){
+      subscribers[i].print("event: location\ndata: " + fix_json() + "\n\n");
+    }
+    sky_sched_add(&sched, &scan_task, millis()); // start the updates
+  }
+
+  void publish_fix(){
+    String event = "event: location\ndata: " + fix_json() + "\n\n";
+    for(int i = 0; i < MAX_LOCATION_SUBSCRIBERS; i++){
+      if(subscribers[i].connected()){
+        subscribers[i].print(event);
       }
       else{
-        server.send(200,"application/json","{\"error\":\"WiFi Disconnected\"}");
+        subscribers[i].stop();
       }
-      yield();
+    }
+  }
+
+  // ends the server-sent events, e.g. when leaving ap mode
+  void close_events(){
+    for(int i = 0; i < MAX_LOCATION_SUBSCRIBERS; i++){
+      subscribers[i].stop();
     }
   }
 };
 
 ClientWiFiWrapper client_req;
 
-void load_config(){
-  String config_json;
-  if (!file_to_string("/resources/preferences.json","r",config_json)) {
-    Serial.println("Config not found!");
-    print_to_oled("Config not found","setting default values");
-    scan_frq = SCAN_DEFAULT_FRQ;
-    HPE = HPE_DEFAULT_VAL;
-    reverse_geo = REVERSE_GEO_DEFAULT_VAL;
-  }
-  
-  DynamicJsonBuffer config_obj_buf;
-  JsonObject& config_obj = config_obj_buf.parseObject(config_json);
-
-  // set values to their corresponding values in preference.json
-  scan_frq = config_obj["scan_freq"];
-  HPE = config_obj["HPE"];
-  reverse_geo = config_obj["reverse_geo"];
-  key.partner_id = config_obj["partner_id"];
-  memset(key.aes_key, 0, sizeof(key.aes_key));
-  hex2bin((const char *)config_obj["aes_key"], strlen(config_obj["aes_key"]), key.aes_key, sizeof(key.aes_key));
+void elg_query_done(sky_client_t *query, struct location_rsp_t *rsp, enum SKY_STATUS status){
+  client_req.query_done(query, status);
+}
+
+void run_button(sky_task_t *task, uint32_t now){
+  state.update();
+}
+
+void run_device(sky_task_t *task, uint32_t now){
+  device.handle();
+}
+
+void run_wifi(sky_task_t *task, uint32_t now){
+  // not during an offline scan, whose results the scan of the known aps would replace
+  if(client_req.is_fast_connecting() || (WiFi.status() != WL_CONNECTED && !client_req.is_scanning())){
+    connect_to_wifi();
+  }
+}
+
+void run_scan(sky_task_t *task, uint32_t now){
+  task->period = scan_frq; // may change with the preferences
+  client_req.handle_scan(now);
+}
+
+void run_query(sky_task_t *task, uint32_t now){
+  client_req.handle_query(now);
+}
+
+void run_display(sky_task_t *task, uint32_t now){
+  print_address_oled();
+}
+
+void run_server(sky_task_t *task, uint32_t now){
+  server.handleClient();
+}
+
+uint32_t log_clock(){
+  return millis();
+}
+
+void run_log(sky_task_t *task, uint32_t now){
+#if SKY_LOG_LEVEL > SKY_LOG_LEVEL_NONE
+  static uint8_t record[SKY_LOG_RECORD_MAX];
+  uint32_t n;
+  // whole records only, so that other serial output does not split them; one longer than the uart
+  // fifo waits until the fifo is empty
+  while((n = sky_log_next()) > 0){
+    int room = Serial.availableForWrite();
+    if((int)n > room && room < LOG_SERIAL_FIFO){
+      break;
+    }
+    sky_log_read(record, sizeof(record));
+    Serial.write(record, n);
+  }
+#endif
+}
+
+void run_sleep(sky_task_t *task, uint32_t now){
+  if(!can_deep_sleep()){
+    return;
+  }
+  // a scan, query or upload in progress completes first, while the wake has time left
+  if(client_req.is_busy() && now < (woke_from_sleep ? DEEP_SLEEP_MAX_AWAKE : DEEP_SLEEP_FIRST_AWAKE)){
+    sky_sched_add(&sched, task, now + QUERY_POLL_RATE);
+    return;
+  }
+  // the scans stay scan_frq apart, counted from the wake
+  uint32_t awake = millis();
+  uint32_t sleep_ms = ((uint32_t)scan_frq > awake + DEEP_SLEEP_MIN_SLEEP) ? scan_frq - awake : DEEP_SLEEP_MIN_SLEEP;
+  sleep_state.awake_ms += awake;
+  sleep_state.asleep_ms += sleep_ms;
+#if SKY_METRICS
+  sleep_state.wake_to_fix = sky_metrics[SKY_STAGE_WAKE];
+#endif
+  save_sleep_rtc();
+  Serial.println("wake " + String(sleep_state.wakes) + ": awake " + String(awake) + " ms, deep sleep "
+      + String(sleep_ms) + " ms, duty cycle " + String(100.0 * sleep_state.awake_ms / (sleep_state.awake_ms
+      + sleep_state.asleep_ms), 1) + "%, battery " + String(gauge.getVoltage(), 2) + " V " + String(gauge.getSOC(), 0) + "%");
+  run_log(task, now);
+  Serial.flush();
+  // the oled keeps showing the location meanwhile
+  ESP.deepSleep((uint64_t)sleep_ms * 1000, WAKE_RF_DEFAULT);
+}
+
+void run_upload(sky_task_t *task, uint32_t now){
+  client_req.handle_upload(now);
+}
+
+void schedule_upload(uint32_t at){
+  if(scanlog_ready && sky_scanlog_pending(&scanlog) > 0){
+    sky_sched_add(&sched, &upload_task, at);
+  }
+}
+
+bool can_deep_sleep(){
+  return DEEP_SLEEP && device.getDeviceState() == CLIENT && (uint32_t)scan_frq >= DEEP_SLEEP_MIN_PERIOD;
+}
+
+void schedule_sleep(uint32_t at){
+  if(can_deep_sleep()){
+    sky_sched_add(&sched, &sleep_task, at);
+  }
+}
+
+void fix_displayed(uint32_t now){
+  static bool first = true;
+  if(woke_from_sleep && first){
+    Serial.println("wake to location: " + String(now) + " ms");
+#if SKY_METRICS
+    sky_metrics_record_us(SKY_STAGE_WAKE, micros());
+#endif
+  }
+  first = false;
+  sleep_state.location = resp.location;
+  sleep_state.has_location = true;
+}
+
+void run_memory(sky_task_t *task, uint32_t now){
+  sample_heap();
+  if(DEBUG && task->runs % (MEM_REPORT_RATE / MEM_SAMPLE_RATE) == 0){
+    print_memory();
+  }
+}
+
+void schedule_mode_tasks(){
+  uint32_t now = millis();
+  // scan_task runs in both modes, in ap mode it scans while web clients subscribe to the locations
+  sky_sched_add(&sched, &scan_task, now);
+  if(device.getDeviceState() == AP){
+    sky_sched_cancel(&sched, &wifi_task);
+    sky_sched_cancel(&sched, &display_task);
+    sky_sched_cancel(&sched, &sleep_task);
+    if(!(WiFi.getMode() & WIFI_AP)){
+      start_soft_ap();
+    }
+    sky_sched_add(&sched, &server_task, now);
+  }
+  else{
+    sky_sched_cancel(&sched, &server_task);
+    client_req.close_events();
+    sky_sched_add(&sched, &wifi_task, now + WIFI_RETRY_RATE);
+    // a wake sleeps again once the location is shown, or gives up after DEEP_SLEEP_MAX_AWAKE; other
+    // boots stay up longer, for the button to switch to ap mode
+    schedule_sleep(now + (woke_from_sleep ? DEEP_SLEEP_MAX_AWAKE : DEEP_SLEEP_FIRST_AWAKE));
+  }
+#if IDLE_LIGHT_SLEEP
+  // the SDK sleeps in delay() (see loop()) between the beacons of the AP it is connected to,
+  // as long as the soft AP is not up
+  WiFi.setSleepMode(device.getDeviceState() == AP ? WIFI_NONE_SLEEP : WIFI_LIGHT_SLEEP);
+#endif
+}
+
+void load_config(){
+  // a sketch which needs the sectors of the store overwrites them, and is not written to
+  config_flash_free = ESP.getSketchSize() <= CONFIG_FLASH_OFFSET;
+  if (!sky_config_load(&config_store, &config)) {
+    Serial.println("no config in flash");
+    if (!import_preferences_json(&config)) {
+      Serial.println("Config not found!");
+      print_to_oled("Config not found","setting default values");
+    }
+    if (!sky_config_save(&config_store, &config)) {
+      Serial.println("config not saved");
+    }
+  }
+  apply_config();
+}
+
+void apply_config(){
+  scan_frq = config.scan_freq;
+  HPE = config.hpe;
+  reverse_geo = config.reverse_geo;
+  key.partner_id = config.partner_id;
+  memcpy(key.aes_key, config.aes_key, sizeof(key.aes_key));
+  sky_rq_prefix_invalidate(&rq_prefix);
+
+  // the compiled in server when none is set
+  sky_endpoints_init(&endpoints);
+  for (int i = 0; i < config.server_count; i++) {
+    int32_t ep = sky_endpoints_add(&endpoints, config.servers[i].host, config.servers[i].port);
+    if (ep < 0) {
+      Serial.println("server ignored: " + String(config.servers[i].host));
+      continue;
+    }
+    endpoints.endpoints[ep].caps = config.servers[i].caps;
+  }
+  if (endpoints.count == 0) {
+    int32_t ep = sky_endpoints_add(&endpoints, SKYHOOK_ELG_SERVER_URL, SKYHOOK_ELG_SERVER_PORT);
+    if (ep >= 0) {
+      endpoints.endpoints[ep].caps = (AP_COMPACT ? SKY_ENDPOINT_AP_COMPACT : 0) | (SERVER_V2 ? SKY_ENDPOINT_V2 : 0);
+    }
+  }
+  // connections to the previous servers
+  client.stop();
+  hedge_client.stop();
+  load_endpoints_rtc();
+}
+
+bool import_preferences_json(sky_config_t *cfg){
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->scan_freq = SCAN_DEFAULT_FRQ;
+  cfg->hpe = HPE_DEFAULT_VAL;
+  cfg->reverse_geo = REVERSE_GEO_DEFAULT_VAL;
+
+  String config_json;
+  if (!file_to_string("/resources/preferences.json","r",config_json)) {
+    return false;
+  }
+  DynamicJsonBuffer config_obj_buf;
+  JsonObject& config_obj = config_obj_buf.parseObject(config_json);
+  if (!config_obj.success()) {
+    return false;
+  }
+  Serial.println("importing preferences.json");
+  uint32_t scan_freq = config_obj["scan_freq"];
+  if (scan_freq >= 200) {
+    cfg->scan_freq = scan_freq;
+  }
+  if (config_obj.containsKey("HPE")) {
+    cfg->hpe = config_obj["HPE"].as<bool>();
+  }
+  if (config_obj.containsKey("reverse_geo")) {
+    cfg->reverse_geo = config_obj["reverse_geo"].as<bool>();
+  }
+  cfg->partner_id = config_obj["partner_id"];
+  const char *aes_key = config_obj["aes_key"];
+  if (aes_key != NULL) {
+    hex2bin(aes_key, strlen(aes_key), cfg->aes_key, sizeof(cfg->aes_key));
+  }
+  JsonArray& servers = config_obj["servers"];
+  for (JsonArray::iterator it=servers.begin(); it!=servers.end(); ++it)
+  {
+    add_config_server(cfg, it->as<const char*>());
+  }
+  return true;
+}
+
+bool add_config_server(sky_config_t *cfg, String server_str){
+  uint16_t caps = 0;
+  int plus = server_str.indexOf('+');
+  String address = (plus < 0) ? server_str : server_str.substring(0, plus);
+  while (plus >= 0) {
+    int next = server_str.indexOf('+', plus + 1);
+    String cap = server_str.substring(plus + 1, (next < 0) ? server_str.length() : next);
+    if (cap == "compact") {
+      caps |= SKY_ENDPOINT_AP_COMPACT;
+    }
+    else if (cap == "v2") {
+      caps |= SKY_ENDPOINT_V2;
+    }
+    else {
+      Serial.println("server capability ignored: " + cap);
+    }
+    plus = next;
+  }
+  int colon = address.lastIndexOf(':');
+  String host = (colon < 0) ? address : address.substring(0, colon);
+  uint16_t port = (colon < 0) ? SKYHOOK_ELG_SERVER_PORT : address.substring(colon + 1).toInt();
+  if (cfg->server_count >= SKY_MAX_ENDPOINTS || host.length() == 0 || host.length() >= SKY_CONFIG_HOST_LEN) {
+    Serial.println("server ignored: " + server_str);
+    return false;
+  }
+  sky_config_server_t *server = &cfg->servers[cfg->server_count++];
+  memset(server, 0, sizeof(*server));
+  strcpy(server->host, host.c_str());
+  server->port = port;
+  server->caps = caps;
+  return true;
+}
+
+// the server of the preferences as add_config_server() reads it
+String config_server_string(const sky_config_server_t *server){
+  String s = String(server->host) + ":" + String(server->port);
+  if (server->caps & SKY_ENDPOINT_AP_COMPACT) {
+    s += "+compact";
+  }
+  if (server->caps & SKY_ENDPOINT_V2) {
+    s += "+v2";
+  }
+  return s;
+}
+
+// the config store takes the last CONFIG_SECTORS sectors of the free space before the file system: a
+// save erases a sector of older records only, so that the current one is kept until the new one is written
+extern "C" uint32_t _SPIFFS_start;
+#define CONFIG_FLASH_OFFSET ((uint32_t)&_SPIFFS_start - 0x40200000 - CONFIG_SECTORS * SPI_FLASH_SEC_SIZE)
+
+bool config_flash_read(uint32_t offset, void *buff, uint32_t len, void *ctx){
+  return config_flash_free && ESP.flashRead(CONFIG_FLASH_OFFSET + offset, (uint32_t *)buff, len);
+}
+
+bool config_flash_write(uint32_t offset, const void *buff, uint32_t len, void *ctx){
+  return config_flash_free && ESP.flashWrite(CONFIG_FLASH_OFFSET + offset, (uint32_t *)buff, len);
+}
+
+bool config_flash_erase(uint32_t offset, void *ctx){
+  return config_flash_free && ESP.flashEraseSector((CONFIG_FLASH_OFFSET + offset) / SPI_FLASH_SEC_SIZE);
+}
+
+// the offline scan log takes the SCANLOG_SECTORS sectors before the config store; an OTA update of a
+// sketch which needs them overwrites it, and the records then fail their CRCs
+#define SCANLOG_FLASH_OFFSET (CONFIG_FLASH_OFFSET - SCANLOG_SECTORS * SPI_FLASH_SEC_SIZE)
+
+bool scanlog_flash_read(uint32_t offset, void *buff, uint32_t len, void *ctx){
+  return ESP.flashRead(SCANLOG_FLASH_OFFSET + offset, (uint32_t *)buff, len);
+}
+
+bool scanlog_flash_write(uint32_t offset, const void *buff, uint32_t len, void *ctx){
+  return ESP.flashWrite(SCANLOG_FLASH_OFFSET + offset, (uint32_t *)buff, len);
+}
+
+bool scanlog_flash_erase(uint32_t offset, void *ctx){
+  return ESP.flashEraseSector((SCANLOG_FLASH_OFFSET + offset) / SPI_FLASH_SEC_SIZE);
+}
+
+void load_scanlog(){
+  if(ESP.getSketchSize() > SCANLOG_FLASH_OFFSET || !sky_scanlog_load(&scanlog)){
+    Serial.println("no offline scan log");
+    return;
+  }
+  scanlog_ready = true;
+  // the scans of earlier boots have no known age, the ones of the wakes since the boot have
+  if(!woke_from_sleep){
+    sleep_state.scans_first = scanlog.seq + 1;
+  }
+  Serial.println("offline scans to upload: " + String(sky_scanlog_pending(&scanlog)));
+}
+
+uint32_t scan_clock(){
+  return sleep_state.awake_ms + sleep_state.asleep_ms + millis();
+}
+
+// the location history takes the HISTORY_SECTORS sectors before the offline scan log
+#define HISTORY_FLASH_OFFSET (SCANLOG_FLASH_OFFSET - HISTORY_SECTORS * SPI_FLASH_SEC_SIZE)
+
+bool history_flash_read(uint32_t offset, void *buff, uint32_t len, void *ctx){
+  return ESP.flashRead(HISTORY_FLASH_OFFSET + offset, (uint32_t *)buff, len);
+}
+
+bool history_flash_write(uint32_t offset, const void *buff, uint32_t len, void *ctx){
+  return ESP.flashWrite(HISTORY_FLASH_OFFSET + offset, (uint32_t *)buff, len);
+}
+
+bool history_flash_erase(uint32_t offset, void *ctx){
+  return ESP.flashEraseSector((HISTORY_FLASH_OFFSET + offset) / SPI_FLASH_SEC_SIZE);
+}
+
+void load_history(){
+  if(ESP.getSketchSize() > HISTORY_FLASH_OFFSET || !sky_history_load(&history)){
+    Serial.println("no location history");
+    return;
+  }
+  history_ready = true;
+  // the clock of a boot starts after the newest fix, the wakes since the boot keep it
+  if(!woke_from_sleep){
+    sleep_state.history_base = history.last + 1 - scan_clock() / 1000;
+  }
+  Serial.println("location history: " + String(sky_history_count(&history)) + " fixes");
+}
+
+uint32_t history_clock(){
+  return sleep_state.history_base + scan_clock() / 1000;
+}
+
+uint32_t server_time(const struct location_rsp_t *rsp){
+  uint64_t ms = 0; // little endian, as the ms of the payload
+  memcpy(&ms, rsp->payload_ext.payload.timestamp, sizeof(rsp->payload_ext.payload.timestamp));
+  return ms / 1000;
+}
+
+void save_history(struct location_rsp_t *rsp, uint8_t ap_count){
+  sky_history_record_t record;
+  if(!history_ready){
+    return;
+  }
+  memset(&record, 0, sizeof(record));
+  uint32_t time = server_time(rsp);
+  if(time != 0){
+    // the fixes without a server time go on from this one
+    sleep_state.history_base = time - scan_clock() / 1000;
+    record.time = time;
+  }
+  else{
+    record.time = history_clock();
+  }
+  record.type = rsp->payload_ext.payload.type;
+  record.ap_count = ap_count;
+  record.location = rsp->location;
+  if(!sky_history_append(&history, &record)){
+    Serial.println("failed to save the location history");
+  }
+}
+
+// server statistics in RTC memory, which keeps them across resets and deep sleep (not power loss)
+struct rtc_endpoints_t {
+  uint32_t magic;
+  uint16_t urls_checksum; // fletcher16 of the server urls, the statistics are dropped when they change
+  uint16_t checksum;      // fletcher16 of stats
+  struct {
+    uint32_t srtt;
+    uint32_t rttvar;
+    uint32_t failures;
+  } stats[SKY_MAX_ENDPOINTS];
+};
+
+#define RTC_ENDPOINTS_MAGIC 0x534b5945
+
+uint16_t endpoints_urls_checksum(){
+  sky_checksum_ctx_t ctx;
+  fletcher16_init(&ctx);
+  for (int i = 0; i < endpoints.count; i++) {
+    fletcher16_update(&ctx, (const uint8_t *)endpoints.endpoints[i].url, strlen(endpoints.endpoints[i].url) + 1);
+  }
+  return fletcher16_final(&ctx);
+}
+
+void save_endpoints_rtc(){
+  struct rtc_endpoints_t rtc;
+  memset(&rtc, 0, sizeof(rtc));
+  rtc.magic = RTC_ENDPOINTS_MAGIC;
+  rtc.urls_checksum = endpoints_urls_checksum();
+  for (int i = 0; i < endpoints.count; i++) {
+    rtc.stats[i].srtt = endpoints.endpoints[i].srtt;
+    rtc.stats[i].rttvar = endpoints.endpoints[i].rttvar;
+    rtc.stats[i].failures = endpoints.endpoints[i].failures;
+  }
+  rtc.checksum = fletcher16((uint8_t *)rtc.stats, sizeof(rtc.stats));
+  ESP.rtcUserMemoryWrite(RTC_ENDPOINTS_OFFSET, (uint32_t *)&rtc, sizeof(rtc));
+}
+
+void load_endpoints_rtc(){
+  struct rtc_endpoints_t rtc;
+  if (!ESP.rtcUserMemoryRead(RTC_ENDPOINTS_OFFSET, (uint32_t *)&rtc, sizeof(rtc))
+      || rtc.magic != RTC_ENDPOINTS_MAGIC || rtc.urls_checksum != endpoints_urls_checksum()
+      || rtc.checksum != fletcher16((uint8_t *)rtc.stats, sizeof(rtc.stats))) {
+    Serial.println("no server statistics in RTC memory");
+    return;
+  }
+  // back-offs end with the reset, as millis() starts over
+  for (int i = 0; i < endpoints.count; i++) {
+    endpoints.endpoints[i].srtt = rtc.stats[i].srtt;
+    endpoints.endpoints[i].rttvar = rtc.stats[i].rttvar;
+    endpoints.endpoints[i].failures = rtc.stats[i].failures;
+    endpoints.endpoints[i].retry_at = 0;
+  }
+}
+
+#define RTC_WIFI_MAGIC 0x534b5957
+#define RTC_WIFI_CHECKED(rtc) ((uint8_t *)&(rtc)->channel)
+#define RTC_WIFI_CHECKED_LEN (sizeof(struct rtc_wifi_t) - offsetof(struct rtc_wifi_t, channel))
+
+void save_wifi_rtc(){
+  struct rtc_wifi_t rtc, last;
+  uint32_t lease = dhcp_lease();
+  memset(&rtc, 0, sizeof(rtc));
+  rtc.magic = RTC_WIFI_MAGIC;
+  rtc.channel = WiFi.channel();
+  memcpy(rtc.bssid, WiFi.BSSID(), sizeof(rtc.bssid));
+  rtc.ip = WiFi.localIP();
+  if(lease > 0){
+    // half the lease, at most a day in the range of the ms clock; the reuses limit an infinite one
+    uint32_t half = (lease / 2 < 86400) ? lease / 2 : 86400;
+    rtc.renew_at = scan_clock() + half * 1000;
+  }
+  else if(load_wifi_rtc(&last) && last.ip == rtc.ip){
+    // the address was reused, its lease is the one of the DHCP which leased it
+    rtc.renew_at = last.renew_at;
+    rtc.reuses = (last.reuses < 0xff) ? last.reuses + 1 : 0xff;
+  }
+  else{
+    rtc.renew_at = scan_clock(); // a lease not known, renewed at the next connect
+  }
+  rtc.gateway = WiFi.gatewayIP();
+  rtc.netmask = WiFi.subnetMask();
+  rtc.dns = WiFi.dnsIP();
+  strncpy(rtc.ssid, WiFi.SSID().c_str(), sizeof(rtc.ssid) - 1);
+  strncpy(rtc.pw, WiFi.psk().c_str(), sizeof(rtc.pw) - 1);
+  rtc.checksum = fletcher16(RTC_WIFI_CHECKED(&rtc), RTC_WIFI_CHECKED_LEN);
+  ESP.rtcUserMemoryWrite(RTC_WIFI_OFFSET, (uint32_t *)&rtc, sizeof(rtc));
+}
+
+bool load_wifi_rtc(struct rtc_wifi_t *rtc){
+  return ESP.rtcUserMemoryRead(RTC_WIFI_OFFSET, (uint32_t *)rtc, sizeof(*rtc)) && rtc->magic == RTC_WIFI_MAGIC
+      && rtc->checksum == fletcher16(RTC_WIFI_CHECKED(rtc), RTC_WIFI_CHECKED_LEN) && rtc->ip != 0;
+}
+
+void clear_wifi_rtc(){
+  uint32_t magic = 0;
+  ESP.rtcUserMemoryWrite(RTC_WIFI_OFFSET, &magic, sizeof(magic));
+}
+
+bool wifi_lease_valid(const struct rtc_wifi_t *rtc){
+  // scan_clock() starts over at a boot other than a wake from deep sleep, which gets a new lease
+  return woke_from_sleep && rtc->reuses < FAST_CONNECT_MAX_REUSES && (int32_t)(rtc->renew_at - scan_clock()) > 0;
+}
+
+uint32_t dhcp_lease(){
+  for(struct netif *n = netif_list; n != NULL; n = n->next){
+    if(dhcp_supplied_address(n)){
+      return netif_dhcp_data(n)->offered_t0_lease;
+    }
+  }
+  return 0;
+}
+
+#define RTC_SLEEP_MAGIC 0x534b5953
+#define RTC_SLEEP_CHECKED(rtc) ((uint8_t *)&(rtc)->reserved)
+#define RTC_SLEEP_CHECKED_LEN (sizeof(struct rtc_sleep_t) - offsetof(struct rtc_sleep_t, reserved))
+
+void load_sleep_rtc(){
+  if (!ESP.rtcUserMemoryRead(RTC_SLEEP_OFFSET, (uint32_t *)&sleep_state, sizeof(sleep_state))
+      || sleep_state.magic != RTC_SLEEP_MAGIC
+      || sleep_state.checksum != fletcher16(RTC_SLEEP_CHECKED(&sleep_state), RTC_SLEEP_CHECKED_LEN)) {
+    memset(&sleep_state, 0, sizeof(sleep_state));
+    woke_from_sleep = false;
+    return;
+  }
+  woke_from_sleep = ESP.getResetInfoPtr()->reason == REASON_DEEP_SLEEP_AWAKE;
+  if (woke_from_sleep) {
+    sleep_state.wakes++;
+  }
+#if SKY_METRICS
+  sky_metrics[SKY_STAGE_WAKE] = sleep_state.wake_to_fix;
+#endif
+}
+
+void save_sleep_rtc(){
+  sleep_state.magic = RTC_SLEEP_MAGIC;
+  sleep_state.checksum = fletcher16(RTC_SLEEP_CHECKED(&sleep_state), RTC_SLEEP_CHECKED_LEN);
+  ESP.rtcUserMemoryWrite(RTC_SLEEP_OFFSET, (uint32_t *)&sleep_state, sizeof(sleep_state));
+}
+
+void start_soft_ap(){
+  uint8_t mac[WL_MAC_ADDR_LENGTH];
+  Serial.println();
+  Serial.println("Configuring access point...");
+  WiFi.mode(WIFI_AP_STA);
+  // set ssid and password
+  WiFi.softAP(ssid, password);
+  WiFi.softAPmacAddress(mac);
+  yield();
 }
 
 void connect_to_wifi() {
-  Serial.print("Attempting to connect to know aps...");
-  print_to_oled("Connecting to APs","");
-  // tell device to connect to saved AP's in AP.json
-  client_req.conn_known_ap();
+  if(!client_req.is_fast_connecting()){
+    oled.clearMsgArea();
+    print_to_oled("Wifi Disconnected","");
+    Serial.print("Attempting to connect to know aps...");
+    print_to_oled("Connecting to APs","");
+  }
+  // tell device to connect to saved AP's in AP.json; wifi_task polls the fast connect to the last one
+  if(!client_req.conn_known_ap()){
+    sky_sched_add(&sched, &wifi_task, millis() + FAST_CONNECT_POLL_RATE);
+    return;
+  }
   if(WiFi.status() == WL_CONNECTED){
+    save_wifi_rtc();
+    schedule_upload(millis());
     Serial.println("Connected!");
     print_to_oled("Success: " + WiFi.SSID(),"");
   }
@@ -976,20 +2040,45 @@ bool file_to_string(String path, const char* type, String& ret_buf){
   return false;
 }
 
-void print_buff(uint8_t *buff, int32_t len) {
-    int32_t i;
-    int32_t j = 0;
+// WiFiClient::connect() has no non-blocking form: a new connection blocks the scheduler until it is
+// up or fails (the WiFiClient timeout at most), so that a hedged query starts no earlier than that.
+// The queries keep their connections open, so this is once per server after a wake or error.
+int32_t wifi_send(uint8_t *buff, uint32_t buff_len, char *host, uint16_t port, void *rpc_handle){
+  WiFiClient *c = (WiFiClient *)rpc_handle;
+  if(!c->connected()){
+    c->stop();
+    Serial.print("connecting to ");
+    Serial.print(host);
+    Serial.print(":");
+    Serial.println(port);
+    yield();
+    SKY_METRICS_START(start);
+    if(!c->connect(host, port)){
+      Serial.println("connection failed");
+      return -1;
+    }
+    SKY_METRICS_STOP(SKY_STAGE_CONNECT, start);
+  }
+  yield();
+  SKY_METRICS_START(start);
+  size_t wcnt = c->write((const uint8_t *)buff, (size_t)buff_len);
+  SKY_METRICS_STOP(SKY_STAGE_WRITE, start);
+  Serial.print("sent:");
+  Serial.println(wcnt);
+  return wcnt;
+}
 
-    char tmp[16];
-     for (int i=0; i<len; i++) { 
-       sprintf(tmp, "%02X",buff[i]); 
-       Serial.print(tmp); Serial.print(" ");
-       if (++j > 15) {
-            j = 0;
-            Serial.print("\n");
-        }
-     }
-     Serial.print("\n");
+int32_t wifi_recv(uint8_t *buff, uint32_t buff_len, void *rpc_handle){
+  WiFiClient *c = (WiFiClient *)rpc_handle;
+  int n = c->available();
+  if(n <= 0){
+    // wait for data unless the server closed the connection
+    return c->connected() ? 0 : -1;
+  }
+  if((uint32_t)n > buff_len){
+    n = buff_len;
+  }
+  return c->read(buff, n);
 }
 
 void print_to_oled(String msg1, String msg2){
@@ -1003,94 +2092,80 @@ void print_to_oled(String msg1, String msg2){
 }
 
 void print_location_oled(){
-  unsigned long start_time = millis();
-  unsigned long page1_display_timer = (unsigned long)scan_frq/2;
-  bool page1_done = false;
-  bool page2_done = false;
-  if(!reverse_geo){
-    page1_display_timer = scan_frq;
-    page2_done = true;
-  }
-  //Serial.println(page1_display_timer);
-  while(true){
-    unsigned long now = millis();
-    String error = "";
-    if(!page1_done){
-      if (get_error(error)){
-        oled.clearDisplay();
-        device.update_oled();
-        oled.setCursor(0,8);
-        oled.println("Unable to determine  location");
-      }
-      else{
-        oled.clearDisplay();
-        device.update_oled();
-        oled.setCursor(0,0);
-        oled.println("INFO:");
-        oled.println("LAT: " + String(resp.location.lat, 5));
-        oled.println("LON: " + String(resp.location.lon, 5));
-        if(HPE){
-          oled.println("HPE: " + String(resp.location.hpe, 5));
-        }
-      }
-      yield();
-      oled.display();
-      yield();
-      page1_done = true;
-    }
-    if(now - start_time > page1_display_timer && !page2_done){
-      if(resp.payload_ext.payload.type == LOCATION_RQ_ADDR){
-        oled.clearDisplay();
-        device.update_oled();
-        oled.setCursor(0,0);
-        oled.println("ADDRESS:");
-        int loc_req_arr[5]={resp.location_ext.street_num_len,resp.location_ext.address_len,resp.location_ext.metro1_len,resp.location_ext.state_code_len,resp.location_ext.postal_code_len};
-        char buff[get_max(loc_req_arr,5)+1];
-        
-        snprintf(buff, resp.location_ext.street_num_len+1, "%s", resp.location_ext.street_num);
-        oled.print(buff);
-        oled.write(' ');
-
-        snprintf(buff, resp.location_ext.address_len+1, "%s", resp.location_ext.address);
-        //oled.print(String(resp.location_ex.address));
-        oled.print(buff);
-        oled.write(',');
-        oled.write(' ');
-
-        snprintf(buff, resp.location_ext.metro1_len+1, "%s", resp.location_ext.metro1);
-        //oled.print(String(resp.location_ex.metro1));
-        oled.print(buff);
-        oled.write(',');
-        oled.write(' ');
-
-        snprintf(buff, resp.location_ext.state_code_len+1, "%s", resp.location_ext.state_code);
-        //oled.print(String(resp.location_ex.state_code));
-        oled.print(buff);
-        oled.write(',');
-        oled.write(' ');
-        
-        snprintf(buff, resp.location_ext.postal_code_len+1, "%s", resp.location_ext.postal_code);
-        oled.println(buff);
-      }
-      else{
-        oled.clearDisplay();
-        oled.setCursor(0,8);
-        oled.println("Unable to determine location");
-      }
-      yield();
-      oled.display();
-      yield();
-      page2_done = true;
-    }
-    if(now - start_time > (unsigned long)scan_frq){
-      Serial.println("Display done");
-      break;
+  String error = "";
+  if (get_error(error)){
+    oled.clearDisplay();
+    device.update_oled();
+    oled.setCursor(0,8);
+    oled.println("Unable to determine  location");
+  }
+  else{
+    oled.clearDisplay();
+    device.update_oled();
+    oled.setCursor(0,0);
+    oled.println("INFO:");
+    oled.println("LAT: " + String(resp.location.lat, 5));
+    oled.println("LON: " + String(resp.location.lon, 5));
+    if(HPE){
+      oled.println("HPE: " + String(resp.location.hpe, 5));
     }
-    if(state.update()) return;
-    yield();
+  }
+  yield();
+  oled.display();
+  yield();
+  // the address page follows half way to the next scan
+  if(reverse_geo){
+    sky_sched_add(&sched, &display_task, millis() + (unsigned long)scan_frq/2);
+  }
+  else{
+    sky_sched_cancel(&sched, &display_task);
   }
 }
 
+void print_address_oled(){
+  if(resp.payload_ext.payload.type == LOCATION_RQ_ADDR){
+    oled.clearDisplay();
+    device.update_oled();
+    oled.setCursor(0,0);
+    oled.println("ADDRESS:");
+    int loc_req_arr[5]={resp.location_ext.street_num_len,resp.location_ext.address_len,resp.location_ext.metro1_len,resp.location_ext.state_code_len,resp.location_ext.postal_code_len};
+    char buff[get_max(loc_req_arr,5)+1];
+    
+    snprintf(buff, resp.location_ext.street_num_len+1, "%s", resp.location_ext.street_num);
+    oled.print(buff);
+    oled.write(' ');
+
+    snprintf(buff, resp.location_ext.address_len+1, "%s", resp.location_ext.address);
+    //oled.print(String(resp.location_ex.address));
+    oled.print(buff);
+    oled.write(',');
+    oled.write(' ');
+
+    snprintf(buff, resp.location_ext.metro1_len+1, "%s", resp.location_ext.metro1);
+    //oled.print(String(resp.location_ex.metro1));
+    oled.print(buff);
+    oled.write(',');
+    oled.write(' ');
+
+    snprintf(buff, resp.location_ext.state_code_len+1, "%s", resp.location_ext.state_code);
+    //oled.print(String(resp.location_ex.state_code));
+    oled.print(buff);
+    oled.write(',');
+    oled.write(' ');
+    
+    snprintf(buff, resp.location_ext.postal_code_len+1, "%s", resp.location_ext.postal_code);
+    oled.println(buff);
+  }
+  else{
+    oled.clearDisplay();
+    oled.setCursor(0,8);
+    oled.println("Unable to determine location");
+  }
+  yield();
+  oled.display();
+  yield();
+}
+
 uint32_t hex2bin(const char *hexstr, uint32_t hexlen, uint8_t *result, uint32_t reslen) {
     uint32_t i, j = 0, k = 0;
 
@@ -1119,16 +2194,6 @@ uint32_t hex2bin(const char *hexstr, uint32_t hexlen, uint8_t *result, uint32_t
     return j;
 }
 
-void yield_wait(int ms){
-  unsigned long now = millis();
-  unsigned long start = now;
-  while(now-start < ms){
-    if(state.update()) return;
-    yield();
-    now = millis();
-  }
-}
-
 void handleRoot() {
   Serial.println("Requesting " + server.uri());
 
@@ -1269,74 +2334,168 @@ void handleGetStatus() {
   main_wifi.send_json_response(wifistatus_obj);
 }
 
-void handleGetPreferences(){
-  String config_json;
-  if (SPIFFS.exists("/resources/preferences.json")) {
-    File a = SPIFFS.open("/resources/preferences.json", "r");
-    if (server.streamFile(a, "application/json") != a.size()) {
-      Serial.println("Error");
+#if SKY_METRICS
+void handleMetrics() {
+  DynamicJsonBuffer metrics_obj_buf;
+  JsonObject& metrics_obj = metrics_obj_buf.createObject();
+  JsonArray& limits = metrics_obj.createNestedArray("bucket_us"); // upper bounds, 0 for no bound
+  for (int i = 0; i < SKY_METRICS_BUCKETS; i++) {
+    limits.add(sky_metrics_bucket_limit(i));
+  }
+  JsonObject& stages = metrics_obj.createNestedObject("stages");
+  for (int i = 0; i < SKY_STAGE_COUNT; i++) {
+    sky_histogram_t *h = &sky_metrics[i];
+    JsonObject& stage = stages.createNestedObject(sky_stage_name((enum SKY_STAGE)i));
+    stage["count"] = h->count;
+    stage["mean_us"] = h->count ? (uint32_t)(h->total_us / h->count) : 0;
+    stage["max_us"] = h->max_us;
+    JsonArray& buckets = stage.createNestedArray("buckets");
+    for (int j = 0; j < SKY_METRICS_BUCKETS; j++) {
+      buckets.add(h->buckets[j]);
     }
   }
+  JsonObject& tasks = metrics_obj.createNestedObject("tasks");
+  sky_task_t *all[] = {&button_task, &device_task, &wifi_task, &scan_task, &query_task, &display_task, &server_task, &memory_task, &log_task, &sleep_task, &upload_task};
+  for (unsigned int i = 0; i < sizeof(all)/sizeof(all[0]); i++) {
+    JsonObject& task = tasks.createNestedObject(all[i]->name);
+    task["runs"] = all[i]->runs;
+    task["misses"] = all[i]->misses;
+    task["max_late_ms"] = all[i]->max_late;
+    task["stack_max"] = all[i]->stack_max;
+  }
+  sample_heap();
+  JsonObject& heap = metrics_obj.createNestedObject("heap");
+  heap["free"] = ESP.getFreeHeap();
+  heap["min_free"] = heap_min_free;
+  heap["largest_block"] = ESP.getMaxFreeBlockSize();
+  heap["min_largest_block"] = heap_min_block;
+  heap["fragmentation"] = ESP.getHeapFragmentation();
+  heap["max_fragmentation"] = heap_max_frag;
+  JsonObject& stack = metrics_obj.createNestedObject("stack");
+  stack["size"] = sky_stack_size();
+  stack["max_used"] = sky_stack_max_used();
+  JsonObject& functions = stack.createNestedObject("functions");
+  sky_stack_probe_t *probes[] = {&send_scan_probe, &poll_probe, &update_fix_probe, &display_probe};
+  for (unsigned int i = 0; i < sizeof(probes)/sizeof(probes[0]); i++) {
+    functions[probes[i]->name] = probes[i]->max_used;
+  }
+  // low-power clnt mode, with the battery to tune it for (the time to the location is the "wake" stage)
+  JsonObject& duty = metrics_obj.createNestedObject("sleep");
+  duty["wakes"] = sleep_state.wakes;
+  duty["awake_ms"] = sleep_state.awake_ms;
+  duty["asleep_ms"] = sleep_state.asleep_ms;
+  duty["battery_v"] = gauge.getVoltage();
+  duty["battery_soc"] = gauge.getSOC();
+  JsonObject& offline = metrics_obj.createNestedObject("scanlog");
+  offline["pending"] = scanlog_ready ? sky_scanlog_pending(&scanlog) : 0;
+  offline["dropped"] = scanlog.dropped;
+  metrics_obj["history_fixes"] = history_ready ? sky_history_count(&history) : 0;
+  main_wifi.send_json_response(metrics_obj);
+  if (server.hasArg("reset")) {
+    sky_metrics_reset();
+  }
+}
+#endif
+
+void sample_heap(){
+#if SKY_METRICS
+  uint32_t free_heap = ESP.getFreeHeap();
+  uint32_t block = ESP.getMaxFreeBlockSize();
+  uint8_t frag = ESP.getHeapFragmentation();
+  if(free_heap < heap_min_free){
+    heap_min_free = free_heap;
+  }
+  if(block < heap_min_block){
+    heap_min_block = block;
+  }
+  if(frag > heap_max_frag){
+    heap_max_frag = frag;
+  }
+#endif
+}
+
+void print_memory(){
+#if SKY_METRICS
+  Serial.println("########### Memory ###########");
+  Serial.println("heap free: " + String(ESP.getFreeHeap()) + " (min " + String(heap_min_free) + ")");
+  Serial.println("heap largest block: " + String(ESP.getMaxFreeBlockSize()) + " (min " + String(heap_min_block) + ")");
+  Serial.println("heap fragmentation: " + String(ESP.getHeapFragmentation()) + "% (max " + String(heap_max_frag) + "%)");
+  Serial.println("stack used: " + String(sky_stack_max_used()) + " of " + String(sky_stack_size()));
+  sky_stack_probe_t *probes[] = {&send_scan_probe, &poll_probe, &update_fix_probe, &display_probe};
+  for (unsigned int i = 0; i < sizeof(probes)/sizeof(probes[0]); i++) {
+    Serial.println("  " + String(probes[i]->name) + ": " + String(probes[i]->max_used));
+  }
+  sky_task_t *all[] = {&button_task, &device_task, &wifi_task, &scan_task, &query_task, &display_task, &server_task, &memory_task, &log_task, &sleep_task, &upload_task};
+  for (unsigned int i = 0; i < sizeof(all)/sizeof(all[0]); i++) {
+    Serial.println("  task " + String(all[i]->name) + ": " + String(all[i]->stack_max));
+  }
+  Serial.println("##############################");
+#endif
+}
+
+void handleGetPreferences(){
+  DynamicJsonBuffer pref_obj_buf;
+  JsonObject& pref_obj = pref_obj_buf.createObject();
+  pref_obj["scan_freq"] = config.scan_freq;
+  pref_obj["HPE"] = (bool)config.hpe;
+  pref_obj["reverse_geo"] = (bool)config.reverse_geo;
+  pref_obj["partner_id"] = config.partner_id;
+  char aes_key[2 * sizeof(config.aes_key) + 1];
+  for (unsigned int i = 0; i < sizeof(config.aes_key); i++) {
+    sprintf(aes_key + 2 * i, "%02X", config.aes_key[i]);
+  }
+  pref_obj["aes_key"] = aes_key;
+  JsonArray& servers = pref_obj.createNestedArray("servers");
+  for (int i = 0; i < config.server_count; i++) {
+    servers.add(config_server_string(&config.servers[i]));
+  }
+  main_wifi.send_json_response(pref_obj);
 }
 
 void handleChangePreferences(){
   Serial.println("User is trying to change Preferences");
-  String preferences;
   if (server.hasArg("HPE") && server.hasArg("reverse_geo") && server.hasArg("scan_freq")) {
-    String HPE_user = server.arg("HPE");
-    if (!file_to_string("/resources/preferences.json","r",preferences)) {
-      preferences = "{}";
-    }
-    Serial.println("before");
-    Serial.println(preferences);
-    
-    DynamicJsonBuffer pref_obj_buf;
-    JsonObject& pref_obj = pref_obj_buf.parseObject(preferences);
-    pref_obj["HPE"] = string_to_bool(server.arg("HPE"));
-    pref_obj["reverse_geo"] = string_to_bool(server.arg("reverse_geo"));
+    sky_config_t cfg = config;
+    cfg.hpe = string_to_bool(server.arg("HPE"));
+    cfg.reverse_geo = string_to_bool(server.arg("reverse_geo"));
     int scan_freq_input = server.arg("scan_freq").toInt();
     if(scan_freq_input < 200){
       scan_freq_input = SCAN_DEFAULT_FRQ;
     }
-    pref_obj["scan_freq"] = scan_freq_input;
-    pref_obj["partner_id"] = server.arg("partner_id").toInt();
-    pref_obj["aes_key"] = server.arg("aes_key");
-
-    if (!SPIFFS.exists("/resources/preferencesTmp.json")) {
-      SPIFFS.remove("/resources/preferencesTmp.json");
-    }
-  
-    File b = SPIFFS.open("/resources/preferencesTmp.json", "w");
-    // ERROR: file couldn't be open or created
-    if (!b) {
-      server.send(200,"application/json","{\"error\":\"No Preferences Json\"}");
-      return;
+    cfg.scan_freq = scan_freq_input;
+    cfg.partner_id = server.arg("partner_id").toInt();
+    String aes_key = server.arg("aes_key");
+    memset(cfg.aes_key, 0, sizeof(cfg.aes_key));
+    hex2bin(aes_key.c_str(), aes_key.length(), cfg.aes_key, sizeof(cfg.aes_key));
+    // servers as a comma separated list of "host:port" (see add_config_server())
+    if (server.hasArg("servers")) {
+      cfg.server_count = 0;
+      String list = server.arg("servers");
+      int start = 0;
+      while (start <= (int)list.length()) {
+        int end = list.indexOf(',', start);
+        if (end < 0) {
+          end = list.length();
+        }
+        String item = list.substring(start, end);
+        item.trim();
+        if (item.length() > 0) {
+          add_config_server(&cfg, item);
+        }
+        start = end + 1;
+      }
     }
-    // write to file
-    pref_obj.printTo(b);
-    b.close();
 
-    // update global "sky_key_t key"
-    key.partner_id = pref_obj["partner_id"];
-    memset(key.aes_key, 0, sizeof(key.aes_key));
-    hex2bin((const char *)pref_obj["aes_key"], strlen(pref_obj["aes_key"]), key.aes_key, sizeof(key.aes_key));
-
-    Serial.println("after");
-    pref_obj.prettyPrintTo(Serial);
-    Serial.println();
-    // delete the old AP list and update the new one to have the same name
-    SPIFFS.remove("/resources/preferences.json");
-    SPIFFS.rename("/resources/preferencesTmp.json", "/resources/preferences.json");
-  
-    // double checks that the JSON exists
-    if (SPIFFS.exists("/resources/preferences.json")) {
-      Serial.println("Preferences Change Successful");
-      load_config();
-      server.send(200);
-    }
-    else {
-      server.send(200,"application/json","{\"error\":\"No preferences Json after rename\"}");
+    // the previous preferences stay in flash until the new ones are written completely
+    if (!sky_config_save(&config_store, &cfg)) {
+      server.send(200,"application/json","{\"error\":\"Preferences Not Saved\"}");
+      return;
     }
+    Serial.println("Preferences Change Successful");
+    config = cfg;
+    apply_config();
+    print_saved_preferences();
+    server.send(200);
   }
   else{
     server.send(200,"application/json","{\"error\":\"Incomplete Request\"}");
@@ -1348,6 +2507,39 @@ void handleLocation(){
   client_req.location_json();
 }
 
+void handleLocationEvents(){
+  client_req.subscribe_events();
+}
+
+void handleHistory(){
+  if(!history_ready){
+    server.send(200,"application/json","{\"error\":\"No History\"}");
+    return;
+  }
+  uint32_t from = server.hasArg("from") ? strtoul(server.arg("from").c_str(), NULL, 10) : 0;
+  uint32_t to = server.hasArg("to") ? strtoul(server.arg("to").c_str(), NULL, 10) : 0xffffffff;
+  sky_history_cursor_t cursor;
+  sky_history_record_t record;
+  // the page summaries find the first fix, which is streamed in chunks of about HISTORY_CHUNK bytes
+  sky_history_find(&history, from, to, &cursor);
+  server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  server.send(200, "application/json", "");
+  String chunk = "{\"now\":" + String(history_clock()) + ",\"fixes\":[";
+  bool first = true;
+  while(sky_history_read(&history, &cursor, &record)){
+    chunk += String(first ? "" : ",") + "{\"time\":" + String(record.time) + ",\"type\":" + String(record.type)
+        + ",\"aps\":" + String(record.ap_count) + ",\"LAT\":" + String(record.location.lat, 5)
+        + ",\"LON\":" + String(record.location.lon, 5) + ",\"HPE\":" + String(record.location.hpe) + "}";
+    first = false;
+    if(chunk.length() >= HISTORY_CHUNK){
+      server.sendContent(chunk);
+      chunk = "";
+    }
+  }
+  server.sendContent(chunk + "]}");
+  server.sendContent("");
+}
+
 void handleNotFound() {
   server.send(404, "text/html", "<head></head><h1>404 Not Found</h1>");
 }
@@ -1367,15 +2559,17 @@ bool get_error(String& error){
   if (resp.payload_ext.payload.type != LOCATION_RQ && resp.payload_ext.payload.type != LOCATION_RQ_ADDR){
       switch (resp.payload_ext.payload.type)
       {
-            case LOCATION_RQ_SUCCESS: Serial.println("LOCATION_RQ_SUCCESS"); break;
-            case LOCATION_RQ_ADDR_SUCCESS: Serial.println("LOCATION_RQ_ADDR_SUCCESS"); break;
-            case PROBE_REQUEST_SUCCESS: Serial.println("PROBE_REQUEST_SUCCESS"); break;
-            case LOCATION_RQ_ERROR: Serial.println("LOCATION_RQ_ERROR"); break;
-            case LOCATION_GATEWAY_ERROR: Serial.println("LOCATION_GATEWAY_ERROR"); break;
-            case LOCATION_API_ERROR: Serial.println("LOCATION_API_ERROR"); break;
-            case LOCATION_UNKNOWN: Serial.println("LOCATION_UNKNOWN"); break;
-            case LOCATION_UNABLE_TO_DETERMINE: Serial.println("LOCATION_UNABLE_TO_DETERMINE"); break;
+            case LOCATION_RQ_SUCCESS: error = "LOCATION_RQ_SUCCESS"; break;
+            case LOCATION_RQ_ADDR_SUCCESS: error = "LOCATION_RQ_ADDR_SUCCESS"; break;
+            case PROBE_REQUEST_SUCCESS: error = "PROBE_REQUEST_SUCCESS"; break;
+            case LOCATION_RQ_ERROR: error = "LOCATION_RQ_ERROR"; break;
+            case LOCATION_GATEWAY_ERROR: error = "LOCATION_GATEWAY_ERROR"; break;
+            case LOCATION_API_ERROR: error = "LOCATION_API_ERROR"; break;
+            case LOCATION_UNKNOWN: error = "LOCATION_UNKNOWN"; break;
+            case LOCATION_UNABLE_TO_DETERMINE: error = "LOCATION_UNABLE_TO_DETERMINE"; break;
+            default: error = "UNKNOWN_RESPONSE"; break;
       }
+      Serial.println(error);
       return true;
   }
     return false;
@@ -1391,20 +2585,6 @@ int get_max(int buf[], int len){
   return max;
 }
 
-void print64(uint64_t value){
-    const int NUM_DIGITS = log10(value) + 1;
-
-    char sz[NUM_DIGITS + 1];
-    
-    sz[NUM_DIGITS] =  0;
-    for ( size_t i = NUM_DIGITS; i--; value /= 10)
-    {
-        sz[i] = '0' + (value % 10);
-    }
-
-    Serial.print(sz);
-}
-
 // DEBUGGING
 void print_saved_networks() {
   String APjson;
@@ -1419,14 +2599,11 @@ void print_saved_networks() {
 
 // DEBUGGING
 void print_saved_preferences(){
-  String pref;
-  if (!file_to_string("/resources/preferences.json","r",pref)) {
-    return;
+  Serial.println("config #" + String(config_store.seq) + ": scan_freq " + String(config.scan_freq) + ", HPE "
+      + String(config.hpe) + ", reverse_geo " + String(config.reverse_geo) + ", partner_id " + String(config.partner_id));
+  for (int i = 0; i < config.server_count; i++) {
+    Serial.println("  server " + config_server_string(&config.servers[i]));
   }
-  DynamicJsonBuffer bssid_obj_buf;
-  JsonObject& bssid_obj = bssid_obj_buf.parseObject(pref);
-  bssid_obj.prettyPrintTo(Serial);
-  Serial.println();
 }
 
 /**
@@ -1448,7 +2625,13 @@ void setup() {
   // Begin Serial output
   if(DEBUG){
     Serial.begin(115200);
+#if SKY_LOG_LEVEL > SKY_LOG_LEVEL_NONE
+    // the SDK writes its debug output to the uart at any time, into the middle of a log record;
+    // the text of Serial.print() goes between whole records (see run_log())
+    Serial.setDebugOutput(false);
+#else
     Serial.setDebugOutput(true);
+#endif
   }
   
   optimistic_yield(100);
@@ -1461,36 +2644,70 @@ void setup() {
   gauge.setAlertThreshold(ALERT_THRESHOLD);
   Serial.println(String("Alert Threshold is set to ") + gauge.getAlertThreshold() + '%');
 
-  // preferences.json is loaded and boolean values are set
+  // location queries to the servers of the preferences
+  sky_client_init(&elg_query[0], query_buff[0], sizeof(query_buff[0]), wifi_send, wifi_recv, &client, elg_query_done, NULL);
+  sky_client_init(&elg_query[1], query_buff[1], sizeof(query_buff[1]), wifi_send, wifi_recv, &hedge_client, elg_query_done, NULL);
+
+  // tasks by priority: the button first, then the network, the web server and the display
+  sky_sched_init(&sched, millis());
+  sky_task_init(&button_task, "button", run_button, NULL, 0, BUTTON_POLL_RATE, 0);
+  sky_task_init(&query_task, "query", run_query, NULL, 1, 0, QUERY_POLL_RATE);
+  sky_task_init(&wifi_task, "wifi", run_wifi, NULL, 1, WIFI_RETRY_RATE, 0);
+  sky_task_init(&scan_task, "scan", run_scan, NULL, 2, SCAN_DEFAULT_FRQ, 0);
+  sky_task_init(&server_task, "server", run_server, NULL, 2, SERVER_POLL_RATE, 0);
+  sky_task_init(&display_task, "display", run_display, NULL, 3, 0, 0);
+  sky_task_init(&device_task, "device", run_device, NULL, 3, DEVICE_UPDATE_RATE, 0);
+  sky_task_init(&memory_task, "memory", run_memory, NULL, 3, MEM_SAMPLE_RATE, 0);
+  sky_task_init(&log_task, "log", run_log, NULL, 3, LOG_DRAIN_RATE, 0);
+  sky_task_init(&sleep_task, "sleep", run_sleep, NULL, 3, 0, 0);
+  sky_task_init(&upload_task, "upload", run_upload, NULL, 3, 0, 0);
+#if SKY_LOG_LEVEL > SKY_LOG_LEVEL_NONE
+  sky_log_set_clock(log_clock);
+#endif
+#if SKY_METRICS
+  // the continuation stack, which loop() and everything it calls runs on (g_pcont of core 2.5 or later)
+  sky_stack_init((uint32_t *)g_pcont->stack, sizeof(g_pcont->stack));
+#endif
+
+  // the preferences are loaded from flash and applied
   load_config();
+  load_sleep_rtc();
+  load_scanlog();
+  load_history();
 
   // initialize OLED
   oled.init();
   oled.clearDisplay();
   // clear RSSI
   oled.setRSSI(0);
-  // display Logo for Skyhook
-  oled.drawBitmap(0, 0, skyhook_logo, 128, 32, WHITE);
-  oled.display();
-
-  // config WiFi
-  WiFi.mode(WIFI_AP_STA);
-  uint8_t mac[WL_MAC_ADDR_LENGTH];
-  WiFi.macAddress(mac);
+  if(!woke_from_sleep){
+    // display Logo for Skyhook
+    oled.drawBitmap(0, 0, skyhook_logo, 128, 32, WHITE);
+    oled.display();
+  }
 
-  // display logo for 4 seconds with no interrupts but allow device to run processes
-  delay(4000);
-  oled.clearDisplay();
-  oled.setConnected(INITIAL_STARTUP_STATE);
-  oled.refreshIcons();
+  // a wake from deep sleep (low-power clnt mode) skips the logo and the soft AP
+  if(woke_from_sleep){
+    WiFi.mode(WIFI_STA);
+    oled.setConnected(CLIENT);
+    // the location of the previous wake, until this one's arrives
+    if(sleep_state.has_location){
+      resp.payload_ext.payload.type = LOCATION_RQ;
+      resp.location = sleep_state.location;
+      print_location_oled();
+      sky_sched_cancel(&sched, &display_task);
+    }
+  }
+  else{
+    // display logo for 4 seconds with no interrupts but allow device to run processes
+    delay(4000);
+    oled.clearDisplay();
+    oled.setConnected(INITIAL_STARTUP_STATE);
+    oled.refreshIcons();
 
-  // station mode allows both client and AP mode
-  Serial.println();
-  Serial.println("Configuring access point...");
-  // set ssid and password
-  WiFi.softAP(ssid, password);
-  WiFi.softAPmacAddress(mac);
-  yield();
+    // station mode allows both client and AP mode
+    start_soft_ap();
+  }
 
   // connect to known WiFi
   connect_to_wifi();
@@ -1501,9 +2718,14 @@ void setup() {
   server.on("/skyhookclient/scan", HTTP_GET, handleScan);
   server.on("/skyhookclient/changeap", HTTP_POST, handleChangeAP);
   server.on("/skyhookclient/getstatus", HTTP_GET, handleGetStatus);
+#if SKY_METRICS
+  server.on("/skyhookclient/metrics", HTTP_GET, handleMetrics);
+#endif
   server.on("/skyhookclient/getpreferences", HTTP_GET, handleGetPreferences);
   server.on("/skyhookclient/changepreferences", HTTP_POST, handleChangePreferences);
   server.on("/skyhookclient/getlocation", HTTP_GET, handleLocation);
+  server.on("/skyhookclient/locationevents", HTTP_GET, handleLocationEvents);
+  server.on("/skyhookclient/history", HTTP_GET, handleHistory);
   server.onNotFound(handleNotFound);
 
   // scripts and css files for the web interface
@@ -1517,39 +2739,45 @@ void setup() {
   Serial.println("Initializing Server");
   yield();
 
-  device.handle();
+  device.update_oled();
 
-  Serial.println("Saved Networks:");
-  print_saved_networks();
-  Serial.println();
-  Serial.println("Saved Preferences:");
-  print_saved_preferences();
-  Serial.println();
+  if(!woke_from_sleep){
+    Serial.println("Saved Networks:");
+    print_saved_networks();
+    Serial.println();
+    Serial.println("Saved Preferences:");
+    print_saved_preferences();
+    Serial.println();
   
-  Serial.println("HTTP server started");
-  Serial.println("Open "+ WiFi.softAPIP().toString()+" in your browser\n");
+    Serial.println("HTTP server started");
+    Serial.println("Open "+ WiFi.softAPIP().toString()+" in your browser\n");
+  }
   device.set_state_settings();
   if(device.getDeviceState() == AP){
     print_to_oled("Open in browser:", WiFi.softAPIP().toString());
   }
+
+  unsigned long now = millis();
+  sky_sched_add(&sched, &button_task, now);
+  sky_sched_add(&sched, &device_task, now);
+#if SKY_METRICS
+  sky_sched_add(&sched, &memory_task, now);
+#endif
+#if SKY_LOG_LEVEL > SKY_LOG_LEVEL_NONE
+  sky_sched_add(&sched, &log_task, now);
+#endif
+  schedule_mode_tasks();
 }
 
 void loop() {
-  // handle differently depending on device state
-  if(device.getDeviceState() == AP){
-    server.handleClient();
-    device.handle();
-  }
-  else{
-    // make sure WiFi connected
-    if(WiFi.status() != WL_CONNECTED){
-      connect_to_wifi();
-      yield_wait(1000); // wait for 1 second to allow changing to AP mode so as to reset WiFi password
-    }else{
-      client_req.handle();
+  // run the task which is due, or sleep until the next one is
+  uint32_t now = millis();
+  if(!sky_sched_run(&sched, now)){
+    uint32_t idle = sky_sched_idle(&sched, now, MAX_IDLE_SLEEP);
+    if(idle > 0){
+      delay(idle);
     }
   }
-  state.update();
   yield();
 }
 
@@ -0,0 +1,102 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+#include <stddef.h>
+#include <string.h>
+#include "sky_config.h"
+
+uint32_t sky_crc32(uint32_t crc, const void *data, uint32_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    int k;
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        for (k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
+
+// offset of the slot after the one at offset, wrapping around at the end of the area
+static uint32_t next_slot(const sky_config_store_t *store, uint32_t offset) {
+    offset += SKY_CONFIG_SLOT_SIZE;
+    if (offset % store->sector_size + SKY_CONFIG_SLOT_SIZE > store->sector_size)
+        offset += store->sector_size - offset % store->sector_size;
+    return (offset + SKY_CONFIG_SLOT_SIZE > store->size) ? 0 : offset;
+}
+
+static bool record_valid(const sky_config_record_t *r) {
+    return r->magic == SKY_CONFIG_MAGIC && r->version == SKY_CONFIG_VERSION
+            && r->len == sizeof(sky_config_record_t)
+            && r->crc == sky_crc32(0, r, offsetof(sky_config_record_t, crc));
+}
+
+// all bytes of the slot are 0xff (erased)
+static bool slot_blank(sky_config_store_t *store, uint32_t offset) {
+    uint32_t words[16];
+    uint32_t done, i;
+    for (done = 0; done < SKY_CONFIG_SLOT_SIZE; done += sizeof(words)) {
+        uint32_t len = (SKY_CONFIG_SLOT_SIZE - done < sizeof(words)) ? SKY_CONFIG_SLOT_SIZE - done : sizeof(words);
+        if (!store->read(offset + done, words, len, store->ctx))
+            return false;
+        for (i = 0; i < len / sizeof(uint32_t); i++) {
+            if (words[i] != 0xffffffff)
+                return false;
+        }
+    }
+    return true;
+}
+
+bool sky_config_load(sky_config_store_t *store, sky_config_t *config) {
+    static sky_config_record_t r; // off the (small) stack of the device
+    uint32_t offset = 0;
+    bool found = false;
+
+    store->next = 0;
+    store->seq = 0;
+    do {
+        if (store->read(offset, &r, sizeof(r), store->ctx) && record_valid(&r)
+                && (!found || (int32_t)(r.seq - store->seq) > 0)) {
+            memcpy(config, &r.config, sizeof(*config));
+            store->seq = r.seq;
+            store->next = next_slot(store, offset);
+            found = true;
+        }
+        offset = next_slot(store, offset);
+    } while (offset != 0);
+    return found;
+}
+
+bool sky_config_save(sky_config_store_t *store, const sky_config_t *config) {
+    static sky_config_record_t r, check;
+    uint32_t offset = store->next;
+
+    memset(&r, 0, sizeof(r));
+    r.magic = SKY_CONFIG_MAGIC;
+    r.version = SKY_CONFIG_VERSION;
+    r.len = sizeof(r);
+    r.seq = store->seq + 1;
+    memcpy(&r.config, config, sizeof(r.config));
+    r.crc = sky_crc32(0, &r, offsetof(sky_config_record_t, crc));
+
+    // the first blank slot from next on; a used one at the start of a sector is an old record, whose
+    // sector is erased, any other was torn by a reset and is skipped
+    while (!slot_blank(store, offset)) {
+        if (offset % store->sector_size == 0) {
+            if (!store->erase(offset, store->ctx))
+                return false;
+            break;
+        }
+        offset = next_slot(store, offset);
+        if (offset == store->next)
+            return false;
+    }
+    // a failed write is not retried in the next slots, which could erase the current record
+    store->next = next_slot(store, offset);
+    if (!store->write(offset, &r, sizeof(r), store->ctx) || !store->read(offset, &check, sizeof(check), store->ctx)
+            || memcmp(&r, &check, sizeof(r)) != 0)
+        return false;
+    store->seq = r.seq;
+    return true;
+}
@@ -0,0 +1,99 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_CONFIG_H
+#define SKY_CONFIG_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include "sky_protocol.h"
+
+/*************************************************************************
+ *
+ * Binary configuration store
+ *
+ * The settings are saved as versioned records with a CRC, one after the
+ * other in the slots of a flash area, and the valid record with the
+ * highest sequence number is the current one. A save writes to a blank
+ * slot, so the previous record stays current until the new one is
+ * complete (a torn write fails its CRC). A sector is erased only when the
+ * writes reach it again, once per sectors worth of saves. The area needs
+ * two sectors or more: the writes then erase a sector of older records
+ * only, while the current record is in the other one, so a power loss at
+ * any point keeps either the previous or the new settings. With a single
+ * sector, the erase removes the current record as well.
+ *
+ *************************************************************************/
+
+#define SKY_CONFIG_MAGIC        0x46434b53  // "SKCF"
+#define SKY_CONFIG_VERSION      1
+#define SKY_CONFIG_HOST_LEN     60
+
+// ELG server
+typedef struct {
+    char host[SKY_CONFIG_HOST_LEN];
+    uint16_t port;
+    uint16_t caps;          // SKY_ENDPOINT_* (sky_protocol.h), 0 for a plain version 1 server
+} sky_config_server_t;
+
+// the settings, as stored (little endian, as the device)
+typedef struct {
+    uint32_t scan_freq;     // ms between scans in clnt mode
+    uint32_t partner_id;
+    uint8_t aes_key[16];    // 128 bit aes key
+    uint8_t hpe;            // show the hpe (bool)
+    uint8_t reverse_geo;    // query the address (bool)
+    uint8_t server_count;
+    uint8_t reserved;
+    sky_config_server_t servers[SKY_MAX_ENDPOINTS];
+} sky_config_t;
+
+// record of a slot
+typedef struct {
+    uint32_t magic;         // SKY_CONFIG_MAGIC
+    uint16_t version;       // SKY_CONFIG_VERSION
+    uint16_t len;           // sizeof(sky_config_record_t)
+    uint32_t seq;           // sequence number, the highest is current
+    sky_config_t config;
+    uint32_t crc;           // sky_crc32() of the record before it
+} sky_config_record_t;
+
+// bytes of a slot, records do not straddle sectors
+#define SKY_CONFIG_SLOT_SIZE    ((sizeof(sky_config_record_t) + 3) & ~3u)
+
+// flash area of the store, whose bytes are 0xff after an erase; offsets (from the start of the area)
+// and lengths of the callbacks are multiples of 4, and the buffers 4 byte aligned
+typedef struct {
+    uint32_t size;          // bytes of the area, a multiple of sector_size
+    uint32_t sector_size;   // bytes of an erase sector
+    bool (* read)(uint32_t offset, void *buff, uint32_t len, void *ctx);
+    bool (* write)(uint32_t offset, const void *buff, uint32_t len, void *ctx);
+    bool (* erase)(uint32_t offset, void *ctx);  // the sector at offset
+    void *ctx;              // caller context of the callbacks
+    // set by sky_config_load()
+    uint32_t next;          // offset of the slot the next save tries first
+    uint32_t seq;           // sequence number of the current record
+} sky_config_store_t;
+
+// CRC-32 (IEEE 802.3) of data, continuing from crc (0 to start)
+uint32_t sky_crc32(uint32_t crc, const void *data, uint32_t len);
+
+// finds the current record of the store, and copies its settings to config
+// returns false when there is none (config is unchanged), e.g. on a blank or erased area
+bool sky_config_load(sky_config_store_t *store, sky_config_t *config);
+
+// saves config as the current record, sky_config_load() has to be called before
+// returns false when it could not be written (the previous record stays current)
+bool sky_config_save(sky_config_store_t *store, const sky_config_t *config);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -9,6 +9,7 @@
 #include <string.h>
 #include <pthread.h>
 #include "sky_crypt.h"
+#include "sky_log.h"
 #include "mauth.h"
 #include "aes.h"
 
@@ -34,7 +35,7 @@ void sky_gen_iv(uint8_t *iv) {
 int32_t sky_aes_encrypt(uint8_t *data, uint32_t data_len, uint8_t *key,
         uint8_t *iv) {
     if (data_len & 0x0F) {
-        //perror("Data length (in bytes) must be a multiple of 16");
+        SKY_LOG_ERROR("Data length (in bytes) must be a multiple of 16");
         return -1;
     }
 
@@ -48,7 +49,7 @@ int32_t sky_aes_encrypt(uint8_t *data, uint32_t data_len, uint8_t *key,
 int32_t sky_aes_decrypt(uint8_t *data, uint32_t data_len, uint8_t *key,
         uint8_t *iv) {
     if (data_len & 0x0F) {
-        //perror("non 16 byte blocks");
+        SKY_LOG_ERROR("non 16 byte blocks");
         return -1;
     }
 
@@ -82,3 +83,44 @@ uint16_t fletcher16(uint8_t const *buff, int32_t buff_len) {
 
     return s2 << 8 | s1;
 }
+
+// The reductions in fletcher16() keep both sums in [1, 255], i.e. congruent to the plain sums
+// modulo 255 with 0 represented as 255. The incremental version keeps the plain sums modulo 255
+// instead, which lets a pre-computed segment be appended without touching its bytes again.
+void fletcher16_init(sky_checksum_ctx_t *ctx) {
+    ctx->s1 = 0;
+    ctx->s2 = 0;
+}
+
+void fletcher16_update(sky_checksum_ctx_t *ctx, uint8_t const *buff, int32_t buff_len) {
+    uint32_t s1 = ctx->s1;
+    uint32_t s2 = ctx->s2;
+
+    while (buff_len > 0) {
+        // s2 stays far below 2^32 within 360 bytes
+        int32_t len = buff_len > 360 ? 360 : buff_len;
+
+        buff_len -= len;
+
+        do {
+            s2 += s1 += *buff++;
+        } while (--len);
+
+        s1 %= 255;
+        s2 %= 255;
+    }
+
+    ctx->s1 = s1;
+    ctx->s2 = s2;
+}
+
+void fletcher16_append(sky_checksum_ctx_t *ctx, sky_checksum_ctx_t const *seg, uint32_t seg_len) {
+    ctx->s2 = (ctx->s2 + (seg_len % 255) * ctx->s1 + seg->s2) % 255;
+    ctx->s1 = (ctx->s1 + seg->s1) % 255;
+}
+
+uint16_t fletcher16_final(sky_checksum_ctx_t const *ctx) {
+    uint16_t s1 = ctx->s1 ? ctx->s1 : 0xFF;
+    uint16_t s2 = ctx->s2 ? ctx->s2 : 0xFF;
+    return s2 << 8 | s1;
+}
@@ -27,6 +27,15 @@ int32_t sky_aes_decrypt(uint8_t *data, uint32_t data_len, uint8_t *key,
 
 uint16_t fletcher16(uint8_t const *buff, int32_t buff_len);
 
+/* incremental fletcher16, gives the same result as fletcher16() over the concatenated data */
+void fletcher16_init(sky_checksum_ctx_t *ctx);
+void fletcher16_update(sky_checksum_ctx_t *ctx, uint8_t const *buff, int32_t buff_len);
+
+/* append a segment of seg_len bytes whose sums were computed on their own from fletcher16_init() */
+void fletcher16_append(sky_checksum_ctx_t *ctx, sky_checksum_ctx_t const *seg, uint32_t seg_len);
+
+uint16_t fletcher16_final(sky_checksum_ctx_t const *ctx);
+
 #endif
 
 #ifdef __cplusplus
@@ -0,0 +1,196 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+#include <stddef.h>
+#include <string.h>
+#include "sky_config.h"
+#include "sky_history.h"
+
+static uint32_t page_count(const sky_history_t *log) {
+    return log->size / log->sector_size;
+}
+
+static uint32_t slot_offset(const sky_history_t *log, uint32_t page, uint32_t slot) {
+    return page * log->sector_size + sizeof(sky_history_header_t) + slot * sizeof(sky_history_record_t);
+}
+
+static bool header_valid(const sky_history_header_t *h) {
+    return h->magic == SKY_HISTORY_MAGIC && h->seq != 0
+            && h->crc == sky_crc32(0, h, offsetof(sky_history_header_t, crc));
+}
+
+static bool read_record(sky_history_t *log, uint32_t page, uint32_t slot, sky_history_record_t *r) {
+    return log->read(slot_offset(log, page, slot), r, sizeof(*r), log->ctx)
+            && r->crc == sky_crc32(0, r, offsetof(sky_history_record_t, crc));
+}
+
+// all bytes of the slot are 0xff (erased)
+static bool slot_blank(sky_history_t *log, uint32_t page, uint32_t slot) {
+    sky_history_record_t r;
+    const uint32_t *words = (const uint32_t *)&r;
+    uint32_t i;
+    if (!log->read(slot_offset(log, page, slot), &r, sizeof(r), log->ctx))
+        return false;
+    for (i = 0; i < sizeof(r) / sizeof(uint32_t); i++) {
+        if (words[i] != 0xffffffff)
+            return false;
+    }
+    return true;
+}
+
+bool sky_history_load(sky_history_t *log) {
+    sky_history_header_t h;
+    sky_history_record_t r;
+    uint32_t page, lo, hi;
+
+    log->current = 0;
+    log->seq = 0;
+    log->last = 0;
+    for (page = 0; page < page_count(log); page++) {
+        sky_history_page_t *s = &log->pages[page];
+        memset(s, 0, sizeof(*s));
+        if (!log->read(page * log->sector_size, &h, sizeof(h), log->ctx))
+            return false;
+        if (!header_valid(&h))
+            continue;
+        s->seq = h.seq;
+        s->first = h.first;
+        s->last = h.first;
+        // the slots are used in order, the first blank one ends them
+        for (lo = 0, hi = SKY_HISTORY_SLOTS(log); lo < hi;) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (slot_blank(log, page, mid))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        s->count = lo;
+        for (; lo > 0; lo--) {
+            if (read_record(log, page, lo - 1, &r)) {
+                s->last = r.time;
+                break;
+            }
+        }
+        if (log->seq == 0 || (int32_t)(s->seq - log->seq) > 0) {
+            log->current = page;
+            log->seq = s->seq;
+            log->last = s->last;
+        }
+    }
+    return true;
+}
+
+// erases the page after the current one (the first of an empty log) and writes its header
+static bool open_page(sky_history_t *log, uint32_t first) {
+    uint32_t page = (log->seq == 0) ? 0 : (log->current + 1) % page_count(log);
+    sky_history_page_t *s = &log->pages[page];
+    sky_history_header_t h;
+
+    memset(s, 0, sizeof(*s)); // its records are dropped
+    if (!log->erase(page * log->sector_size, log->ctx))
+        return false;
+    h.magic = SKY_HISTORY_MAGIC;
+    h.seq = log->seq + 1;
+    h.first = first;
+    h.crc = sky_crc32(0, &h, offsetof(sky_history_header_t, crc));
+    if (!log->write(page * log->sector_size, &h, sizeof(h), log->ctx))
+        return false;
+    s->seq = h.seq;
+    s->first = first;
+    s->last = first;
+    log->current = page;
+    log->seq = h.seq;
+    return true;
+}
+
+bool sky_history_append(sky_history_t *log, sky_history_record_t *record) {
+    sky_history_record_t check;
+    sky_history_page_t *s;
+    uint32_t offset;
+
+    if (log->seq != 0 && record->time < log->last)
+        record->time = log->last; // the clock started over
+    record->reserved = 0;
+    record->reserved2 = 0;
+    record->crc = sky_crc32(0, record, offsetof(sky_history_record_t, crc));
+
+    if ((log->seq == 0 || log->pages[log->current].count >= SKY_HISTORY_SLOTS(log))
+            && !open_page(log, record->time))
+        return false;
+    s = &log->pages[log->current];
+    // a failed write takes its slot as well
+    offset = slot_offset(log, log->current, s->count++);
+    if (!log->write(offset, record, sizeof(*record), log->ctx) || !log->read(offset, &check, sizeof(check), log->ctx)
+            || memcmp(record, &check, sizeof(check)) != 0)
+        return false;
+    s->last = record->time;
+    log->last = record->time;
+    return true;
+}
+
+uint32_t sky_history_count(const sky_history_t *log) {
+    uint32_t page, n = 0;
+    for (page = 0; page < page_count(log); page++) {
+        if (log->pages[page].seq != 0)
+            n += log->pages[page].count;
+    }
+    return n;
+}
+
+void sky_history_find(sky_history_t *log, uint32_t from, uint32_t to, sky_history_cursor_t *cursor) {
+    sky_history_record_t r;
+    uint32_t i, lo, hi;
+
+    cursor->from = from;
+    cursor->to = to;
+    cursor->seq = 0;
+    if (log->seq == 0 || from > to)
+        return;
+    // oldest page first, the one after the current around the ring
+    for (i = 1; i <= page_count(log); i++) {
+        uint32_t page = (log->current + i) % page_count(log);
+        const sky_history_page_t *s = &log->pages[page];
+        if (s->seq == 0 || s->count == 0 || s->last < from)
+            continue;
+        if (s->first > to)
+            return;
+        // the first slot at from or later; a torn one counts as later, the reads skip what is before from
+        for (lo = 0, hi = s->count; lo < hi;) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (read_record(log, page, mid, &r) && r.time < from)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        cursor->page = page;
+        cursor->seq = s->seq;
+        cursor->slot = lo;
+        return;
+    }
+}
+
+bool sky_history_read(sky_history_t *log, sky_history_cursor_t *cursor, sky_history_record_t *record) {
+    while (cursor->seq != 0) {
+        const sky_history_page_t *s = &log->pages[cursor->page];
+        uint32_t next;
+        if (s->seq != cursor->seq)
+            break; // erased
+        if (cursor->slot < s->count) {
+            if (!read_record(log, cursor->page, cursor->slot++, record) || record->time < cursor->from)
+                continue;
+            if (record->time > cursor->to)
+                break;
+            return true;
+        }
+        // the page of the next sequence number
+        next = (cursor->page + 1) % page_count(log);
+        if (cursor->page == log->current || log->pages[next].seq != cursor->seq + 1)
+            break;
+        cursor->page = next;
+        cursor->seq++;
+        cursor->slot = 0;
+    }
+    cursor->seq = 0;
+    return false;
+}
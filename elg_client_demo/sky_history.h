@@ -0,0 +1,121 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_HISTORY_H
+#define SKY_HISTORY_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include "sky_protocol.h"
+
+/*************************************************************************
+ *
+ * Location history
+ *
+ * Every fix is appended as a fixed-size record with a CRC to a ring of
+ * flash pages, one per erase sector. A page starts with a header (its
+ * sequence number and the time of its first record), written with the
+ * first record after the page is erased; the writes erase a page when they
+ * enter it, which drops its records (the oldest). The times of the records
+ * never decrease, so the records of a page are sorted, and the pages are in
+ * time order by sequence number.
+ *
+ * sky_history_load() reads the header and finds the last record of each
+ * page once, and keeps them in the page summaries in RAM (one per page,
+ * from the caller). A time range query then skips the pages out of range
+ * with the summaries, and finds its first record in the first page by
+ * binary search: the reads are a few per page, not the whole log. The ring
+ * needs two pages or more, with a single one an erase drops all the
+ * records.
+ *
+ *************************************************************************/
+
+#define SKY_HISTORY_MAGIC       0x54534948  // "HIST"
+
+// page header, at the start of a page
+typedef struct {
+    uint32_t magic;         // SKY_HISTORY_MAGIC
+    uint32_t seq;           // sequence number of the page, from 1 up
+    uint32_t first;         // time of its first record
+    uint32_t crc;           // sky_crc32() of the header before it
+} sky_history_header_t;
+
+// record of a slot, after the header (little endian, as the device)
+typedef struct {
+    uint32_t time;          // s of the caller's clock at the fix
+    uint8_t type;           // payload.type of the response
+    uint8_t ap_count;       // access points of the scan
+    uint16_t reserved;
+    struct location_t location;
+    uint32_t reserved2;     // pads the record to the alignment of location
+    uint32_t crc;           // sky_crc32() of the record before it
+} sky_history_record_t;
+
+// summary of a page, in RAM
+typedef struct {
+    uint32_t seq;           // of the header, 0 for a page without one (blank, or torn)
+    uint32_t first;         // time of the first record
+    uint32_t last;          // time of the last valid record
+    uint16_t count;         // # of slots used, valid or torn
+    uint16_t reserved;
+} sky_history_page_t;
+
+// flash area of the log, whose bytes are 0xff after an erase; offsets (from the start of the area) and
+// lengths of the callbacks are multiples of 4, and the buffers 4 byte aligned
+typedef struct {
+    uint32_t size;          // bytes of the area, a multiple of sector_size
+    uint32_t sector_size;   // bytes of an erase sector, a page
+    bool (* read)(uint32_t offset, void *buff, uint32_t len, void *ctx);
+    bool (* write)(uint32_t offset, const void *buff, uint32_t len, void *ctx);
+    bool (* erase)(uint32_t offset, void *ctx);  // the sector at offset
+    void *ctx;              // caller context of the callbacks
+    sky_history_page_t *pages; // size / sector_size summaries
+    // set by sky_history_load()
+    uint32_t current;       // index of the page of the newest record
+    uint32_t seq;           // its sequence number, 0 for an empty log
+    uint32_t last;          // time of the newest record
+} sky_history_t;
+
+// position of sky_history_read() in a time range
+typedef struct {
+    uint32_t page;          // index of the page read
+    uint32_t seq;           // its sequence number, 0 when the range is done
+    uint32_t slot;          // slot read next
+    uint32_t from;          // the range, in time
+    uint32_t to;
+} sky_history_cursor_t;
+
+// # of record slots of a page
+#define SKY_HISTORY_SLOTS(log) \
+    (((log)->sector_size - sizeof(sky_history_header_t)) / sizeof(sky_history_record_t))
+
+// reads the page headers and finds the last record of each page, for the page summaries
+// returns false when the area could not be read
+bool sky_history_load(sky_history_t *log);
+
+// appends the record, whose time, location, type and ap count the caller set, as the newest one; a
+// time before the newest record's is raised to it. sky_history_load() has to be called before
+// returns false when it could not be written
+bool sky_history_append(sky_history_t *log, sky_history_record_t *record);
+
+// returns the # of records of the log (torn ones included)
+uint32_t sky_history_count(const sky_history_t *log);
+
+// moves the cursor to the first record of the log at time from or later
+void sky_history_find(sky_history_t *log, uint32_t from, uint32_t to, sky_history_cursor_t *cursor);
+
+// reads the record at the cursor, oldest first, and moves the cursor past it
+// returns false when there is none left up to time to, or an append erased the page of the cursor
+bool sky_history_read(sky_history_t *log, sky_history_cursor_t *cursor, sky_history_record_t *record);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,115 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+#include <stdarg.h>
+#include "sky_log.h"
+
+#if SKY_LOG_LEVEL > SKY_LOG_LEVEL_NONE
+
+#define RING_MASK   (SKY_LOG_RING_SIZE - 1)
+#define PAD4(n)     (((n) + 3) & ~3u)
+
+static uint8_t ring[SKY_LOG_RING_SIZE];
+static volatile uint32_t head;  // bytes written, moved by the writer only
+static volatile uint32_t tail;  // bytes read, moved by the reader only
+static uint16_t seq;
+static uint32_t dropped;
+static uint32_t (* clock_ms)(void);
+
+// copy into the ring at offset pos, wrapping around
+static void ring_put(uint32_t pos, const void *data, uint32_t len) {
+    if (len == 0)
+        return;
+    uint32_t at = pos & RING_MASK;
+    uint32_t first = (len < SKY_LOG_RING_SIZE - at) ? len : SKY_LOG_RING_SIZE - at;
+    memcpy(ring + at, data, first);
+    memcpy(ring, (const uint8_t *)data + first, len - first);
+}
+
+static void ring_get(uint32_t pos, void *data, uint32_t len) {
+    uint32_t at = pos & RING_MASK;
+    uint32_t first = (len < SKY_LOG_RING_SIZE - at) ? len : SKY_LOG_RING_SIZE - at;
+    memcpy(data, ring + at, first);
+    memcpy((uint8_t *)data + first, ring, len - first);
+}
+
+void sky_log_set_clock(uint32_t (* now_ms)(void)) {
+    clock_ms = now_ms;
+}
+
+static void log_record(uint8_t level, uint8_t kind, const char *fmt, const uint32_t *args, uint32_t nargs,
+        const void *data, uint32_t len) {
+    static const uint8_t pad[4];
+    sky_log_record_t r;
+    uint32_t size = sizeof(r) + nargs * sizeof(uint32_t) + PAD4(len);
+    uint32_t pos = head;
+
+    r.seq = seq++;
+    if (size > SKY_LOG_RING_SIZE - (pos - tail)) {
+        dropped++;
+        return;
+    }
+    r.sync[0] = SKY_LOG_SYNC0;
+    r.sync[1] = SKY_LOG_SYNC1;
+    r.level = level;
+    r.kind_nargs = (uint8_t)(kind << 4 | nargs);
+    r.len = (uint16_t)len;
+    r.time = (clock_ms != NULL) ? clock_ms() : 0;
+    r.fmt = (uint32_t)(uintptr_t)fmt;
+    ring_put(pos, &r, sizeof(r));
+    pos += sizeof(r);
+    ring_put(pos, args, nargs * sizeof(uint32_t));
+    pos += nargs * sizeof(uint32_t);
+    ring_put(pos, data, len);
+    pos += len;
+    ring_put(pos, pad, PAD4(len) - len);
+    pos += PAD4(len) - len;
+    __sync_synchronize(); // the record is complete before the reader sees it
+    head = pos;
+}
+
+void sky_log_write(uint8_t level, uint32_t nargs, const char *fmt, ...) {
+    uint32_t args[SKY_LOG_MAX_ARGS];
+    uint32_t i;
+    va_list ap;
+    if (nargs > SKY_LOG_MAX_ARGS)
+        nargs = SKY_LOG_MAX_ARGS;
+    va_start(ap, fmt);
+    for (i = 0; i < nargs; i++)
+        args[i] = va_arg(ap, uint32_t);
+    va_end(ap);
+    log_record(level, SKY_LOG_KIND_FORMAT, fmt, args, nargs, NULL, 0);
+}
+
+void sky_log_data(uint8_t level, uint8_t kind, const char *fmt, const void *data, uint32_t len) {
+    if (len > SKY_LOG_DATA_MAX)
+        len = SKY_LOG_DATA_MAX;
+    log_record(level, kind, fmt, NULL, 0, data, len);
+}
+
+uint32_t sky_log_next(void) {
+    sky_log_record_t r;
+    uint32_t pos = tail;
+    if (head == pos)
+        return 0;
+    __sync_synchronize();
+    ring_get(pos, &r, sizeof(r));
+    return sizeof(r) + (r.kind_nargs & 0x0f) * sizeof(uint32_t) + PAD4(r.len);
+}
+
+uint32_t sky_log_read(uint8_t *buff, uint32_t len) {
+    uint32_t n = sky_log_next();
+    if (n == 0 || n > len)
+        return 0;
+    ring_get(tail, buff, n);
+    __sync_synchronize(); // done with the record before the writer reuses its space
+    tail += n;
+    return n;
+}
+
+uint32_t sky_log_dropped(void) {
+    return dropped;
+}
+
+#endif
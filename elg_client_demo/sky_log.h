@@ -0,0 +1,163 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_LOG_H
+#define SKY_LOG_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+
+/*************************************************************************
+ *
+ * Deferred binary logging
+ *
+ * A log call copies its format string's address, its arguments and the
+ * time into a binary record in a ring buffer, and does no formatting. The
+ * reader (e.g. an idle task of the sketch) sends the records out as they
+ * are, and tools/elg_logdecode formats them on the host, looking the
+ * format strings up in the firmware's ELF file. Text sent between the
+ * records, e.g. by Serial.print(), passes through the decoder unchanged.
+ *
+ * Levels below SKY_LOG_LEVEL compile to nothing. The arguments have to
+ * be 32 bit integers, or be passed with SKY_LOG_FLOAT() ("%f"),
+ * SKY_LOG_DOUBLE() ("%lf", 2 arguments) or SKY_LOG_STR() ("%s", string
+ * constants only). The ring has one writer and one reader, both outside
+ * interrupts; a record which does not fit is dropped.
+ *
+ *************************************************************************/
+
+#define SKY_LOG_LEVEL_NONE      0
+#define SKY_LOG_LEVEL_ERROR     1
+#define SKY_LOG_LEVEL_WARN      2
+#define SKY_LOG_LEVEL_INFO      3
+#define SKY_LOG_LEVEL_DEBUG     4   // including the hex dumps of the frames
+
+#ifndef SKY_LOG_LEVEL
+#ifdef ARDUINO
+#define SKY_LOG_LEVEL SKY_LOG_LEVEL_INFO
+#else
+#define SKY_LOG_LEVEL SKY_LOG_LEVEL_NONE
+#endif
+#endif
+
+#define SKY_LOG_RING_SIZE   4096    // bytes, a power of 2
+#define SKY_LOG_MAX_ARGS    8
+#define SKY_LOG_DATA_MAX    1024    // bytes of a hex dump or text, longer ones are cut
+
+#define SKY_LOG_SYNC0       0x1e
+#define SKY_LOG_SYNC1       0x4c
+
+enum SKY_LOG_KIND {
+    SKY_LOG_KIND_FORMAT = 0,  // fmt formatted with the arguments
+    SKY_LOG_KIND_HEX,         // fmt is the title of a hex dump of the data
+    SKY_LOG_KIND_TEXT,        // fmt is the label of the data, which is text
+};
+
+// record header, followed by nargs uint32_t arguments and len bytes of data, padded to 4 bytes
+// (little endian, as the device)
+typedef struct {
+    uint8_t sync[2];    // SKY_LOG_SYNC0, SKY_LOG_SYNC1
+    uint8_t level;
+    uint8_t kind_nargs; // enum SKY_LOG_KIND << 4 | # of arguments
+    uint16_t len;
+    uint16_t seq;       // sequence number, which skips the records dropped
+    uint32_t time;      // ms
+    uint32_t fmt;       // address of the format string in the firmware
+} sky_log_record_t;
+
+#define SKY_LOG_RECORD_MAX  (sizeof(sky_log_record_t) + SKY_LOG_MAX_ARGS * sizeof(uint32_t) + SKY_LOG_DATA_MAX)
+
+static inline uint32_t sky_log_float_bits(float f) {
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+static inline uint32_t sky_log_double_word(double d, int i) {
+    uint32_t u[2];
+    memcpy(u, &d, sizeof(u));
+    return u[i];
+}
+
+#define SKY_LOG_FLOAT(f)    sky_log_float_bits(f)
+#define SKY_LOG_DOUBLE(d)   sky_log_double_word(d, 0), sky_log_double_word(d, 1)
+#define SKY_LOG_STR(s)      ((uint32_t)(uintptr_t)(s))
+
+#if SKY_LOG_LEVEL > SKY_LOG_LEVEL_NONE
+
+// set the clock for the time of the records (ms), e.g. millis()
+void sky_log_set_clock(uint32_t (* now_ms)(void));
+
+// write a record of kind SKY_LOG_KIND_FORMAT with nargs uint32_t arguments
+void sky_log_write(uint8_t level, uint32_t nargs, const char *fmt, ...);
+
+// write a record with data, a hex dump or text (enum SKY_LOG_KIND)
+void sky_log_data(uint8_t level, uint8_t kind, const char *fmt, const void *data, uint32_t len);
+
+// returns the length of the next record in the ring, or 0 when it is empty
+uint32_t sky_log_next(void);
+
+// moves the next record out of the ring into buff, which has to hold sky_log_next() bytes
+// returns its length, or 0 when the ring is empty
+uint32_t sky_log_read(uint8_t *buff, uint32_t len);
+
+// returns the # of records dropped because the ring was full
+uint32_t sky_log_dropped(void);
+
+#define SKY_LOG_NARGS(...)  SKY_LOG_NARGS_(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define SKY_LOG_NARGS_(fmt, a1, a2, a3, a4, a5, a6, a7, a8, n, ...) n
+#define SKY_LOG_AT(level, ...)  sky_log_write(level, SKY_LOG_NARGS(__VA_ARGS__), __VA_ARGS__)
+
+// hex dump or text of data at a level
+#define SKY_LOG_DUMP(level, title, data, len)   do {                                      \
+        if ((level) <= SKY_LOG_LEVEL)                                                   \
+            sky_log_data(level, SKY_LOG_KIND_HEX, title, data, len);                    \
+    } while (0)
+#define SKY_LOG_TEXT(level, label, text, len)   do {                                      \
+        if ((level) <= SKY_LOG_LEVEL)                                                   \
+            sky_log_data(level, SKY_LOG_KIND_TEXT, label, text, len);                   \
+    } while (0)
+
+#else
+
+#define SKY_LOG_DUMP(level, title, data, len)   do {} while (0)
+#define SKY_LOG_TEXT(level, label, text, len)   do {} while (0)
+
+#endif
+
+#if SKY_LOG_LEVEL >= SKY_LOG_LEVEL_ERROR
+#define SKY_LOG_ERROR(...)  SKY_LOG_AT(SKY_LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define SKY_LOG_ERROR(...)  do {} while (0)
+#endif
+
+#if SKY_LOG_LEVEL >= SKY_LOG_LEVEL_WARN
+#define SKY_LOG_WARN(...)   SKY_LOG_AT(SKY_LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define SKY_LOG_WARN(...)   do {} while (0)
+#endif
+
+#if SKY_LOG_LEVEL >= SKY_LOG_LEVEL_INFO
+#define SKY_LOG_INFO(...)   SKY_LOG_AT(SKY_LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define SKY_LOG_INFO(...)   do {} while (0)
+#endif
+
+#if SKY_LOG_LEVEL >= SKY_LOG_LEVEL_DEBUG
+#define SKY_LOG_DEBUG(...)  SKY_LOG_AT(SKY_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define SKY_LOG_DEBUG(...)  do {} while (0)
+#endif
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
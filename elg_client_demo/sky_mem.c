@@ -0,0 +1,68 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+#include <stddef.h>
+#include "sky_mem.h"
+
+#if SKY_METRICS
+
+#define PAINT_MARGIN    16  // words left unpainted below the frame of sky_stack_paint()
+
+static uint32_t *stack_low;
+static uint32_t stack_words;
+static uint32_t stack_max;  // bytes, the most used as of the last paint
+
+// returns the lowest word of the stack which is not painted
+static uint32_t *stack_lowest_used(void) {
+    uint32_t *p = stack_low, *end = stack_low + stack_words;
+    while (p < end && *p == SKY_STACK_PATTERN)
+        p++;
+    return p;
+}
+
+void sky_stack_init(uint32_t *low, uint32_t size) {
+    stack_low = low;
+    stack_words = size / sizeof(uint32_t);
+    stack_max = 0;
+}
+
+uint32_t sky_stack_size(void) {
+    return stack_words * sizeof(uint32_t);
+}
+
+uint32_t sky_stack_max_used(void) {
+    if (stack_low == NULL)
+        return 0;
+    uint32_t used = (uintptr_t)(stack_low + stack_words) - (uintptr_t)stack_lowest_used();
+    if (used > stack_max)
+        stack_max = used;
+    return stack_max;
+}
+
+__attribute__((noinline)) uintptr_t sky_stack_paint(void) {
+    volatile uint32_t here = 0;
+    uint32_t *p, *top;
+    if (stack_low == NULL)
+        return 0;
+    top = (uint32_t *)((uintptr_t)&here & ~(uintptr_t)3) - PAINT_MARGIN;
+    if (top <= stack_low || top > stack_low + stack_words)
+        return 0; // not on the stack tracked
+    sky_stack_max_used(); // before the paint covers it
+    // the words below the lowest one used are still painted
+    for (p = stack_lowest_used(); p < top; p++)
+        *p = SKY_STACK_PATTERN;
+    return (uintptr_t)&here;
+}
+
+void sky_stack_record(sky_stack_probe_t *probe, uintptr_t mark) {
+    if (mark == 0)
+        return;
+    uintptr_t lowest = (uintptr_t)stack_lowest_used();
+    uint32_t used = (mark > lowest) ? mark - lowest : 0;
+    probe->calls++;
+    if (used > probe->max_used)
+        probe->max_used = used;
+}
+
+#endif
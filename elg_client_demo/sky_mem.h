@@ -0,0 +1,75 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_MEM_H
+#define SKY_MEM_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include "sky_metrics.h"
+
+/*************************************************************************
+ *
+ * Stack high-water marks
+ *
+ * The free part of the stack is painted with a pattern, and the depth of
+ * a call is the lowest word whose pattern it overwrote. The stack has to
+ * be given with sky_stack_init(), e.g. the 4 KB continuation stack of the
+ * ESP8266 sketch, whose core paints it with the same pattern at boot.
+ * The depths are approximate (within a few words), and a probe nested in
+ * another one hides what the outer call used before it. Part of the
+ * metrics, see SKY_METRICS.
+ *
+ *************************************************************************/
+
+#define SKY_STACK_PATTERN   0xfeefeffe  // CONT_STACKGUARD of the ESP8266 core
+
+// deepest use of the stack by a function (or task)
+typedef struct {
+    const char *name;
+    uint32_t calls;
+    uint32_t max_used;    // bytes below the caller's frame, the most used by a call
+} sky_stack_probe_t;
+
+#if SKY_METRICS
+
+// set the stack to track, which grows down towards low; size in bytes
+void sky_stack_init(uint32_t *low, uint32_t size);
+
+// returns the size of the stack, 0 before sky_stack_init()
+uint32_t sky_stack_size(void);
+
+// returns the most bytes of the stack used since boot (as far as the paint tells)
+uint32_t sky_stack_max_used(void);
+
+// paints the free stack below the caller's frame
+// returns the mark for sky_stack_record()
+uintptr_t sky_stack_paint(void);
+
+// records the stack used below the mark since sky_stack_paint() for the probe
+void sky_stack_record(sky_stack_probe_t *probe, uintptr_t mark);
+
+// measure the stack used by the call, e.g. SKY_STACK_PROBE(encode_probe, cnt = encode(buff))
+#define SKY_STACK_PROBE(probe, call) do {           \
+        uintptr_t sky_stack_mark_ = sky_stack_paint(); \
+        call;                                       \
+        sky_stack_record(&(probe), sky_stack_mark_);   \
+    } while (0)
+
+#else
+
+#define SKY_STACK_PROBE(probe, call)    do { call; } while (0)
+
+#endif
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
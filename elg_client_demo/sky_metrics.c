@@ -0,0 +1,56 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+#include <string.h>
+#include "sky_metrics.h"
+
+#if SKY_METRICS
+
+#if defined(F_CPU)
+#define CYCLES_PER_US   (F_CPU / 1000000)
+#elif defined(__XTENSA__)
+#define CYCLES_PER_US   80
+#else
+#define CYCLES_PER_US   1000 // ns of sky_cycles() on the host
+#endif
+
+sky_histogram_t sky_metrics[SKY_STAGE_COUNT];
+
+static const char *stage_names[SKY_STAGE_COUNT] = {
+    "scan", "select", "encode", "encrypt", "connect", "write", "wait", "read", "decrypt", "decode",
+    "display", "wake",
+};
+
+void sky_metrics_record(enum SKY_STAGE stage, uint32_t cycles) {
+    sky_metrics_record_us(stage, cycles / CYCLES_PER_US);
+}
+
+void sky_metrics_record_us(enum SKY_STAGE stage, uint32_t us) {
+    sky_histogram_t *h = &sky_metrics[stage];
+    uint32_t i = 0;
+    if (us >= 16) {
+        i = 31 - __builtin_clz(us) - 3; // 16 to 31 us is bucket 1
+        if (i > SKY_METRICS_BUCKETS - 1)
+            i = SKY_METRICS_BUCKETS - 1;
+    }
+    h->buckets[i]++;
+    h->count++;
+    h->total_us += us;
+    if (us > h->max_us)
+        h->max_us = us;
+}
+
+void sky_metrics_reset(void) {
+    memset(sky_metrics, 0, sizeof(sky_metrics));
+}
+
+const char *sky_stage_name(enum SKY_STAGE stage) {
+    return (stage < SKY_STAGE_COUNT) ? stage_names[stage] : "unknown";
+}
+
+uint32_t sky_metrics_bucket_limit(uint32_t i) {
+    return (i < SKY_METRICS_BUCKETS - 1) ? 16u << i : 0;
+}
+
+#endif
@@ -0,0 +1,114 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_METRICS_H
+#define SKY_METRICS_H
+
+#include <inttypes.h>
+
+/*************************************************************************
+ *
+ * Latency of the stages of a location fix
+ *
+ * Each stage is timed with the cpu cycle counter and counted in a histogram
+ * of fixed buckets in RAM. The timing is not thread safe; it is meant for
+ * the device, where it is on by default. Set SKY_METRICS to 0 (e.g. for a
+ * release build) and the timing compiles to nothing.
+ *
+ *************************************************************************/
+
+#ifndef SKY_METRICS
+#ifdef ARDUINO
+#define SKY_METRICS 1
+#else
+#define SKY_METRICS 0
+#endif
+#endif
+
+// bucket 0 counts durations below 16 us, bucket i (1 to SKY_METRICS_BUCKETS - 2) those from
+// 2^(i+3) us up to twice that, and the last one all longer ones (from about 4 s)
+#define SKY_METRICS_BUCKETS 20
+
+enum SKY_STAGE {
+    SKY_STAGE_SCAN = 0,   // wifi scan
+    SKY_STAGE_SELECT,     // selection of the scanned aps for the request
+    SKY_STAGE_ENCODE,     // sky_encode_req_bin()
+    SKY_STAGE_ENCRYPT,    // sky_aes_encrypt() of the request
+    SKY_STAGE_CONNECT,    // connection to the server
+    SKY_STAGE_WRITE,      // sending the request
+    SKY_STAGE_WAIT,       // from the request sent to the first byte of the response
+    SKY_STAGE_READ,       // from the first byte to the whole response
+    SKY_STAGE_DECRYPT,    // sky_aes_decrypt() of the response
+    SKY_STAGE_DECODE,     // sky_decode_resp_bin()
+    SKY_STAGE_DISPLAY,    // the location on the display
+    SKY_STAGE_WAKE,       // from the wake out of deep sleep to the location on the display
+    SKY_STAGE_COUNT,
+};
+
+typedef struct {
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t total_us;
+    uint32_t buckets[SKY_METRICS_BUCKETS];
+} sky_histogram_t;
+
+#if SKY_METRICS
+
+// cpu cycle counter, which wraps around (after about 53 s at 80 MHz)
+#if defined(__XTENSA__)
+static inline uint32_t sky_cycles(void) {
+    uint32_t ccount;
+    __asm__ __volatile__("rsr %0, ccount" : "=a"(ccount));
+    return ccount;
+}
+#else
+#include <time.h>
+static inline uint32_t sky_cycles(void) { // ns on the host
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+#endif
+
+extern sky_histogram_t sky_metrics[SKY_STAGE_COUNT];
+
+// count a duration of the stage, in cycles of sky_cycles()
+void sky_metrics_record(enum SKY_STAGE stage, uint32_t cycles);
+
+// count a duration of the stage in us, for the longer ones which sky_cycles() would wrap around in
+void sky_metrics_record_us(enum SKY_STAGE stage, uint32_t us);
+
+// clear all the histograms
+void sky_metrics_reset(void);
+
+// returns the name of the stage, e.g. "encrypt"
+const char *sky_stage_name(enum SKY_STAGE stage);
+
+// returns the upper bound (us, exclusive) of histogram bucket i, or 0 for the last one
+uint32_t sky_metrics_bucket_limit(uint32_t i);
+
+// time a stage: SKY_METRICS_START() where it begins, SKY_METRICS_STOP() where it ends
+#define SKY_METRICS_START(start)        uint32_t start = sky_cycles()
+#define SKY_METRICS_STOP(stage, start)  sky_metrics_record(stage, sky_cycles() - (start))
+// for a stage which spans calls, with its start kept in a variable or field
+#define SKY_METRICS_MARK(start)         ((start) = sky_cycles())
+
+#else
+
+#define SKY_METRICS_START(start)
+#define SKY_METRICS_STOP(stage, start)
+#define SKY_METRICS_MARK(start)
+
+#endif
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -12,21 +12,66 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <float.h>
+#include <stddef.h>
 #include "sky_crypt.h"
 #include "sky_protocol.h"
+#include "sky_log.h"
+
+// The client's stages are timed in the sketch (sky_metrics.h, a sketch file), or on the host with
+// SKY_METRICS defined and sky_metrics.c linked; other builds get no-op macros.
+#if defined(ARDUINO) || defined(SKY_METRICS)
+#include "sky_metrics.h"
+#else
+#define SKY_METRICS 0
+#define SKY_METRICS_START(start)
+#define SKY_METRICS_STOP(stage, start)
+#define SKY_METRICS_MARK(start)
+#endif
+
+// Storage class of the encoder scratch below, like AES_TLS of aes.c: __thread (or _Thread_local)
+// for encoding requests in several threads.
+#ifndef SKY_TLS
+#ifdef AES_TLS
+#define SKY_TLS AES_TLS
+#else
+#define SKY_TLS
+#endif
+#endif
+
+// Offset in buffer of the access points which the caller of sky_encode_req_aps_begin() writes when
+// they are not in place (version 2, or DATA_TYPE_AP_COMPACT): past the bytes which the encoders
+// write before reading them (the longest header, the payload, the MAC and IP data entries and
+// the compact OUI dictionary), so that encoding only moves them towards the start of buffer.
+#define SKY_RQ_APS_OFFSET                                                     \
+    (SKY_V2_RQ_HEADER_MAX_LEN + sizeof(sky_payload_t) + SKY_RQ_PREFIX_LEN      \
+    + 3 * (1 + 5) + sizeof(struct ap_compact_hdr_t) + MAX_APS * 3)
+
+// frame capture, see sky_set_capture()
+static sky_capture_fn capture_fn;
+static void *capture_ctx;
+
+static inline void sky_capture(uint8_t kind, const uint8_t *buff, uint32_t len) {
+    if (capture_fn != NULL)
+        capture_fn(capture_ctx, kind, buff, len);
+}
+
+void sky_set_capture(sky_capture_fn capture, void *ctx) {
+    capture_fn = capture;
+    capture_ctx = ctx;
+}
 
 // parse url
 inline
 bool sky_parse_url(char * url, char * host, uint16_t * port) {
 
     if (strlen(url) > URL_SIZE || strlen(host) > HOST_SIZE) {
-        //perror("url or host length is too big");
+        SKY_LOG_ERROR("url or host length is too big");
         return false;
     }
 
     uint32_t val = 0;
     if (sscanf(url, "elg://%[^:]%*[:]%u/", host, &val) != 2) {
-        //perror("ERROR: sky_parse_url() received wrong url; expected url format is 'elg://host:port/'");
+        SKY_LOG_ERROR("ERROR: sky_parse_url() received wrong url; expected url format is 'elg://host:port/'");
         return false;
     }
     *port = (uint16_t)val;
@@ -53,7 +98,7 @@ void sky_set_ap_band(struct ap_t* ap, enum SKY_BAND band) {
         ap->flag |= 1 << 2; // set bit 2
         break;
     default:
-        //perror("undefined SKY_BAND");
+        SKY_LOG_ERROR("undefined SKY_BAND");
         break;
     }
 }
@@ -184,37 +229,145 @@ void sky_location_endian_swap(struct location_t * p) {
 inline
 bool check_rq_max_counts(const struct location_rq_t * p_rq) {
     if (p_rq->mac_count > MAX_MACS) {
-        //perror("Too big: mac_count > MAX_MACS");
+        SKY_LOG_ERROR("Too big: mac_count > MAX_MACS");
         return false;
     }
     if (p_rq->ip_count > MAX_IPS) {
-        //perror("Too big: ip_count > MAX_IPS");
+        SKY_LOG_ERROR("Too big: ip_count > MAX_IPS");
         return false;
     }
     if (p_rq->ap_count > MAX_APS) {
-        //perror("Too big: ap_count > MAX_APS");
+        SKY_LOG_ERROR("Too big: ap_count > MAX_APS");
         return false;
     }
     if (p_rq->cell_count > MAX_CELLS) {
-        //perror("Too big: cell_count > MAX_CELLS");
+        SKY_LOG_ERROR("Too big: cell_count > MAX_CELLS");
         return false;
     }
     if (p_rq->gps_count > MAX_GPSS) {
-        //perror("Too big: gps_count > MAX_GPSS");
+        SKY_LOG_ERROR("Too big: gps_count > MAX_GPSS");
         return false;
     }
     if (p_rq->ble_count > MAX_BLES) {
-        //perror("Too big: ble_count > MAX_BLES");
+        SKY_LOG_ERROR("Too big: ble_count > MAX_BLES");
         return false;;
     }
     return true;
 }
 
+// Return true for the location request payload types.
+static inline
+bool sky_is_location_rq(uint8_t payload_type) {
+    switch (payload_type) {
+    case LOCATION_RQ:
+    case LOCATION_RQ_ADDR:
+    case LOCATION_RQ_DELTA:
+    case LOCATION_RQ_ADDR_DELTA:
+    case LOCATION_RQ_BATCH:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Return the size of the access point delta in buffer, or 0 if it is malformed.
+static inline
+uint32_t sky_get_ap_delta_len(const uint8_t * delta, uint32_t delta_len) {
+    struct ap_delta_t hdr;
+    if (delta_len < sizeof(hdr))
+        return 0;
+    memcpy(&hdr, delta, sizeof(hdr));
+    uint32_t len = sizeof(hdr) + hdr.removed_count + hdr.changed_count * sizeof(struct ap_rssi_delta_t)
+            + hdr.added_count * sizeof(struct ap_t);
+    return (len <= delta_len) ? len : 0;
+}
+
+// OUI dictionary of sky_set_ap_compact(), and the dictionary index of each access point
+static SKY_TLS uint8_t compact_oui[MAX_APS][3];
+static SKY_TLS uint8_t compact_oui_index[MAX_APS];
+
+// Encode access points in compact form into buffer, or only count the bytes if buff is NULL.
+// Every access point is read before its compact form is written, so buff may start before aps
+// in the same buffer, by the size of the header and dictionary at least.
+// Return the number of bytes.
+static inline
+uint32_t sky_set_ap_compact(uint8_t * buff, const struct ap_t * aps, uint8_t ap_count) {
+    struct ap_compact_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    uint32_t i, j;
+    for (i = 0; i < ap_count && i < MAX_APS; i++) {
+        for (j = 0; j < hdr.oui_count; j++) {
+            if (memcmp(compact_oui[j], aps[i].MAC, sizeof(compact_oui[j])) == 0)
+                break;
+        }
+        if (j == hdr.oui_count)
+            memcpy(compact_oui[hdr.oui_count++], aps[i].MAC, sizeof(compact_oui[j]));
+        compact_oui_index[i] = j;
+        if ((aps[i].flag & 0x01) && hdr.connected == 0)
+            hdr.connected = i + 1;
+    }
+    uint32_t len = sizeof(hdr) + hdr.oui_count * sizeof(compact_oui[0]) + ap_count * sizeof(struct ap_compact_t);
+    if (buff == NULL)
+        return len;
+
+    memcpy(buff, &hdr, sizeof(hdr));
+    buff += sizeof(hdr);
+    memcpy(buff, compact_oui, hdr.oui_count * sizeof(compact_oui[0]));
+    buff += hdr.oui_count * sizeof(compact_oui[0]);
+    for (i = 0; i < ap_count; i++) {
+        struct ap_compact_t ap;
+        uint32_t rssi = (aps[i].rssi < 0) ? -aps[i].rssi : 0;
+        uint8_t band = (aps[i].flag >> 1) & 0x07;
+        ap.oui = compact_oui_index[i];
+        memcpy(ap.nic, aps[i].MAC + sizeof(compact_oui[0]), sizeof(ap.nic));
+        ap.rssi_band = ((band <= BAND_5G ? band : BAND_UNKNOWN) << 6) | ((rssi >> 1) > 63 ? 63 : (rssi >> 1));
+        memcpy(buff, &ap, sizeof(ap));
+        buff += sizeof(ap);
+    }
+    return len;
+}
+
+// Return true if the access points of the request are sent in compact form.
+static inline
+bool sky_use_ap_compact(const struct location_rq_t * creq) {
+    return creq->ap_type == DATA_TYPE_AP_COMPACT
+            && sky_set_ap_compact(NULL, creq->aps, creq->ap_count) < creq->ap_count * sizeof(struct ap_t);
+}
+
+// Return the size of the compact access points in buffer, or 0 if it is malformed.
+static inline
+uint32_t sky_get_ap_compact_len(const uint8_t * data, uint32_t data_len, uint32_t ap_count) {
+    struct ap_compact_hdr_t hdr;
+    if (data_len < sizeof(hdr))
+        return 0;
+    memcpy(&hdr, data, sizeof(hdr));
+    uint32_t len = sizeof(hdr) + hdr.oui_count * 3 + ap_count * sizeof(struct ap_compact_t);
+    return (len <= data_len) ? len : 0;
+}
+
+// Return the size of the batch of scan_count scans in buffer, or 0 if it is malformed.
+static inline
+uint32_t sky_get_scan_batch_len(const uint8_t * batch, uint32_t batch_len, uint32_t scan_count) {
+    struct batch_scan_t scan;
+    uint32_t len = 0, i;
+    if (scan_count > MAX_BATCH_SCANS)
+        return 0;
+    for (i = 0; i < scan_count; i++) {
+        if (batch_len - len < sizeof(scan))
+            return 0;
+        memcpy(&scan, batch + len, sizeof(scan));
+        len += sizeof(scan) + scan.ap_count * sizeof(struct ap_t);
+        if (len > batch_len)
+            return 0;
+    }
+    return len;
+}
+
 // Return header by parameter "header & h".
 inline
 bool sky_get_header(const uint8_t * buff, uint32_t buff_len, uint8_t * p_header, uint32_t header_len) {
     if (buff_len < header_len) {
-        //perror("buffer too small");
+        SKY_LOG_ERROR("buffer too small");
         return false;
     }
     memcpy(p_header, buff, header_len);
@@ -230,7 +383,7 @@ inline
 bool sky_get_payload(const uint8_t * buff, uint32_t buff_len, uint8_t header_len,
         sky_payload_ext_t * p_payload_ex, uint16_t payload_len) {
     if (buff_len < header_len + payload_len) {
-        //perror("buffer too small");
+        SKY_LOG_ERROR("buffer too small");
         return false;
     }
     memcpy(&p_payload_ex->payload, buff + header_len, sizeof(sky_payload_t));
@@ -243,7 +396,7 @@ bool sky_get_payload(const uint8_t * buff, uint32_t buff_len, uint8_t header_len
 inline
 bool sky_verify_checksum(const uint8_t * buff, uint32_t buff_len, uint8_t header_len, uint16_t payload_len) {
     if (buff_len < header_len + payload_len + sizeof(sky_checksum_t)) {
-        //perror("buffer too small");
+        SKY_LOG_ERROR("buffer too small");
         return false;
     }
     sky_checksum_t cs = *(sky_checksum_t *)(buff + header_len + payload_len); // little endianness
@@ -251,7 +404,7 @@ bool sky_verify_checksum(const uint8_t * buff, uint32_t buff_len, uint8_t header
     if (cs == fletcher16(buff, header_len + payload_len))
         return 1;
     else {
-        //perror("invalid checksum");
+        SKY_LOG_ERROR("invalid checksum");
         return true;
     }
 }
@@ -260,7 +413,7 @@ bool sky_verify_checksum(const uint8_t * buff, uint32_t buff_len, uint8_t header
 inline
 bool sky_set_header(uint8_t * buff, uint32_t buff_len, uint8_t * p_header, uint32_t header_len) {
     if (buff_len < header_len) {
-        //perror("buffer too small");
+        SKY_LOG_ERROR("buffer too small");
         return false;
     }
 #ifdef __BIG_ENDIAN__
@@ -277,7 +430,7 @@ inline
 bool sky_set_payload(uint8_t * buff, uint32_t buff_len, uint8_t header_len,
         sky_payload_ext_t * p_payload_ex, uint16_t payload_len) {
     if (buff_len < header_len + payload_len) {
-        //perror("buffer too small");
+        SKY_LOG_ERROR("buffer too small");
         return false;
     }
     memcpy(buff + header_len, &p_payload_ex->payload, sizeof(sky_payload_t));
@@ -290,7 +443,7 @@ bool sky_set_payload(uint8_t * buff, uint32_t buff_len, uint8_t header_len,
 inline
 bool sky_set_checksum(uint8_t * buff, uint32_t buff_len, uint8_t header_len, uint16_t payload_len) {
     if (buff_len < header_len + payload_len + sizeof(sky_checksum_t)) {
-        //perror("buffer too small");
+        SKY_LOG_ERROR("buffer too small");
         return false;
     }
     sky_checksum_t cs = fletcher16(buff, header_len + payload_len);
@@ -314,9 +467,170 @@ uint8_t sky_get_ipaddr_len(const struct location_rq_t * p_loc_rq) {
     return (sky_get_ip_type(p_loc_rq) == DATA_TYPE_IPV4) ? 4 : 16;
 }
 
+// Return the number of bytes of value as varint.
+static inline
+uint32_t sky_varint_len(uint32_t value) {
+    uint32_t n = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+// Put value as varint (unsigned LEB128) into buffer.
+// Return the number of bytes.
+static inline
+uint32_t sky_put_varint(uint8_t * buff, uint32_t value) {
+    uint32_t n = 0;
+    while (value >= 0x80) {
+        buff[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    buff[n++] = (uint8_t)value;
+    return n;
+}
+
+// Get a varint from buffer by parameter "value".
+// Return the number of bytes, 0 if buffer ends before the varint, or -1 if it exceeds 32 bits.
+static inline
+int32_t sky_get_varint(const uint8_t * buff, uint32_t buff_len, uint32_t * value) {
+    uint32_t v = 0;
+    uint32_t i;
+    for (i = 0; i < 5; i++) {
+        if (i >= buff_len)
+            return 0;
+        v |= (uint32_t)(buff[i] & 0x7F) << (7 * i);
+        if ((buff[i] & 0x80) == 0) {
+            if (i == 4 && buff[i] > 0x0F)
+                return -1;
+            *value = v;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+// Set the version 2 header in parameter "uint8_t * buff"; partner_id is only set for requests.
+// Return the header length, or 0 if buffer is too small.
+static inline
+uint32_t sky_set_header_v2(uint8_t * buff, uint32_t buff_len, bool is_request, uint8_t flags,
+        uint32_t request_id, uint32_t payload_length, uint32_t partner_id, const uint8_t * iv) {
+    uint8_t header[SKY_V2_RQ_HEADER_MAX_LEN];
+    uint32_t n = 0;
+    header[n++] = SKY_PROTOCOL_VERSION_2;
+    header[n++] = flags;
+    n += sky_put_varint(header + n, request_id);
+    n += sky_put_varint(header + n, payload_length);
+    if (is_request) {
+        SKY_ENDIAN_SWAP(partner_id);
+        memcpy(header + n, &partner_id, sizeof(partner_id));
+        n += sizeof(partner_id);
+    }
+    memcpy(header + n, iv, sizeof(((sky_rq_header_t *)0)->iv));
+    n += sizeof(((sky_rq_header_t *)0)->iv);
+    if (buff_len < n) {
+        SKY_LOG_ERROR("buffer too small");
+        return 0;
+    }
+    memcpy(buff, header, n);
+    return n;
+}
+
+// Return the version 2 header fields by parameters; partner_id and iv may be NULL.
+// Return the header length, 0 if buffer ends before the header, or -1 for an invalid header.
+static int32_t sky_get_header_v2(const uint8_t * buff, uint32_t buff_len, bool is_request, uint8_t * flags,
+        uint32_t * request_id, uint32_t * payload_length, uint32_t * partner_id, uint8_t * iv) {
+    uint32_t n = 2; // version and flags
+    if (buff_len < n)
+        return 0;
+    if (buff[0] != SKY_PROTOCOL_VERSION_2)
+        return -1;
+    *flags = buff[1];
+    int32_t len = sky_get_varint(buff + n, buff_len - n, request_id);
+    if (len <= 0)
+        return len;
+    n += len;
+    len = sky_get_varint(buff + n, buff_len - n, payload_length);
+    if (len <= 0)
+        return len;
+    n += len;
+    if (*payload_length < sizeof(sky_payload_t) || *payload_length > UINT16_MAX || (*payload_length & 0x0F)) {
+        SKY_LOG_ERROR("invalid payload length");
+        return -1;
+    }
+    if (is_request) {
+        if (buff_len < n + sizeof(uint32_t))
+            return 0;
+        if (partner_id != NULL) {
+            memcpy(partner_id, buff + n, sizeof(uint32_t));
+            SKY_ENDIAN_SWAP(*partner_id);
+        }
+        n += sizeof(uint32_t);
+    }
+    if (buff_len < n + sizeof(((sky_rq_header_t *)0)->iv))
+        return 0;
+    if (iv != NULL)
+        memcpy(iv, buff + n, sizeof(((sky_rq_header_t *)0)->iv));
+    n += sizeof(((sky_rq_header_t *)0)->iv);
+    return n;
+}
+
+// Verify checksum of a version 2 frame.
+static inline
+bool sky_verify_checksum_v2(const uint8_t * buff, uint32_t buff_len, uint32_t header_len, uint32_t payload_len) {
+    sky_checksum_t cs;
+    if (buff_len < header_len + payload_len + sizeof(cs)) {
+        SKY_LOG_ERROR("buffer too small");
+        return false;
+    }
+    memcpy(&cs, buff + header_len + payload_len, sizeof(cs)); // little endianness
+    SKY_ENDIAN_SWAP(cs);
+    if (cs != fletcher16(buff, header_len + payload_len)) {
+        SKY_LOG_ERROR("invalid checksum");
+        return false;
+    }
+    return true;
+}
+
+int32_t sky_get_frame_len(const uint8_t *buff, uint32_t buff_len, bool is_request,
+        uint32_t *header_len) {
+    if (buff_len == 0)
+        return 0;
+    if (buff[0] != SKY_PROTOCOL_VERSION && buff[0] != SKY_PROTOCOL_VERSION_2) {
+        SKY_LOG_ERROR("unknown protocol version %d", buff[0]);
+        return -1;
+    }
+    if (buff[0] == SKY_PROTOCOL_VERSION_2) {
+        uint8_t flags;
+        uint32_t request_id, payload_length;
+        int32_t n = sky_get_header_v2(buff, buff_len, is_request, &flags, &request_id, &payload_length, NULL, NULL);
+        if (n <= 0)
+            return n;
+        *header_len = n;
+        return n + payload_length + sizeof(sky_checksum_t);
+    }
+    // protocol version 1, the payload length is at the same offset in both headers
+    uint32_t n = is_request ? sizeof(sky_rq_header_t) : sizeof(sky_rsp_header_t);
+    if (buff_len < n)
+        return 0;
+    uint16_t payload_length;
+    memcpy(&payload_length, buff + 2, sizeof(payload_length));
+    SKY_ENDIAN_SWAP(payload_length);
+    *header_len = n;
+    return n + payload_length + sizeof(sky_checksum_t);
+}
+
 // find aes key  based on partner_id in key root and set it
 //int sky_set_key(void *key_root, struct location_head_t *head);
 uint32_t sky_get_partner_id_from_rq_header(uint8_t *buff, uint32_t buff_len) {
+    if (buff_len > 0 && buff[0] == SKY_PROTOCOL_VERSION_2) {
+        uint8_t flags;
+        uint32_t request_id, payload_length, partner_id;
+        if (sky_get_header_v2(buff, buff_len, true, &flags, &request_id, &payload_length, &partner_id, NULL) > 0)
+            return partner_id;
+        return 0;
+    }
     sky_rq_header_t header;
     memset(&header, 0, sizeof(header));
     if (sky_get_header(buff, buff_len, (uint8_t *)&header, sizeof(header))) {
@@ -325,6 +639,15 @@ uint32_t sky_get_partner_id_from_rq_header(uint8_t *buff, uint32_t buff_len) {
     return 0;
 }
 
+uint32_t sky_get_request_id_from_rq_header(uint8_t *buff, uint32_t buff_len) {
+    uint8_t flags;
+    uint32_t request_id, payload_length, partner_id;
+    if (buff_len > 0 && buff[0] == SKY_PROTOCOL_VERSION_2
+            && sky_get_header_v2(buff, buff_len, true, &flags, &request_id, &payload_length, &partner_id, NULL) > 0)
+        return request_id;
+    return 0;
+}
+
 int32_t sprint_buff(uint8_t *hex_buff, uint32_t hex_buff_len, uint8_t *buff, uint32_t buff_len) {
     uint32_t i;
     char *p = (char *)hex_buff;
@@ -341,149 +664,692 @@ int32_t sprint_buff(uint8_t *hex_buff, uint32_t hex_buff_len, uint8_t *buff, uin
 }
 
 void print_buff(uint8_t *buff, uint32_t len) {
-    uint32_t i;
-    uint32_t j = 0;
+    (void)buff; // unused when the logging is compiled out
+    (void)len;
+    SKY_LOG_DUMP(SKY_LOG_LEVEL_DEBUG, "buffer", buff, len);
+}
 
-    for (i = 0; i < len; i++) {
-        //printf("%02X ", buff[i]);
 
-        if (++j > 15) {
-            j = 0;
-            //printf("\n");
+// Read a request data entry of count elements from data into the request.
+// Return the number of data bytes of the entry, or -1 for failure.
+static int32_t sky_get_req_entry(struct location_rq_t * creq, uint8_t type, uint32_t count,
+        uint8_t * data, uint32_t data_len) {
+    uint32_t sz = 0;
+    if (count > UINT16_MAX) {
+        SKY_LOG_ERROR("data entry count too big");
+        return -1;
+    }
+    switch (type) {
+    case DATA_TYPE_MAC:
+        creq->mac_count = count;
+        sz = MAC_SIZE * count;
+        creq->mac = data;
+        break;
+    case DATA_TYPE_IPV4:
+        creq->ip_count = count;
+        creq->ip_type = DATA_TYPE_IPV4;
+        sz = IPV4_SIZE * count;
+        creq->ip_addr = data;
+        break;
+    case DATA_TYPE_IPV6:
+        creq->ip_count = count;
+        creq->ip_type = DATA_TYPE_IPV6;
+        sz = IPV6_SIZE * count;
+        creq->ip_addr = data;
+        break;
+    case DATA_TYPE_AP:
+        creq->ap_count = count;
+        sz = sizeof(struct ap_t) * count;
+        creq->aps = (struct ap_t *)data;
+        break;
+    case DATA_TYPE_AP_COMPACT:
+        creq->ap_count = count;
+        sz = sky_get_ap_compact_len(data,
+                data_len, creq->ap_count);
+        if (sz == 0) {
+            SKY_LOG_ERROR("malformed compact access points");
+            return -1;
+        }
+        creq->ap_type = DATA_TYPE_AP_COMPACT;
+        creq->ap_compact_len = sz;
+        creq->ap_compact = data;
+        creq->aps = NULL;
+        break;
+    case DATA_TYPE_AP_DELTA:
+        sz = sky_get_ap_delta_len(data,
+                data_len);
+        if (sz == 0) {
+            SKY_LOG_ERROR("malformed access point delta");
+            return -1;
         }
+        creq->ap_delta_len = sz;
+        creq->ap_delta = data;
+        break;
+    case DATA_TYPE_SCAN_BATCH:
+        sz = sky_get_scan_batch_len(data,
+                data_len, count);
+        if (sz == 0) {
+            SKY_LOG_ERROR("malformed batch of scans");
+            return -1;
+        }
+        creq->batch_count = count;
+        creq->batch_len = sz;
+        creq->batch = data;
+        break;
+    case DATA_TYPE_SCAN_ID:
+        sz = sizeof(creq->scan_id);
+        if (count != 1 || data_len < sz) {
+            SKY_LOG_ERROR("malformed scan id");
+            return -1;
+        }
+        memcpy(&creq->scan_id, data, sizeof(creq->scan_id));
+        SKY_ENDIAN_SWAP(creq->scan_id);
+        break;
+    case DATA_TYPE_BLE:
+        creq->ble_count = count;
+        sz = sizeof(struct ble_t) * count;
+        creq->bles = (struct ble_t *)data;
+#ifdef __BIG_ENDIAN__
+        sky_ble_endian_swap(creq->bles);
+#endif
+        break;
+    case DATA_TYPE_GSM:
+        creq->gsm_count = count;
+        sz = sizeof(struct gsm_t) * count;
+        creq->gsms = (struct gsm_t *)data;
+#ifdef __BIG_ENDIAN__
+        sky_gsm_endian_swap(&creq->cell->gsm);
+#endif
+        break;
+    case DATA_TYPE_CDMA:
+        creq->cdma_count = count;
+        sz = sizeof(struct cdma_t) * count;
+        creq->cdmas = (struct cdma_t *)data;
+#ifdef __BIG_ENDIAN__
+        sky_cdma_endian_swap(&creq->cell->cdma);
+#endif
+        break;
+    case DATA_TYPE_UMTS:
+        creq->umts_count = count;
+        sz = sizeof(struct umts_t) * count;
+        creq->umtss = (struct umts_t *)data;
+#ifdef __BIG_ENDIAN__
+        sky_umts_endian_swap(&creq->cell->umtss);
+#endif
+        break;
+    case DATA_TYPE_LTE:
+        creq->lte_count = count;
+        sz = sizeof(struct lte_t) * count;
+        creq->ltes = (struct lte_t *)data;
+#ifdef __BIG_ENDIAN__
+        sky_lte_endian_swap(&creq->cell->lte);
+#endif
+        break;
+    case DATA_TYPE_GPS:
+        creq->gps_count = count;
+        sz = sizeof(struct gps_t) * count;
+        creq->gps = (struct gps_t *)data;
+#ifdef __BIG_ENDIAN__
+        sky_gps_endian_swap(creq->gps);
+#endif
+        break;
+    default:
+        SKY_LOG_ERROR("unknown data type");
+        return -1;
+    }
+    if (sz > data_len) {
+        SKY_LOG_ERROR("data entry exceeds payload");
+        return -1;
     }
-    //printf("\n");
+    return sz;
 }
 
-
-// received by the server from the client
-/* decode binary data from client, result is in the location_req_t struct */
-/* binary encoded data in buff from client with data */
-int32_t sky_decode_req_bin(uint8_t *buff, uint32_t buff_len,
-        struct location_rq_t *creq) {
-
-    memset(&creq->header, 0, sizeof(creq->header));
-    if (!sky_get_header(buff, buff_len, (uint8_t *)&creq->header, sizeof(creq->header)))
+// Read a response data entry of count bytes from data into the response.
+// Return the number of data bytes of the entry, or -1 for failure.
+static int32_t sky_get_resp_entry(struct location_rsp_t * cresp, uint8_t type, uint32_t count,
+        uint8_t * data, uint32_t data_len) {
+    // the count of the batch locations is the number of scans
+    uint32_t len = (type == DATA_TYPE_SCAN_BATCH) ? count * sizeof(struct batch_location_t) : count;
+    if (count > UINT16_MAX || len > data_len) {
+        SKY_LOG_ERROR("data entry exceeds payload");
         return -1;
-    if (!sky_verify_checksum(buff, buff_len, (uint8_t)sizeof(creq->header), creq->header.payload_length))
-        return -1;
-    memset(&creq->payload_ext, 0, sizeof(creq->payload_ext));
-    if (!sky_get_payload(buff, buff_len, sizeof(sky_rq_header_t), &creq->payload_ext, creq->header.payload_length))
+    }
+    switch (type) {
+    case DATA_TYPE_MAC:
+        cresp->location_ext.mac_len = count;
+        cresp->location_ext.mac = data;
+        break;
+    case DATA_TYPE_IPV4:
+        cresp->location_ext.ip_type = DATA_TYPE_IPV4;
+        cresp->location_ext.ip_len = count;
+        cresp->location_ext.ip_addr = data;
+        break;
+    case DATA_TYPE_IPV6:
+        cresp->location_ext.ip_type = DATA_TYPE_IPV6;
+        cresp->location_ext.ip_len = count;
+        cresp->location_ext.ip_addr = data;
+        break;
+    case DATA_TYPE_LAT_LON:
+        if (count > sizeof(cresp->location))
+            return -1;
+#ifdef __BIG_ENDIAN__
+        sky_location_endian_swap(&cresp->location);
+#endif
+        memcpy(&cresp->location, data, count);
+        break;
+    case DATA_TYPE_STREET_NUM:
+        cresp->location_ext.street_num_len = count;
+        cresp->location_ext.street_num = (char *)data;
+        break;
+    case DATA_TYPE_ADDRESS:
+        cresp->location_ext.address_len = count;
+        cresp->location_ext.address = (char *)data;
+        break;
+    case DATA_TYPE_CITY:
+        cresp->location_ext.city_len = count;
+        cresp->location_ext.city = (char *)data;
+        break;
+    case DATA_TYPE_STATE:
+        cresp->location_ext.state_len = count;
+        cresp->location_ext.state = (char *)data;
+        break;
+    case DATA_TYPE_STATE_CODE:
+        cresp->location_ext.state_code_len = count;
+        cresp->location_ext.state_code = (char *)data;
+        break;
+    case DATA_TYPE_METRO1:
+        cresp->location_ext.metro1_len = count;
+        cresp->location_ext.metro1 = (char *)data;
+        break;
+    case DATA_TYPE_METRO2:
+        cresp->location_ext.metro2_len = count;
+        cresp->location_ext.metro2 = (char *)data;
+        break;
+    case DATA_TYPE_POSTAL_CODE:
+        cresp->location_ext.postal_code_len = count;
+        cresp->location_ext.postal_code = (char *)data;
+        break;
+    case DATA_TYPE_COUNTY:
+        cresp->location_ext.county_len = count;
+        cresp->location_ext.county = (char *)data;
+        break;
+    case DATA_TYPE_COUNTRY:
+        cresp->location_ext.country_len = count;
+        cresp->location_ext.country = (char *)data;
+        break;
+    case DATA_TYPE_COUNTRY_CODE:
+        cresp->location_ext.country_code_len = count;
+        cresp->location_ext.country_code = (char *)data;
+        break;
+    case DATA_TYPE_SCAN_ID:
+        if (count < sizeof(cresp->scan_id))
+            return -1;
+        memcpy(&cresp->scan_id, data, sizeof(cresp->scan_id));
+        SKY_ENDIAN_SWAP(cresp->scan_id);
+        break;
+    case DATA_TYPE_SCAN_BATCH:
+        cresp->batch_count = count;
+        cresp->batch = data;
+        break;
+    default:
+        SKY_LOG_ERROR("unknown data type");
         return -1;
+    }
+    return len;
+}
 
-    /* binary protocol description in sky_protocol.h */
-    creq->key.partner_id = creq->header.partner_id;
+// Return true if the address data entries of the response fit the uint8_t counts of version 1.
+static inline
+bool sky_check_resp_v1(const struct location_rsp_t * cresp) {
+    const struct location_ext_t * ext = &cresp->location_ext;
+    const uint16_t lens[] = {
+        ext->mac_len, ext->ip_len, ext->street_num_len, ext->address_len, ext->city_len, ext->state_len,
+        ext->state_code_len, ext->metro1_len, ext->metro2_len, ext->postal_code_len, ext->county_len,
+        ext->country_len, ext->country_code_len,
+    };
+    uint32_t i;
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        if (lens[i] > UINT8_MAX) {
+            SKY_LOG_ERROR("sky_encode_resp_bin: data entries over 255 bytes need protocol version 2");
+            return false;
+        }
+    }
+    return true;
+}
 
-    if (creq->payload_ext.payload.type != LOCATION_RQ
-            && creq->payload_ext.payload.type != LOCATION_RQ_ADDR) {
-        //fprintf(stderr, "Unknown payload type %d\n", creq->payload_ext.payload.type);
-        return -1;
+// Check the request before encoding.
+static inline
+bool sky_check_req(const struct location_rq_t * creq) {
+    if (creq->cell_count &&
+            (creq->gsm_count || creq->cdma_count || creq->umts_count || creq->lte_count)) {
+        SKY_LOG_ERROR("struct location_rq_t: use cell_t or gsm_t|cdma_t|umts_t|lte_t, but not both");
+        return false;
     }
+    if (!check_rq_max_counts(creq))
+        return false;
 
-    // read data entries from buffer
-    sky_entry_ext_t * p_entry_ex = &creq->payload_ext.data_entry;
-    uint32_t payload_offset = sizeof(sky_payload_t);
-    while (payload_offset < creq->header.payload_length) {
-        uint32_t sz = 0;
-        switch (p_entry_ex->entry->data_type) {
-        case DATA_TYPE_MAC:
-            creq->mac_count = p_entry_ex->entry->data_type_count;
-            sz = MAC_SIZE * p_entry_ex->entry->data_type_count;
-            creq->mac = p_entry_ex->data;
+    if (!sky_is_location_rq(creq->payload_ext.payload.type)) {
+        SKY_LOG_ERROR("sky_encode_req_bin: unknown payload type %d", creq->payload_ext.payload.type);
+        return false;
+    }
+    if (creq->batch_count > MAX_BATCH_SCANS) {
+        SKY_LOG_ERROR("Too big: batch_count > MAX_BATCH_SCANS");
+        return false;
+    }
+    if ((creq->payload_ext.payload.type == LOCATION_RQ_BATCH || creq->batch_count > 0)
+            && creq->header.version != SKY_PROTOCOL_VERSION_2) {
+        SKY_LOG_ERROR("sky_encode_req_bin: batch requests need protocol version 2");
+        return false;
+    }
+    return true;
+}
+
+// Put a version 2 data entry at *p and advance *p, or only count the bytes if *p is NULL.
+// The data is not copied if data is NULL; it may overlap the entry (access points in buffer).
+// Return the number of bytes.
+static inline
+uint32_t sky_put_entry_v2(uint8_t ** p, uint8_t type, uint32_t count, const void * data, uint32_t len) {
+    uint32_t n = sizeof(uint8_t) + sky_varint_len(count);
+    if (*p != NULL) {
+        (*p)[0] = type;
+        sky_put_varint(*p + sizeof(uint8_t), count);
+        if (data != NULL)
+            memmove(*p + n, data, len);
+        *p += n + len;
+    }
+    return n + len;
+}
+
+// Put the request data entries in version 2 form at buff, or only count the bytes if buff is NULL.
+// Return the number of bytes, or -1 for failure.
+static int32_t sky_set_req_entries_v2(uint8_t * buff, struct location_rq_t * creq) {
+    uint8_t * p = buff;
+    uint32_t len = 0;
+
+    if (creq->mac_count > 0)
+        len += sky_put_entry_v2(&p, DATA_TYPE_MAC, creq->mac_count, creq->mac, creq->mac_count * MAC_SIZE);
+    if (creq->ip_count > 0)
+        len += sky_put_entry_v2(&p, creq->ip_type, creq->ip_count, creq->ip_addr,
+                creq->ip_count * (creq->ip_type == DATA_TYPE_IPV4 ? IPV4_SIZE : IPV6_SIZE));
+    if (creq->ap_count > 0 && sky_use_ap_compact(creq)) {
+        uint32_t sz = sky_set_ap_compact(NULL, creq->aps, creq->ap_count);
+        len += sky_put_entry_v2(&p, DATA_TYPE_AP_COMPACT, creq->ap_count, NULL, sz);
+        if (p != NULL)
+            sky_set_ap_compact(p - sz, creq->aps, creq->ap_count);
+    } else if (creq->ap_count > 0) {
+        len += sky_put_entry_v2(&p, DATA_TYPE_AP, creq->ap_count, creq->aps, creq->ap_count * sizeof(struct ap_t));
+    }
+    if (creq->ap_delta_len > 0)
+        len += sky_put_entry_v2(&p, DATA_TYPE_AP_DELTA, 1, creq->ap_delta, creq->ap_delta_len);
+    if (creq->scan_id != 0) {
+        uint32_t scan_id = creq->scan_id;
+        SKY_ENDIAN_SWAP(scan_id);
+        len += sky_put_entry_v2(&p, DATA_TYPE_SCAN_ID, 1, &scan_id, sizeof(scan_id));
+    }
+    if (creq->batch_count > 0)
+        len += sky_put_entry_v2(&p, DATA_TYPE_SCAN_BATCH, creq->batch_count, creq->batch, creq->batch_len);
+    if (creq->ble_count > 0) {
+#ifdef __BIG_ENDIAN__
+        if (p != NULL)
+            sky_ble_endian_swap(creq->bles);
+#endif
+        len += sky_put_entry_v2(&p, DATA_TYPE_BLE, creq->ble_count, creq->bles, creq->ble_count * sizeof(struct ble_t));
+    }
+    if (creq->cell_count > 0) {
+        uint32_t sz;
+        switch (creq->cell_type) {
+        case DATA_TYPE_GSM:
+            sz = sizeof(struct gsm_t);
             break;
-        case DATA_TYPE_IPV4:
-            creq->ip_count = p_entry_ex->entry->data_type_count;
-            creq->ip_type = DATA_TYPE_IPV4;
-            sz = IPV4_SIZE * p_entry_ex->entry->data_type_count;
-            creq->ip_addr = p_entry_ex->data;
+        case DATA_TYPE_CDMA:
+            sz = sizeof(struct cdma_t);
             break;
-        case DATA_TYPE_IPV6:
-            creq->ip_count = p_entry_ex->entry->data_type_count;
-            creq->ip_type = DATA_TYPE_IPV6;
-            sz = IPV6_SIZE * p_entry_ex->entry->data_type_count;
-            creq->ip_addr = p_entry_ex->data;
+        case DATA_TYPE_UMTS:
+            sz = sizeof(struct umts_t);
             break;
-        case DATA_TYPE_AP:
-            creq->ap_count = p_entry_ex->entry->data_type_count;
-            sz = sizeof(struct ap_t) * p_entry_ex->entry->data_type_count;
-            creq->aps = (struct ap_t *)p_entry_ex->data;
+        case DATA_TYPE_LTE:
+            sz = sizeof(struct lte_t);
             break;
-        case DATA_TYPE_BLE:
-            creq->ble_count = p_entry_ex->entry->data_type_count;
-            sz = sizeof(struct ble_t) * p_entry_ex->entry->data_type_count;
-            creq->bles = (struct ble_t *)p_entry_ex->data;
+        default:
+            SKY_LOG_ERROR("unknown data type");
+            return -1;
+        }
+        len += sky_put_entry_v2(&p, creq->cell_type, creq->cell_count, creq->cell, creq->cell_count * sz);
+    }
+    if (creq->gsm_count > 0) {
 #ifdef __BIG_ENDIAN__
-            sky_ble_endian_swap(creq->bles);
+        if (p != NULL)
+            sky_gsm_endian_swap(creq->gsms);
 #endif
-            break;
-        case DATA_TYPE_GSM:
-            creq->gsm_count = p_entry_ex->entry->data_type_count;
-            sz = sizeof(struct gsm_t) * p_entry_ex->entry->data_type_count;
-            creq->gsms = (struct gsm_t *)p_entry_ex->data;
+        len += sky_put_entry_v2(&p, DATA_TYPE_GSM, creq->gsm_count, creq->gsms, creq->gsm_count * sizeof(struct gsm_t));
+    }
+    if (creq->cdma_count > 0) {
 #ifdef __BIG_ENDIAN__
-            sky_gsm_endian_swap(&creq->cell->gsm);
+        if (p != NULL)
+            sky_cdma_endian_swap(creq->cdmas);
 #endif
-            break;
-        case DATA_TYPE_CDMA:
-            creq->cdma_count = p_entry_ex->entry->data_type_count;
-            sz = sizeof(struct cdma_t) * p_entry_ex->entry->data_type_count;
-            creq->cdmas = (struct cdma_t *)p_entry_ex->data;
+        len += sky_put_entry_v2(&p, DATA_TYPE_CDMA, creq->cdma_count, creq->cdmas, creq->cdma_count * sizeof(struct cdma_t));
+    }
+    if (creq->umts_count > 0) {
 #ifdef __BIG_ENDIAN__
-            sky_cdma_endian_swap(&creq->cell->cdma);
+        if (p != NULL)
+            sky_umts_endian_swap(creq->umtss);
 #endif
-            break;
-        case DATA_TYPE_UMTS:
-            creq->umts_count = p_entry_ex->entry->data_type_count;
-            sz = sizeof(struct umts_t) * p_entry_ex->entry->data_type_count;
-            creq->umtss = (struct umts_t *)p_entry_ex->data;
+        len += sky_put_entry_v2(&p, DATA_TYPE_UMTS, creq->umts_count, creq->umtss, creq->umts_count * sizeof(struct umts_t));
+    }
+    if (creq->lte_count > 0) {
 #ifdef __BIG_ENDIAN__
-            sky_umts_endian_swap(&creq->cell->umtss);
+        if (p != NULL)
+            sky_lte_endian_swap(creq->ltes);
 #endif
-            break;
-        case DATA_TYPE_LTE:
-            creq->lte_count = p_entry_ex->entry->data_type_count;
-            sz = sizeof(struct lte_t) * p_entry_ex->entry->data_type_count;
-            creq->ltes = (struct lte_t *)p_entry_ex->data;
+        len += sky_put_entry_v2(&p, DATA_TYPE_LTE, creq->lte_count, creq->ltes, creq->lte_count * sizeof(struct lte_t));
+    }
+    if (creq->gps_count > 0) {
 #ifdef __BIG_ENDIAN__
-            sky_lte_endian_swap(&creq->cell->lte);
+        if (p != NULL)
+            sky_gps_endian_swap(creq->gps);
 #endif
-            break;
-        case DATA_TYPE_GPS:
-            creq->gps_count = p_entry_ex->entry->data_type_count;
-            sz = sizeof(struct gps_t) * p_entry_ex->entry->data_type_count;
-            creq->gps = (struct gps_t *)p_entry_ex->data;
+        len += sky_put_entry_v2(&p, DATA_TYPE_GPS, creq->gps_count, creq->gps, creq->gps_count * sizeof(struct gps_t));
+    }
+    return len;
+}
+
+// Put the response data entries in version 2 form at buff, or only count the bytes if buff is NULL.
+// Return the number of bytes.
+static int32_t sky_set_resp_entries_v2(uint8_t * buff, struct location_rsp_t * cresp) {
+    uint8_t * p = buff;
+    uint32_t len = 0;
+    uint8_t type = cresp->payload_ext.payload.type;
+
+    // latitude and longitude
+    if (type == LOCATION_RQ_SUCCESS || type == LOCATION_RQ_ADDR_SUCCESS) {
+        struct location_t location = cresp->location;
 #ifdef __BIG_ENDIAN__
-            sky_gps_endian_swap(creq->gps);
+        sky_location_endian_swap(&location);
 #endif
-            break;
-        case DATA_TYPE_PAD:
-            return 0; // success
-        default:
-            //perror("unknown data type");
-            return -1;
+        len += sky_put_entry_v2(&p, DATA_TYPE_LAT_LON, sizeof(location), &location, sizeof(location));
+    }
+    // full address, etc.
+    if (type == LOCATION_RQ_ADDR_SUCCESS) {
+        const struct location_ext_t * ext = &cresp->location_ext;
+        const struct {
+            uint8_t type;
+            uint16_t len;
+            const void * data;
+        } fields[] = {
+            { DATA_TYPE_MAC, ext->mac_len, ext->mac },
+            { ext->ip_type, ext->ip_len, ext->ip_addr },
+            { DATA_TYPE_STREET_NUM, ext->street_num_len, ext->street_num },
+            { DATA_TYPE_ADDRESS, ext->address_len, ext->address },
+            { DATA_TYPE_CITY, ext->city_len, ext->city },
+            { DATA_TYPE_STATE, ext->state_len, ext->state },
+            { DATA_TYPE_STATE_CODE, ext->state_code_len, ext->state_code },
+            { DATA_TYPE_METRO1, ext->metro1_len, ext->metro1 },
+            { DATA_TYPE_METRO2, ext->metro2_len, ext->metro2 },
+            { DATA_TYPE_POSTAL_CODE, ext->postal_code_len, ext->postal_code },
+            { DATA_TYPE_COUNTY, ext->county_len, ext->county },
+            { DATA_TYPE_COUNTRY, ext->country_len, ext->country },
+            { DATA_TYPE_COUNTRY_CODE, ext->country_code_len, ext->country_code },
+        };
+        uint32_t i;
+        for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+            if (fields[i].len > 0)
+                len += sky_put_entry_v2(&p, fields[i].type, fields[i].len, fields[i].data, fields[i].len);
         }
-        payload_offset += sizeof(sky_entry_t) + sz;
-        adjust_data_entry(buff, buff_len, sizeof(sky_rq_header_t) + payload_offset, p_entry_ex);
     }
-    return 0;
+    // scan id of the request, stored as access point baseline
+    if (cresp->scan_id != 0) {
+        uint32_t scan_id = cresp->scan_id;
+        SKY_ENDIAN_SWAP(scan_id);
+        len += sky_put_entry_v2(&p, DATA_TYPE_SCAN_ID, sizeof(scan_id), &scan_id, sizeof(scan_id));
+    }
+    // locations of the scans of a batch
+    if (type == LOCATION_RQ_BATCH_SUCCESS)
+        len += sky_put_entry_v2(&p, DATA_TYPE_SCAN_BATCH, cresp->batch_count, cresp->batch,
+                cresp->batch_count * sizeof(struct batch_location_t));
+    return len;
 }
 
-// sent by the server to the client
-/* encodes the loc struct into binary formatted packet sent to client */
-// returns the packet len or -1 when fails
-int32_t sky_encode_resp_bin(uint8_t *buff, uint32_t buff_len, struct location_rsp_t *cresp) {
+// Encode the request into a version 2 frame.
+// Return the packet len or -1 when fails.
+static int32_t sky_encode_req_bin_v2(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq) {
 
-    uint32_t payload_length = sizeof(sky_payload_t);
+    if (!sky_check_req(creq))
+        return -1;
 
-    // count bytes of data entries
-    switch (cresp->payload_ext.payload.type) {
-    case LOCATION_RQ_SUCCESS:
-        payload_length += sizeof(sky_entry_t) + sizeof(struct location_t); // latitude and longitude
-        break;
-    case LOCATION_RQ_ADDR_SUCCESS:
-        payload_length += sizeof(sky_entry_t) + sizeof(struct location_t); // latitude and longitude
-        if (cresp->location_ext.mac_len > 0)
-            payload_length += sizeof(sky_entry_t) + cresp->location_ext.mac_len;
+    int32_t entries_len = sky_set_req_entries_v2(NULL, creq);
+    if (entries_len < 0)
+        return -1;
+
+    // payload length must be a multiple of 16 bytes
+    uint32_t payload_length = sizeof(sky_payload_t) + entries_len;
+    uint8_t pad_len = pad_16(payload_length);
+    payload_length += pad_len;
+    if (payload_length > UINT16_MAX) {
+        SKY_LOG_ERROR("payload too big");
+        return -1;
+    }
+
+    creq->header.version = SKY_PROTOCOL_VERSION_2;
+    creq->header.payload_length = payload_length;
+    creq->header.partner_id = creq->key.partner_id;
+    // 16 byte initialization vector
+    sky_gen_iv(creq->header.iv);
+    uint32_t header_len = sky_set_header_v2(buff, buff_len, true, creq->flags, creq->request_id,
+            payload_length, creq->header.partner_id, creq->header.iv);
+    if (header_len == 0 || buff_len < header_len + payload_length + sizeof(sky_checksum_t)) {
+        SKY_LOG_ERROR("buffer too small");
+        return -1;
+    }
+
+    uint8_t * p = buff + header_len;
+    memcpy(p, &creq->payload_ext.payload, sizeof(sky_payload_t));
+    p += sizeof(sky_payload_t);
+    p += sky_set_req_entries_v2(p, creq);
+    memset(p, DATA_TYPE_PAD, pad_len);
+
+    if (!sky_set_checksum(buff, buff_len, (uint8_t)header_len, payload_length))
+        return -1;
+
+    return header_len + payload_length + sizeof(sky_checksum_t);
+}
+
+// Decode a version 2 request frame.
+static int32_t sky_decode_req_bin_v2(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq) {
+
+    uint32_t payload_length = 0;
+    memset(&creq->header, 0, sizeof(creq->header));
+    int32_t header_len = sky_get_header_v2(buff, buff_len, true, &creq->flags, &creq->request_id,
+            &payload_length, &creq->header.partner_id, creq->header.iv);
+    if (header_len <= 0)
+        return -1;
+    creq->header.version = SKY_PROTOCOL_VERSION_2;
+    creq->header.payload_length = payload_length;
+    if (!sky_verify_checksum_v2(buff, buff_len, header_len, payload_length))
+        return -1;
+    memset(&creq->payload_ext, 0, sizeof(creq->payload_ext));
+    if (!sky_get_payload(buff, buff_len, header_len, &creq->payload_ext, payload_length))
+        return -1;
+
+    creq->key.partner_id = creq->header.partner_id;
+
+    if (!sky_is_location_rq(creq->payload_ext.payload.type)) {
+        SKY_LOG_ERROR("Unknown payload type %d", creq->payload_ext.payload.type);
+        return -1;
+    }
+
+    // read data entries from buffer
+    uint32_t offset = header_len + sizeof(sky_payload_t);
+    uint32_t end = header_len + payload_length;
+    while (offset < end && buff[offset] != DATA_TYPE_PAD) {
+        uint8_t type = buff[offset++];
+        uint32_t count = 0;
+        int32_t n = sky_get_varint(buff + offset, end - offset, &count);
+        if (n <= 0)
+            return -1;
+        offset += n;
+        int32_t sz = sky_get_req_entry(creq, type, count, buff + offset, end - offset);
+        if (sz < 0)
+            return -1;
+        offset += sz;
+    }
+    return 0;
+}
+
+// Encode the response into a version 2 frame.
+// Return the packet len or -1 when fails.
+static int32_t sky_encode_resp_bin_v2(uint8_t *buff, uint32_t buff_len, struct location_rsp_t *cresp) {
+
+    // payload length must be a multiple of 16 bytes
+    uint32_t payload_length = sizeof(sky_payload_t) + sky_set_resp_entries_v2(NULL, cresp);
+    uint8_t pad_len = pad_16(payload_length);
+    payload_length += pad_len;
+    if (payload_length > UINT16_MAX) {
+        SKY_LOG_ERROR("payload too big");
+        return -1;
+    }
+
+    cresp->header.version = SKY_PROTOCOL_VERSION_2;
+    cresp->header.payload_length = payload_length;
+    sky_gen_iv(cresp->header.iv); // 16 byte initialization vector
+    uint32_t header_len = sky_set_header_v2(buff, buff_len, false, cresp->flags, cresp->request_id,
+            payload_length, 0, cresp->header.iv);
+    if (header_len == 0 || buff_len < header_len + payload_length + sizeof(sky_checksum_t)) {
+        SKY_LOG_ERROR("buffer too small");
+        return -1;
+    }
+
+    uint8_t * p = buff + header_len;
+    memcpy(p, &cresp->payload_ext.payload, sizeof(sky_payload_t));
+    p += sizeof(sky_payload_t);
+    p += sky_set_resp_entries_v2(p, cresp);
+    memset(p, DATA_TYPE_PAD, pad_len);
+
+    if (!sky_set_checksum(buff, buff_len, (uint8_t)header_len, payload_length))
+        return -1;
+
+    return header_len + payload_length + sizeof(sky_checksum_t);
+}
+
+// Decode a version 2 response frame.
+static int32_t sky_decode_resp_bin_v2(uint8_t *buff, uint32_t buff_len, struct location_rsp_t *cresp) {
+
+    uint32_t payload_length = 0;
+    memset(&cresp->header, 0, sizeof(cresp->header));
+    int32_t header_len = sky_get_header_v2(buff, buff_len, false, &cresp->flags, &cresp->request_id,
+            &payload_length, NULL, cresp->header.iv);
+    if (header_len <= 0)
+        return -1;
+    cresp->header.version = SKY_PROTOCOL_VERSION_2;
+    cresp->header.payload_length = payload_length;
+    if (!sky_verify_checksum_v2(buff, buff_len, header_len, payload_length))
+        return -1;
+    if (!sky_get_payload(buff, buff_len, header_len, &cresp->payload_ext, payload_length))
+        return -1;
+    cresp->scan_id = 0;
+    cresp->batch_count = 0;
+
+    switch (cresp->payload_ext.payload.type) {
+    case LOCATION_RQ_SUCCESS:
+    case LOCATION_RQ_ADDR_SUCCESS:
+    case LOCATION_RQ_BATCH_SUCCESS:
+        break;
+    case PROBE_REQUEST_SUCCESS:
+    case LOCATION_RQ_ERROR:
+    case LOCATION_GATEWAY_ERROR:
+    case LOCATION_API_ERROR:
+    case LOCATION_UNKNOWN:
+    case LOCATION_UNABLE_TO_DETERMINE:
+    case LOCATION_BASELINE_UNKNOWN:
+        return 0; // success
+    default:
+        SKY_LOG_ERROR("Unknown payload type %d", cresp->payload_ext.payload.type);
+        return -1;
+    }
+
+    // read data entries from buffer
+    uint32_t offset = header_len + sizeof(sky_payload_t);
+    uint32_t end = header_len + payload_length;
+    while (offset < end && buff[offset] != DATA_TYPE_PAD) {
+        uint8_t type = buff[offset++];
+        uint32_t count = 0;
+        int32_t n = sky_get_varint(buff + offset, end - offset, &count);
+        if (n <= 0)
+            return -1;
+        offset += n;
+        int32_t sz = sky_get_resp_entry(cresp, type, count, buff + offset, end - offset);
+        if (sz < 0)
+            return -1;
+        offset += sz;
+    }
+    return 0; // success
+}
+
+// received by the server from the client
+/* decode binary data from client, result is in the location_req_t struct */
+/* binary encoded data in buff from client with data */
+int32_t sky_decode_req_bin(uint8_t *buff, uint32_t buff_len,
+        struct location_rq_t *creq) {
+
+    if (buff_len > 0 && buff[0] == SKY_PROTOCOL_VERSION_2)
+        return sky_decode_req_bin_v2(buff, buff_len, creq);
+
+    memset(&creq->header, 0, sizeof(creq->header));
+    if (!sky_get_header(buff, buff_len, (uint8_t *)&creq->header, sizeof(creq->header)))
+        return -1;
+    if (!sky_verify_checksum(buff, buff_len, (uint8_t)sizeof(creq->header), creq->header.payload_length))
+        return -1;
+    memset(&creq->payload_ext, 0, sizeof(creq->payload_ext));
+    if (!sky_get_payload(buff, buff_len, sizeof(sky_rq_header_t), &creq->payload_ext, creq->header.payload_length))
+        return -1;
+
+    /* binary protocol description in sky_protocol.h */
+    creq->key.partner_id = creq->header.partner_id;
+
+    if (!sky_is_location_rq(creq->payload_ext.payload.type)) {
+        SKY_LOG_ERROR("Unknown payload type %d", creq->payload_ext.payload.type);
+        return -1;
+    }
+
+    // read data entries from buffer
+    sky_entry_ext_t * p_entry_ex = &creq->payload_ext.data_entry;
+    uint32_t payload_offset = sizeof(sky_payload_t);
+    while (payload_offset < creq->header.payload_length) {
+        if (p_entry_ex->entry->data_type == DATA_TYPE_PAD)
+            return 0; // success
+        if (payload_offset + sizeof(sky_entry_t) > creq->header.payload_length)
+            return -1;
+        int32_t sz = sky_get_req_entry(creq, p_entry_ex->entry->data_type, p_entry_ex->entry->data_type_count,
+                p_entry_ex->data, creq->header.payload_length - payload_offset - sizeof(sky_entry_t));
+        if (sz < 0)
+            return -1;
+        payload_offset += sizeof(sky_entry_t) + sz;
+        adjust_data_entry(buff, buff_len, sizeof(sky_rq_header_t) + payload_offset, p_entry_ex);
+    }
+    return 0;
+}
+
+// sent by the server to the client
+/* encodes the loc struct into binary formatted packet sent to client */
+// returns the packet len or -1 when fails
+int32_t sky_encode_resp_bin(uint8_t *buff, uint32_t buff_len, struct location_rsp_t *cresp) {
+
+    if (cresp->header.version == SKY_PROTOCOL_VERSION_2)
+        return sky_encode_resp_bin_v2(buff, buff_len, cresp);
+
+    uint32_t payload_length = sizeof(sky_payload_t);
+
+    // count bytes of data entries
+    switch (cresp->payload_ext.payload.type) {
+    case LOCATION_RQ_SUCCESS:
+        payload_length += sizeof(sky_entry_t) + sizeof(struct location_t); // latitude and longitude
+        break;
+    case LOCATION_RQ_ADDR_SUCCESS:
+        if (!sky_check_resp_v1(cresp))
+            return -1;
+        payload_length += sizeof(sky_entry_t) + sizeof(struct location_t); // latitude and longitude
+        if (cresp->location_ext.mac_len > 0)
+            payload_length += sizeof(sky_entry_t) + cresp->location_ext.mac_len;
         if (cresp->location_ext.ip_len > 0)
             payload_length += sizeof(sky_entry_t) + cresp->location_ext.ip_len;
         if (cresp->location_ext.street_num_len > 0)
@@ -509,10 +1375,15 @@ int32_t sky_encode_resp_bin(uint8_t *buff, uint32_t buff_len, struct location_rs
         if (cresp->location_ext.country_code_len > 0)
             payload_length += sizeof(sky_entry_t) + cresp->location_ext.country_code_len;
         break;
+    case LOCATION_RQ_BATCH_SUCCESS:
+        SKY_LOG_ERROR("sky_encode_resp_bin: batch responses need protocol version 2");
+        return -1;
     default: // i.e. PROBE_REQUEST_SUCCESS, LOCATION_RQ_ERROR, LOCATION_GATEWAY_ERROR, LOCATION_API_ERROR, etc.
         // no data entry in payload so far
         break;
     }
+    if (cresp->scan_id != 0)
+        payload_length += sizeof(sky_entry_t) + sizeof(cresp->scan_id);
 
     // payload length must be a multiple of 16 bytes
     uint8_t pad_len = pad_16(payload_length);
@@ -643,6 +1514,17 @@ int32_t sky_encode_resp_bin(uint8_t *buff, uint32_t buff_len, struct location_rs
         }
     }
 
+    // scan id of the request, stored as access point baseline
+    if (cresp->scan_id != 0) {
+        sky_entry_ext_t * p_entry_ex = &cresp->payload_ext.data_entry;
+        uint32_t scan_id = cresp->scan_id;
+        SKY_ENDIAN_SWAP(scan_id);
+        p_entry_ex->entry->data_type = DATA_TYPE_SCAN_ID;
+        p_entry_ex->entry->data_type_count = sizeof(scan_id);
+        memcpy(p_entry_ex->data, &scan_id, sizeof(scan_id));
+        adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + p_entry_ex->entry->data_type_count, p_entry_ex);
+    }
+
     // fill in padding bytes
     if (pad_len > 0) {
         uint8_t * pad_bytes = buff + sizeof(sky_rsp_header_t) + cresp->header.payload_length - pad_len;
@@ -654,33 +1536,25 @@ int32_t sky_encode_resp_bin(uint8_t *buff, uint32_t buff_len, struct location_rs
     return sizeof(sky_rsp_header_t) + cresp->header.payload_length + sizeof(sky_checksum_t);
 }
 
-// sent by the client to the server
-/* encodes the request struct into binary formatted packet sent to server */
-// returns the packet len or -1 when fails
-int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq) {
-
-    if (creq->cell_count &&
-            (creq->gsm_count || creq->cdma_count || creq->umts_count || creq->lte_count)) {
-        //perror("struct location_rq_t: use cell_t or gsm_t|cdma_t|umts_t|lte_t, but not both");
-        return -1;
-    }
-    if (!check_rq_max_counts(creq))
-        return -1;
-
-    if (creq->payload_ext.payload.type != LOCATION_RQ
-            && creq->payload_ext.payload.type != LOCATION_RQ_ADDR) {
-        //fprintf(stderr, "sky_encode_req_bin: unknown payload type %d\n", creq->payload_ext.payload.type);
-        return -1;
-    }
-
+// Return the request payload length without padding bytes, or 0 for failure.
+static inline
+uint32_t sky_get_req_payload_length(const struct location_rq_t * creq) {
     uint32_t payload_length = sizeof(sky_payload_t);
     if (creq->mac_count > 0)
         payload_length += sizeof(sky_entry_t) + creq->mac_count * MAC_SIZE;
     if (creq->ip_count > 0)
         payload_length += sizeof(sky_entry_t) +
             creq->ip_count * (creq->ip_type == DATA_TYPE_IPV4 ? IPV4_SIZE : IPV6_SIZE);
-    if (creq->ap_count > 0)
-        payload_length += sizeof(sky_entry_t) + creq->ap_count * sizeof(struct ap_t);
+    if (creq->ap_count > 0) {
+        if (sky_use_ap_compact(creq))
+            payload_length += sizeof(sky_entry_t) + sky_set_ap_compact(NULL, creq->aps, creq->ap_count);
+        else
+            payload_length += sizeof(sky_entry_t) + creq->ap_count * sizeof(struct ap_t);
+    }
+    if (creq->ap_delta_len > 0)
+        payload_length += sizeof(sky_entry_t) + creq->ap_delta_len;
+    if (creq->scan_id != 0)
+        payload_length += sizeof(sky_entry_t) + sizeof(creq->scan_id);
     if (creq->ble_count > 0)
         payload_length += sizeof(sky_entry_t) + creq->ble_count * sizeof(struct ble_t);
     if (creq->gps_count > 0)
@@ -701,8 +1575,8 @@ int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len, struct location_rq_
             sz = sizeof(struct lte_t);
             break;
         default:
-            //perror("unknown data type");
-            return -1;
+            SKY_LOG_ERROR("unknown data type");
+            return 0;
         }
         payload_length += creq->cell_count * sz + sizeof(sky_entry_t);
     }
@@ -719,22 +1593,13 @@ int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len, struct location_rq_
         payload_length += sizeof(sky_entry_t) + creq->lte_count * sizeof(struct lte_t);
     }
 
-    // payload length must be a multiple of 16 bytes
-    uint8_t pad_len = pad_16(payload_length);
-    payload_length += pad_len;
-
-    creq->header.payload_length = payload_length;
-    creq->header.partner_id = creq->key.partner_id;
-    // 16 byte initialization vector
-    sky_gen_iv(creq->header.iv);
-    if (!sky_set_header(buff, buff_len, (uint8_t *)&creq->header, sizeof(creq->header)))
-        return -1;
-
-    if (!sky_set_payload(buff, buff_len, sizeof(sky_rq_header_t), &creq->payload_ext, creq->header.payload_length))
-        return -1;
+    return payload_length;
+}
 
-    // fill in data entries in buffer
-    sky_entry_ext_t * p_entry_ex = &creq->payload_ext.data_entry;
+// Fill in the MAC and IP data entries in buffer.
+static inline
+void sky_set_req_addr_entries(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq,
+        sky_entry_ext_t * p_entry_ex) {
     uint32_t sz = 0;
     // MAC
     {
@@ -760,12 +1625,46 @@ int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len, struct location_rq_
         memcpy(p_entry_ex->data, creq->ip_addr, sz);
         adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + sz, p_entry_ex);
     }
+}
+
+// Fill in the scanned data entries (access point, blue tooth, cell and GPS) in buffer.
+static inline
+bool sky_set_req_scan_entries(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq,
+        sky_entry_ext_t * p_entry_ex) {
+    uint32_t sz = 0;
+    // Access Point, compact form
+    if (creq->ap_count > 0 && sky_use_ap_compact(creq)) {
+        p_entry_ex->entry->data_type = DATA_TYPE_AP_COMPACT;
+        p_entry_ex->entry->data_type_count = creq->ap_count;
+        sz = sky_set_ap_compact(p_entry_ex->data, creq->aps, creq->ap_count);
+        adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + sz, p_entry_ex);
+    }
     // Access Point
-    if (creq->ap_count > 0) {
+    else if (creq->ap_count > 0) {
         p_entry_ex->entry->data_type = DATA_TYPE_AP;
         p_entry_ex->entry->data_type_count = creq->ap_count;
         sz = sizeof(struct ap_t) * creq->ap_count;
-        memcpy(p_entry_ex->data, creq->aps, sz);
+        // written in place (or further on in buffer) by the caller in case of sky_encode_req_aps_begin()
+        if ((uint8_t *)creq->aps != p_entry_ex->data)
+            memmove(p_entry_ex->data, creq->aps, sz);
+        adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + sz, p_entry_ex);
+    }
+    // Access Point Delta
+    if (creq->ap_delta_len > 0) {
+        p_entry_ex->entry->data_type = DATA_TYPE_AP_DELTA;
+        p_entry_ex->entry->data_type_count = 1;
+        sz = creq->ap_delta_len;
+        memcpy(p_entry_ex->data, creq->ap_delta, sz);
+        adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + sz, p_entry_ex);
+    }
+    // Scan ID
+    if (creq->scan_id != 0) {
+        p_entry_ex->entry->data_type = DATA_TYPE_SCAN_ID;
+        p_entry_ex->entry->data_type_count = 1;
+        sz = sizeof(creq->scan_id);
+        uint32_t scan_id = creq->scan_id;
+        SKY_ENDIAN_SWAP(scan_id);
+        memcpy(p_entry_ex->data, &scan_id, sz);
         adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + sz, p_entry_ex);
     }
     // Blue Tooth
@@ -813,8 +1712,8 @@ int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len, struct location_rq_
             memcpy(p_entry_ex->data, &creq->cell->umts, sz);
             break;
         default:
-            //perror("unknown data type");
-            return -1;
+            SKY_LOG_ERROR("unknown data type");
+            return false;
         }
         adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + sz, p_entry_ex);
     }
@@ -873,6 +1772,43 @@ int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len, struct location_rq_
         memcpy(p_entry_ex->data, creq->gps, sz);
         adjust_data_entry(buff, buff_len, (p_entry_ex->data - buff) + sz, p_entry_ex);
     }
+    return true;
+}
+
+// sent by the client to the server
+/* encodes the request struct into binary formatted packet sent to server */
+// returns the packet len or -1 when fails
+int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq) {
+
+    if (creq->header.version == SKY_PROTOCOL_VERSION_2)
+        return sky_encode_req_bin_v2(buff, buff_len, creq);
+
+    if (!sky_check_req(creq))
+        return -1;
+
+    uint32_t payload_length = sky_get_req_payload_length(creq);
+    if (payload_length == 0)
+        return -1;
+
+    // payload length must be a multiple of 16 bytes
+    uint8_t pad_len = pad_16(payload_length);
+    payload_length += pad_len;
+
+    creq->header.payload_length = payload_length;
+    creq->header.partner_id = creq->key.partner_id;
+    // 16 byte initialization vector
+    sky_gen_iv(creq->header.iv);
+    if (!sky_set_header(buff, buff_len, (uint8_t *)&creq->header, sizeof(creq->header)))
+        return -1;
+
+    if (!sky_set_payload(buff, buff_len, sizeof(sky_rq_header_t), &creq->payload_ext, creq->header.payload_length))
+        return -1;
+
+    // fill in data entries in buffer
+    sky_entry_ext_t * p_entry_ex = &creq->payload_ext.data_entry;
+    sky_set_req_addr_entries(buff, buff_len, creq, p_entry_ex);
+    if (!sky_set_req_scan_entries(buff, buff_len, creq, p_entry_ex))
+        return -1;
 
     // fill in padding bytes
     if (pad_len > 0) {
@@ -886,11 +1822,179 @@ int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len, struct location_rq_
     return sizeof(sky_rq_header_t) + creq->header.payload_length + sizeof(sky_checksum_t);
 }
 
+void sky_rq_prefix_invalidate(sky_rq_prefix_t *prefix) {
+    prefix->valid = false;
+}
+
+// Fill in the MAC and IP data entries in buffer from the prefix cache; the cache is built when invalid.
+static inline
+bool sky_set_req_prefix_entries(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq,
+        sky_rq_prefix_t *prefix, sky_entry_ext_t * p_entry_ex) {
+    uint8_t * prefix_bytes = (uint8_t *)p_entry_ex->entry;
+    if (prefix->valid) {
+        memcpy(prefix_bytes, prefix->data, prefix->len);
+        adjust_data_entry(buff, buff_len, (prefix_bytes - buff) + prefix->len, p_entry_ex);
+        return true;
+    }
+    sky_set_req_addr_entries(buff, buff_len, creq, p_entry_ex);
+    uint32_t len = (uint8_t *)p_entry_ex->entry - prefix_bytes;
+    if (len > sizeof(prefix->data)) {
+        SKY_LOG_ERROR("too many MAC or IP addresses");
+        return false;
+    }
+    memcpy(prefix->data, prefix_bytes, len);
+    prefix->len = len;
+    fletcher16_init(&prefix->sums);
+    fletcher16_update(&prefix->sums, prefix->data, prefix->len);
+    prefix->valid = true;
+    return true;
+}
+
+// Set checksum in parameter "uint8_t * buff", with the cached sums of the prefix entries which
+// directly follow the payload header.
+static inline
+bool sky_set_checksum_cached(uint8_t * buff, uint32_t buff_len, uint8_t header_len, uint16_t payload_len,
+        const sky_rq_prefix_t * prefix) {
+    if (buff_len < header_len + payload_len + sizeof(sky_checksum_t)) {
+        SKY_LOG_ERROR("buffer too small");
+        return false;
+    }
+    uint32_t prefix_offset = header_len + sizeof(sky_payload_t);
+    uint32_t rest_offset = prefix_offset + prefix->len;
+    sky_checksum_ctx_t ctx;
+    fletcher16_init(&ctx);
+    fletcher16_update(&ctx, buff, prefix_offset);
+    fletcher16_append(&ctx, &prefix->sums, prefix->len);
+    fletcher16_update(&ctx, buff + rest_offset, header_len + payload_len - rest_offset);
+    sky_checksum_t cs = fletcher16_final(&ctx);
+    SKY_ENDIAN_SWAP(cs);
+    *(sky_checksum_t *)(buff + header_len + payload_len) = cs; // little endianness
+    return true;
+}
+
+// sent by the client to the server
+/* encodes the request struct like sky_encode_req_bin, with the MAC and IP data entries from cache */
+// returns the packet len or -1 when fails
+int32_t sky_encode_req_bin_cached(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq,
+        sky_rq_prefix_t *prefix) {
+
+    // the prefix cache holds version 1 data entries
+    if (creq->header.version == SKY_PROTOCOL_VERSION_2)
+        return sky_encode_req_bin_v2(buff, buff_len, creq);
+
+    if (!sky_check_req(creq))
+        return -1;
+
+    uint32_t payload_length = sky_get_req_payload_length(creq);
+    if (payload_length == 0)
+        return -1;
+
+    // payload length must be a multiple of 16 bytes
+    uint8_t pad_len = pad_16(payload_length);
+    payload_length += pad_len;
+
+    creq->header.payload_length = payload_length;
+    creq->header.partner_id = creq->key.partner_id;
+    // 16 byte initialization vector
+    sky_gen_iv(creq->header.iv);
+    if (!sky_set_header(buff, buff_len, (uint8_t *)&creq->header, sizeof(creq->header)))
+        return -1;
+
+    if (!sky_set_payload(buff, buff_len, sizeof(sky_rq_header_t), &creq->payload_ext, creq->header.payload_length))
+        return -1;
+
+    // fill in data entries in buffer
+    sky_entry_ext_t * p_entry_ex = &creq->payload_ext.data_entry;
+    if (!sky_set_req_prefix_entries(buff, buff_len, creq, prefix, p_entry_ex))
+        return -1;
+    if (!sky_set_req_scan_entries(buff, buff_len, creq, p_entry_ex))
+        return -1;
+
+    // fill in padding bytes
+    if (pad_len > 0) {
+        uint8_t * pad_bytes = p_entry_ex->data - sizeof(sky_entry_t);
+        memset(pad_bytes, DATA_TYPE_PAD, pad_len);
+    }
+
+    if (!sky_set_checksum_cached(buff, buff_len, (uint8_t)sizeof(creq->header), creq->header.payload_length, prefix))
+        return -1;
+
+    return sizeof(sky_rq_header_t) + creq->header.payload_length + sizeof(sky_checksum_t);
+}
+
+// Return true if the access points of sky_encode_req_aps_begin() are in place, where the
+// version 1 DATA_TYPE_AP data entry has them; otherwise they are at SKY_RQ_APS_OFFSET.
+static inline
+bool sky_aps_in_place(const struct location_rq_t * creq) {
+    return creq->header.version != SKY_PROTOCOL_VERSION_2 && creq->ap_type != DATA_TYPE_AP_COMPACT;
+}
+
+// sent by the client to the server
+/* encodes the request up to the access point data, which the caller writes in place in buffer */
+// returns the address of the access point array in buffer or NULL when fails
+struct ap_t * sky_encode_req_aps_begin(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq,
+        sky_rq_prefix_t *prefix) {
+
+    if (!sky_check_req(creq))
+        return NULL;
+
+    // the encoding of sky_encode_req_aps_end() moves them
+    if (!sky_aps_in_place(creq)) {
+        if (SKY_RQ_APS_OFFSET + MAX_APS * sizeof(struct ap_t) > buff_len) {
+            SKY_LOG_ERROR("buffer too small");
+            return NULL;
+        }
+        return (struct ap_t *)(buff + SKY_RQ_APS_OFFSET);
+    }
+
+    if (!sky_set_payload(buff, buff_len, sizeof(sky_rq_header_t), &creq->payload_ext, sizeof(sky_payload_t)))
+        return NULL;
+
+    sky_entry_ext_t * p_entry_ex = &creq->payload_ext.data_entry;
+    if (!sky_set_req_prefix_entries(buff, buff_len, creq, prefix, p_entry_ex))
+        return NULL;
+
+    if ((p_entry_ex->data - buff) + MAX_APS * sizeof(struct ap_t) > buff_len) {
+        SKY_LOG_ERROR("buffer too small");
+        return NULL;
+    }
+    return (struct ap_t *)p_entry_ex->data;
+}
+
+// sent by the client to the server
+/* finishes the request started by sky_encode_req_aps_begin with ap_count access points in place */
+// returns the packet len or -1 when fails
+int32_t sky_encode_req_aps_end(uint8_t *buff, uint32_t buff_len, struct location_rq_t *creq,
+        sky_rq_prefix_t *prefix, uint8_t ap_count) {
+
+    if (ap_count > MAX_APS) {
+        SKY_LOG_ERROR("Too big: ap_count > MAX_APS");
+        return -1;
+    }
+    creq->ap_count = ap_count;
+    if (!sky_aps_in_place(creq)) {
+        creq->aps = (struct ap_t *)(buff + SKY_RQ_APS_OFFSET);
+        return sky_encode_req_bin_cached(buff, buff_len, creq, prefix);
+    }
+
+    if (!prefix->valid) {
+        SKY_LOG_ERROR("sky_encode_req_aps_begin() was not called");
+        return -1;
+    }
+    // the access points are already in place, so sky_set_req_scan_entries() skips copying them
+    creq->aps = (struct ap_t *)(buff + sizeof(sky_rq_header_t) + sizeof(sky_payload_t)
+            + prefix->len + sizeof(sky_entry_t));
+    return sky_encode_req_bin_cached(buff, buff_len, creq, prefix);
+}
+
 // received by the client from the server
 /* decodes the binary data and the result is in the location_resp_t struct */
 int32_t sky_decode_resp_bin(uint8_t *buff, uint32_t buff_len,
         struct location_rsp_t *cresp) {
 
+    if (buff_len > 0 && buff[0] == SKY_PROTOCOL_VERSION_2)
+        return sky_decode_resp_bin_v2(buff, buff_len, cresp);
+
     memset(&cresp->header, 0, sizeof(cresp->header));
     if (!sky_get_header(buff, buff_len, (uint8_t *)&cresp->header, sizeof(cresp->header)))
         return -1;
@@ -898,6 +2002,8 @@ int32_t sky_decode_resp_bin(uint8_t *buff, uint32_t buff_len,
         return -1;
     if (!sky_get_payload(buff, buff_len, sizeof(sky_rsp_header_t), &cresp->payload_ext, cresp->header.payload_length))
         return -1;
+    cresp->scan_id = 0;
+    cresp->batch_count = 0;
 
     if (cresp->payload_ext.payload.type != LOCATION_RQ_SUCCESS
             && cresp->payload_ext.payload.type != LOCATION_RQ_ADDR_SUCCESS) {
@@ -909,9 +2015,10 @@ int32_t sky_decode_resp_bin(uint8_t *buff, uint32_t buff_len,
         case LOCATION_API_ERROR:
         case LOCATION_UNKNOWN:
         case LOCATION_UNABLE_TO_DETERMINE:
+        case LOCATION_BASELINE_UNKNOWN:
             return 0; // success
         default:
-            //fprintf(stderr, "Unknown payload type %d\n", cresp->payload_ext.payload.type);
+            SKY_LOG_ERROR("Unknown payload type %d", cresp->payload_ext.payload.type);
             return -1;
         }
     }
@@ -921,83 +2028,377 @@ int32_t sky_decode_resp_bin(uint8_t *buff, uint32_t buff_len,
     sky_entry_ext_t * p_entry_ex = &cresp->payload_ext.data_entry;
     uint32_t payload_offset = sizeof(sky_payload_t);
     while (payload_offset < cresp->header.payload_length) {
-        switch (p_entry_ex->entry->data_type) {
-        case DATA_TYPE_MAC:
-            cresp->location_ext.mac_len = p_entry_ex->entry->data_type_count;
-            cresp->location_ext.mac = p_entry_ex->data;
-            break;
-        case DATA_TYPE_IPV4:
-            cresp->location_ext.ip_type = DATA_TYPE_IPV4;
-            cresp->location_ext.ip_len = p_entry_ex->entry->data_type_count;
-            cresp->location_ext.ip_addr = p_entry_ex->data;
-            break;
-        case DATA_TYPE_IPV6:
-            cresp->location_ext.ip_type = DATA_TYPE_IPV6;
-            cresp->location_ext.ip_len = p_entry_ex->entry->data_type_count;
-            cresp->location_ext.ip_addr = p_entry_ex->data;
-            break;
-        case DATA_TYPE_LAT_LON:
-#ifdef __BIG_ENDIAN__
-            sky_location_endian_swap(&cresp->location);
-#endif
-            memcpy(&cresp->location, p_entry_ex->data, p_entry_ex->entry->data_type_count);
-            break;
-        case DATA_TYPE_STREET_NUM:
-            cresp->location_ext.street_num_len = p_entry_ex->entry->data_type_count;
-            cresp->location_ext.street_num = (char *)p_entry_ex->data;
-            break;
-        case DATA_TYPE_ADDRESS:
-            cresp->location_ext.address_len = p_entry_ex->entry->data_type_count;
-            cresp->location_ext.address = (char *)p_entry_ex->data;
-            break;
-        case DATA_TYPE_CITY:
-            cresp->location_ext.city_len = p_entry_ex->entry->data_type_count;
-            cresp->location_ext.city = (char *)p_entry_ex->data;
-            break;
-        case DATA_TYPE_STATE:
-            cresp->location_ext.state_len = p_entry_ex->entry->data_type_count;
-            cresp->location_ext.state = (char *)p_entry_ex->data;
-            break;
-        case DATA_TYPE_STATE_CODE:
-            cresp->location_ext.state_code_len = p_entry_ex->entry->data_type_count;
-            cresp->location_ext.state_code = (char *)p_entry_ex->data;
-            break;
-        case DATA_TYPE_METRO1:
-            cresp->location_ext.metro1_len = p_entry_ex->entry->data_type_count;
-            cresp->location_ext.metro1 = (char *)p_entry_ex->data;
-            break;
-        case DATA_TYPE_METRO2:
-            cresp->location_ext.metro2_len = p_entry_ex->entry->data_type_count;
-            cresp->location_ext.metro2 = (char *)p_entry_ex->data;
-            break;
-        case DATA_TYPE_POSTAL_CODE:
-            cresp->location_ext.postal_code_len = p_entry_ex->entry->data_type_count;
-            cresp->location_ext.postal_code = (char *)p_entry_ex->data;
-            break;
-        case DATA_TYPE_COUNTY:
-            cresp->location_ext.county_len = p_entry_ex->entry->data_type_count;
-            cresp->location_ext.county = (char *)p_entry_ex->data;
-            break;
-        case DATA_TYPE_COUNTRY:
-            cresp->location_ext.country_len = p_entry_ex->entry->data_type_count;
-            cresp->location_ext.country = (char *)p_entry_ex->data;
-            break;
-        case DATA_TYPE_COUNTRY_CODE:
-            cresp->location_ext.country_code_len = p_entry_ex->entry->data_type_count;
-            cresp->location_ext.country_code = (char *)p_entry_ex->data;
-            break;
-        case DATA_TYPE_PAD:
+        if (p_entry_ex->entry->data_type == DATA_TYPE_PAD)
             return 0; // success
-        default:
-            //perror("unknown data type");
+        if (payload_offset + sizeof(sky_entry_t) > cresp->header.payload_length)
             return -1;
-        }
-        payload_offset += sizeof(sky_entry_t) + p_entry_ex->entry->data_type_count;
+        int32_t sz = sky_get_resp_entry(cresp, p_entry_ex->entry->data_type, p_entry_ex->entry->data_type_count,
+                p_entry_ex->data, cresp->header.payload_length - payload_offset - sizeof(sky_entry_t));
+        if (sz < 0)
+            return -1;
+        payload_offset += sizeof(sky_entry_t) + sz;
         adjust_data_entry(buff, buff_len, sizeof(sky_rsp_header_t) + payload_offset, p_entry_ex);
     }
     return 0; // success
 }
 
+// sent by the client to the server
+/* encodes the access point changes from the baseline scan to the current scan */
+// returns the number of bytes in buff or -1 when fails
+int32_t sky_encode_ap_delta(uint8_t *buff, uint32_t buff_len, uint32_t baseline_id,
+        const struct ap_t *baseline, uint8_t baseline_count,
+        const struct ap_t *aps, uint8_t ap_count) {
+
+    if (baseline_count > MAX_APS || ap_count > MAX_APS) {
+        SKY_LOG_ERROR("Too big: ap_count > MAX_APS");
+        return -1;
+    }
+
+    // match every current access point with a baseline access point of the same MAC and flag
+    int16_t match[MAX_APS];
+    bool matched[MAX_APS];
+    memset(matched, 0, sizeof(matched));
+    struct ap_delta_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.baseline_id = baseline_id;
+    uint32_t i, j;
+    for (i = 0; i < ap_count; i++) {
+        match[i] = -1;
+        for (j = 0; j < baseline_count; j++) {
+            if (!matched[j] && aps[i].flag == baseline[j].flag
+                    && memcmp(aps[i].MAC, baseline[j].MAC, MAC_SIZE) == 0) {
+                int32_t d = aps[i].rssi - baseline[j].rssi;
+                if (d < INT8_MIN || d > INT8_MAX)
+                    break; // send it as removed and added
+                match[i] = j;
+                matched[j] = true;
+                if (d != 0)
+                    hdr.changed_count++;
+                break;
+            }
+        }
+        if (match[i] < 0)
+            hdr.added_count++;
+    }
+    for (j = 0; j < baseline_count; j++) {
+        if (!matched[j])
+            hdr.removed_count++;
+    }
+
+    uint32_t len = sizeof(hdr) + hdr.removed_count + hdr.changed_count * sizeof(struct ap_rssi_delta_t)
+            + hdr.added_count * sizeof(struct ap_t);
+    if (buff_len < len) {
+        SKY_LOG_ERROR("buffer too small");
+        return -1;
+    }
+
+    uint8_t * p = buff;
+    SKY_ENDIAN_SWAP(hdr.baseline_id);
+    memcpy(p, &hdr, sizeof(hdr));
+    p += sizeof(hdr);
+    for (j = 0; j < baseline_count; j++) {
+        if (!matched[j])
+            *p++ = (uint8_t)j;
+    }
+    for (i = 0; i < ap_count; i++) {
+        if (match[i] >= 0 && aps[i].rssi != baseline[match[i]].rssi) {
+            struct ap_rssi_delta_t change;
+            change.index = (uint8_t)match[i];
+            change.rssi = (int8_t)(aps[i].rssi - baseline[match[i]].rssi);
+            memcpy(p, &change, sizeof(change));
+            p += sizeof(change);
+        }
+    }
+    for (i = 0; i < ap_count; i++) {
+        if (match[i] < 0) {
+            memcpy(p, &aps[i], sizeof(struct ap_t));
+            p += sizeof(struct ap_t);
+        }
+    }
+    return (int32_t)len;
+}
+
+// received by the server from the client
+/* expands access points in compact form */
+// returns the number of access points in aps or -1 when fails
+int32_t sky_decode_ap_compact(const uint8_t *data, uint32_t data_len, uint32_t ap_count,
+        struct ap_t *aps, uint32_t aps_len) {
+
+    if (sky_get_ap_compact_len(data, data_len, ap_count) == 0 || ap_count > aps_len) {
+        SKY_LOG_ERROR("malformed compact access points");
+        return -1;
+    }
+    struct ap_compact_hdr_t hdr;
+    memcpy(&hdr, data, sizeof(hdr));
+    const uint8_t * oui = data + sizeof(hdr);
+    const uint8_t * p = oui + hdr.oui_count * 3;
+    uint32_t i;
+    for (i = 0; i < ap_count; i++) {
+        struct ap_compact_t ap;
+        memcpy(&ap, p + i * sizeof(ap), sizeof(ap));
+        if (ap.oui >= hdr.oui_count) {
+            SKY_LOG_ERROR("malformed compact access points");
+            return -1;
+        }
+        memcpy(aps[i].MAC, oui + ap.oui * 3, 3);
+        memcpy(aps[i].MAC + 3, ap.nic, sizeof(ap.nic));
+        aps[i].rssi = -(int8_t)((ap.rssi_band & 0x3F) << 1);
+        aps[i].flag = (ap.rssi_band >> 6) << 1;
+        if (hdr.connected == i + 1)
+            aps[i].flag |= 0x01;
+    }
+    return ap_count;
+}
+
+// received by the server from the client
+uint32_t sky_get_ap_delta_baseline_id(const uint8_t *delta, uint32_t delta_len) {
+    struct ap_delta_t hdr;
+    if (sky_get_ap_delta_len(delta, delta_len) == 0)
+        return 0;
+    memcpy(&hdr, delta, sizeof(hdr));
+    SKY_ENDIAN_SWAP(hdr.baseline_id);
+    return hdr.baseline_id;
+}
+
+// received by the server from the client
+/* applies the access point delta to the baseline scan */
+// returns the number of access points in aps or -1 when fails
+int32_t sky_decode_ap_delta(const uint8_t *delta, uint32_t delta_len, uint32_t baseline_id,
+        const struct ap_t *baseline, uint8_t baseline_count,
+        struct ap_t *aps, uint32_t aps_len) {
+
+    if (sky_get_ap_delta_len(delta, delta_len) == 0) {
+        SKY_LOG_ERROR("malformed access point delta");
+        return -1;
+    }
+    struct ap_delta_t hdr;
+    memcpy(&hdr, delta, sizeof(hdr));
+    SKY_ENDIAN_SWAP(hdr.baseline_id);
+    if (hdr.baseline_id != baseline_id) {
+        SKY_LOG_ERROR("access point delta is relative to another baseline");
+        return -1;
+    }
+    const uint8_t * removed = delta + sizeof(hdr);
+    const uint8_t * changed = removed + hdr.removed_count;
+    const uint8_t * added = changed + hdr.changed_count * sizeof(struct ap_rssi_delta_t);
+
+    uint8_t gone[256 / 8]; // bit set of removed baseline indexes
+    memset(gone, 0, sizeof(gone));
+    uint32_t i, j, n = 0;
+    for (i = 0; i < hdr.removed_count; i++) {
+        if (removed[i] >= baseline_count) {
+            SKY_LOG_ERROR("access point delta does not match the baseline");
+            return -1;
+        }
+        gone[removed[i] >> 3] |= 1 << (removed[i] & 0x07);
+    }
+    for (j = 0; j < baseline_count; j++) {
+        if (gone[j >> 3] & (1 << (j & 0x07)))
+            continue;
+        if (n >= aps_len)
+            return -1;
+        aps[n++] = baseline[j];
+    }
+    // apply rssi changes to the kept baseline access points
+    for (i = 0; i < hdr.changed_count; i++) {
+        struct ap_rssi_delta_t change;
+        memcpy(&change, changed + i * sizeof(change), sizeof(change));
+        if (change.index >= baseline_count || (gone[change.index >> 3] & (1 << (change.index & 0x07)))) {
+            SKY_LOG_ERROR("access point delta does not match the baseline");
+            return -1;
+        }
+        // position of the baseline access point after removals
+        uint32_t pos = change.index;
+        for (j = 0; j < change.index; j++) {
+            if (gone[j >> 3] & (1 << (j & 0x07)))
+                pos--;
+        }
+        aps[pos].rssi = (int8_t)(aps[pos].rssi + change.rssi);
+    }
+    for (i = 0; i < hdr.added_count; i++) {
+        if (n >= aps_len)
+            return -1;
+        memcpy(&aps[n++], added + i * sizeof(struct ap_t), sizeof(struct ap_t));
+    }
+    return (int32_t)n;
+}
+
+// sent by the client to the server
+/* appends a scan to the batch of scans of a batch request */
+// returns the number of bytes in buff or -1 when it is too small
+int32_t sky_add_batch_scan(uint8_t *buff, uint32_t buff_len, uint32_t len, uint32_t age,
+        const struct ap_t *aps, uint8_t ap_count) {
+    struct batch_scan_t scan;
+    uint32_t sz = sizeof(scan) + ap_count * sizeof(struct ap_t);
+    if (len > buff_len || buff_len - len < sz) {
+        SKY_LOG_ERROR("buffer too small");
+        return -1;
+    }
+    memset(&scan, 0, sizeof(scan));
+    scan.age = age;
+    SKY_ENDIAN_SWAP(scan.age);
+    scan.ap_count = ap_count;
+    memcpy(buff + len, &scan, sizeof(scan));
+    memcpy(buff + len + sizeof(scan), aps, ap_count * sizeof(struct ap_t));
+    return (int32_t)(len + sz);
+}
+
+// received by the server from the client
+/* reads a scan of the batch of scans of a batch request */
+// returns the number of access points in aps or -1 when fails
+int32_t sky_get_batch_scan(const uint8_t *batch, uint32_t batch_len, uint32_t *offset,
+        uint32_t *age, struct ap_t *aps, uint32_t aps_len) {
+    struct batch_scan_t scan;
+    if (*offset > batch_len || batch_len - *offset < sizeof(scan))
+        return -1;
+    memcpy(&scan, batch + *offset, sizeof(scan));
+    SKY_ENDIAN_SWAP(scan.age);
+    uint32_t sz = scan.ap_count * sizeof(struct ap_t);
+    if (batch_len - *offset - sizeof(scan) < sz || scan.ap_count > aps_len)
+        return -1;
+    memcpy(aps, batch + *offset + sizeof(scan), sz);
+    *age = scan.age;
+    *offset += sizeof(scan) + sz;
+    return scan.ap_count;
+}
+
+// received by the client from the server
+/* copies the location of a scan of a batch response */
+bool sky_get_batch_location(const struct location_rsp_t *rsp, uint32_t i, struct batch_location_t *location) {
+    if (rsp->batch == NULL || i >= rsp->batch_count)
+        return false;
+    memcpy(location, rsp->batch + i * sizeof(*location), sizeof(*location));
+#ifdef __BIG_ENDIAN__
+    sky_location_endian_swap(&location->location);
+#endif
+    return true;
+}
+
+void sky_correlator_init(sky_correlator_t *corr, uint32_t first_id) {
+    memset(corr, 0, sizeof(*corr));
+    corr->next_id = first_id;
+}
+
+uint32_t sky_correlator_add(sky_correlator_t *corr, void *ctx, uint32_t now) {
+    uint32_t i;
+    if (corr->count >= SKY_MAX_INFLIGHT)
+        return 0;
+    for (i = 0; i < SKY_MAX_INFLIGHT; i++) {
+        if (corr->slots[i].request_id == 0)
+            break;
+    }
+    if (corr->next_id == 0) // 0 stands for no request id
+        corr->next_id++;
+    corr->slots[i].request_id = corr->next_id++;
+    corr->slots[i].sent_at = now;
+    corr->slots[i].ctx = ctx;
+    corr->count++;
+    return corr->slots[i].request_id;
+}
+
+bool sky_correlator_match(sky_correlator_t *corr, uint32_t request_id, uint32_t now,
+        void **ctx, uint32_t *rtt) {
+    uint32_t i;
+    if (request_id == 0)
+        return false;
+    for (i = 0; i < SKY_MAX_INFLIGHT; i++) {
+        if (corr->slots[i].request_id == request_id) {
+            if (ctx != NULL)
+                *ctx = corr->slots[i].ctx;
+            if (rtt != NULL)
+                *rtt = now - corr->slots[i].sent_at;
+            corr->slots[i].request_id = 0;
+            corr->count--;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t sky_correlator_expire(sky_correlator_t *corr, uint32_t now, uint32_t timeout,
+        sky_correlator_expired_fn expired) {
+    uint32_t i, n = 0;
+    for (i = 0; i < SKY_MAX_INFLIGHT; i++) {
+        sky_inflight_t slot = corr->slots[i];
+        if (slot.request_id != 0 && now - slot.sent_at >= timeout) {
+            corr->slots[i].request_id = 0;
+            corr->count--;
+            n++;
+            if (expired != NULL)
+                expired(slot.request_id, slot.ctx);
+        }
+    }
+    return n;
+}
+
+void sky_endpoints_init(sky_endpoints_t *eps) {
+    memset(eps, 0, sizeof(*eps));
+}
+
+int32_t sky_endpoints_add(sky_endpoints_t *eps, const char *host, uint16_t port) {
+    if (eps->count >= SKY_MAX_ENDPOINTS)
+        return -1;
+    sky_endpoint_t *ep = &eps->endpoints[eps->count];
+    int n = snprintf(ep->url, sizeof(ep->url), "elg://%s:%u/", host, port);
+    if (n < 0 || n >= (int)sizeof(ep->url))
+        return -1;
+    ep->caps = 0;
+    ep->srtt = ep->rttvar = 0;
+    ep->failures = 0;
+    ep->retry_at = 0;
+    return eps->count++;
+}
+
+int32_t sky_endpoints_select(const sky_endpoints_t *eps, uint32_t now, int32_t exclude, uint8_t caps) {
+    int32_t i, best = -1, backoff = -1;
+    for (i = 0; i < eps->count; i++) {
+        const sky_endpoint_t *ep = &eps->endpoints[i];
+        if (i == exclude || (ep->caps & caps) != caps)
+            continue;
+        if (ep->failures > 0 && (int32_t)(now - ep->retry_at) < 0) {
+            if (backoff < 0 || (int32_t)(ep->retry_at - eps->endpoints[backoff].retry_at) < 0)
+                backoff = i;
+            continue;
+        }
+        if (best < 0 || ep->srtt < eps->endpoints[best].srtt)
+            best = i;
+    }
+    return (best >= 0) ? best : backoff;
+}
+
+void sky_endpoints_report(sky_endpoints_t *eps, int32_t idx, uint32_t now, bool success, uint32_t rtt) {
+    if (idx < 0 || idx >= eps->count)
+        return;
+    sky_endpoint_t *ep = &eps->endpoints[idx];
+    if (!success) {
+        if (ep->failures < UINT16_MAX)
+            ep->failures++;
+        ep->retry_at = now + (SKY_ENDPOINT_BACKOFF << (ep->failures < 6 ? ep->failures - 1 : 5));
+        return;
+    }
+    ep->failures = 0;
+    if (rtt == 0)
+        rtt = 1; // srtt 0 means not measured
+    if (ep->srtt == 0) {
+        ep->srtt = rtt;
+        ep->rttvar = rtt / 2;
+    } else {
+        // rttvar = 3/4 rttvar + 1/4 |srtt - rtt|, srtt = 7/8 srtt + 1/8 rtt (RFC 6298)
+        uint32_t delta = (ep->srtt > rtt) ? ep->srtt - rtt : rtt - ep->srtt;
+        ep->rttvar = (3 * ep->rttvar + delta) / 4;
+        ep->srtt = (7 * ep->srtt + rtt) / 8;
+        if (ep->srtt == 0)
+            ep->srtt = 1;
+    }
+}
+
+uint32_t sky_endpoints_hedge_delay(const sky_endpoints_t *eps, int32_t idx) {
+    if (idx < 0 || idx >= eps->count)
+        return 0;
+    // the mean deviation is about 0.8 standard deviations
+    return eps->endpoints[idx].srtt + 2 * eps->endpoints[idx].rttvar;
+}
+
 int32_t sky_send_location_request(struct location_rq_t * rq,
         sky_client_send_fn rpc_send, char * url, void * rpc_handle) {
 
@@ -1007,24 +2408,25 @@ int32_t sky_send_location_request(struct location_rq_t * rq,
     // encode into ELGv2 binary protocol
     int32_t cnt = sky_encode_req_bin(buff, sizeof(buff), rq);
     if (cnt < 0) {
-        //perror("encode binary protocol failed");
+        SKY_LOG_ERROR("encode binary protocol failed");
         return -1;
     }
 
-    //puts("\n------ encoded packet -------");
-    print_buff(buff, cnt);
-    //puts("---------------------\n");
+    SKY_LOG_DUMP(SKY_LOG_LEVEL_DEBUG, "encoded packet", buff, cnt);
+    sky_capture(SKY_CAPTURE_RQ_PLAIN, buff, cnt);
 
     // encrypt payload with AES
-    if (sky_aes_encrypt(buff + sizeof(sky_rq_header_t), cnt - sizeof(sky_rq_header_t) - sizeof(sky_checksum_t),
-            rq->key.aes_key, buff + sizeof(sky_rq_header_t) - sizeof(rq->header.iv)) == -1) {
-        //perror("failed to encrypt request");
+    uint32_t header_len = 0;
+    if (sky_get_frame_len(buff, cnt, true, &header_len) != cnt)
+        return -1;
+    if (sky_aes_encrypt(buff + header_len, cnt - header_len - sizeof(sky_checksum_t),
+            rq->key.aes_key, buff + header_len - sizeof(rq->header.iv)) == -1) {
+        SKY_LOG_ERROR("failed to encrypt request");
         return -1;
     }
+    sky_capture(SKY_CAPTURE_RQ_CIPHER, buff, cnt);
 
-    //puts("\n------ encrypted sent packet -------");
-    print_buff(buff, cnt);
-    //puts("---------------------\n");
+    SKY_LOG_DUMP(SKY_LOG_LEVEL_DEBUG, "encrypted sent packet", buff, cnt);
 
     // send binary data from client to server
     char host[HOST_SIZE];
@@ -1032,52 +2434,126 @@ int32_t sky_send_location_request(struct location_rq_t * rq,
     sky_parse_url(url, host, &port);
     cnt = rpc_send(buff, cnt, host, port, rpc_handle);
     if (cnt < 0) {
-        //perror("failed to send location request");
+        SKY_LOG_ERROR("failed to send location request");
     }
     return cnt;
 }
 
-int32_t sky_recv_location_response(struct location_rsp_t *rsp,
-        sky_client_recv_fn rpc_recv, void * rpc_handle) {
+// Split the unsent part of the encrypted frame in buff, from byte pos on, into header, payload and
+// checksum segments; returns the number of segments in iov.
+static uint32_t sky_get_frame_iov(const uint8_t *buff, uint32_t frame_len, uint32_t header_len,
+        uint32_t pos, sky_iovec_t iov[3]) {
+    uint32_t ends[3] = { header_len, frame_len - sizeof(sky_checksum_t), frame_len };
+    uint32_t i, n = 0;
+    for (i = 0; i < 3; i++) {
+        if (pos >= ends[i])
+            continue;
+        iov[n].base = buff + pos;
+        iov[n].len = ends[i] - pos;
+        pos = ends[i];
+        n++;
+    }
+    return n;
+}
+
+int32_t sky_send_location_request_v(struct location_rq_t * rq,
+        sky_client_sendv_fn rpc_sendv, char * url, void * rpc_handle) {
 
     uint8_t buff[SKY_PROT_BUFF_LEN];
     memset(buff, 0, sizeof(buff));
-    memset(&rsp->location_ext, 0, sizeof(rsp->location_ext));
 
-    // receive binary data from server to client
-    int32_t cnt = rpc_recv(buff, sizeof(buff), rpc_handle);
-    if (cnt < 0) {
-        //perror("failed to receive location response");
+    // encode into ELGv2 binary protocol
+    int32_t cnt = sky_encode_req_bin(buff, sizeof(buff), rq);
+    uint32_t header_len = 0;
+    if (cnt < 0 || sky_get_frame_len(buff, cnt, true, &header_len) != cnt) {
+        SKY_LOG_ERROR("encode binary protocol failed");
         return -1;
     }
+    sky_capture(SKY_CAPTURE_RQ_PLAIN, buff, cnt);
+
+    // encrypt payload with AES
+    if (sky_aes_encrypt(buff + header_len, cnt - header_len - sizeof(sky_checksum_t),
+            rq->key.aes_key, buff + header_len - sizeof(rq->header.iv)) == -1) {
+        SKY_LOG_ERROR("failed to encrypt request");
+        return -1;
+    }
+    sky_capture(SKY_CAPTURE_RQ_CIPHER, buff, cnt);
+
+    // send header, payload and checksum from client to server
+    char host[HOST_SIZE];
+    uint16_t port = 0; // max port number is 65535
+    sky_parse_url(url, host, &port);
+    sky_iovec_t iov[3];
+    uint32_t iov_count = sky_get_frame_iov(buff, cnt, header_len, 0, iov);
+    cnt = rpc_sendv(iov, iov_count, host, port, rpc_handle);
+    if (cnt < 0) {
+        SKY_LOG_ERROR("failed to send location request");
+    }
+    return cnt;
+}
+
+int32_t sky_decode_location_response(uint8_t *buff, uint32_t buff_len,
+        struct location_rsp_t *rsp) {
+
+    uint32_t header_len = 0;
+    int32_t cnt = sky_get_frame_len(buff, buff_len, false, &header_len);
+    if (cnt <= 0 || (uint32_t)cnt > buff_len)
+        return (cnt < 0) ? -1 : 0;
+    memset(&rsp->location_ext, 0, sizeof(rsp->location_ext));
+    sky_capture(SKY_CAPTURE_RSP_CIPHER, buff, cnt);
 
     // decrypt payload with AES
-    if (sky_aes_decrypt(buff + sizeof(sky_rsp_header_t), cnt - sizeof(sky_rsp_header_t) - sizeof(sky_checksum_t),
-            rsp->key.aes_key, buff + sizeof(sky_rsp_header_t) - sizeof(rsp->header.iv)) != 0) {
-        //perror("failed to decrypt response");
+    SKY_METRICS_START(start);
+    if (sky_aes_decrypt(buff + header_len, cnt - header_len - sizeof(sky_checksum_t),
+            rsp->key.aes_key, buff + header_len - sizeof(rsp->header.iv)) != 0) {
+        SKY_LOG_ERROR("failed to decrypt response");
         return -1;
     }
+    SKY_METRICS_STOP(SKY_STAGE_DECRYPT, start);
+    sky_capture(SKY_CAPTURE_RSP_PLAIN, buff, cnt);
 
-    //puts("\n------ decrypted recv packet -------");
-    print_buff(buff, cnt);
-    //puts("---------------------\n");
+    SKY_LOG_DUMP(SKY_LOG_LEVEL_DEBUG, "decrypted recv packet", buff, cnt);
 
     // decode from ELGv2 binary protocol
-    if (sky_decode_resp_bin(buff, sizeof(buff), rsp) < 0) {
-        //perror("failed to decode response");
+    SKY_METRICS_MARK(start);
+    if (sky_decode_resp_bin(buff, cnt, rsp) < 0) {
+        SKY_LOG_ERROR("failed to decode response");
         return -1;
     }
+    SKY_METRICS_STOP(SKY_STAGE_DECODE, start);
 
     return cnt;
 }
 
+int32_t sky_recv_location_response(struct location_rsp_t *rsp,
+        sky_client_recv_fn rpc_recv, void * rpc_handle) {
+
+    uint8_t buff[SKY_PROT_BUFF_LEN];
+    memset(buff, 0, sizeof(buff));
+    memset(&rsp->location_ext, 0, sizeof(rsp->location_ext));
+
+    // receive binary data from server to client
+    int32_t cnt = rpc_recv(buff, sizeof(buff), rpc_handle);
+    if (cnt < 0) {
+        SKY_LOG_ERROR("failed to receive location response");
+        return -1;
+    }
+
+    cnt = sky_decode_location_response(buff, cnt, rsp);
+    if (cnt <= 0) {
+        SKY_LOG_ERROR("failed to decode location response");
+        return -1;
+    }
+    return cnt;
+}
+
 bool sky_query_location(
         struct location_rq_t * rq, sky_client_send_fn rpc_send, char * url,
         struct location_rsp_t *rsp, sky_client_recv_fn rpc_recv, void * rpc_handle) {
 
     int32_t cnt = sky_send_location_request(rq, rpc_send, url, rpc_handle);
     if (cnt < 0) {
-        //perror("Failed to send location request\n");
+        SKY_LOG_ERROR("Failed to send location request");
         return false;
     }
 
@@ -1086,9 +2562,247 @@ bool sky_query_location(
 
     cnt = sky_recv_location_response(rsp, rpc_recv, rpc_handle);
     if (cnt < 0) {
-        //perror("Failed to receive location response\n");
+        SKY_LOG_ERROR("Failed to receive location response");
         return false;
     }
 
     return true;
 }
+
+void sky_client_init(sky_client_t *client, uint8_t *buff, uint32_t buff_len,
+        sky_client_send_fn rpc_send, sky_client_recv_fn rpc_recv,
+        void *rpc_handle, sky_client_done_fn done, void *ctx) {
+    memset(client, 0, sizeof(*client));
+    client->state = SKY_CLIENT_IDLE;
+    client->buff = buff;
+    client->buff_len = buff_len;
+    client->send = rpc_send;
+    client->recv = rpc_recv;
+    client->rpc_handle = rpc_handle;
+    client->done = done;
+    client->ctx = ctx;
+}
+
+void sky_client_init_v(sky_client_t *client, uint8_t *buff, uint32_t buff_len,
+        sky_client_sendv_fn rpc_sendv, sky_client_recv_fn rpc_recv,
+        void *rpc_handle, sky_client_done_fn done, void *ctx) {
+    sky_client_init(client, buff, buff_len, NULL, rpc_recv, rpc_handle, done, ctx);
+    client->sendv = rpc_sendv;
+}
+
+bool sky_client_start(sky_client_t *client, struct location_rq_t *rq, struct location_rsp_t *rsp,
+        char *url, uint32_t now, uint32_t timeout) {
+    if (client->state != SKY_CLIENT_IDLE)
+        return false;
+    if (client->datagram && (rq->header.version != SKY_PROTOCOL_VERSION_2 || rq->request_id == 0))
+        return false;
+    client->rq = rq;
+    client->rsp = rsp;
+    client->url = url;
+    client->deadline = now + timeout;
+    client->len = 0;
+    client->pos = 0;
+    client->retries = 0;
+    client->state = SKY_CLIENT_ENCODING;
+    return true;
+}
+
+bool sky_client_start_encoded(sky_client_t *client, uint32_t frame_len, struct location_rsp_t *rsp,
+        char *url, uint32_t now, uint32_t timeout) {
+    uint32_t header_len = 0;
+    if (client->state != SKY_CLIENT_IDLE || client->datagram || frame_len > client->buff_len
+            || sky_get_frame_len(client->buff, frame_len, true, &header_len) != (int32_t)frame_len)
+        return false;
+    memset(&rsp->location_ext, 0, sizeof(rsp->location_ext));
+    sky_capture(SKY_CAPTURE_RQ_CIPHER, client->buff, frame_len);
+    client->rq = NULL;
+    client->rsp = rsp;
+    client->url = url;
+    client->deadline = now + timeout;
+    client->len = frame_len;
+    client->pos = 0;
+    client->header_len = header_len;
+    client->retries = 0;
+    client->state = SKY_CLIENT_SENDING;
+    return true;
+}
+
+void sky_client_set_datagram(sky_client_t *client, uint32_t retry_timeout) {
+    client->datagram = true;
+    client->retry_timeout = (retry_timeout > 0) ? retry_timeout : 1; // at most one send per poll
+}
+
+// Time from now to the next retransmission of a datagram request: the retry timeout doubles with
+// every retransmission (up to 16 times), plus a random jitter of up to half of it, so that
+// clients which lost their requests at the same time do not retransmit in step.
+static uint32_t sky_client_retry_delay(sky_client_t *client) {
+    uint32_t delay = client->retry_timeout << (client->retries < 4 ? client->retries : 4);
+    return delay + (uint32_t)rand() % (delay / 2 + 1);
+}
+
+void sky_client_cancel(sky_client_t *client) {
+    client->state = SKY_CLIENT_IDLE;
+}
+
+// Complete the query of the client with status.
+static void sky_client_finish(sky_client_t *client, enum SKY_STATUS status) {
+    client->state = SKY_CLIENT_IDLE;
+    if (client->done != NULL)
+        client->done(client, (status == SKY_OK) ? client->rsp : NULL, status);
+}
+
+bool sky_client_poll(sky_client_t *client, uint32_t now) {
+    for (;;) {
+        if (client->state != SKY_CLIENT_IDLE && client->state != SKY_CLIENT_DECODING
+                && (int32_t)(now - client->deadline) >= 0) {
+            SKY_LOG_ERROR("location query timed out");
+            sky_client_finish(client, SOCKET_TIMEOUT_FAILED);
+            return false;
+        }
+
+        switch (client->state) {
+        case SKY_CLIENT_IDLE:
+            return false;
+
+        case SKY_CLIENT_ENCODING: {
+            SKY_METRICS_START(start);
+            int32_t cnt = sky_encode_req_bin(client->buff, client->buff_len, client->rq);
+            uint32_t header_len = 0;
+            if (cnt < 0 || sky_get_frame_len(client->buff, cnt, true, &header_len) != cnt) {
+                SKY_LOG_ERROR("encode binary protocol failed");
+                sky_client_finish(client, ENCODE_BIN_FAILED);
+                return false;
+            }
+            SKY_METRICS_STOP(SKY_STAGE_ENCODE, start);
+            sky_capture(SKY_CAPTURE_RQ_PLAIN, client->buff, cnt);
+            SKY_METRICS_MARK(start);
+            if (sky_aes_encrypt(client->buff + header_len, cnt - header_len - sizeof(sky_checksum_t),
+                    client->rq->key.aes_key, client->buff + header_len - sizeof(client->rq->header.iv)) != 0) {
+                SKY_LOG_ERROR("failed to encrypt request");
+                sky_client_finish(client, ENCRYPT_BIN_FAILED);
+                return false;
+            }
+            SKY_METRICS_STOP(SKY_STAGE_ENCRYPT, start);
+            sky_capture(SKY_CAPTURE_RQ_CIPHER, client->buff, cnt);
+            memset(&client->rsp->location_ext, 0, sizeof(client->rsp->location_ext));
+            memcpy(&client->rsp->key, &client->rq->key, sizeof(client->rsp->key));
+            client->len = cnt;
+            client->pos = 0;
+            client->header_len = header_len;
+            client->state = SKY_CLIENT_SENDING;
+            break;
+        }
+
+        case SKY_CLIENT_SENDING: {
+            char host[HOST_SIZE];
+            uint16_t port = 0; // max port number is 65535
+            if (!sky_parse_url(client->url, host, &port)) {
+                sky_client_finish(client, API_URL_UNKNOWN);
+                return false;
+            }
+            int32_t cnt;
+            if (client->sendv != NULL) {
+                sky_iovec_t iov[3];
+                uint32_t iov_count = sky_get_frame_iov(client->buff, client->len, client->header_len,
+                        client->pos, iov);
+                cnt = client->sendv(iov, iov_count, host, port, client->rpc_handle);
+            } else {
+                cnt = client->send(client->buff + client->pos, client->len - client->pos,
+                        host, port, client->rpc_handle);
+            }
+            if (cnt < 0) {
+                SKY_LOG_ERROR("failed to send location request");
+                sky_client_finish(client, SOCKET_WRITE_FAILED);
+                return false;
+            }
+            if (client->datagram && cnt != 0 && (uint32_t)cnt != client->len) {
+                SKY_LOG_ERROR("request datagram truncated");
+                sky_client_finish(client, SOCKET_WRITE_FAILED);
+                return false;
+            }
+            client->pos += cnt;
+            if (client->pos < client->len)
+                return true; // wait for the send buffer
+            client->len = 0;
+            if (client->datagram)
+                client->retry_at = now + sky_client_retry_delay(client);
+            SKY_METRICS_MARK(client->stage_start);
+            client->state = SKY_CLIENT_AWAITING;
+            break;
+        }
+
+        case SKY_CLIENT_AWAITING: {
+            if (client->datagram) {
+                if ((int32_t)(now - client->retry_at) >= 0) {
+                    // retransmit with the same request id (and a new iv)
+                    client->retries++;
+                    client->state = SKY_CLIENT_ENCODING;
+                    break;
+                }
+                int32_t cnt = client->recv(client->buff, client->buff_len, client->rpc_handle);
+                if (cnt < 0) {
+                    SKY_LOG_ERROR("failed to receive location response");
+                    sky_client_finish(client, SOCKET_RECV_FAILED);
+                    return false;
+                }
+                if (cnt == 0)
+                    return true; // wait for data
+                SKY_METRICS_STOP(SKY_STAGE_WAIT, client->stage_start);
+                client->len = cnt;
+                client->state = SKY_CLIENT_DECODING;
+                break;
+            }
+            // the header tells the length of the response; read no byte beyond it
+            uint32_t header_len = 0;
+            int32_t frame_len = sky_get_frame_len(client->buff, client->len, false, &header_len);
+            if (frame_len < 0 || frame_len > (int32_t)client->buff_len) {
+                SKY_LOG_ERROR("invalid response header");
+                sky_client_finish(client, DECODE_BIN_FAILED);
+                return false;
+            }
+            if (frame_len > 0 && client->len == (uint32_t)frame_len) {
+                SKY_METRICS_STOP(SKY_STAGE_READ, client->stage_start);
+                client->state = SKY_CLIENT_DECODING;
+                break;
+            }
+            uint32_t want = (frame_len > 0) ? frame_len - client->len : sizeof(sky_rsp_header_t) - client->len;
+            if (frame_len == 0 && client->len >= sizeof(sky_rsp_header_t))
+                want = 1; // protocol version 2 header of unknown length
+            int32_t cnt = client->recv(client->buff + client->len, want, client->rpc_handle);
+            if (cnt < 0) {
+                SKY_LOG_ERROR("failed to receive location response");
+                sky_client_finish(client, SOCKET_RECV_FAILED);
+                return false;
+            }
+            if (cnt == 0)
+                return true; // wait for data
+#if SKY_METRICS
+            if (client->len == 0) {
+                SKY_METRICS_STOP(SKY_STAGE_WAIT, client->stage_start);
+                SKY_METRICS_MARK(client->stage_start);
+            }
+#endif
+            client->len += cnt;
+            break;
+        }
+
+        case SKY_CLIENT_DECODING: {
+            int32_t cnt = sky_decode_location_response(client->buff, client->len, client->rsp);
+            if (client->datagram && (cnt != (int32_t)client->len
+                    || client->rsp->request_id != client->rq->request_id)) {
+                // drop a foreign datagram or a duplicate response to an earlier request
+                client->len = 0;
+                client->state = SKY_CLIENT_AWAITING;
+                break;
+            }
+            if (cnt <= 0) {
+                SKY_LOG_ERROR("failed to decode location response");
+                sky_client_finish(client, DECODE_BIN_FAILED);
+                return false;
+            }
+            sky_client_finish(client, SKY_OK);
+            return client->state != SKY_CLIENT_IDLE;
+        }
+        }
+    }
+}
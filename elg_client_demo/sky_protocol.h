@@ -25,6 +25,7 @@ extern "C" {
  *************************************************************************/
 
 #define SKY_PROTOCOL_VERSION    1
+#define SKY_PROTOCOL_VERSION_2  2 // frame with varint lengths and request id, see below
 
 #define URL_FORMAT              "elg://host:port/"
 
@@ -44,6 +45,7 @@ extern "C" {
 #define MAX_GPSS                2   // max # of gps
 #define MAX_CELLS               7   // max # of cells
 #define MAX_BLES                5   // max # of blue tooth
+#define MAX_BATCH_SCANS         16  // max # of scans of a batch request (LOCATION_RQ_BATCH)
 
 // max # of bytes for request buffer
 #define SKY_PROT_RQ_BUFF_LEN                                                 \
@@ -61,6 +63,20 @@ extern "C" {
     + sizeof(struct location_t) + sizeof(struct location_ext_t)               \
     + 1024 // the char array of full address
 
+// max # of bytes of protocol version 2 headers:
+// version, flags, request_id and payload_length varints, (partner_id,) iv
+#define SKY_V2_RQ_HEADER_MAX_LEN    (2 + 5 + 5 + 4 + 16)
+#define SKY_V2_RSP_HEADER_MAX_LEN   (2 + 5 + 5 + 16)
+
+// max # of in-flight requests per connection tracked by sky_correlator_t
+#define SKY_MAX_INFLIGHT            8
+
+// max # of ELG server endpoints in sky_endpoints_t, and max # of bytes of their urls
+#define SKY_MAX_ENDPOINTS           4
+#define SKY_ENDPOINT_URL_LEN        80
+// back-off (ms) after the first failure of an endpoint, doubling with each further failure
+#define SKY_ENDPOINT_BACKOFF        1000
+
 // max # of bytes for both request and response buffer
 #define SKY_PROT_BUFF_LEN                                                     \
                             ((SKY_PROT_RQ_BUFF_LEN > SKY_PROT_RSP_BUFF_LEN) ? \
@@ -149,6 +165,11 @@ enum SKY_DATA_TYPE {
     DATA_TYPE_IPV4,         // ipv4 address
     DATA_TYPE_IPV6,         // ipv6 address
     DATA_TYPE_MAC,          // device MAC address
+
+    DATA_TYPE_AP_DELTA,     // access point changes relative to a baseline scan
+    DATA_TYPE_SCAN_ID,      // scan id of the access points in a request
+    DATA_TYPE_AP_COMPACT,   // access point, compact form
+    DATA_TYPE_SCAN_BATCH,   // scans of a batch request, or their locations in the response
 };
 
 // request payload types
@@ -158,6 +179,9 @@ enum SKY_RQ_PAYLOAD_TYPE {
     LOCATION_RQ,                // location request
     LOCATION_RQ_ADDR,           // location request full
     PROBE_REQUEST,              // probe test
+    LOCATION_RQ_DELTA,          // location request, access points relative to a baseline scan
+    LOCATION_RQ_ADDR_DELTA,     // location request full, access points relative to a baseline scan
+    LOCATION_RQ_BATCH,          // location requests of several earlier scans (protocol version 2 only)
 };
 
 // response payload types
@@ -168,6 +192,7 @@ enum SKY_RSP_PAYLOAD_TYPE {
     LOCATION_RQ_SUCCESS,        // lat+lon success
     LOCATION_RQ_ADDR_SUCCESS,   // full address success
     PROBE_REQUEST_SUCCESS,      // probe success
+    LOCATION_RQ_BATCH_SUCCESS,  // batch success, with the location (or error) of each scan
 
     // error codes
     LOCATION_RQ_ERROR = 10,      // client domain errors
@@ -178,6 +203,8 @@ enum SKY_RSP_PAYLOAD_TYPE {
     // detailed client domain error codes
     LOCATION_UNABLE_TO_DETERMINE = 20,// api-server is unable to determine the client
                                       // location by the given client data.
+    LOCATION_BASELINE_UNKNOWN,        // the baseline scan of an access point delta is unknown
+                                      // to the server; the client needs to send a full scan.
 };
 
 // internal error codes
@@ -245,6 +272,24 @@ typedef struct {
     uint8_t data_type_count;   // data type count
 } sky_entry_t;
 
+// Protocol version 2 frame (header.version == SKY_PROTOCOL_VERSION_2), byte by byte:
+//   uint8_t version           // SKY_PROTOCOL_VERSION_2
+//   uint8_t flags             // reserved, 0
+//   varint request_id         // chosen by the client and echoed in the response, 0 for none
+//   varint payload_length     // multiple of 16 bytes
+//   uint32_t partner_id       // request only
+//   uint8_t iv[16]            // initialization vector
+//   payload                   // AES encrypted: sky_payload_t followed by data entries of
+//                             // uint8_t data_type, varint data_type_count and the data,
+//                             // padded with DATA_TYPE_PAD bytes
+//   sky_checksum_t            // checksum of the unencrypted header and payload
+// A varint is an unsigned LEB128 number: 7 bits per byte, least significant group first,
+// bit 7 set if more bytes follow. Data entry counts have the same meaning as in version 1,
+// so entries with a count below 128 look the same in both versions; they go up to UINT16_MAX
+// (the counts and lengths of location_rq_t and location_rsp_t), where version 1 stops at 255.
+// Several requests may be in flight on one connection; responses are matched by request_id
+// (see sky_correlator_t) and frames are delimited with sky_get_frame_len().
+
 // read and write in place in buffer
 typedef struct {
     sky_entry_t * entry;       // entry without data
@@ -264,6 +309,12 @@ typedef struct {
 
 typedef uint16_t sky_checksum_t;
 
+// running sums for computing the checksum in several pieces (see fletcher16_init() in sky_crypt.h)
+typedef struct {
+    uint32_t s1;
+    uint32_t s2;
+} sky_checksum_ctx_t;
+
 // enum values to set struct ap_t::flag.
 enum SKY_BAND {
     BAND_UNKNOWN = 0,
@@ -300,6 +351,52 @@ struct ap_t {
                   // bits 4-7: Reserved
 };
 
+// access point in compact form (DATA_TYPE_AP_COMPACT)
+// Note: The data entry count is the number of access points. The data starts with
+//       struct ap_compact_hdr_t, followed by the OUI dictionary uint8_t oui[oui_count][3]
+//       and struct ap_compact_t[count]. There is no padding between them.
+struct ap_compact_hdr_t {
+    uint8_t oui_count; // # of OUIs (the first 3 MAC bytes) in the dictionary
+    uint8_t connected; // 1 + index of the access point the device is connected to, 0 for none
+};
+
+struct ap_compact_t {
+    uint8_t oui;       // index of the first 3 MAC bytes in the OUI dictionary
+    uint8_t nic[3];    // last 3 MAC bytes
+    uint8_t rssi_band; // bits 0-5: -rssi / 2, capped at 63 (rssi in 2 dB steps)
+                       // bits 6-7: band indicator, see struct ap_t::flag
+};
+
+// access point changes relative to a baseline scan (DATA_TYPE_AP_DELTA)
+// Note: The data entry count is always 1. The struct is followed in buffer by
+//       uint8_t removed[removed_count]                - baseline indexes of access points gone
+//       struct ap_rssi_delta_t changed[changed_count] - rssi changes of baseline access points
+//       struct ap_t added[added_count]                - access points not in the baseline
+//       Baseline access points which are neither removed nor changed are unchanged.
+struct ap_delta_t {
+    uint32_t baseline_id; // scan id of the baseline, acknowledged by the server
+    uint8_t removed_count;
+    uint8_t changed_count;
+    uint8_t added_count;
+    uint8_t unused; // padding byte
+};
+
+struct ap_rssi_delta_t {
+    uint8_t index; // index of the access point in the baseline
+    int8_t rssi;   // rssi change
+};
+
+// scan of a batch (DATA_TYPE_SCAN_BATCH in a LOCATION_RQ_BATCH request)
+// Note: The data entry count is the number of scans. Each scan is the struct followed by
+//       struct ap_t[ap_count], with no padding between the scans. Build it with sky_add_batch_scan().
+struct batch_scan_t {
+    uint32_t age;      // ms from the scan to the request, SKY_BATCH_AGE_UNKNOWN if unknown
+    uint8_t ap_count;
+    uint8_t unused[3]; // padding bytes
+};
+
+#define SKY_BATCH_AGE_UNKNOWN   0xffffffff
+
 // http://wiki.opencellid.org/wiki/API
 struct gsm_t {
     uint32_t ci;
@@ -392,47 +489,56 @@ struct location_t {
     float distance_to_point; // 32 bit IEEE-754
 };
 
+// location of a scan of a batch (DATA_TYPE_SCAN_BATCH in a LOCATION_RQ_BATCH_SUCCESS response)
+// Note: Unlike the other response data entries, the count is the number of scans, not bytes;
+//       the data is struct batch_location_t[count], in the order of the scans in the request.
+struct batch_location_t {
+    struct location_t location;
+    uint8_t type;      // LOCATION_RQ_SUCCESS, or the error (e.g. LOCATION_UNABLE_TO_DETERMINE)
+    uint8_t unused[7]; // padding bytes
+};
+
 // extended location result
 struct location_ext_t {
 
-    uint8_t mac_len;
+    uint16_t mac_len;
     uint8_t *mac;
 
-    uint8_t ip_len;
+    uint16_t ip_len;
     uint8_t ip_type;  // DATA_TYPE_IPV4 or DATA_TYPE_IPV6
     uint8_t *ip_addr; // ipv4 (4 bytes) or ipv6 (16 bytes)
 
-    uint8_t street_num_len;
+    uint16_t street_num_len;
     char *street_num;
 
-    uint8_t address_len;
+    uint16_t address_len;
     char *address;
 
-    uint8_t city_len;
+    uint16_t city_len;
     char *city;
 
-    uint8_t state_len;
+    uint16_t state_len;
     char *state;
 
-    uint8_t state_code_len;
+    uint16_t state_code_len;
     char *state_code;
 
-    uint8_t metro1_len;
+    uint16_t metro1_len;
     char *metro1;
 
-    uint8_t metro2_len;
+    uint16_t metro2_len;
     char *metro2;
 
-    uint8_t postal_code_len;
+    uint16_t postal_code_len;
     char *postal_code;
 
-    uint8_t county_len;
+    uint16_t county_len;
     char *county;
 
-    uint8_t country_len;
+    uint16_t country_len;
     char *country;
 
-    uint8_t country_code_len;
+    uint16_t country_code_len;
     char *country_code;
 };
 
@@ -451,7 +557,7 @@ struct sky_relay_t {
     uint8_t valid;
 };
 
-// stores keys in a binary tree
+// key of a partner; servers find them by partner id in a sky_keystore_t (tools/sky_keystore.h)
 struct sky_key_t {
     uint32_t partner_id;
     uint8_t aes_key[16];  // 128 bit aes key
@@ -468,45 +574,67 @@ struct location_rq_t {
     sky_rq_header_t header;
     sky_payload_ext_t payload_ext;
 
-    uint8_t mac_count; // count of MAC address
+    // protocol version 2 only
+    uint8_t flags;
+    uint32_t request_id; // echoed in the response, 0 for none
+
+    uint16_t mac_count; // count of MAC address
     uint8_t *mac;      // client device MAC identifier
 
-    uint8_t ip_count; // count of IP address
+    uint16_t ip_count; // count of IP address
     uint8_t ip_type;
     uint8_t *ip_addr; // ipv4 or ipv6
 
     // wifi access points
-    uint8_t ap_count;
+    uint16_t ap_count;
     struct ap_t *aps;
+    uint8_t ap_type;       // DATA_TYPE_AP (or 0) or DATA_TYPE_AP_COMPACT for the encoding on the wire;
+                           // DATA_TYPE_AP_COMPACT is only used when it is smaller
+    uint16_t ap_compact_len; // DATA_TYPE_AP_COMPACT: bytes in ap_compact, aps is NULL after decoding;
+    uint8_t *ap_compact;     // expand with sky_decode_ap_compact()
+
+    // wifi access point changes relative to a baseline scan, encoded by sky_encode_ap_delta();
+    // used by LOCATION_RQ_DELTA and LOCATION_RQ_ADDR_DELTA
+    uint16_t ap_delta_len; // bytes in ap_delta
+    uint8_t *ap_delta;
+
+    // scan id of the access points (0 for none); the server echoes it in the response once it
+    // stored them as a baseline for later access point deltas
+    uint32_t scan_id;
+
+    // earlier scans of a LOCATION_RQ_BATCH request, built with sky_add_batch_scan()
+    uint16_t batch_count;  // # of scans, up to MAX_BATCH_SCANS
+    uint16_t batch_len;    // bytes in batch
+    uint8_t *batch;
 
     // blue tooth
-    uint8_t ble_count;
+    uint16_t ble_count;
     struct ble_t *bles;
 
     // cell
     // note: *DEPRECATED*, please use gsm, cdma, lte, and umts which are defined below.
-    uint8_t cell_count; // deprecated, use gsm, cdma, lte and umts instead
-    uint8_t cell_type;  // deprecated, use gsm, cdma, lte and umts instead
-    union cell_t *cell; // deprecated, use gsm, cdma, lte and umts instead
+    uint16_t cell_count; // deprecated, use gsm, cdma, lte and umts instead
+    uint8_t cell_type;   // deprecated, use gsm, cdma, lte and umts instead
+    union cell_t *cell;  // deprecated, use gsm, cdma, lte and umts instead
 
     // gsm
-    uint8_t gsm_count;
+    uint16_t gsm_count;
     struct gsm_t *gsms;
 
     // cdma
-    uint8_t cdma_count;
+    uint16_t cdma_count;
     struct cdma_t *cdmas;
 
     // lte
-    uint8_t lte_count;
+    uint16_t lte_count;
     struct lte_t *ltes;
 
     // umts
-    uint8_t umts_count;
+    uint16_t umts_count;
     struct umts_t *umtss;
 
     // gps
-    uint8_t gps_count;
+    uint16_t gps_count;
     struct gps_t *gps;
 
     //
@@ -530,6 +658,10 @@ struct location_rsp_t {
     sky_rsp_header_t header;
     sky_payload_ext_t payload_ext;
 
+    // protocol version 2 only
+    uint8_t flags;
+    uint32_t request_id; // request_id of the request
+
     //
     // additional attributes
     //
@@ -539,8 +671,73 @@ struct location_rsp_t {
     struct location_t location; // location result: lat and lon
 
     struct location_ext_t location_ext; // ext location result: full address, etc.
+
+    uint32_t scan_id; // scan id of the request stored as baseline by the server (0 for none)
+
+    // locations of the scans of a LOCATION_RQ_BATCH request (struct batch_location_t[batch_count],
+    // not aligned in buffer), read with sky_get_batch_location()
+    uint16_t batch_count;
+    uint8_t *batch;
 };
 
+// max # of bytes of the MAC and IP data entries in a request
+#define SKY_RQ_PREFIX_LEN                                                     \
+    ((sizeof(sky_entry_t) + MAX_MACS * MAC_SIZE)                              \
+    + (sizeof(sky_entry_t) + MAX_IPS * IPV6_SIZE))
+
+// Encoded request data entries which do not change between scans (device MAC and IP address),
+// together with their checksum sums, so that every scan only encodes the header, the payload
+// and the scanned data entries.
+// The cache holds protocol version 1 data entries only: version 2 requests are encoded in full by
+// sky_encode_req_bin_cached(), and leave the cache as it is.
+// Invalidate with sky_rq_prefix_invalidate() when the device IP address or the key changes.
+typedef struct {
+    bool valid;
+    uint8_t len;                      // bytes in data
+    uint8_t data[SKY_RQ_PREFIX_LEN];  // encoded MAC and IP data entries
+    sky_checksum_ctx_t sums;          // checksum sums over data
+} sky_rq_prefix_t;
+
+// request in flight, see sky_correlator_t
+typedef struct {
+    uint32_t request_id;       // 0 for a free slot
+    uint32_t sent_at;          // time of sending in ms
+    void * ctx;                // caller context of the request
+} sky_inflight_t;
+
+// Matches responses to the in-flight requests of one connection by request id,
+// so that several requests can be pipelined (protocol version 2).
+typedef struct {
+    uint32_t next_id;
+    uint8_t count;             // # of requests in flight
+    sky_inflight_t slots[SKY_MAX_INFLIGHT];
+} sky_correlator_t;
+
+// callback function for requests which got no response in time
+// @param request_id - request id
+// @param ctx - caller context given to sky_correlator_add()
+typedef void (* sky_correlator_expired_fn)(uint32_t request_id, void * ctx);
+
+// capabilities of an ELG server endpoint beyond plain version 1 requests (sky_endpoint_t::caps)
+#define SKY_ENDPOINT_AP_COMPACT     0x01    // decodes access points in compact form (DATA_TYPE_AP_COMPACT)
+#define SKY_ENDPOINT_V2             0x02    // decodes version 2 requests, LOCATION_RQ_BATCH among them
+
+// ELG server endpoint with its round trip time statistics (as for the TCP retransmission timer)
+typedef struct {
+    char url[SKY_ENDPOINT_URL_LEN]; // "elg://host:port/"
+    uint8_t caps;              // SKY_ENDPOINT_* the server is known to decode, 0 unless the caller sets them
+    uint32_t srtt;             // smoothed round trip time in ms, 0 until measured
+    uint32_t rttvar;           // smoothed mean deviation of the round trip time in ms
+    uint16_t failures;         // # of consecutive failures
+    uint32_t retry_at;         // time (ms) before which an endpoint with failures is skipped
+} sky_endpoint_t;
+
+// Ranks the ELG server endpoints, so that queries go to the fastest healthy one.
+typedef struct {
+    uint8_t count;
+    sky_endpoint_t endpoints[SKY_MAX_ENDPOINTS];
+} sky_endpoints_t;
+
 // callback function for sending data from buffer
 // @param buff - data buffer
 // @param buff_len - data length in buffer
@@ -561,6 +758,89 @@ typedef int32_t (* sky_client_send_fn)(uint8_t *buff, uint32_t buff_len,
 typedef int32_t (* sky_client_recv_fn)(uint8_t *buff, uint32_t buff_len,
         void * rpc_handle);
 
+// segment of data for sky_client_sendv_fn (like struct iovec of writev())
+typedef struct {
+    const uint8_t *base;
+    uint32_t len;
+} sky_iovec_t;
+
+// callback function for sending data from several segments, in order, as if they were one buffer
+// (e.g. writev() on host, or one client.write() per segment into the lwIP send buffer on the device)
+// @param iov - data segments
+// @param iov_count - # of segments in iov
+// @param host - host name
+// @param port - port number
+// @param rpc_handle - the remote procedure call handle (e.g. socket) for client-server model communication
+// @return the number of sent bytes, which should be the sum of the segment lengths, upon success,
+//         or -1 upon failure.
+typedef int32_t (* sky_client_sendv_fn)(const sky_iovec_t *iov, uint32_t iov_count,
+        char *host, uint16_t port, void * rpc_handle);
+
+// kinds of frames passed to sky_capture_fn
+enum SKY_CAPTURE_KIND {
+    SKY_CAPTURE_RQ_PLAIN = 1,  // encoded request, before encryption
+    SKY_CAPTURE_RQ_CIPHER,     // encrypted request, as sent
+    SKY_CAPTURE_RSP_CIPHER,    // response as received, before decryption
+    SKY_CAPTURE_RSP_PLAIN,     // decrypted response
+};
+
+// callback function for capturing the frames the client sends and receives (see sky_set_capture()),
+// e.g. to record field traffic for replaying it later (tools/sky_capture.h)
+// @param ctx - caller context given to sky_set_capture()
+// @param kind - enum SKY_CAPTURE_KIND
+// @param buff - the frame, valid during the call only
+// @param len - # of bytes of the frame
+typedef void (* sky_capture_fn)(void *ctx, uint8_t kind, const uint8_t *buff, uint32_t len);
+
+// Note: With sky_client_t, sky_client_send_fn and sky_client_recv_fn must not block; they may
+//       transfer fewer bytes than buff_len, and return 0 when no byte can be transferred yet.
+//       The same applies to sky_client_sendv_fn.
+
+// states of sky_client_t
+enum SKY_CLIENT_STATE {
+    SKY_CLIENT_IDLE = 0,       // no query
+    SKY_CLIENT_ENCODING,       // encoding and encrypting the request
+    SKY_CLIENT_SENDING,        // sending the request
+    SKY_CLIENT_AWAITING,       // receiving the response
+    SKY_CLIENT_DECODING,       // decrypting and decoding the response
+};
+
+typedef struct sky_client_s sky_client_t;
+
+// callback function for the completion of a location query of sky_client_t
+// @param client - the client, idle again so that the next query can be started from the callback
+// @param rsp - server's location response upon success, or NULL upon failure
+// @param status - SKY_OK upon success, or the failure (e.g. SOCKET_TIMEOUT_FAILED)
+typedef void (* sky_client_done_fn)(sky_client_t *client, struct location_rsp_t *rsp,
+        enum SKY_STATUS status);
+
+// Non-blocking location query: sky_client_start() starts it, and sky_client_poll() moves it on
+// as far as the send and receive callbacks allow, until the done callback reports the result.
+struct sky_client_s {
+    enum SKY_CLIENT_STATE state;
+    struct location_rq_t *rq;
+    struct location_rsp_t *rsp;
+    char *url;                 // "elg://host:port/"
+    sky_client_send_fn send;
+    sky_client_sendv_fn sendv; // used instead of send if not NULL
+    sky_client_recv_fn recv;
+    void *rpc_handle;
+    sky_client_done_fn done;
+    void *ctx;                 // caller context, e.g. for the done callback
+    uint32_t deadline;         // time (ms) by which the query has to complete
+    uint32_t len;              // bytes of the request frame, or received bytes of the response
+    uint32_t pos;              // bytes of the request frame sent so far
+    uint32_t header_len;       // header length of the request frame
+    // datagram (UDP) mode, see sky_client_set_datagram()
+    bool datagram;
+    uint8_t retries;           // # of retransmissions of the request so far
+    uint32_t retry_timeout;    // time (ms) to wait for the response before the first retransmission
+    uint32_t retry_at;         // time (ms) of the next retransmission
+    uint32_t stage_start;      // cycles at the start of the wait or read stage, when timed (sky_metrics.h)
+    uint8_t *buff;             // request and response frames, from the caller (see sky_client_init())
+    uint32_t buff_len;
+};
+
 
 /*************************************************************************
  *
@@ -580,28 +860,165 @@ void sky_init_gps_attrib(struct gps_t * gps);
 // find aes key  based on partner_id in key root and set it
 uint32_t sky_get_partner_id_from_rq_header(uint8_t *buff, uint32_t buff_len);
 
+// called by server
+// returns the request id in the (unencrypted) request header of protocol version 2, or 0 for none
+uint32_t sky_get_request_id_from_rq_header(uint8_t *buff, uint32_t buff_len);
+
+// called by client and server
+// returns the length of the frame (header, payload and checksum) at the start of buff once its header
+// is complete, 0 when more bytes are needed, or -1 for an invalid frame (protocol version 1 or 2);
+// header_len returns the header length, which is where the encrypted payload starts
+int32_t sky_get_frame_len(const uint8_t *buff, uint32_t buff_len, bool is_request,
+        uint32_t *header_len);
+
 // called by server
 // decode binary data from client, result is in the location_rq_t struct
+// (protocol version 1 or 2, depending on the version in buff)
 int32_t sky_decode_req_bin(uint8_t *buff, uint32_t buff_len,
         struct location_rq_t *creq);
 
 // called by server
 // encodes the loc struct into binary formatted packet sent to client
+// (protocol version 2 if cresp->header.version is SKY_PROTOCOL_VERSION_2)
 // returns the packet len or -1 when fails
 int32_t sky_encode_resp_bin(uint8_t *buff, uint32_t buff_len,
         struct location_rsp_t *cresp);
 
 // called by client
 // encodes the request struct into binary formatted packet
+// (protocol version 2 if creq->header.version is SKY_PROTOCOL_VERSION_2)
 // returns the packet len or -1 when fails
 int32_t sky_encode_req_bin(uint8_t *buff, uint32_t buff_len,
         struct location_rq_t *creq);
 
+// called by client
+// invalidates the cached request prefix, so that the next sky_encode_req_bin_cached() re-encodes it
+void sky_rq_prefix_invalidate(sky_rq_prefix_t *prefix);
+
+// called by client
+// same as sky_encode_req_bin(), but copies the MAC and IP data entries from the prefix cache
+// and only checksums the bytes which changed; the cache is (re)built when invalid
+// (protocol version 1 only, a version 2 request is encoded by sky_encode_req_bin() without the cache)
+// returns the packet len or -1 when fails
+int32_t sky_encode_req_bin_cached(uint8_t *buff, uint32_t buff_len,
+        struct location_rq_t *creq, sky_rq_prefix_t *prefix);
+
+// called by client
+// encodes the request up to the access point data entry, like sky_encode_req_bin_cached(), and
+// returns the address in buff where the caller writes up to MAX_APS access points in place,
+// which saves keeping a separate access point array; finish with sky_encode_req_aps_end()
+// (for protocol version 2 or creq->ap_type DATA_TYPE_AP_COMPACT, the access points are written
+// further on in buff, and sky_encode_req_aps_end() encodes them to the front of the frame)
+// returns NULL when fails
+struct ap_t * sky_encode_req_aps_begin(uint8_t *buff, uint32_t buff_len,
+        struct location_rq_t *creq, sky_rq_prefix_t *prefix);
+
+// called by client
+// completes the request started by sky_encode_req_aps_begin() with ap_count access points:
+// entry count, header, remaining data entries, padding and checksum
+// returns the packet len or -1 when fails
+int32_t sky_encode_req_aps_end(uint8_t *buff, uint32_t buff_len,
+        struct location_rq_t *creq, sky_rq_prefix_t *prefix, uint8_t ap_count);
+
 // called by client
 // decodes the binary data and the result is in the location_rsp_t struct
+// (protocol version 1 or 2, depending on the version in buff)
 int32_t sky_decode_resp_bin(uint8_t *buff, uint32_t buff_len,
         struct location_rsp_t *cresp);
 
+// called by client
+// starts request ids at first_id (e.g. a random number, 0 is skipped) with no request in flight
+void sky_correlator_init(sky_correlator_t *corr, uint32_t first_id);
+
+// called by client
+// registers a request sent at time now (ms) with the caller context ctx
+// returns the request id for location_rq_t::request_id, or 0 when SKY_MAX_INFLIGHT requests are in flight
+uint32_t sky_correlator_add(sky_correlator_t *corr, void *ctx, uint32_t now);
+
+// called by client
+// removes the request matching the response's request id; rtt returns the round trip time in ms
+// returns true and the caller context in ctx, or false for an unknown (e.g. expired) request id
+bool sky_correlator_match(sky_correlator_t *corr, uint32_t request_id, uint32_t now,
+        void **ctx, uint32_t *rtt);
+
+// called by client
+// removes the requests sent timeout ms or longer before now, calling expired for each of them
+// returns the number of removed requests
+uint32_t sky_correlator_expire(sky_correlator_t *corr, uint32_t now, uint32_t timeout,
+        sky_correlator_expired_fn expired);
+
+// called by client
+// empties the endpoint list
+void sky_endpoints_init(sky_endpoints_t *eps);
+
+// called by client
+// adds the endpoint host:port, not measured yet
+// returns the index of the endpoint, or -1 when the list is full or the host name too long
+int32_t sky_endpoints_add(sky_endpoints_t *eps, const char *host, uint16_t port);
+
+// called by client
+// returns the index of the endpoint to query at time now: the healthy endpoint (other than exclude, and
+// with all the capabilities caps) with the lowest smoothed round trip time, where endpoints not
+// measured yet come first; when none is healthy, the one whose back-off ends first; -1 when there is
+// no endpoint other than exclude with caps
+int32_t sky_endpoints_select(const sky_endpoints_t *eps, uint32_t now, int32_t exclude, uint8_t caps);
+
+// called by client
+// records the outcome of a query to endpoint idx: the round trip time rtt (ms) upon success,
+// or a failure, which puts the endpoint into back-off
+void sky_endpoints_report(sky_endpoints_t *eps, int32_t idx, uint32_t now, bool success, uint32_t rtt);
+
+// called by client
+// returns the time (ms) after which a query to endpoint idx is slower than usual (about the 95th
+// percentile of its round trip times), e.g. for hedging it to another endpoint; 0 until measured
+uint32_t sky_endpoints_hedge_delay(const sky_endpoints_t *eps, int32_t idx);
+
+// called by client
+// encodes the changes from the baseline access points (whose scan id the server acknowledged)
+// to the current access points into buff, for location_rq_t::ap_delta
+// returns the number of bytes in buff or -1 when fails
+int32_t sky_encode_ap_delta(uint8_t *buff, uint32_t buff_len, uint32_t baseline_id,
+        const struct ap_t *baseline, uint8_t baseline_count,
+        const struct ap_t *aps, uint8_t ap_count);
+
+// called by server
+// expands access points in compact form (location_rq_t::ap_compact) into aps
+// returns the number of access points in aps or -1 when fails
+int32_t sky_decode_ap_compact(const uint8_t *data, uint32_t data_len, uint32_t ap_count,
+        struct ap_t *aps, uint32_t aps_len);
+
+// called by server
+// returns the baseline scan id of the access point delta, or 0 when fails
+uint32_t sky_get_ap_delta_baseline_id(const uint8_t *delta, uint32_t delta_len);
+
+// called by server
+// applies the access point delta to the baseline access points of scan id baseline_id, result is
+// in aps: the baseline access points which are kept (in baseline order), then the added ones
+// returns the number of access points in aps or -1 when fails, e.g. when the delta is relative
+// to another baseline or has an index out of the baseline
+int32_t sky_decode_ap_delta(const uint8_t *delta, uint32_t delta_len, uint32_t baseline_id,
+        const struct ap_t *baseline, uint8_t baseline_count,
+        struct ap_t *aps, uint32_t aps_len);
+
+// called by client
+// appends a scan with ap_count access points, taken age ms before the request (or SKY_BATCH_AGE_UNKNOWN),
+// to the batch of scans in buff (location_rq_t::batch), which holds len bytes
+// returns the number of bytes in buff or -1 when it is too small
+int32_t sky_add_batch_scan(uint8_t *buff, uint32_t buff_len, uint32_t len, uint32_t age,
+        const struct ap_t *aps, uint8_t ap_count);
+
+// called by server
+// reads the scan at *offset of the batch of scans (location_rq_t::batch) into age and aps, and moves
+// *offset to the next scan
+// returns the number of access points in aps or -1 when fails
+int32_t sky_get_batch_scan(const uint8_t *batch, uint32_t batch_len, uint32_t *offset,
+        uint32_t *age, struct ap_t *aps, uint32_t aps_len);
+
+// called by client
+// copies the location of scan i of a batch response (location_rsp_t::batch) into location
+// returns false when there is no such scan
+bool sky_get_batch_location(const struct location_rsp_t *rsp, uint32_t i, struct batch_location_t *location);
+
 /*************************************************************************
  *
  * Skyhook Easy APIs for ELGv2 Protocol client
@@ -637,6 +1054,17 @@ int32_t sprint_buff(uint8_t *hex_buff, uint32_t hex_buff_len, uint8_t *buff, uin
 int32_t sky_send_location_request(struct location_rq_t * rq,
         sky_client_send_fn rpc_send, char * url, void * rpc_handle);
 
+// Called by the client to encode, encrypt and send a location request to Skyhook location service,
+// like sky_send_location_request(), but hands the header, the encrypted payload and the checksum
+// to rpc_sendv as separate segments, so that they are not copied into one packet for sending.
+// @param rq [in] - client's location request
+// @param rpc_sendv [in] - callback function for sending out data segments
+// @param url [in] - destination server and port in the format of "elg://host:port/"
+// @param rpc_handle [out] - the RPC call handle to mask the underlying communication details
+// @return the number of sent bytes (in ELG request) upon success, or -1 upon failure.
+int32_t sky_send_location_request_v(struct location_rq_t * rq,
+        sky_client_sendv_fn rpc_sendv, char * url, void * rpc_handle);
+
 // Called by the client to receive, decrypt and decode Skyhook location service's response.
 // @param rsp [out] - server's location response
 // @param rpc_recv [in] - callback function for receiving data
@@ -645,6 +1073,15 @@ int32_t sky_send_location_request(struct location_rq_t * rq,
 int32_t sky_recv_location_response(struct location_rsp_t *rsp,
         sky_client_recv_fn rpc_recv, void * rpc_handle);
 
+// Called by the client to decrypt and decode the response frame at the start of buff,
+// e.g. for the responses of pipelined requests which arrive back to back in one stream.
+// @param buff [in] - received data, decrypted in place
+// @param buff_len [in] - # of received bytes in buff
+// @param rsp [out] - server's location response, rsp->request_id tells the request
+// @return the frame length upon success, 0 if buff does not hold the complete frame yet, or -1 upon failure.
+int32_t sky_decode_location_response(uint8_t *buff, uint32_t buff_len,
+        struct location_rsp_t *rsp);
+
 // Called by the client to query location.
 // - Simple blocking call to invoke sky_send_location_request() and sky_recv_location_response() automatically.
 // - If nonblocking calls are desirable, invoke sky_send_location_request() and sky_recv_location_response() directly
@@ -660,6 +1097,81 @@ bool sky_query_location(
         struct location_rq_t * rq, sky_client_send_fn rpc_send, char * url,
         struct location_rsp_t *rsp, sky_client_recv_fn rpc_recv, void * rpc_handle);
 
+// Called by the client to set up a non-blocking client.
+// @param client [out] - the client, idle
+// @param buff [in] - buffer of the request and response frames, SKY_PROT_BUFF_LEN bytes (or fewer
+//        when the caller's frames are smaller), kept by the caller. Clients whose queries never
+//        run at the same time may share one; the response fields of location_ext point into it.
+// @param buff_len [in] - # of bytes of buff
+// @param rpc_send [in] - non-blocking callback function for sending out data buffer
+// @param rpc_recv [in] - non-blocking callback function for receiving data
+// @param rpc_handle [in] - the RPC call handle for tx and rx
+// @param done [in] - callback function for the completion of a query
+// @param ctx [in] - caller context, stored in client->ctx
+void sky_client_init(sky_client_t *client, uint8_t *buff, uint32_t buff_len,
+        sky_client_send_fn rpc_send, sky_client_recv_fn rpc_recv,
+        void *rpc_handle, sky_client_done_fn done, void *ctx);
+
+// Called by the client to set up a non-blocking client, which sends with a scatter-gather callback.
+// Parameters are the same as sky_client_init(), except rpc_sendv [in] - non-blocking callback
+// function for sending out data segments.
+void sky_client_init_v(sky_client_t *client, uint8_t *buff, uint32_t buff_len,
+        sky_client_sendv_fn rpc_sendv, sky_client_recv_fn rpc_recv,
+        void *rpc_handle, sky_client_done_fn done, void *ctx);
+
+// Called by the client to switch the non-blocking client to a datagram transport (e.g. UDP).
+// - rpc_send (or rpc_sendv) sends the whole request in one datagram, or returns 0 if it cannot yet.
+// - rpc_recv receives one whole datagram per call, or returns 0 if none has arrived.
+// - Requests must be of protocol version 2 with a request id (see sky_correlator_t). A request which
+//   gets no response is retransmitted with the same request id after retry_timeout ms, doubling
+//   with each retransmission and jittered by up to half, so that the server can suppress duplicates.
+// - Datagrams which fail to decode or carry another request id (e.g. late duplicate responses)
+//   are dropped.
+// @param retry_timeout [in] - time in ms to wait for the response before the first retransmission
+void sky_client_set_datagram(sky_client_t *client, uint32_t retry_timeout);
+
+// Called by the client to start a non-blocking location query; the request is encoded by the next
+// sky_client_poll().
+// @param rq [in] - client's location request, kept by the caller until the query completes
+// @param rsp [out] - server's location response, kept by the caller until the query completes
+// @param url [in] - destination server and port in the format of "elg://host:port/"
+// @param now [in] - current time in ms
+// @param timeout [in] - time in ms for the whole query
+// @return true upon success, or false if the client is busy with another query (or, in datagram mode,
+//         the request has no request id).
+bool sky_client_start(sky_client_t *client, struct location_rq_t *rq, struct location_rsp_t *rsp,
+        char *url, uint32_t now, uint32_t timeout);
+
+// Called by the client to start a non-blocking location query of a request, which the caller has
+// encoded and encrypted into client->buff already (e.g. with sky_encode_req_aps_begin()), so that
+// the query starts with sending. Not available in datagram mode, which re-encodes retransmissions.
+// @param frame_len [in] - # of bytes of the request frame in client->buff
+// @param rsp [out] - server's location response, whose key the caller sets
+// @param url [in] - destination server and port in the format of "elg://host:port/"
+// @param now [in] - current time in ms
+// @param timeout [in] - time in ms for the whole query
+// @return true upon success, or false if the client is busy or the frame is invalid.
+bool sky_client_start_encoded(sky_client_t *client, uint32_t frame_len, struct location_rsp_t *rsp,
+        char *url, uint32_t now, uint32_t timeout);
+
+// Called by the client (e.g. from loop() or an event loop) to move the query on as far as possible
+// without blocking; the done callback is called when the query completes, fails or times out.
+// @param now [in] - current time in ms
+// @return true while a query is in progress, or false when the client is idle.
+bool sky_client_poll(sky_client_t *client, uint32_t now);
+
+// Called by the client to abandon the query in progress without calling the done callback;
+// the caller resets the connection of rpc_handle.
+void sky_client_cancel(sky_client_t *client);
+
+// Called by the client to capture every request and response frame, plain and encrypted, which
+// sky_send_location_request(), sky_send_location_request_v(), sky_decode_location_response() and
+// sky_client_t encode or decode (requests of sky_client_start_encoded() encrypted only); set before
+// the first query, as it is not synchronized.
+// @param capture [in] - callback function, or NULL to stop capturing
+// @param ctx [in] - caller context passed to capture
+void sky_set_capture(sky_capture_fn capture, void *ctx);
+
 #endif
 
 #ifdef __cplusplus
@@ -0,0 +1,196 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+#include <stddef.h>
+#include <string.h>
+#include "sky_config.h"
+#include "sky_scanlog.h"
+
+// offset of the slot after the one at offset, wrapping around at the end of the area
+static uint32_t next_slot(const sky_scanlog_t *log, uint32_t offset) {
+    offset += SKY_SCANLOG_SLOT_SIZE;
+    if (offset % log->sector_size + SKY_SCANLOG_SLOT_SIZE > log->sector_size)
+        offset += log->sector_size - offset % log->sector_size;
+    return (offset + SKY_SCANLOG_SLOT_SIZE > log->size) ? 0 : offset;
+}
+
+// # of slots of the area
+static uint32_t slot_count(const sky_scanlog_t *log) {
+    return (log->size / log->sector_size) * (log->sector_size / SKY_SCANLOG_SLOT_SIZE);
+}
+
+static bool record_valid(const sky_scan_record_t *r) {
+    return r->magic == SKY_SCANLOG_MAGIC && r->seq != 0 && r->ap_count <= SKY_SCANLOG_MAX_APS
+            && r->crc == sky_crc32(0, r, offsetof(sky_scan_record_t, crc));
+}
+
+static bool read_record(sky_scanlog_t *log, uint32_t offset, sky_scan_record_t *r) {
+    return log->read(offset, r, sizeof(*r), log->ctx) && record_valid(r);
+}
+
+// all bytes of the slot are 0xff (erased)
+static bool slot_blank(sky_scanlog_t *log, uint32_t offset) {
+    sky_scan_record_t r;
+    const uint32_t *words = (const uint32_t *)&r;
+    uint32_t i;
+    if (!log->read(offset, &r, sizeof(r), log->ctx))
+        return false;
+    for (i = 0; i < sizeof(r) / sizeof(uint32_t); i++) {
+        if (words[i] != 0xffffffff)
+            return false;
+    }
+    return true;
+}
+
+// moves the tail from its offset to the oldest record not uploaded, which is at or after it
+static void seek_tail(sky_scanlog_t *log) {
+    sky_scan_record_t r;
+    uint32_t n;
+    for (n = slot_count(log); n > 0 && log->tail_seq <= log->seq; n--) {
+        if (read_record(log, log->tail, &r) && r.seq >= log->tail_seq) {
+            log->dropped += r.seq - log->tail_seq;
+            log->tail_seq = r.seq;
+            return;
+        }
+        log->tail = next_slot(log, log->tail);
+    }
+    log->dropped += log->seq + 1 - log->tail_seq;
+    log->tail = log->next;
+    log->tail_seq = log->seq + 1;
+}
+
+bool sky_scanlog_load(sky_scanlog_t *log) {
+    sky_scan_record_t r;
+    uint32_t offset = 0, acked = 0;
+    bool found = false;
+
+    log->next = 0;
+    log->seq = 0;
+    log->dropped = 0;
+    do {
+        if (!log->read(offset, &r, sizeof(r), log->ctx))
+            return false;
+        if (record_valid(&r)) {
+            if (!found || (int32_t)(r.seq - log->seq) > 0) {
+                log->seq = r.seq;
+                log->next = next_slot(log, offset);
+            }
+            if (r.sent == 0 && (int32_t)(r.seq - acked) > 0)
+                acked = r.seq;
+            found = true;
+        }
+        offset = next_slot(log, offset);
+    } while (offset != 0);
+
+    // the oldest record after the newest one uploaded
+    log->tail = log->next;
+    log->tail_seq = log->seq + 1;
+    do {
+        if (read_record(log, offset, &r) && (int32_t)(r.seq - acked) > 0
+                && (int32_t)(r.seq - log->tail_seq) < 0) {
+            log->tail = offset;
+            log->tail_seq = r.seq;
+        }
+        offset = next_slot(log, offset);
+    } while (offset != 0);
+    return true;
+}
+
+void sky_scan_record_add_ap(sky_scan_record_t *record, const struct ap_t *ap) {
+    uint32_t i = (record->ap_count < SKY_SCANLOG_MAX_APS) ? record->ap_count++ : SKY_SCANLOG_MAX_APS;
+    // insertion, the weakest falls off the end
+    for (; i > 0 && record->aps[i - 1].rssi < ap->rssi; i--) {
+        if (i < SKY_SCANLOG_MAX_APS)
+            record->aps[i] = record->aps[i - 1];
+    }
+    if (i < SKY_SCANLOG_MAX_APS)
+        record->aps[i] = *ap;
+}
+
+// erases the sector at offset, and moves the tail past it when it holds records not uploaded
+static bool erase_sector(sky_scanlog_t *log, uint32_t offset) {
+    if (!log->erase(offset, log->ctx))
+        return false;
+    if (log->tail_seq <= log->seq && log->tail / log->sector_size == offset / log->sector_size) {
+        log->tail = (offset + log->sector_size < log->size) ? offset + log->sector_size : 0;
+        seek_tail(log);
+    }
+    return true;
+}
+
+bool sky_scanlog_append(sky_scanlog_t *log, sky_scan_record_t *record) {
+    sky_scan_record_t check;
+    uint32_t offset = log->next, n;
+
+    // the first blank slot from next on; the writes erase each sector they enter, and skip the
+    // slots torn by a reset
+    for (n = slot_count(log); n > 0; n--) {
+        if (offset % log->sector_size == 0) {
+            if (!erase_sector(log, offset))
+                return false;
+            break;
+        }
+        if (slot_blank(log, offset))
+            break;
+        offset = next_slot(log, offset);
+    }
+    if (n == 0)
+        return false;
+
+    record->magic = SKY_SCANLOG_MAGIC;
+    record->seq = log->seq + 1;
+    memset(record->reserved, 0, sizeof(record->reserved));
+    memset(record->aps + record->ap_count, 0, (SKY_SCANLOG_MAX_APS - record->ap_count) * sizeof(struct ap_t));
+    record->crc = sky_crc32(0, record, offsetof(sky_scan_record_t, crc));
+    record->sent = 0xffffffff;
+    log->next = next_slot(log, offset);
+    if (!log->write(offset, record, sizeof(*record), log->ctx) || !log->read(offset, &check, sizeof(check), log->ctx)
+            || memcmp(record, &check, sizeof(check)) != 0)
+        return false;
+    log->seq = record->seq;
+    if (log->tail_seq == log->seq)
+        log->tail = offset; // the only record not uploaded
+    return true;
+}
+
+uint32_t sky_scanlog_pending(const sky_scanlog_t *log) {
+    return log->seq + 1 - log->tail_seq;
+}
+
+void sky_scanlog_rewind(const sky_scanlog_t *log, sky_scanlog_cursor_t *cursor) {
+    cursor->offset = log->tail;
+    cursor->last = log->tail;
+    cursor->seq = log->tail_seq - 1;
+}
+
+bool sky_scanlog_read(sky_scanlog_t *log, sky_scanlog_cursor_t *cursor, sky_scan_record_t *record) {
+    uint32_t n;
+    for (n = slot_count(log); n > 0 && cursor->seq != log->seq; n--) {
+        uint32_t offset = cursor->offset;
+        cursor->offset = next_slot(log, offset);
+        if (read_record(log, offset, record) && (int32_t)(record->seq - cursor->seq) > 0
+                && (int32_t)(record->seq - log->tail_seq) >= 0) {
+            cursor->last = offset;
+            cursor->seq = record->seq;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool sky_scanlog_ack(sky_scanlog_t *log, const sky_scanlog_cursor_t *cursor) {
+    static const uint32_t sent = 0;
+    sky_scan_record_t r;
+    bool ok = true;
+
+    if ((int32_t)(cursor->seq - log->tail_seq) < 0)
+        return true; // none read, or dropped meanwhile
+    // the record may have been erased by an append since it was read
+    if (read_record(log, cursor->last, &r) && r.seq == cursor->seq)
+        ok = log->write(cursor->last + offsetof(sky_scan_record_t, sent), &sent, sizeof(sent), log->ctx);
+    log->tail = cursor->offset;
+    log->tail_seq = cursor->seq + 1;
+    seek_tail(log);
+    return ok;
+}
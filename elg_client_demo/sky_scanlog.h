@@ -0,0 +1,106 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_SCANLOG_H
+#define SKY_SCANLOG_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include "sky_protocol.h"
+
+/*************************************************************************
+ *
+ * Offline scan log
+ *
+ * Scans taken while the device is offline are appended as fixed-size
+ * records with a CRC, one slot after the other, to a ring of flash
+ * sectors. When the writes reach a sector again, it is erased and its
+ * records (the oldest) are dropped, whether they were uploaded or not, so
+ * every sector is erased once per round of the ring. A record is marked
+ * uploaded by clearing its sent word, which flash allows without an erase;
+ * the mark of the newest uploaded record covers all the records before
+ * it. The ring needs two sectors or more, with a single one an erase
+ * drops all the records.
+ *
+ *************************************************************************/
+
+#define SKY_SCANLOG_MAGIC       0x4c4e4353  // "SCNL"
+#define SKY_SCANLOG_MAX_APS     8           // strongest access points kept of a scan
+
+// record of a slot (little endian, as the device)
+typedef struct {
+    uint32_t magic;         // SKY_SCANLOG_MAGIC
+    uint32_t seq;           // sequence number, from 1 up
+    uint32_t time;          // ms of the caller's clock at the scan
+    uint8_t ap_count;
+    uint8_t reserved[3];
+    struct ap_t aps[SKY_SCANLOG_MAX_APS]; // strongest first
+    uint32_t crc;           // sky_crc32() of the record before it
+    uint32_t sent;          // 0xffffffff, cleared to 0 when the record (and all before it) is uploaded
+} sky_scan_record_t;
+
+// bytes of a slot, records do not straddle sectors
+#define SKY_SCANLOG_SLOT_SIZE   sizeof(sky_scan_record_t)
+
+// flash area of the log, whose bytes are 0xff after an erase and whose bits can be cleared by a
+// write; offsets (from the start of the area) and lengths of the callbacks are multiples of 4, and
+// the buffers 4 byte aligned
+typedef struct {
+    uint32_t size;          // bytes of the area, a multiple of sector_size
+    uint32_t sector_size;   // bytes of an erase sector
+    bool (* read)(uint32_t offset, void *buff, uint32_t len, void *ctx);
+    bool (* write)(uint32_t offset, const void *buff, uint32_t len, void *ctx);
+    bool (* erase)(uint32_t offset, void *ctx);  // the sector at offset
+    void *ctx;              // caller context of the callbacks
+    // set by sky_scanlog_load()
+    uint32_t next;          // offset of the slot the next append tries first
+    uint32_t seq;           // sequence number of the newest record, 0 for none
+    uint32_t tail;          // offset of the oldest record not uploaded
+    uint32_t tail_seq;      // its sequence number, seq + 1 when all are uploaded
+    uint32_t dropped;       // # of records erased before their upload
+} sky_scanlog_t;
+
+// position of sky_scanlog_read()
+typedef struct {
+    uint32_t offset;        // of the slot read next
+    uint32_t last;          // of the last record read
+    uint32_t seq;           // sequence number of the last record read
+} sky_scanlog_cursor_t;
+
+// finds the newest record and the oldest one not uploaded of the log
+// returns false when the area could not be read
+bool sky_scanlog_load(sky_scanlog_t *log);
+
+// adds the access point to the record, which keeps the SKY_SCANLOG_MAX_APS strongest, strongest first
+void sky_scan_record_add_ap(sky_scan_record_t *record, const struct ap_t *ap);
+
+// appends the record, whose time and access points the caller set, as the newest one; its
+// sequence number is set. sky_scanlog_load() has to be called before
+// returns false when it could not be written
+bool sky_scanlog_append(sky_scanlog_t *log, sky_scan_record_t *record);
+
+// returns the # of records not uploaded
+uint32_t sky_scanlog_pending(const sky_scanlog_t *log);
+
+// moves the cursor to the oldest record not uploaded
+void sky_scanlog_rewind(const sky_scanlog_t *log, sky_scanlog_cursor_t *cursor);
+
+// reads the record at the cursor, oldest first, and moves the cursor past it
+// returns false when there is none left
+bool sky_scanlog_read(sky_scanlog_t *log, sky_scanlog_cursor_t *cursor, sky_scan_record_t *record);
+
+// marks the records up to the last one read with the cursor uploaded
+// returns false when the mark could not be written (they are uploaded again after a reset)
+bool sky_scanlog_ack(sky_scanlog_t *log, const sky_scanlog_cursor_t *cursor);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,173 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+#include <string.h>
+#include "sky_sched.h"
+#include "sky_mem.h"
+
+#define SLOT_OF(t)  (((t) / SKY_SCHED_TICK) & (SKY_SCHED_SLOTS - 1))
+
+// true if time a is before time b, allowing for the wrap around
+#define BEFORE(a, b)    ((int32_t)((a) - (b)) < 0)
+
+void sky_sched_init(sky_sched_t *sched, uint32_t now) {
+    memset(sched, 0, sizeof(*sched));
+    sched->time = now - now % SKY_SCHED_TICK;
+}
+
+void sky_task_init(sky_task_t *task, const char *name, sky_task_fn run, void *ctx,
+        uint8_t priority, uint32_t period, uint32_t deadline) {
+    memset(task, 0, sizeof(*task));
+    task->name = name;
+    task->run = run;
+    task->ctx = ctx;
+    task->priority = (priority < SKY_SCHED_PRIORITIES) ? priority : SKY_SCHED_PRIORITIES - 1;
+    task->period = period;
+    task->deadline = deadline;
+}
+
+// unlink the task from the list at head; returns false if it is not in the list
+static bool sched_unlink(sky_task_t **head, sky_task_t *task, sky_task_t **tail) {
+    sky_task_t *prev = NULL, *t;
+    for (t = *head; t != NULL; prev = t, t = t->next) {
+        if (t != task)
+            continue;
+        if (prev == NULL)
+            *head = t->next;
+        else
+            prev->next = t->next;
+        if (tail != NULL && *tail == t)
+            *tail = prev;
+        t->next = NULL;
+        return true;
+    }
+    return false;
+}
+
+static void sched_ready(sky_sched_t *sched, sky_task_t *task) {
+    uint8_t p = task->priority;
+    task->state = SKY_TASK_READY;
+    task->next = NULL;
+    if (sched->ready_tail[p] == NULL)
+        sched->ready[p] = task;
+    else
+        sched->ready_tail[p]->next = task;
+    sched->ready_tail[p] = task;
+}
+
+void sky_sched_cancel(sky_sched_t *sched, sky_task_t *task) {
+    if (task->state == SKY_TASK_WAITING) {
+        // a task due before the wheel's current tick waits in the slot of that tick
+        uint32_t slot = BEFORE(task->due, sched->time) ? SLOT_OF(sched->time) : SLOT_OF(task->due);
+        if (!sched_unlink(&sched->slots[slot], task, NULL)) {
+            uint32_t i;
+            for (i = 0; i < SKY_SCHED_SLOTS && !sched_unlink(&sched->slots[i], task, NULL); i++)
+                ;
+        }
+    } else if (task->state == SKY_TASK_READY) {
+        sched_unlink(&sched->ready[task->priority], task, &sched->ready_tail[task->priority]);
+    }
+    task->state = SKY_TASK_IDLE;
+}
+
+void sky_sched_add(sky_sched_t *sched, sky_task_t *task, uint32_t due) {
+    if (task->state == SKY_TASK_WAITING || task->state == SKY_TASK_READY)
+        sky_sched_cancel(sched, task);
+    task->due = due;
+    // a task due already goes into the slot of the current tick, which is checked again next time
+    uint32_t slot = BEFORE(due, sched->time) ? SLOT_OF(sched->time) : SLOT_OF(due);
+    task->next = sched->slots[slot];
+    sched->slots[slot] = task;
+    task->state = SKY_TASK_WAITING;
+}
+
+// move the tasks of the slot which are due by now to their ready queues
+static void sched_expire_slot(sky_sched_t *sched, uint32_t slot, uint32_t now) {
+    sky_task_t **p = &sched->slots[slot];
+    while (*p != NULL) {
+        sky_task_t *t = *p;
+        if (BEFORE(now, t->due)) {
+            p = &t->next; // due in a later turn of the wheel
+            continue;
+        }
+        *p = t->next;
+        sched_ready(sched, t);
+    }
+}
+
+// turn the wheel up to the tick of now
+static void sched_advance(sky_sched_t *sched, uint32_t now) {
+    uint32_t steps = 0;
+    for (;;) {
+        sched_expire_slot(sched, SLOT_OF(sched->time), now);
+        if (now - sched->time < SKY_SCHED_TICK)
+            break; // the current tick, its slot is checked again next time
+        sched->time += SKY_SCHED_TICK;
+        if (++steps == SKY_SCHED_SLOTS) {
+            // every slot was checked for now already
+            sched->time = now - now % SKY_SCHED_TICK;
+            sched_expire_slot(sched, SLOT_OF(sched->time), now);
+            break;
+        }
+    }
+}
+
+bool sky_sched_run(sky_sched_t *sched, uint32_t now) {
+    uint8_t p;
+    sched_advance(sched, now);
+    for (p = 0; p < SKY_SCHED_PRIORITIES && sched->ready[p] == NULL; p++)
+        ;
+    if (p == SKY_SCHED_PRIORITIES)
+        return false;
+
+    sky_task_t *task = sched->ready[p];
+    sched->ready[p] = task->next;
+    if (sched->ready[p] == NULL)
+        sched->ready_tail[p] = NULL;
+    task->next = NULL;
+
+    uint32_t late = now - task->due;
+    if (late > task->max_late)
+        task->max_late = late;
+    if (task->deadline > 0 && late > task->deadline)
+        task->misses++;
+    task->runs++;
+    task->state = SKY_TASK_RUNNING;
+#if SKY_METRICS
+    sky_stack_probe_t probe = {task->name, 0, task->stack_max};
+    SKY_STACK_PROBE(probe, task->run(task, now));
+    task->stack_max = probe.max_used;
+#else
+    task->run(task, now);
+#endif
+
+    if (task->state == SKY_TASK_RUNNING) {
+        task->state = SKY_TASK_IDLE;
+        if (task->period > 0) {
+            // the next period; a task which fell behind by more than a period skips the runs it
+            // missed rather than catching up on them
+            uint32_t due = task->due + task->period;
+            sky_sched_add(sched, task, BEFORE(due, now) ? now + task->period : due);
+        }
+    }
+    return true;
+}
+
+uint32_t sky_sched_idle(sky_sched_t *sched, uint32_t now, uint32_t max_idle) {
+    uint32_t i, idle = max_idle;
+    for (i = 0; i < SKY_SCHED_PRIORITIES; i++) {
+        if (sched->ready[i] != NULL)
+            return 0;
+    }
+    for (i = 0; i < SKY_SCHED_SLOTS; i++) {
+        sky_task_t *t;
+        for (t = sched->slots[i]; t != NULL; t = t->next) {
+            if (!BEFORE(now, t->due))
+                return 0;
+            if (t->due - now < idle)
+                idle = t->due - now;
+        }
+    }
+    return idle;
+}
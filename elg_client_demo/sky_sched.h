@@ -0,0 +1,100 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_SCHED_H
+#define SKY_SCHED_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include "sky_metrics.h"
+
+/*************************************************************************
+ *
+ * Cooperative task scheduler
+ *
+ * Tasks wait on a hashed timer wheel until they are due, then queue by
+ * priority and run one at a time from sky_sched_run(), e.g. once per loop().
+ * A task runs to completion and must not block; a periodic task is
+ * rescheduled one period after it was due, and any task may reschedule
+ * itself from its run function. Times are in ms (e.g. millis()) and may
+ * wrap around.
+ *
+ *************************************************************************/
+
+#define SKY_SCHED_TICK          4   // ms per slot of the timer wheel, a power of 2
+#define SKY_SCHED_SLOTS         64  // slots of the timer wheel, a power of 2
+#define SKY_SCHED_PRIORITIES    4   // 0 is the highest
+
+enum SKY_TASK_STATE {
+    SKY_TASK_IDLE = 0,  // not scheduled
+    SKY_TASK_WAITING,   // on the timer wheel
+    SKY_TASK_READY,     // due, queued to run
+    SKY_TASK_RUNNING,
+};
+
+typedef struct sky_task_s sky_task_t;
+
+// run function of a task
+// @param task - the task, which may reschedule itself (sky_sched_add()) or change its period
+// @param now - current time in ms
+typedef void (* sky_task_fn)(sky_task_t *task, uint32_t now);
+
+struct sky_task_s {
+    const char *name;
+    sky_task_fn run;
+    void *ctx;                 // caller context
+    uint8_t priority;          // 0 (highest) to SKY_SCHED_PRIORITIES - 1
+    uint32_t period;           // ms between runs, 0 for a task which runs once per sky_sched_add()
+    uint32_t deadline;         // ms after it is due by which the task should run, 0 for none
+    enum SKY_TASK_STATE state;
+    uint32_t due;              // time (ms) the task is due
+    sky_task_t *next;          // in its wheel slot or ready queue
+    // statistics
+    uint32_t runs;
+    uint32_t misses;           // runs later than the deadline
+    uint32_t max_late;         // ms, the longest a run was late
+#if SKY_METRICS
+    uint32_t stack_max;        // bytes of stack the most a run used, see sky_mem.h
+#endif
+};
+
+typedef struct {
+    sky_task_t *slots[SKY_SCHED_SLOTS];
+    uint32_t time;             // start of the current tick of the wheel (ms)
+    sky_task_t *ready[SKY_SCHED_PRIORITIES];
+    sky_task_t *ready_tail[SKY_SCHED_PRIORITIES];
+} sky_sched_t;
+
+// initialize an empty scheduler at time now
+void sky_sched_init(sky_sched_t *sched, uint32_t now);
+
+// set up a task, idle
+void sky_task_init(sky_task_t *task, const char *name, sky_task_fn run, void *ctx,
+        uint8_t priority, uint32_t period, uint32_t deadline);
+
+// schedule the task to be due at time due (ms), or reschedule it if it is scheduled already
+void sky_sched_add(sky_sched_t *sched, sky_task_t *task, uint32_t due);
+
+// unschedule the task (a running task is not rescheduled when it returns)
+void sky_sched_cancel(sky_sched_t *sched, sky_task_t *task);
+
+// moves the tasks which are due by now to their ready queues and runs the first one of the
+// highest priority
+// @return true if a task ran, false if none is due
+bool sky_sched_run(sky_sched_t *sched, uint32_t now);
+
+// @return the time in ms until the next task is due (0 if one is ready), at most max_idle;
+//         the caller may sleep that long
+uint32_t sky_sched_idle(sky_sched_t *sched, uint32_t now, uint32_t max_idle);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
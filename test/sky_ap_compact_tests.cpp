@@ -0,0 +1,180 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#include <gtest/gtest.h>
+#include <string.h>
+#include "sky_protocol.h"
+#include "sky_crypt.h"
+
+// access points in compact form (DATA_TYPE_AP_COMPACT): what the server decodes from requests of
+// either protocol version, when the encoders choose it, and the in-place encoding of
+// sky_encode_req_aps_begin() against the encoding of a separate access point array
+
+class sky_ap_compact_tests : public ::testing::Test {
+ protected:
+  sky_ap_compact_tests() : _ap_count(0) {
+    memset(_buff, 0, sizeof(_buff));
+    memset(_copy, 0, sizeof(_copy));
+    memset(&_rq, 0, sizeof(_rq));
+    memset(&_prefix, 0, sizeof(_prefix));
+    static uint8_t mac[MAC_SIZE] = {1, 2, 3, 4, 5, 6};
+    static uint8_t ip[IPV4_SIZE] = {10, 0, 0, 1};
+    _rq.payload_ext.payload.type = LOCATION_RQ;
+    _rq.mac = mac;
+    _rq.mac_count = 1;
+    _rq.ip_addr = ip;
+    _rq.ip_count = 1;
+    _rq.ip_type = DATA_TYPE_IPV4;
+    _rq.ap_type = DATA_TYPE_AP_COMPACT;
+  }
+
+  void add(uint8_t oui0, uint8_t oui1, uint8_t oui2, uint8_t id, int8_t rssi, uint8_t flag) {
+    struct ap_t *a = &_aps[_ap_count++];
+    uint8_t mac[MAC_SIZE] = {oui0, oui1, oui2, 0x30, 0x40, id};
+    memcpy(a->MAC, mac, sizeof(a->MAC));
+    a->rssi = rssi;
+    a->flag = flag;
+  }
+
+  // access points of two vendors, and of OUIs which occur once (among them locally administered ones)
+  void addMixed() {
+    for (uint8_t i = 0; i < 6; i++)
+      add(0x00, 0x11, 0x22, i, -40 - 2 * i, BAND_2_4G << 1);
+    for (uint8_t i = 0; i < 3; i++)
+      add(0xf0, 0x9f, 0xc2, i, -71 - i, BAND_5G << 1);
+    add(0x02, 0xab, 0xcd, 0, -90, BAND_UNKNOWN << 1);
+    add(0xde, 0xad, 0x01, 1, -127, BAND_2_4G << 1);
+    add(0x7a, 0x00, 0x00, 2, -33, (BAND_5G << 1) | 0x01); // connected
+  }
+
+  // access points whose OUIs all differ, for which the compact form is larger
+  void addDistinct(uint8_t n) {
+    for (uint8_t i = 0; i < n; i++)
+      add(0x10 + i, 0x20 + i, 0x30 + i, i, -60, BAND_2_4G << 1);
+  }
+
+  void encode(uint8_t version) {
+    _rq.header.version = version;
+    _rq.aps = _aps;
+    _rq.ap_count = _ap_count;
+    _len = sky_encode_req_bin(_buff, sizeof(_buff), &_rq);
+    ASSERT_GT(_len, 0);
+  }
+
+  // checks the checksum of the request frame (which sky_decode_req_bin() only logs for version 1),
+  // then zeroes its IV (which differs for every frame) and sets the checksum again, for comparing frames
+  static void zeroIv(uint8_t *buff, int32_t len) {
+    struct location_rq_t dq;
+    uint32_t header_len = 0;
+    sky_checksum_t cs;
+    memcpy(&cs, buff + len - sizeof(cs), sizeof(cs));
+    ASSERT_EQ(fletcher16(buff, len - sizeof(cs)), cs);
+    ASSERT_EQ(len, sky_get_frame_len(buff, len, true, &header_len));
+    memset(buff + header_len - sizeof(dq.header.iv), 0, sizeof(dq.header.iv));
+    cs = fletcher16(buff, len - sizeof(cs));
+    memcpy(buff + len - sizeof(cs), &cs, sizeof(cs));
+  }
+
+  // the access points as the compact form keeps them: rssi in 2 dB steps, band and connected flags
+  static struct ap_t compacted(struct ap_t a) {
+    int rssi = (a.rssi < 0) ? -a.rssi : 0;
+    a.rssi = -(int8_t)(((rssi >> 1) > 63 ? 63 : (rssi >> 1)) << 1);
+    a.flag &= 0x07;
+    return a;
+  }
+
+  uint8_t _buff[SKY_PROT_BUFF_LEN];
+  uint8_t _copy[SKY_PROT_BUFF_LEN];
+  struct location_rq_t _rq;
+  sky_rq_prefix_t _prefix;
+  struct ap_t _aps[MAX_APS];
+  uint8_t _ap_count;
+  int32_t _len;
+};
+
+#define TEST_(name) TEST_F(sky_ap_compact_tests, name)
+
+TEST_(MixedAndUnknownOuis_RoundTrip) {
+  addMixed();
+  const uint8_t versions[] = {SKY_PROTOCOL_VERSION, SKY_PROTOCOL_VERSION_2};
+  for (size_t v = 0; v < sizeof(versions); v++) {
+    encode(versions[v]);
+    struct location_rq_t dq;
+    memset(&dq, 0, sizeof(dq));
+    ASSERT_EQ(0, sky_decode_req_bin(_buff, _len, &dq));
+    ASSERT_EQ(DATA_TYPE_AP_COMPACT, dq.ap_type);
+    EXPECT_EQ(NULL, dq.aps);
+    EXPECT_EQ(_ap_count, dq.ap_count);
+
+    struct ap_t aps[MAX_APS];
+    ASSERT_EQ(_ap_count, sky_decode_ap_compact(dq.ap_compact, dq.ap_compact_len, dq.ap_count, aps, MAX_APS));
+    for (uint8_t i = 0; i < _ap_count; i++) {
+      struct ap_t expected = compacted(_aps[i]);
+      EXPECT_EQ(0, memcmp(expected.MAC, aps[i].MAC, MAC_SIZE)) << "ap " << (int)i;
+      EXPECT_EQ(expected.rssi, aps[i].rssi) << "ap " << (int)i;
+      EXPECT_EQ(expected.flag, aps[i].flag) << "ap " << (int)i;
+    }
+  }
+}
+
+TEST_(DistinctOuis_SentInFull) {
+  addDistinct(5);
+  encode(SKY_PROTOCOL_VERSION);
+  struct location_rq_t dq;
+  memset(&dq, 0, sizeof(dq));
+  ASSERT_EQ(0, sky_decode_req_bin(_buff, _len, &dq));
+  EXPECT_NE(DATA_TYPE_AP_COMPACT, dq.ap_type);
+  ASSERT_EQ(_ap_count, dq.ap_count);
+  ASSERT_TRUE(dq.aps != NULL);
+  EXPECT_EQ(0, memcmp(_aps, dq.aps, _ap_count * sizeof(struct ap_t)));
+}
+
+TEST_(SharedOuis_CompactOnlyWhenSmaller) {
+  addMixed();
+  encode(SKY_PROTOCOL_VERSION_2);
+  struct location_rq_t dq;
+  memset(&dq, 0, sizeof(dq));
+  ASSERT_EQ(0, sky_decode_req_bin(_buff, _len, &dq));
+  ASSERT_EQ(DATA_TYPE_AP_COMPACT, dq.ap_type);
+  EXPECT_LT(dq.ap_compact_len, _ap_count * sizeof(struct ap_t));
+  int32_t compact_len = _len;
+
+  _rq.ap_type = DATA_TYPE_AP;
+  encode(SKY_PROTOCOL_VERSION_2);
+  EXPECT_LT(compact_len, _len);
+}
+
+TEST_(InPlace_EqualsCopy) {
+  const uint8_t versions[] = {SKY_PROTOCOL_VERSION, SKY_PROTOCOL_VERSION_2};
+  for (int distinct = 0; distinct < 2; distinct++) {
+    _ap_count = 0;
+    if (distinct)
+      addDistinct(MAX_APS);
+    else
+      addMixed();
+    for (size_t v = 0; v < sizeof(versions); v++) {
+      SCOPED_TRACE(::testing::Message() << "version " << (int)versions[v] << ", distinct " << distinct);
+      encode(versions[v]);
+      memcpy(_copy, _buff, _len);
+      int32_t copy_len = _len;
+
+      // the access points go into the request buffer, past what the encoding writes before reading them
+      memset(_buff, 0xa5, sizeof(_buff));
+      sky_rq_prefix_invalidate(&_prefix);
+      _rq.aps = NULL;
+      _rq.ap_count = 0;
+      struct ap_t *aps = sky_encode_req_aps_begin(_buff, sizeof(_buff), &_rq, &_prefix);
+      ASSERT_TRUE(aps != NULL);
+      ASSERT_GT((uint8_t *)aps, _buff);
+      ASSERT_LE((uint8_t *)(aps + MAX_APS), _buff + sizeof(_buff));
+      memcpy(aps, _aps, _ap_count * sizeof(struct ap_t));
+      int32_t len = sky_encode_req_aps_end(_buff, sizeof(_buff), &_rq, &_prefix, _ap_count);
+      ASSERT_EQ(copy_len, len);
+      zeroIv(_copy, len);
+      zeroIv(_buff, len);
+      EXPECT_EQ(0, memcmp(_copy, _buff, len));
+    }
+  }
+}
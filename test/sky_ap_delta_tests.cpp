@@ -0,0 +1,187 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#include <gtest/gtest.h>
+#include <string.h>
+#include <algorithm>
+#include "sky_protocol.h"
+
+// access point deltas (sky_encode_ap_delta(), sky_decode_ap_delta()) against the full DATA_TYPE_AP
+// encoding of the same scan
+
+static const uint32_t BASELINE_ID = 0x12345678;
+
+class sky_ap_delta_tests : public ::testing::Test {
+ protected:
+  sky_ap_delta_tests() : _baseline_count(0), _ap_count(0) {
+    memset(_buff, 0, sizeof(_buff));
+  }
+
+  static struct ap_t ap(uint8_t id, int8_t rssi) {
+    struct ap_t a;
+    uint8_t mac[MAC_SIZE] = {0x00, 0x11, 0x22, 0x33, 0x44, id};
+    memcpy(a.MAC, mac, sizeof(a.MAC));
+    a.rssi = rssi;
+    a.flag = 1 << 1; // BAND_2_4G
+    return a;
+  }
+
+  // the access points of the current scan as the server decodes them from a full request
+  int fullDecode(struct ap_t *aps) {
+    struct location_rq_t rq, dq;
+    uint8_t mac[MAC_SIZE] = {1, 2, 3, 4, 5, 6};
+    uint8_t ip[IPV4_SIZE] = {10, 0, 0, 1};
+    memset(&rq, 0, sizeof(rq));
+    rq.header.version = SKY_PROTOCOL_VERSION;
+    rq.payload_ext.payload.type = LOCATION_RQ;
+    rq.mac = mac;
+    rq.mac_count = 1;
+    rq.ip_addr = ip;
+    rq.ip_count = 1;
+    rq.ip_type = DATA_TYPE_IPV4;
+    rq.aps = _aps;
+    rq.ap_count = _ap_count;
+    rq.ap_type = DATA_TYPE_AP;
+    int32_t len = sky_encode_req_bin(_buff, sizeof(_buff), &rq);
+    EXPECT_GT(len, 0);
+    memset(&dq, 0, sizeof(dq));
+    EXPECT_EQ(0, sky_decode_req_bin(_buff, len, &dq));
+    memcpy(aps, dq.aps, dq.ap_count * sizeof(struct ap_t));
+    return dq.ap_count;
+  }
+
+  // the access points of the current scan as the server decodes them from its delta
+  int deltaDecode(struct ap_t *aps) {
+    uint8_t delta[SKY_PROT_BUFF_LEN];
+    int32_t len = sky_encode_ap_delta(delta, sizeof(delta), BASELINE_ID, _baseline, _baseline_count,
+        _aps, _ap_count);
+    EXPECT_GT(len, 0);
+    EXPECT_EQ(BASELINE_ID, sky_get_ap_delta_baseline_id(delta, len));
+    return sky_decode_ap_delta(delta, len, BASELINE_ID, _baseline, _baseline_count, aps, MAX_APS);
+  }
+
+  static bool byMac(const struct ap_t &a, const struct ap_t &b) {
+    return memcmp(a.MAC, b.MAC, MAC_SIZE) < 0;
+  }
+
+  // delta header followed by its removed and changed indexes
+  uint32_t delta(uint8_t *buff, uint32_t baseline_id, const uint8_t *removed, uint8_t removed_count,
+      const struct ap_rssi_delta_t *changed, uint8_t changed_count) {
+    struct ap_delta_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.baseline_id = baseline_id;
+    hdr.removed_count = removed_count;
+    hdr.changed_count = changed_count;
+    memcpy(buff, &hdr, sizeof(hdr));
+    memcpy(buff + sizeof(hdr), removed, removed_count);
+    memcpy(buff + sizeof(hdr) + removed_count, changed, changed_count * sizeof(*changed));
+    return sizeof(hdr) + removed_count + changed_count * sizeof(*changed);
+  }
+
+  uint8_t _buff[SKY_PROT_BUFF_LEN];
+  struct ap_t _baseline[MAX_APS];
+  uint8_t _baseline_count;
+  struct ap_t _aps[MAX_APS];
+  uint8_t _ap_count;
+};
+
+#define TEST_(name) TEST_F(sky_ap_delta_tests, name)
+
+TEST_(RemovedChangedAndAdded_EqualsFullEncoding) {
+  _baseline[0] = ap(1, -40);
+  _baseline[1] = ap(2, -50);
+  _baseline[2] = ap(3, -60);
+  _baseline[3] = ap(4, -70);
+  _baseline_count = 4;
+  _aps[0] = ap(1, -40); // unchanged
+  _aps[1] = ap(3, -66); // rssi changed, ap 2 removed
+  _aps[2] = ap(4, -70); // unchanged
+  _aps[3] = ap(5, -80); // added
+  _ap_count = 4;
+
+  struct ap_t full[MAX_APS], decoded[MAX_APS];
+  ASSERT_EQ(4, fullDecode(full));
+  ASSERT_EQ(4, deltaDecode(decoded));
+  EXPECT_EQ(0, memcmp(full, decoded, 4 * sizeof(struct ap_t)));
+}
+
+TEST_(Unchanged_EqualsFullEncoding) {
+  for (uint8_t i = 0; i < 10; i++)
+    _aps[i] = _baseline[i] = ap(i, -40 - i);
+  _baseline_count = _ap_count = 10;
+
+  struct ap_t full[MAX_APS], decoded[MAX_APS];
+  ASSERT_EQ(10, fullDecode(full));
+  ASSERT_EQ(10, deltaDecode(decoded));
+  EXPECT_EQ(0, memcmp(full, decoded, 10 * sizeof(struct ap_t)));
+}
+
+TEST_(Reordered_SameAccessPointsAsFullEncoding) {
+  _baseline[0] = ap(1, -40);
+  _baseline[1] = ap(2, -50);
+  _baseline[2] = ap(3, -128);
+  _baseline_count = 3;
+  _aps[0] = ap(6, -30); // added
+  _aps[1] = ap(3, 0);   // change beyond int8_t: removed and added
+  _aps[2] = ap(2, -45);
+  _ap_count = 3;        // ap 1 removed
+
+  struct ap_t full[MAX_APS], decoded[MAX_APS];
+  ASSERT_EQ(3, fullDecode(full));
+  ASSERT_EQ(3, deltaDecode(decoded));
+  std::sort(full, full + 3, byMac);
+  std::sort(decoded, decoded + 3, byMac);
+  EXPECT_EQ(0, memcmp(full, decoded, 3 * sizeof(struct ap_t)));
+}
+
+TEST_(OtherBaseline_Rejected) {
+  _baseline[0] = ap(1, -40);
+  _baseline_count = 1;
+  uint8_t removed[] = {0};
+  uint32_t len = delta(_buff, BASELINE_ID, removed, 1, NULL, 0);
+  struct ap_t aps[MAX_APS];
+  EXPECT_EQ(0, sky_decode_ap_delta(_buff, len, BASELINE_ID, _baseline, _baseline_count, aps, MAX_APS));
+  EXPECT_EQ(-1, sky_decode_ap_delta(_buff, len, BASELINE_ID + 1, _baseline, _baseline_count, aps, MAX_APS));
+}
+
+TEST_(RemovedIndexOutOfRange_Rejected) {
+  _baseline[0] = ap(1, -40);
+  _baseline[1] = ap(2, -50);
+  _baseline_count = 2;
+  uint8_t removed[] = {2};
+  uint32_t len = delta(_buff, BASELINE_ID, removed, 1, NULL, 0);
+  struct ap_t aps[MAX_APS];
+  EXPECT_EQ(-1, sky_decode_ap_delta(_buff, len, BASELINE_ID, _baseline, _baseline_count, aps, MAX_APS));
+}
+
+TEST_(ChangedIndexOutOfRange_Rejected) {
+  _baseline[0] = ap(1, -40);
+  _baseline[1] = ap(2, -50);
+  _baseline_count = 2;
+  struct ap_rssi_delta_t changed[] = {{2, 5}};
+  uint32_t len = delta(_buff, BASELINE_ID, NULL, 0, changed, 1);
+  struct ap_t aps[MAX_APS];
+  EXPECT_EQ(-1, sky_decode_ap_delta(_buff, len, BASELINE_ID, _baseline, _baseline_count, aps, MAX_APS));
+}
+
+TEST_(ChangedIndexRemoved_Rejected) {
+  _baseline[0] = ap(1, -40);
+  _baseline[1] = ap(2, -50);
+  _baseline_count = 2;
+  uint8_t removed[] = {1};
+  struct ap_rssi_delta_t changed[] = {{1, 5}};
+  uint32_t len = delta(_buff, BASELINE_ID, removed, 1, changed, 1);
+  struct ap_t aps[MAX_APS];
+  EXPECT_EQ(-1, sky_decode_ap_delta(_buff, len, BASELINE_ID, _baseline, _baseline_count, aps, MAX_APS));
+}
+
+TEST_(Truncated_Rejected) {
+  _baseline[0] = ap(1, -40);
+  _baseline_count = 1;
+  uint8_t removed[] = {0};
+  uint32_t len = delta(_buff, BASELINE_ID, removed, 1, NULL, 0);
+  struct ap_t aps[MAX_APS];
+  EXPECT_EQ(-1, sky_decode_ap_delta(_buff, len - 1, BASELINE_ID, _baseline, _baseline_count, aps, MAX_APS));
+}
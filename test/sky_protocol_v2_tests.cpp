@@ -0,0 +1,121 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#include <gtest/gtest.h>
+#include <string.h>
+#include "sky_protocol.h"
+#include "sky_crypt.h"
+
+// protocol version 2 frames: counts above 255 and frame lengths
+
+class sky_protocol_v2_tests : public ::testing::Test {
+ protected:
+  sky_protocol_v2_tests() {
+    memset(_buff, 0, sizeof(_buff));
+    memset(&_rsp, 0, sizeof(_rsp));
+    memset(_address, 'a', sizeof(_address));
+    _rsp.payload_ext.payload.type = LOCATION_RQ_ADDR_SUCCESS;
+    _rsp.location.lat = 42.36;
+    _rsp.location.lon = -71.06;
+    _rsp.location_ext.address = _address;
+  }
+
+  uint8_t _buff[SKY_PROT_BUFF_LEN];
+  struct location_rsp_t _rsp;
+  char _address[300];
+};
+
+#define TEST_(name) TEST_F(sky_protocol_v2_tests, name)
+
+TEST_(AddressOver255Bytes_RoundTrip) {
+  _rsp.header.version = SKY_PROTOCOL_VERSION_2;
+  _rsp.request_id = 9;
+  _rsp.location_ext.address_len = sizeof(_address);
+  int32_t len = sky_encode_resp_bin(_buff, sizeof(_buff), &_rsp);
+  ASSERT_GT(len, 0);
+
+  struct location_rsp_t out;
+  memset(&out, 0, sizeof(out));
+  ASSERT_EQ(0, sky_decode_resp_bin(_buff, len, &out));
+  EXPECT_EQ(9U, out.request_id);
+  EXPECT_EQ(sizeof(_address), out.location_ext.address_len);
+  EXPECT_EQ(0, memcmp(_address, out.location_ext.address, sizeof(_address)));
+  EXPECT_EQ(_rsp.location.lat, out.location.lat);
+}
+
+TEST_(AddressOver255Bytes_RejectedByVersion1) {
+  _rsp.header.version = SKY_PROTOCOL_VERSION;
+  _rsp.location_ext.address_len = sizeof(_address);
+  EXPECT_EQ(-1, sky_encode_resp_bin(_buff, sizeof(_buff), &_rsp));
+  _rsp.location_ext.address_len = 255;
+  EXPECT_GT(sky_encode_resp_bin(_buff, sizeof(_buff), &_rsp), 0);
+}
+
+TEST_(FrameLen_BothVersions) {
+  uint32_t header_len = 0;
+  _rsp.location_ext.address_len = 20;
+  _rsp.header.version = SKY_PROTOCOL_VERSION;
+  int32_t len = sky_encode_resp_bin(_buff, sizeof(_buff), &_rsp);
+  EXPECT_EQ(len, sky_get_frame_len(_buff, len, false, &header_len));
+  EXPECT_EQ(sizeof(sky_rsp_header_t), header_len);
+  EXPECT_EQ(0, sky_get_frame_len(_buff, header_len - 1, false, &header_len));
+
+  _rsp.header.version = SKY_PROTOCOL_VERSION_2;
+  len = sky_encode_resp_bin(_buff, sizeof(_buff), &_rsp);
+  EXPECT_EQ(len, sky_get_frame_len(_buff, len, false, &header_len));
+  EXPECT_EQ(0, sky_get_frame_len(_buff, 2, false, &header_len));
+}
+
+TEST_(FrameLen_UnknownVersion_Invalid) {
+  uint32_t header_len = 0;
+  const uint8_t versions[] = {0, 3, 0x7f, 0xff};
+  for (size_t i = 0; i < sizeof(versions); i++) {
+    memset(_buff, 0, sizeof(_buff));
+    _buff[0] = versions[i];
+    EXPECT_EQ(-1, sky_get_frame_len(_buff, 1, false, &header_len));
+    EXPECT_EQ(-1, sky_get_frame_len(_buff, sizeof(_buff), true, &header_len));
+  }
+}
+
+TEST_(ScanIdMalformed_Rejected) {
+  struct location_rq_t rq, dq;
+  uint8_t mac[MAC_SIZE] = {1, 2, 3, 4, 5, 6};
+  memset(&rq, 0, sizeof(rq));
+  rq.header.version = SKY_PROTOCOL_VERSION_2;
+  rq.payload_ext.payload.type = LOCATION_RQ;
+  rq.mac = mac;
+  rq.mac_count = 1;
+  rq.scan_id = 7;
+  int32_t len = sky_encode_req_bin(_buff, sizeof(_buff), &rq);
+  ASSERT_GT(len, 0);
+  memset(&dq, 0, sizeof(dq));
+  ASSERT_EQ(0, sky_decode_req_bin(_buff, len, &dq));
+  EXPECT_EQ(7U, dq.scan_id);
+
+  // the scan id entry follows the MAC entry, then the padding up to the checksum
+  uint32_t header_len = 0;
+  ASSERT_EQ(len, sky_get_frame_len(_buff, len, true, &header_len));
+  uint8_t *entry = _buff + header_len + sizeof(sky_payload_t) + 2 + MAC_SIZE;
+  uint8_t *end = _buff + len - sizeof(sky_checksum_t);
+  ASSERT_EQ(DATA_TYPE_SCAN_ID, entry[0]);
+  ASSERT_EQ(1, entry[1]);
+
+  entry[1] = 2;
+  sky_checksum_t cs = fletcher16(_buff, end - _buff);
+  memcpy(end, &cs, sizeof(cs));
+  EXPECT_EQ(-1, sky_decode_req_bin(_buff, len, &dq));
+
+  // an IPv4 entry takes up the payload up to less than a scan id after the scan id entry
+  uint32_t ips = (end - entry - 4) / IPV4_SIZE;
+  entry[0] = DATA_TYPE_IPV4;
+  entry[1] = ips;
+  uint8_t *scan_id = entry + 2 + ips * IPV4_SIZE;
+  scan_id[0] = DATA_TYPE_SCAN_ID;
+  scan_id[1] = 1;
+  ASSERT_LT(end - (scan_id + 2), (int)sizeof(rq.scan_id));
+  cs = fletcher16(_buff, end - _buff);
+  memcpy(end, &cs, sizeof(cs));
+  EXPECT_EQ(-1, sky_decode_req_bin(_buff, len, &dq));
+}
@@ -0,0 +1,230 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ ************************************************/
+
+#include <gtest/gtest.h>
+#include <string.h>
+#include "sky_protocol.h"
+#include "sky_crypt.h"
+
+// the cached request prefix (sky_encode_req_bin_cached(), with its incremental checksum) and the
+// access points written in place (sky_encode_req_aps_begin(), sky_encode_req_aps_end()) against the
+// encoding of the whole request by sky_encode_req_bin(), across cache hits and misses
+
+class sky_rq_prefix_tests : public ::testing::Test {
+ protected:
+  sky_rq_prefix_tests() : _ap_count(0) {
+    memset(_buff, 0, sizeof(_buff));
+    memset(_copy, 0, sizeof(_copy));
+    memset(&_rq, 0, sizeof(_rq));
+    memset(&_prefix, 0, sizeof(_prefix));
+    uint8_t mac[MAC_SIZE] = {1, 2, 3, 4, 5, 6};
+    uint8_t ip[IPV4_SIZE] = {10, 0, 0, 1};
+    memcpy(_mac, mac, sizeof(_mac));
+    memset(_ip, 0, sizeof(_ip));
+    memcpy(_ip, ip, sizeof(ip));
+    _rq.header.version = SKY_PROTOCOL_VERSION;
+    _rq.key.partner_id = 2;
+    _rq.payload_ext.payload.sw_version = 1;
+    _rq.payload_ext.payload.type = LOCATION_RQ;
+    _rq.mac = _mac;
+    _rq.mac_count = 1;
+    _rq.ip_addr = _ip;
+    _rq.ip_count = 1;
+    _rq.ip_type = DATA_TYPE_IPV4;
+    _rq.ap_type = DATA_TYPE_AP;
+    sky_rq_prefix_invalidate(&_prefix);
+  }
+
+  // a scan of n access points, which differs for every seed
+  void scan(uint8_t n, uint8_t seed) {
+    for (_ap_count = 0; _ap_count < n; _ap_count++) {
+      struct ap_t *a = &_aps[_ap_count];
+      uint8_t mac[MAC_SIZE] = {0x00, 0x11, 0x22, seed, 0x40, _ap_count};
+      memcpy(a->MAC, mac, sizeof(a->MAC));
+      a->rssi = -40 - (int8_t)((seed + _ap_count) % 50);
+      a->flag = 1 << 1; // BAND_2_4G
+    }
+  }
+
+  // encodes the request with sky_encode_req_bin() into _copy
+  int32_t encodeCopy() {
+    _rq.aps = _aps;
+    _rq.ap_count = _ap_count;
+    return sky_encode_req_bin(_copy, sizeof(_copy), &_rq);
+  }
+
+  // checks the checksum of the request frame (which sky_decode_req_bin() only logs for version 1),
+  // then zeroes its IV (which differs for every frame) and sets the checksum again, for comparing frames
+  static void zeroIv(uint8_t *buff, int32_t len) {
+    struct location_rq_t dq;
+    uint32_t header_len = 0;
+    sky_checksum_t cs;
+    memcpy(&cs, buff + len - sizeof(cs), sizeof(cs));
+    ASSERT_EQ(fletcher16(buff, len - sizeof(cs)), cs);
+    ASSERT_EQ(len, sky_get_frame_len(buff, len, true, &header_len));
+    memset(buff + header_len - sizeof(dq.header.iv), 0, sizeof(dq.header.iv));
+    cs = fletcher16(buff, len - sizeof(cs));
+    memcpy(buff + len - sizeof(cs), &cs, sizeof(cs));
+  }
+
+  // the request in _buff is the one sky_encode_req_bin() encodes, but for the IV
+  void expectSameAsCopy(int32_t len) {
+    int32_t copy_len = encodeCopy();
+    ASSERT_GT(len, 0);
+    ASSERT_EQ(copy_len, len);
+    zeroIv(_buff, len);
+    zeroIv(_copy, len);
+    EXPECT_EQ(0, memcmp(_copy, _buff, len));
+  }
+
+  int32_t encodeCached() {
+    _rq.aps = _aps;
+    _rq.ap_count = _ap_count;
+    return sky_encode_req_bin_cached(_buff, sizeof(_buff), &_rq, &_prefix);
+  }
+
+  // encodes the request with the access points written into _buff between sky_encode_req_aps_begin()
+  // and sky_encode_req_aps_end(), over the previous request in _buff; aps is where they went
+  int32_t encodeInPlace(struct ap_t **aps) {
+    _rq.aps = NULL;
+    _rq.ap_count = 0;
+    *aps = sky_encode_req_aps_begin(_buff, sizeof(_buff), &_rq, &_prefix);
+    if (*aps == NULL)
+      return -1;
+    memcpy(*aps, _aps, _ap_count * sizeof(struct ap_t));
+    return sky_encode_req_aps_end(_buff, sizeof(_buff), &_rq, &_prefix, _ap_count);
+  }
+
+  uint8_t _buff[SKY_PROT_BUFF_LEN];
+  uint8_t _copy[SKY_PROT_BUFF_LEN];
+  uint8_t _mac[MAC_SIZE];
+  uint8_t _ip[IPV6_SIZE];
+  struct location_rq_t _rq;
+  sky_rq_prefix_t _prefix;
+  struct ap_t _aps[MAX_APS];
+  uint8_t _ap_count;
+};
+
+#define TEST_(name) TEST_F(sky_rq_prefix_tests, name)
+
+TEST_(Cached_EqualsUncached) {
+  scan(12, 1);
+  {
+    SCOPED_TRACE("miss");
+    expectSameAsCopy(encodeCached());
+  }
+  EXPECT_TRUE(_prefix.valid);
+  {
+    SCOPED_TRACE("hit");
+    expectSameAsCopy(encodeCached());
+  }
+}
+
+TEST_(CacheHits_ScansAndHeadersChange) {
+  scan(12, 1);
+  expectSameAsCopy(encodeCached());
+  uint8_t counts[] = {3, 0, MAX_APS, 1, 12};
+  for (size_t i = 0; i < sizeof(counts); i++) {
+    SCOPED_TRACE(::testing::Message() << counts[i] << " aps");
+    scan(counts[i], (uint8_t)(i + 2));
+    expectSameAsCopy(encodeCached());
+  }
+
+  SCOPED_TRACE("header and payload");
+  _rq.key.partner_id = 77;
+  _rq.payload_ext.payload.type = LOCATION_RQ_ADDR;
+  _rq.payload_ext.payload.sw_version = 3;
+  expectSameAsCopy(encodeCached());
+}
+
+TEST_(CacheMisses_AddressChanges) {
+  scan(8, 1);
+  expectSameAsCopy(encodeCached());
+
+  SCOPED_TRACE("IPv4 address");
+  _ip[3] = 99;
+  sky_rq_prefix_invalidate(&_prefix);
+  EXPECT_FALSE(_prefix.valid);
+  expectSameAsCopy(encodeCached());
+
+  SCOPED_TRACE("IPv6 address");
+  memset(_ip, 0xfe, sizeof(_ip));
+  _rq.ip_type = DATA_TYPE_IPV6;
+  sky_rq_prefix_invalidate(&_prefix);
+  expectSameAsCopy(encodeCached());
+  expectSameAsCopy(encodeCached());
+}
+
+TEST_(Version2_EncodedInFull_CacheKept) {
+  scan(8, 1);
+  expectSameAsCopy(encodeCached());
+  sky_rq_prefix_t prefix = _prefix;
+
+  _rq.header.version = SKY_PROTOCOL_VERSION_2;
+  _rq.request_id = 5;
+  expectSameAsCopy(encodeCached());
+  EXPECT_EQ(0, memcmp(&prefix, &_prefix, sizeof(prefix)));
+
+  _rq.header.version = SKY_PROTOCOL_VERSION;
+  expectSameAsCopy(encodeCached());
+}
+
+TEST_(InPlace_EqualsUncached_AcrossHitsAndMisses) {
+  struct ap_t *aps, *first;
+  scan(12, 1);
+  {
+    SCOPED_TRACE("miss");
+    expectSameAsCopy(encodeInPlace(&first));
+  }
+  ASSERT_TRUE(_prefix.valid);
+  EXPECT_EQ(_buff + sizeof(sky_rq_header_t) + sizeof(sky_payload_t) + _prefix.len + sizeof(sky_entry_t),
+      (uint8_t *)first);
+
+  // a shorter scan after a longer one leaves the access points beyond its own in the buffer
+  uint8_t counts[] = {MAX_APS, 3, 0, 12};
+  for (size_t i = 0; i < sizeof(counts); i++) {
+    SCOPED_TRACE(::testing::Message() << "hit, " << counts[i] << " aps");
+    scan(counts[i], (uint8_t)(i + 2));
+    expectSameAsCopy(encodeInPlace(&aps));
+    EXPECT_EQ(first, aps);
+  }
+  {
+    SCOPED_TRACE("hit, header and payload");
+    _rq.key.partner_id = 77;
+    _rq.payload_ext.payload.type = LOCATION_RQ_ADDR;
+    expectSameAsCopy(encodeInPlace(&aps));
+    EXPECT_EQ(first, aps);
+  }
+  {
+    SCOPED_TRACE("miss, IPv6 address");
+    memset(_ip, 0xfe, sizeof(_ip));
+    _rq.ip_type = DATA_TYPE_IPV6;
+    sky_rq_prefix_invalidate(&_prefix);
+    expectSameAsCopy(encodeInPlace(&aps));
+    EXPECT_EQ((uint8_t *)first + IPV6_SIZE - IPV4_SIZE, (uint8_t *)aps);
+  }
+  {
+    SCOPED_TRACE("hit, IPv6 address");
+    scan(5, 9);
+    expectSameAsCopy(encodeInPlace(&aps));
+  }
+}
+
+TEST_(InPlace_Version2_CacheKept) {
+  struct ap_t *aps;
+  scan(12, 1);
+  expectSameAsCopy(encodeInPlace(&aps));
+  sky_rq_prefix_t prefix = _prefix;
+
+  // written further on in the buffer and moved to the front by sky_encode_req_aps_end()
+  _rq.header.version = SKY_PROTOCOL_VERSION_2;
+  scan(MAX_APS, 2);
+  expectSameAsCopy(encodeInPlace(&aps));
+  EXPECT_EQ(0, memcmp(&prefix, &_prefix, sizeof(prefix)));
+
+  _rq.header.version = SKY_PROTOCOL_VERSION;
+  scan(4, 3);
+  expectSameAsCopy(encodeInPlace(&aps));
+}
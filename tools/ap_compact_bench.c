@@ -0,0 +1,141 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ * Reports the size of the access point entries in a location request
+ * for DATA_TYPE_AP and DATA_TYPE_AP_COMPACT on recorded scans.
+ *
+ * build (host):
+ *   gcc -O2 -I../elg_client_demo -o ap_compact_bench ap_compact_bench.c \
+ *       ../elg_client_demo/sky_protocol.c ../elg_client_demo/sky_crypt.c \
+ *       ../elg_client_demo/mauth.c ../elg_client_demo/hmac256.c ../elg_client_demo/aes.c
+ *
+ * usage:
+ *   ap_compact_bench scans.txt
+ *
+ * scans.txt holds one access point per line as "MAC,rssi[,channel]", e.g.
+ *   b8:27:eb:01:02:03,-67,6
+ * and a blank line between scans. Lines starting with '#' are ignored.
+ ************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sky_protocol.h"
+
+// encode a request with the scan and return the payload length, or -1 when fails
+static int32_t encode(uint8_t *buff, struct ap_t *aps, uint8_t ap_count, uint8_t ap_type) {
+    static uint8_t mac[MAC_SIZE] = {0x5c, 0xcf, 0x7f, 0x01, 0x02, 0x03};
+    static uint8_t ip[IPV4_SIZE] = {192, 168, 1, 2};
+    struct location_rq_t rq;
+    memset(&rq, 0, sizeof(rq));
+    rq.key.partner_id = 2;
+    memset(rq.key.aes_key, 0x5a, sizeof(rq.key.aes_key));
+    rq.payload_ext.payload.sw_version = 1;
+    rq.payload_ext.payload.type = LOCATION_RQ_ADDR;
+    rq.mac_count = 1;
+    rq.mac = mac;
+    rq.ip_count = 1;
+    rq.ip_type = DATA_TYPE_IPV4;
+    rq.ip_addr = ip;
+    rq.ap_count = ap_count;
+    rq.aps = aps;
+    rq.ap_type = ap_type;
+    if (sky_encode_req_bin(buff, SKY_PROT_RQ_BUFF_LEN, &rq) < 0)
+        return -1;
+    return rq.header.payload_length;
+}
+
+// decode the request and check it against the scan, return false when it differs
+// entry_len returns the size of the access point entry
+static bool verify(uint8_t *buff, struct ap_t *aps, uint8_t ap_count, uint32_t *entry_len) {
+    struct location_rq_t rq;
+    struct ap_t out[MAX_APS];
+    memset(&rq, 0, sizeof(rq));
+    if (sky_decode_req_bin(buff, SKY_PROT_RQ_BUFF_LEN, &rq) < 0)
+        return false;
+    if (rq.ap_type != DATA_TYPE_AP_COMPACT) {
+        *entry_len = sizeof(sky_entry_t) + rq.ap_count * sizeof(struct ap_t);
+        return rq.ap_count == ap_count && memcmp(rq.aps, aps, ap_count * sizeof(struct ap_t)) == 0;
+    }
+    *entry_len = sizeof(sky_entry_t) + rq.ap_compact_len;
+    if (sky_decode_ap_compact(rq.ap_compact, rq.ap_compact_len, rq.ap_count, out, MAX_APS) != ap_count)
+        return false;
+    uint32_t i;
+    for (i = 0; i < ap_count; i++) {
+        if (memcmp(out[i].MAC, aps[i].MAC, MAC_SIZE) != 0 || out[i].flag != aps[i].flag
+                || out[i].rssi < aps[i].rssi || out[i].rssi >= aps[i].rssi + 2)
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s scans.txt\n", argv[0]);
+        return 1;
+    }
+    FILE *f = fopen(argv[1], "r");
+    if (f == NULL) {
+        perror("fopen");
+        return 1;
+    }
+
+    static uint8_t buff[SKY_PROT_RQ_BUFF_LEN];
+    struct ap_t aps[MAX_APS];
+    uint8_t ap_count = 0;
+    uint32_t scans = 0, total_aps = 0, failed = 0;
+    uint64_t ap_bytes = 0, compact_bytes = 0, ap_payload = 0, compact_payload = 0;
+    char line[128];
+    bool eof = false;
+
+    while (!eof) {
+        eof = fgets(line, sizeof(line), f) == NULL;
+        if (!eof && line[0] == '#')
+            continue;
+        unsigned int m[MAC_SIZE];
+        int rssi, channel = 0;
+        if (!eof && sscanf(line, "%x:%x:%x:%x:%x:%x,%d,%d", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5],
+                &rssi, &channel) >= 7) {
+            if (ap_count < MAX_APS) {
+                uint32_t i;
+                for (i = 0; i < MAC_SIZE; i++)
+                    aps[ap_count].MAC[i] = (uint8_t)m[i];
+                aps[ap_count].rssi = (int8_t)rssi;
+                aps[ap_count].flag = (channel == 0 ? BAND_UNKNOWN : channel <= 14 ? BAND_2_4G : BAND_5G) << 1;
+                ap_count++;
+            }
+            continue;
+        }
+        // end of a scan
+        if (ap_count == 0)
+            continue;
+        int32_t len_ap = encode(buff, aps, ap_count, DATA_TYPE_AP);
+        int32_t len_compact = encode(buff, aps, ap_count, DATA_TYPE_AP_COMPACT);
+        uint32_t entry_len = 0;
+        if (len_ap < 0 || len_compact < 0 || !verify(buff, aps, ap_count, &entry_len)) {
+            failed++;
+        } else {
+            scans++;
+            total_aps += ap_count;
+            ap_bytes += sizeof(sky_entry_t) + ap_count * sizeof(struct ap_t);
+            compact_bytes += entry_len;
+            ap_payload += len_ap;
+            compact_payload += len_compact;
+        }
+        ap_count = 0;
+    }
+    fclose(f);
+
+    if (scans == 0) {
+        fprintf(stderr, "no scans (%u failed)\n", failed);
+        return 1;
+    }
+    printf("scans: %u, access points: %u (%.1f per scan), failed: %u\n",
+            scans, total_aps, (double)total_aps / scans, failed);
+    printf("access point entry bytes: %llu -> %llu (%.1f%%)\n",
+            (unsigned long long)ap_bytes, (unsigned long long)compact_bytes,
+            100.0 * compact_bytes / ap_bytes);
+    printf("padded payload bytes:     %llu -> %llu (%.1f%%)\n",
+            (unsigned long long)ap_payload, (unsigned long long)compact_payload,
+            100.0 * compact_payload / ap_payload);
+    return 0;
+}
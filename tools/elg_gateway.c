@@ -0,0 +1,916 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ * Local stand-in for the ELG server, for load and latency tests of the
+ * client: answers location requests of protocol version 1 and 2 with
+ * synthetic locations around a base location, after a configurable delay.
+ * Batch requests (LOCATION_RQ_BATCH) get the location of each of their scans.
+ * The access points of requests with a scan id are kept as baselines, per
+ * partner, for the access point deltas of later requests; a delta whose
+ * baseline is not kept (any more) is answered with LOCATION_BASELINE_UNKNOWN.
+ * Version 2 requests may be pipelined; every request is answered in order on
+ * its connection with its request id. The same port takes requests over UDP,
+ * one request per datagram; the responses to recent version 2 requests are
+ * kept, so that retransmitted requests are answered again without being
+ * processed twice.
+ *
+ * Keys are looked up by partner id in a sky_keystore_t; the key file is
+ * reloaded on SIGHUP while requests are being served.
+ *
+ * Every worker thread runs its own epoll loop on its own SO_REUSEPORT TCP and
+ * UDP sockets, so the kernel spreads connections and datagrams over the
+ * workers. Requests/s and latency percentiles are printed every interval and
+ * the latency histogram on exit (SIGINT or SIGTERM). Latency is measured from
+ * the arrival of the whole request to the write of the whole response.
+ *
+ * build (host, linux):
+ *   gcc -O2 -pthread -DAES_TLS=__thread -I../elg_client_demo -o elg_gateway elg_gateway.c sky_keystore.c \
+ *       ../elg_client_demo/sky_protocol.c ../elg_client_demo/sky_crypt.c \
+ *       ../elg_client_demo/mauth.c ../elg_client_demo/hmac256.c ../elg_client_demo/aes.c -lm
+ *
+ * usage:
+ *   elg_gateway (-k partner_id:aes_key_hex | -f key_file) [-p port] [-l lat,lon] [-r radius_m]
+ *               [-d delay_ms[,jitter_ms]] [-t threads] [-s stats_interval_s]
+ ************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "sky_crypt.h"
+#include "sky_protocol.h"
+#include "sky_keystore.h"
+
+#define MAX_CONNS       4096 // per worker
+#define MAX_EVENTS      64
+#define MAX_PENDING     64   // responses of a connection waiting to be written
+#define CONN_BUFF_LEN   (8 * SKY_PROT_BUFF_LEN)
+#define DUP_CACHE_LEN   64
+#define HIST_BUCKETS    144  // see hist_bucket()
+#define BASELINE_SLOTS  256  // baseline scans kept for access point deltas, see baseline_slot()
+
+// epoll data of the listening sockets; connections use their slot
+#define EV_LISTEN       MAX_CONNS
+#define EV_UDP          (MAX_CONNS + 1)
+
+// statistics are written by the workers and read by the main thread
+#define STAT_ADD(x, n)  __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+#define STAT_GET(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+// response in the output buffer of a connection
+struct pending_t {
+    uint32_t end;     // end of the response in conn_t::out
+    uint64_t due;     // time (us) when it may be written
+    uint64_t arrived; // time (us) when its request arrived
+};
+
+struct conn_t {
+    int fd;
+    uint32_t events;    // epoll events of interest
+    uint32_t in_len;
+    uint32_t out_len;
+    uint32_t out_ready; // out[0, out_ready) is due
+    uint64_t last_due;
+    uint32_t pending_head;
+    uint32_t pending_count;
+    struct pending_t pending[MAX_PENDING];
+    uint8_t in[CONN_BUFF_LEN];
+    uint8_t out[CONN_BUFF_LEN];
+};
+
+// delayed response datagram
+struct dgram_t {
+    struct sockaddr_in peer;
+    uint64_t arrived;
+    uint32_t len;
+    uint8_t data[];
+};
+
+// delayed response of the connection in slot (while its generation is gen), or a datagram
+struct delay_t {
+    uint64_t due;
+    uint32_t slot;
+    uint32_t gen;
+    struct dgram_t *dgram;
+};
+
+// response to a datagram request, for answering its retransmissions
+struct dup_t {
+    struct sockaddr_in peer;
+    uint32_t partner_id;
+    uint32_t request_id;
+    uint32_t len;
+    uint8_t rsp[SKY_PROT_BUFF_LEN];
+};
+
+// baseline scan of a partner for the access point deltas of its later requests (scan_id 0 when free)
+struct baseline_t {
+    pthread_mutex_t lock;
+    uint32_t partner_id;
+    uint32_t scan_id;
+    uint8_t ap_count;
+    struct ap_t aps[MAX_APS];
+};
+
+struct worker_t {
+    pthread_t thread;
+    int epfd;
+    int lfd;
+    int ufd;
+    unsigned int seed;
+    struct conn_t *conns[MAX_CONNS];
+    uint32_t gens[MAX_CONNS];
+    struct delay_t *delays; // min-heap by due
+    uint32_t delay_count;
+    uint32_t delay_cap;
+    struct dup_t dups[DUP_CACHE_LEN];
+    uint32_t dup_next;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t hist[HIST_BUCKETS];
+};
+
+static sky_keystore_t keystore;
+static struct baseline_t baselines[BASELINE_SLOTS];
+static const char *key_file;
+static struct location_t location = { 42.3601, -71.0589, 25.0f, 0.0f };
+static double radius = 1000.0;
+static uint64_t delay_us;
+static uint64_t jitter_us;
+static uint16_t port = 9755;
+static volatile sig_atomic_t stop;
+static volatile sig_atomic_t reload;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// latency histogram bucket: exact below 8 us, then 4 buckets per power of two
+static uint32_t hist_bucket(uint64_t us) {
+    if (us < 8)
+        return (uint32_t)us;
+    uint32_t msb = 63 - __builtin_clzll(us);
+    uint32_t i = 8 + (msb - 3) * 4 + ((us >> (msb - 2)) & 3);
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+// largest latency (us) of bucket i
+static uint64_t hist_bound(uint32_t i) {
+    if (i < 8)
+        return i;
+    uint32_t msb = (i - 8) / 4 + 3;
+    return ((uint64_t)(4 + (i - 8) % 4 + 1) << (msb - 2)) - 1;
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total, double p) {
+    uint64_t target = (uint64_t)ceil(total * p), sum = 0;
+    uint32_t i;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        sum += hist[i];
+        if (sum >= target && sum > 0)
+            return hist_bound(i);
+    }
+    return 0;
+}
+
+static void record(struct worker_t *w, uint64_t arrived) {
+    uint64_t now = now_us();
+    STAT_ADD(w->hist[hist_bucket(now > arrived ? now - arrived : 0)], 1);
+}
+
+static bool parse_key(const char *s, struct sky_key_t *k) {
+    unsigned int id;
+    char hex[2 * sizeof(k->aes_key) + 1];
+    uint32_t i;
+    if (sscanf(s, "%u:%32s", &id, hex) != 2 || strlen(hex) != 2 * sizeof(k->aes_key))
+        return false;
+    memset(k, 0, sizeof(*k));
+    k->partner_id = id;
+    for (i = 0; i < sizeof(k->aes_key); i++) {
+        unsigned int b;
+        if (sscanf(hex + 2 * i, "%2x", &b) != 1)
+            return false;
+        k->aes_key[i] = (uint8_t)b;
+    }
+    return true;
+}
+
+static uint32_t fnv1a(uint32_t h, const uint8_t *data, uint32_t len) {
+    uint32_t i;
+    for (i = 0; i < len; i++)
+        h = (h ^ data[i]) * 16777619u;
+    return h;
+}
+
+// synthetic location within radius of the base location, derived from the access points of
+// the request (or the device MAC), so that the same scan always gets the same location, whatever
+// the order of its access points (which a delta changes)
+static struct location_t synthetic_location(const struct location_rq_t *rq) {
+    uint32_t h = 2166136261u, i;
+    if (rq->aps != NULL && rq->ap_count > 0) {
+        uint32_t sum = 0;
+        for (i = 0; i < rq->ap_count; i++)
+            sum += fnv1a(h, rq->aps[i].MAC, MAC_SIZE);
+        h = fnv1a(h, (const uint8_t *)&sum, sizeof(sum));
+    } else if (rq->mac != NULL) {
+        h = fnv1a(h, rq->mac, rq->mac_count * MAC_SIZE);
+    }
+
+    struct location_t loc = location;
+    double r = radius * sqrt((h & 0xffff) / 65536.0);
+    double a = 2 * M_PI * (h >> 16) / 65536.0;
+    loc.lat += r * cos(a) / 111320.0;
+    loc.lon += r * sin(a) / (111320.0 * cos(location.lat * M_PI / 180));
+    loc.hpe = 10.0f + (float)(h % 40);
+    return loc;
+}
+
+// slot of the baseline scan scan_id of a partner; a newer baseline takes the slot over
+static struct baseline_t *baseline_slot(uint32_t partner_id, uint32_t scan_id) {
+    uint32_t key[2] = { partner_id, scan_id };
+    return &baselines[fnv1a(2166136261u, (const uint8_t *)key, sizeof(key)) % BASELINE_SLOTS];
+}
+
+// keep the access points of the scan scan_id of a partner for the deltas of its later requests
+static void store_baseline(uint32_t partner_id, uint32_t scan_id, const struct ap_t *aps, uint8_t ap_count) {
+    struct baseline_t *b = baseline_slot(partner_id, scan_id);
+    pthread_mutex_lock(&b->lock);
+    b->partner_id = partner_id;
+    b->scan_id = scan_id;
+    b->ap_count = ap_count;
+    memcpy(b->aps, aps, ap_count * sizeof(*aps));
+    pthread_mutex_unlock(&b->lock);
+}
+
+// apply the access point delta of a request of a partner to its baseline scan, result is in aps;
+// returns the number of access points in aps or -1 when fails, known is false when the baseline
+// is not kept
+static int32_t expand_delta(uint32_t partner_id, const struct location_rq_t *rq, struct ap_t *aps,
+        bool *known) {
+    uint32_t scan_id = sky_get_ap_delta_baseline_id(rq->ap_delta, rq->ap_delta_len);
+    int32_t n = -1;
+    *known = true;
+    if (scan_id == 0)
+        return -1;
+    struct baseline_t *b = baseline_slot(partner_id, scan_id);
+    pthread_mutex_lock(&b->lock);
+    if (b->scan_id == scan_id && b->partner_id == partner_id)
+        n = sky_decode_ap_delta(rq->ap_delta, rq->ap_delta_len, scan_id, b->aps, b->ap_count, aps, MAX_APS);
+    else
+        *known = false;
+    pthread_mutex_unlock(&b->lock);
+    return n;
+}
+
+// encode and encrypt the response rsp into out; returns its length or -1 when fails
+static int32_t encode_answer(struct location_rsp_t *rsp, const struct sky_key_t *key, uint8_t *out,
+        uint32_t out_len) {
+    int32_t n = sky_encode_resp_bin(out, out_len, rsp);
+    uint32_t rsp_header_len = 0;
+    if (n < 0 || sky_get_frame_len(out, n, false, &rsp_header_len) != n)
+        return -1;
+    if (sky_aes_encrypt(out + rsp_header_len, n - rsp_header_len - sizeof(sky_checksum_t),
+            (uint8_t *)key->aes_key, out + rsp_header_len - sizeof(rsp->header.iv)) != 0)
+        return -1;
+    return n;
+}
+
+// answer the request frame in buff; returns the response length in out or -1 when fails
+static int32_t answer(uint8_t *buff, uint32_t len, uint32_t header_len, uint8_t *out, uint32_t out_len) {
+    static char street_num[] = "1", address[] = "Main Street", metro1[] = "Boston",
+            state_code[] = "MA", postal_code[] = "02110", country_code[] = "US";
+    struct location_rq_t rq;
+    struct location_rsp_t rsp;
+    struct batch_location_t batch[MAX_BATCH_SCANS];
+    struct ap_t aps[MAX_APS], rq_aps[MAX_APS];
+    uint32_t i, offset;
+    int32_t n;
+
+    const struct sky_key_t *key = sky_keystore_lookup_rq(&keystore, buff, len);
+    if (key == NULL)
+        return -1;
+    if (sky_aes_decrypt(buff + header_len, len - header_len - sizeof(sky_checksum_t),
+            (uint8_t *)key->aes_key, buff + header_len - sizeof(rq.header.iv)) != 0)
+        return -1;
+    memset(&rq, 0, sizeof(rq));
+    if (sky_decode_req_bin(buff, len, &rq) < 0)
+        return -1;
+
+    memset(&rsp, 0, sizeof(rsp));
+    rsp.header.version = rq.header.version;
+    rsp.request_id = rq.request_id;
+    rsp.payload_ext.payload.sw_version = 1;
+
+    // the access points of the scan in full
+    if (rq.ap_type == DATA_TYPE_AP_COMPACT && rq.ap_compact != NULL) {
+        n = sky_decode_ap_compact(rq.ap_compact, rq.ap_compact_len, rq.ap_count, rq_aps, MAX_APS);
+        if (n < 0)
+            return -1;
+        rq.aps = rq_aps;
+        rq.ap_count = n;
+        rq.ap_type = DATA_TYPE_AP;
+    }
+    if (rq.payload_ext.payload.type == LOCATION_RQ_DELTA || rq.payload_ext.payload.type == LOCATION_RQ_ADDR_DELTA) {
+        bool known;
+        n = expand_delta(key->partner_id, &rq, rq_aps, &known);
+        if (!known) {
+            // the client sends its whole scan again
+            rsp.payload_ext.payload.type = LOCATION_BASELINE_UNKNOWN;
+            return encode_answer(&rsp, key, out, out_len);
+        }
+        if (n < 0)
+            return -1;
+        rq.aps = rq_aps;
+        rq.ap_count = n;
+        rq.ap_type = DATA_TYPE_AP;
+    }
+    if (rq.scan_id != 0 && rq.payload_ext.payload.type != LOCATION_RQ_BATCH) {
+        store_baseline(key->partner_id, rq.scan_id, rq.aps, (uint8_t)rq.ap_count);
+        rsp.scan_id = rq.scan_id;
+    }
+
+    switch (rq.payload_ext.payload.type) {
+    case LOCATION_RQ:
+    case LOCATION_RQ_DELTA:
+        rsp.payload_ext.payload.type = LOCATION_RQ_SUCCESS;
+        break;
+    case LOCATION_RQ_ADDR:
+    case LOCATION_RQ_ADDR_DELTA:
+        rsp.payload_ext.payload.type = LOCATION_RQ_ADDR_SUCCESS;
+        rsp.location_ext.mac_len = rq.mac_count * MAC_SIZE;
+        rsp.location_ext.mac = rq.mac;
+        rsp.location_ext.ip_type = rq.ip_type;
+        rsp.location_ext.ip_len = rq.ip_count * (rq.ip_type == DATA_TYPE_IPV4 ? IPV4_SIZE : IPV6_SIZE);
+        rsp.location_ext.ip_addr = rq.ip_addr;
+        rsp.location_ext.street_num_len = sizeof(street_num) - 1;
+        rsp.location_ext.street_num = street_num;
+        rsp.location_ext.address_len = sizeof(address) - 1;
+        rsp.location_ext.address = address;
+        rsp.location_ext.metro1_len = sizeof(metro1) - 1;
+        rsp.location_ext.metro1 = metro1;
+        rsp.location_ext.state_code_len = sizeof(state_code) - 1;
+        rsp.location_ext.state_code = state_code;
+        rsp.location_ext.postal_code_len = sizeof(postal_code) - 1;
+        rsp.location_ext.postal_code = postal_code;
+        rsp.location_ext.country_code_len = sizeof(country_code) - 1;
+        rsp.location_ext.country_code = country_code;
+        break;
+    case LOCATION_RQ_BATCH:
+        // every scan gets the location its access points would get on their own
+        rsp.payload_ext.payload.type = LOCATION_RQ_BATCH_SUCCESS;
+        for (i = 0, offset = 0; i < rq.batch_count; i++) {
+            struct location_rq_t scan;
+            uint32_t age;
+            n = sky_get_batch_scan(rq.batch, rq.batch_len, &offset, &age, aps, MAX_APS);
+            if (n < 0)
+                return -1;
+            memset(&scan, 0, sizeof(scan));
+            scan.aps = aps;
+            scan.ap_count = n;
+            memset(&batch[i], 0, sizeof(batch[i]));
+            batch[i].type = (n > 0) ? LOCATION_RQ_SUCCESS : LOCATION_UNABLE_TO_DETERMINE;
+            batch[i].location = synthetic_location(&scan);
+        }
+        rsp.batch_count = rq.batch_count;
+        rsp.batch = (uint8_t *)batch;
+        break;
+    default:
+        rsp.payload_ext.payload.type = LOCATION_RQ_ERROR;
+        break;
+    }
+    rsp.location = synthetic_location(&rq);
+    return encode_answer(&rsp, key, out, out_len);
+}
+
+// time (us) when the response to a request which arrived at time arrived is due
+static uint64_t due_time(struct worker_t *w, uint64_t arrived) {
+    uint64_t due = arrived + delay_us;
+    if (jitter_us > 0)
+        due += (uint64_t)rand_r(&w->seed) % (jitter_us + 1);
+    return due;
+}
+
+static void delay_push(struct worker_t *w, struct delay_t d) {
+    if (w->delay_count == w->delay_cap) {
+        w->delay_cap = w->delay_cap ? 2 * w->delay_cap : 256;
+        w->delays = realloc(w->delays, w->delay_cap * sizeof(*w->delays));
+        if (w->delays == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    uint32_t i = w->delay_count++;
+    while (i > 0 && w->delays[(i - 1) / 2].due > d.due) {
+        w->delays[i] = w->delays[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    w->delays[i] = d;
+}
+
+static struct delay_t delay_pop(struct worker_t *w) {
+    struct delay_t top = w->delays[0];
+    struct delay_t last = w->delays[--w->delay_count];
+    uint32_t i = 0;
+    for (;;) {
+        uint32_t c = 2 * i + 1;
+        if (c >= w->delay_count)
+            break;
+        if (c + 1 < w->delay_count && w->delays[c + 1].due < w->delays[c].due)
+            c++;
+        if (last.due <= w->delays[c].due)
+            break;
+        w->delays[i] = w->delays[c];
+        i = c;
+    }
+    if (w->delay_count > 0)
+        w->delays[i] = last;
+    return top;
+}
+
+static void close_conn(struct worker_t *w, uint32_t slot) {
+    close(w->conns[slot]->fd);
+    free(w->conns[slot]);
+    w->conns[slot] = NULL;
+    w->gens[slot]++;
+}
+
+// read while there is room for requests, write while responses are due
+static void update_events(struct worker_t *w, uint32_t slot) {
+    struct conn_t *c = w->conns[slot];
+    uint32_t events = (c->in_len < CONN_BUFF_LEN ? EPOLLIN : 0) | (c->out_ready > 0 ? EPOLLOUT : 0);
+    if (events == c->events)
+        return;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = slot;
+    epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+// release the responses which are due at time now for writing
+static void release(struct conn_t *c, uint64_t now) {
+    uint32_t i;
+    for (i = 0; i < c->pending_count; i++) {
+        struct pending_t *p = &c->pending[(c->pending_head + i) % MAX_PENDING];
+        if (p->due > now)
+            break;
+        c->out_ready = p->end;
+    }
+}
+
+// write the released responses; returns false to close the connection
+static bool flush(struct worker_t *w, struct conn_t *c) {
+    while (c->out_ready > 0) {
+        ssize_t n = write(c->fd, c->out, c->out_ready);
+        if (n < 0)
+            return errno == EAGAIN || errno == EINTR;
+        STAT_ADD(w->bytes_out, n);
+        memmove(c->out, c->out + n, c->out_len - n);
+        c->out_len -= n;
+        c->out_ready -= n;
+        while (c->pending_count > 0 && c->pending[c->pending_head].end <= (uint32_t)n) {
+            record(w, c->pending[c->pending_head].arrived);
+            c->pending_head = (c->pending_head + 1) % MAX_PENDING;
+            c->pending_count--;
+        }
+        uint32_t i;
+        for (i = 0; i < c->pending_count; i++)
+            c->pending[(c->pending_head + i) % MAX_PENDING].end -= n;
+    }
+    return true;
+}
+
+// answer all complete request frames in the input buffer; returns false to close the connection
+static bool serve(struct worker_t *w, uint32_t slot) {
+    struct conn_t *c = w->conns[slot];
+    uint32_t off = 0;
+    uint64_t now = now_us();
+    while (off < c->in_len && CONN_BUFF_LEN - c->out_len >= SKY_PROT_BUFF_LEN
+            && c->pending_count < MAX_PENDING) {
+        uint32_t header_len = 0;
+        int32_t len = sky_get_frame_len(c->in + off, c->in_len - off, true, &header_len);
+        if (len < 0 || (uint32_t)len > CONN_BUFF_LEN)
+            return false;
+        if (len == 0 || off + len > c->in_len)
+            break; // wait for the rest of the frame
+        int32_t n = answer(c->in + off, len, header_len, c->out + c->out_len, CONN_BUFF_LEN - c->out_len);
+        if (n < 0) {
+            STAT_ADD(w->errors, 1);
+            return false;
+        }
+        STAT_ADD(w->requests, 1);
+        c->out_len += n;
+        off += len;
+
+        // responses are written in request order, so none is due before the one ahead of it
+        struct pending_t *p = &c->pending[(c->pending_head + c->pending_count++) % MAX_PENDING];
+        p->end = c->out_len;
+        p->arrived = now;
+        p->due = due_time(w, now);
+        if (p->due < c->last_due)
+            p->due = c->last_due;
+        c->last_due = p->due;
+        if (p->due > now) {
+            struct delay_t d = { p->due, slot, w->gens[slot], NULL };
+            delay_push(w, d);
+        }
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+    release(c, now);
+    return true;
+}
+
+static void accept_conns(struct worker_t *w) {
+    for (;;) {
+        int fd = accept4(w->lfd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0)
+            return;
+        uint32_t slot;
+        for (slot = 0; slot < MAX_CONNS && w->conns[slot] != NULL; slot++)
+            ;
+        struct conn_t *c = (slot < MAX_CONNS) ? malloc(sizeof(*c)) : NULL;
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        memset(c, 0, offsetof(struct conn_t, pending));
+        c->fd = fd;
+        c->events = EPOLLIN;
+        w->conns[slot] = c;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = slot;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static void handle_conn(struct worker_t *w, uint32_t slot, uint32_t events) {
+    struct conn_t *c = w->conns[slot];
+    if ((events & EPOLLOUT) && !flush(w, c)) {
+        close_conn(w, slot);
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && c->in_len < CONN_BUFF_LEN) {
+        ssize_t n = read(c->fd, c->in + c->in_len, CONN_BUFF_LEN - c->in_len);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            close_conn(w, slot);
+            return;
+        }
+        if (n > 0) {
+            STAT_ADD(w->bytes_in, n);
+            c->in_len += n;
+        }
+    }
+    // also answers the frames which were held back while the output buffer was full
+    if (!serve(w, slot) || !flush(w, c)) {
+        close_conn(w, slot);
+        return;
+    }
+    update_events(w, slot);
+}
+
+static struct dup_t *find_dup(struct worker_t *w, const struct sockaddr_in *peer, uint32_t partner_id,
+        uint32_t request_id) {
+    uint32_t i;
+    for (i = 0; i < DUP_CACHE_LEN; i++) {
+        struct dup_t *d = &w->dups[i];
+        if (d->len > 0 && d->request_id == request_id && d->partner_id == partner_id
+                && d->peer.sin_addr.s_addr == peer->sin_addr.s_addr && d->peer.sin_port == peer->sin_port)
+            return d;
+    }
+    return NULL;
+}
+
+static void send_datagram(struct worker_t *w, const struct sockaddr_in *peer, const uint8_t *data,
+        uint32_t len, uint64_t arrived) {
+    if (sendto(w->ufd, data, len, 0, (const struct sockaddr *)peer, sizeof(*peer)) == (ssize_t)len) {
+        STAT_ADD(w->bytes_out, len);
+        record(w, arrived);
+    }
+}
+
+// answer the waiting request datagrams
+static void serve_datagrams(struct worker_t *w) {
+    for (;;) {
+        uint8_t buff[SKY_PROT_BUFF_LEN];
+        uint8_t out[SKY_PROT_BUFF_LEN];
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+        ssize_t len = recvfrom(w->ufd, buff, sizeof(buff), 0, (struct sockaddr *)&peer, &peer_len);
+        if (len < 0)
+            return;
+        uint64_t now = now_us();
+        STAT_ADD(w->bytes_in, len);
+        uint32_t header_len = 0;
+        if (len == 0 || sky_get_frame_len(buff, len, true, &header_len) != len) {
+            STAT_ADD(w->errors, 1);
+            continue; // not one whole request
+        }
+
+        uint32_t partner_id = sky_get_partner_id_from_rq_header(buff, len);
+        uint32_t request_id = sky_get_request_id_from_rq_header(buff, len);
+        struct dup_t *d = (request_id != 0) ? find_dup(w, &peer, partner_id, request_id) : NULL;
+        int32_t n;
+        if (d != NULL) {
+            n = d->len;
+            memcpy(out, d->rsp, n);
+        } else {
+            n = answer(buff, len, header_len, out, sizeof(out));
+            if (n < 0) {
+                STAT_ADD(w->errors, 1);
+                continue;
+            }
+            STAT_ADD(w->requests, 1);
+            if (request_id != 0) {
+                d = &w->dups[w->dup_next++ % DUP_CACHE_LEN];
+                d->peer = peer;
+                d->partner_id = partner_id;
+                d->request_id = request_id;
+                d->len = n;
+                memcpy(d->rsp, out, n);
+            }
+        }
+
+        uint64_t due = due_time(w, now);
+        if (due <= now) {
+            send_datagram(w, &peer, out, n, now);
+            continue;
+        }
+        struct dgram_t *g = malloc(sizeof(*g) + n);
+        if (g == NULL)
+            continue;
+        g->peer = peer;
+        g->arrived = now;
+        g->len = n;
+        memcpy(g->data, out, n);
+        struct delay_t dl = { due, 0, 0, g };
+        delay_push(w, dl);
+    }
+}
+
+// send the delayed responses which are due; returns the time (ms) until the next one, or -1
+static int run_delays(struct worker_t *w) {
+    uint64_t now = now_us();
+    while (w->delay_count > 0 && w->delays[0].due <= now) {
+        struct delay_t d = delay_pop(w);
+        if (d.dgram != NULL) {
+            send_datagram(w, &d.dgram->peer, d.dgram->data, d.dgram->len, d.dgram->arrived);
+            free(d.dgram);
+            continue;
+        }
+        if (w->conns[d.slot] == NULL || w->gens[d.slot] != d.gen)
+            continue; // connection closed since
+        struct conn_t *c = w->conns[d.slot];
+        release(c, now);
+        if (!flush(w, c) || !serve(w, d.slot) || !flush(w, c))
+            close_conn(w, d.slot);
+        else
+            update_events(w, d.slot);
+    }
+    if (w->delay_count == 0)
+        return -1;
+    return (int)((w->delays[0].due - now + 999) / 1000);
+}
+
+static int open_socket(int type) {
+    int fd = socket(AF_INET, type | SOCK_NONBLOCK, 0);
+    int one = 1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+            || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0
+            || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+            || (type == SOCK_STREAM && listen(fd, 1024) < 0)) {
+        perror(type == SOCK_STREAM ? "listen" : "bind udp");
+        exit(1);
+    }
+    return fd;
+}
+
+static void *work(void *arg) {
+    struct worker_t *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    sky_keystore_reader_t reader;
+    sky_keystore_register(&keystore, &reader);
+    for (;;) {
+        int timeout = run_delays(w);
+        // no keys are held while waiting, so a reload need not wait for this worker
+        sky_keystore_offline(&keystore, &reader);
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+        sky_keystore_online(&keystore, &reader);
+        int i;
+        for (i = 0; i < n; i++) {
+            uint32_t slot = (uint32_t)events[i].data.u64;
+            if (slot == EV_LISTEN)
+                accept_conns(w);
+            else if (slot == EV_UDP)
+                serve_datagrams(w);
+            else if (w->conns[slot] != NULL)
+                handle_conn(w, slot, events[i].events);
+        }
+    }
+    return NULL;
+}
+
+static void on_signal(int sig) {
+    if (sig == SIGHUP)
+        reload = 1;
+    else
+        stop = 1;
+}
+
+// (re)load the key file; the old keys stay in use when it fails
+static bool load_keys(void) {
+    uint32_t line = 0;
+    int32_t n = sky_keystore_load(&keystore, key_file, &line);
+    if (n == SKY_KEYSTORE_NO_FILE)
+        fprintf(stderr, "%s: %s\n", key_file, strerror(errno));
+    else if (n < 0 && line > 0)
+        fprintf(stderr, "%s:%u: bad key or duplicate partner id\n", key_file, line);
+    else if (n < 0)
+        fprintf(stderr, "failed to load keys from %s\n", key_file);
+    else
+        printf("loaded %d keys from %s\n", n, key_file);
+    fflush(stdout);
+    return n >= 0;
+}
+
+static void print_percentiles(const uint64_t *hist, uint64_t total) {
+    printf("latency us p50 %llu, p90 %llu, p99 %llu, p99.9 %llu",
+            (unsigned long long)hist_percentile(hist, total, 0.5),
+            (unsigned long long)hist_percentile(hist, total, 0.9),
+            (unsigned long long)hist_percentile(hist, total, 0.99),
+            (unsigned long long)hist_percentile(hist, total, 0.999));
+}
+
+int main(int argc, char *argv[]) {
+    struct sky_key_t key;
+    bool have_key = false, ok = true;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int interval = 5;
+    double d, j;
+    int opt, n;
+    sky_keystore_init(&keystore);
+    for (n = 0; n < BASELINE_SLOTS; n++)
+        pthread_mutex_init(&baselines[n].lock, NULL);
+    while ((opt = getopt(argc, argv, "k:f:p:l:r:d:t:s:")) != -1) {
+        switch (opt) {
+        case 'k':
+            ok &= parse_key(optarg, &key) && sky_keystore_set(&keystore, &key, 1) == 1;
+            have_key = true;
+            break;
+        case 'f':
+            key_file = optarg;
+            have_key = true;
+            break;
+        case 'p':
+            port = (uint16_t)atoi(optarg);
+            break;
+        case 'l':
+            ok &= sscanf(optarg, "%lf,%lf", &location.lat, &location.lon) == 2;
+            break;
+        case 'r':
+            radius = atof(optarg);
+            break;
+        case 'd':
+            n = sscanf(optarg, "%lf,%lf", &d, &j);
+            ok &= n >= 1 && d >= 0 && (n == 1 || j >= 0);
+            delay_us = (uint64_t)(d * 1000);
+            jitter_us = (n == 2) ? (uint64_t)(j * 1000) : 0;
+            break;
+        case 't':
+            threads = atol(optarg);
+            break;
+        case 's':
+            interval = (unsigned int)atoi(optarg);
+            break;
+        default:
+            ok = false;
+            break;
+        }
+    }
+    if (!have_key || !ok || threads < 1 || interval < 1) {
+        fprintf(stderr, "usage: %s (-k partner_id:aes_key_hex | -f key_file) [-p port] [-l lat,lon] [-r radius_m]\n"
+                "       [-d delay_ms[,jitter_ms]] [-t threads] [-s stats_interval_s]\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGHUP, on_signal);
+    if (key_file != NULL && !load_keys())
+        return 1;
+
+    struct worker_t *workers = calloc(threads, sizeof(*workers));
+    if (workers == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    long i;
+    for (i = 0; i < threads; i++) {
+        struct worker_t *w = &workers[i];
+        struct epoll_event ev;
+        w->seed = (unsigned int)(time(NULL) + i);
+        w->epfd = epoll_create1(0);
+        w->lfd = open_socket(SOCK_STREAM);
+        w->ufd = open_socket(SOCK_DGRAM);
+        ev.events = EPOLLIN;
+        ev.data.u64 = EV_LISTEN;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->lfd, &ev);
+        ev.data.u64 = EV_UDP;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->ufd, &ev);
+        if (pthread_create(&w->thread, NULL, work, w) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    printf("elg_gateway: listening on port %u, %ld workers, delay %.1f+%.1f ms\n",
+            port, threads, delay_us / 1000.0, jitter_us / 1000.0);
+    fflush(stdout);
+
+    uint64_t hist[HIST_BUCKETS], last[HIST_BUCKETS], delta[HIST_BUCKETS];
+    uint64_t last_requests = 0, last_errors = 0, last_in = 0, last_out = 0;
+    uint64_t start = now_us(), from = start;
+    uint32_t b;
+    memset(last, 0, sizeof(last));
+    while (!stop) {
+        while (!stop && now_us() - from < (uint64_t)interval * 1000000) {
+            usleep(100000);
+            if (reload && key_file != NULL) {
+                reload = 0;
+                load_keys();
+            }
+        }
+
+        uint64_t requests = 0, errors = 0, in = 0, out = 0, total = 0;
+        memset(hist, 0, sizeof(hist));
+        for (i = 0; i < threads; i++) {
+            requests += STAT_GET(workers[i].requests);
+            errors += STAT_GET(workers[i].errors);
+            in += STAT_GET(workers[i].bytes_in);
+            out += STAT_GET(workers[i].bytes_out);
+            for (b = 0; b < HIST_BUCKETS; b++)
+                hist[b] += STAT_GET(workers[i].hist[b]);
+        }
+        for (b = 0; b < HIST_BUCKETS; b++) {
+            delta[b] = hist[b] - last[b];
+            total += delta[b];
+        }
+        uint64_t now = now_us();
+        double secs = (now - from) / 1e6;
+        printf("%.0f req/s, %llu errors, in %.1f KB/s, out %.1f KB/s, ",
+                (requests - last_requests) / secs, (unsigned long long)(errors - last_errors),
+                (in - last_in) / secs / 1024, (out - last_out) / secs / 1024);
+        print_percentiles(delta, total);
+        printf("\n");
+        fflush(stdout);
+        memcpy(last, hist, sizeof(last));
+        last_requests = requests;
+        last_errors = errors;
+        last_in = in;
+        last_out = out;
+        from = now;
+    }
+
+    // latency histogram of the whole run
+    uint64_t total = 0, max = 0;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        total += last[b];
+        if (last[b] > max)
+            max = last[b];
+    }
+    printf("\n%llu requests, %llu errors in %.1f s, ", (unsigned long long)last_requests,
+            (unsigned long long)last_errors, (now_us() - start) / 1e6);
+    print_percentiles(last, total);
+    printf("\n");
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        if (last[b] == 0)
+            continue;
+        printf("<= %8llu us %10llu ", (unsigned long long)hist_bound(b), (unsigned long long)last[b]);
+        for (n = 0; n < (int)(50 * last[b] / max); n++)
+            putchar('#');
+        putchar('\n');
+    }
+    return 0;
+}
@@ -0,0 +1,720 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ * Fleet load generator: simulates many devices, each with its own key, MAC
+ * address and movement trace through a grid of synthetic access points, and
+ * sends their location requests through the non-blocking client
+ * (sky_client_t, over non-blocking sockets) to an ELG server or the
+ * elg_gateway stand-in.
+ *
+ * Every device keeps one connection (or UDP socket) and queries either as
+ * fast as the server answers (closed loop, default), or at a fixed total
+ * rate spread over the devices (-q). Achieved requests/s, latency
+ * percentiles, bytes on the wire and errors are printed every interval, and
+ * the error classes at the end.
+ *
+ * With -c, the frames sent and received are recorded into a capture file
+ * (sky_capture.h) for elg_replay.
+ *
+ * build (host, linux):
+ *   gcc -O2 -pthread -DAES_TLS=__thread -I../elg_client_demo -o elg_loadgen elg_loadgen.c sky_capture.c \
+ *       ../elg_client_demo/sky_protocol.c ../elg_client_demo/sky_crypt.c \
+ *       ../elg_client_demo/mauth.c ../elg_client_demo/hmac256.c ../elg_client_demo/aes.c -lm
+ *
+ * usage:
+ *   elg_loadgen -k partner_id:aes_key_hex [-k ...] [-u elg://host:port/] [-n devices]
+ *               [-q requests_per_s] [-d duration_s] [-T timeout_ms] [-v protocol_version]
+ *               [-U retry_timeout_ms] [-t threads] [-s stats_interval_s] [-c capture_file]
+ *
+ * Devices take the keys (-k) in turn. -U sends over UDP, with protocol
+ * version 2.
+ ************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "sky_crypt.h"
+#include "sky_protocol.h"
+#include "sky_capture.h"
+
+#define MAX_KEYS        64
+#define MAX_EVENTS      256
+#define HIST_BUCKETS    144  // see hist_bucket()
+#define STATUS_CLASSES  64   // SKY_STATUS values, the last one for all larger values
+#define SCAN_APS        15   // access points per scan, the strongest
+#define GRID_SPACING    30.0 // m between the synthetic access points
+#define SCAN_RANGE      100.0 // m within which access points are seen
+#define WALK_SPEED      1.4  // m/s
+#define FAILURE_BACKOFF 100000 // us before a device queries again after a failure, in closed loop
+
+#define STAT_ADD(x, n)  __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+#define STAT_GET(x)     __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+struct worker_t;
+
+struct device_t {
+    struct worker_t *w;
+    int fd;
+    bool busy;
+    uint32_t seq;       // changes with every start and completion, to skip stale timers
+    uint64_t started;   // time (us) of the start of the query
+    uint64_t next_at;   // time (us) of the next query
+    uint64_t walked_at; // time (us) of the last position update
+    double x, y;        // position (m)
+    double heading;     // rad
+    uint32_t request_id;
+    sky_client_t client;
+    uint8_t buff[SKY_PROT_BUFF_LEN]; // frames of client
+    struct location_rq_t rq;
+    struct location_rsp_t rsp;
+    uint8_t mac[MAC_SIZE];
+    uint8_t ip[IPV4_SIZE];
+    struct ap_t aps[SCAN_APS];
+};
+
+// query start or deadline of a device
+struct timer_t_ {
+    uint64_t due;
+    struct device_t *dev;
+    uint32_t seq;
+};
+
+struct worker_t {
+    pthread_t thread;
+    int epfd;
+    unsigned int seed;
+    struct device_t *devices;
+    uint32_t device_count;
+    struct timer_t_ *timers; // min-heap by due
+    uint32_t timer_count;
+    uint32_t timer_cap;
+    // statistics, read by the main thread
+    uint64_t requests;
+    uint64_t failures;
+    uint64_t rejected;  // responses without a location
+    uint64_t connects;
+    uint64_t connect_errors;
+    uint64_t late;      // queries started late, because the one before took longer than the period
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t status[STATUS_CLASSES];
+    uint64_t hist[HIST_BUCKETS];
+};
+
+static struct sky_key_t keys[MAX_KEYS];
+static uint32_t key_count;
+static char url[URL_SIZE] = "elg://127.0.0.1:9755/";
+static struct sockaddr_storage server;
+static socklen_t server_len;
+static uint32_t version = SKY_PROTOCOL_VERSION_2;
+static uint32_t timeout_ms = 5000;
+static uint32_t retry_ms;  // UDP when not 0
+static double qps;         // total; 0 for closed loop
+static uint64_t period_us; // between the queries of one device when qps > 0
+static volatile sig_atomic_t stop;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// latency histogram bucket: exact below 8 us, then 4 buckets per power of two
+static uint32_t hist_bucket(uint64_t us) {
+    if (us < 8)
+        return (uint32_t)us;
+    uint32_t msb = 63 - __builtin_clzll(us);
+    uint32_t i = 8 + (msb - 3) * 4 + ((us >> (msb - 2)) & 3);
+    return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+}
+
+// largest latency (us) of bucket i
+static uint64_t hist_bound(uint32_t i) {
+    if (i < 8)
+        return i;
+    uint32_t msb = (i - 8) / 4 + 3;
+    return ((uint64_t)(4 + (i - 8) % 4 + 1) << (msb - 2)) - 1;
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total, double p) {
+    uint64_t target = (uint64_t)ceil(total * p), sum = 0;
+    uint32_t i;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        sum += hist[i];
+        if (sum >= target && sum > 0)
+            return hist_bound(i);
+    }
+    return 0;
+}
+
+static const char *status_name(uint32_t status) {
+    switch (status) {
+    case SOCKET_TIMEOUT_FAILED:
+        return "timeout";
+    case SOCKET_WRITE_FAILED:
+        return "send failed";
+    case SOCKET_RECV_FAILED:
+        return "receive failed";
+    case DECRYPT_BIN_FAILED:
+        return "decrypt failed";
+    case DECODE_BIN_FAILED:
+        return "decode failed";
+    case ENCODE_BIN_FAILED:
+        return "encode failed";
+    case ENCRYPT_BIN_FAILED:
+        return "encrypt failed";
+    case API_URL_UNKNOWN:
+        return "bad url";
+    default:
+        return NULL;
+    }
+}
+
+static bool parse_key(const char *s, struct sky_key_t *k) {
+    unsigned int id;
+    char hex[2 * sizeof(k->aes_key) + 1];
+    uint32_t i;
+    if (sscanf(s, "%u:%32s", &id, hex) != 2 || strlen(hex) != 2 * sizeof(k->aes_key))
+        return false;
+    memset(k, 0, sizeof(*k));
+    k->partner_id = id;
+    for (i = 0; i < sizeof(k->aes_key); i++) {
+        unsigned int b;
+        if (sscanf(hex + 2 * i, "%2x", &b) != 1)
+            return false;
+        k->aes_key[i] = (uint8_t)b;
+    }
+    return true;
+}
+
+// resolve the server once, rather than per connection
+static bool resolve(char *u) {
+    char host[HOST_SIZE], port[PORT_SIZE];
+    uint16_t port_num;
+    struct addrinfo hints, *res;
+    if (!sky_parse_url(u, host, &port_num))
+        return false;
+    snprintf(port, sizeof(port), "%u", port_num);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = retry_ms ? SOCK_DGRAM : SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return false;
+    memcpy(&server, res->ai_addr, res->ai_addrlen);
+    server_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+static void timer_push(struct worker_t *w, uint64_t due, struct device_t *dev) {
+    if (w->timer_count == w->timer_cap) {
+        w->timer_cap = w->timer_cap ? 2 * w->timer_cap : 1024;
+        w->timers = realloc(w->timers, w->timer_cap * sizeof(*w->timers));
+        if (w->timers == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    struct timer_t_ t = { due, dev, dev->seq };
+    uint32_t i = w->timer_count++;
+    while (i > 0 && w->timers[(i - 1) / 2].due > t.due) {
+        w->timers[i] = w->timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    w->timers[i] = t;
+}
+
+static struct timer_t_ timer_pop(struct worker_t *w) {
+    struct timer_t_ top = w->timers[0];
+    struct timer_t_ last = w->timers[--w->timer_count];
+    uint32_t i = 0;
+    for (;;) {
+        uint32_t c = 2 * i + 1;
+        if (c >= w->timer_count)
+            break;
+        if (c + 1 < w->timer_count && w->timers[c + 1].due < w->timers[c].due)
+            c++;
+        if (last.due <= w->timers[c].due)
+            break;
+        w->timers[i] = w->timers[c];
+        i = c;
+    }
+    if (w->timer_count > 0)
+        w->timers[i] = last;
+    return top;
+}
+
+static void close_device(struct device_t *dev) {
+    if (dev->fd >= 0)
+        close(dev->fd);
+    dev->fd = -1;
+}
+
+// connect the device to the server without blocking; returns false when fails
+static bool connect_device(struct device_t *dev) {
+    struct worker_t *w = dev->w;
+    int fd = socket(server.ss_family, (retry_ms ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return false;
+    if (!retry_ms) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    STAT_ADD(w->connects, 1);
+    if (connect(fd, (struct sockaddr *)&server, server_len) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return false;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = dev;
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev);
+    dev->fd = fd;
+    return true;
+}
+
+// sky_client_send_fn, also connects
+static int32_t device_send(uint8_t *buff, uint32_t buff_len, char *host, uint16_t port, void *rpc_handle) {
+    struct device_t *dev = rpc_handle;
+    (void)host; // connect_device() connects to the server of the command line
+    (void)port;
+    if (dev->fd < 0 && !connect_device(dev)) {
+        STAT_ADD(dev->w->connect_errors, 1);
+        return -1;
+    }
+    ssize_t n = send(dev->fd, buff, buff_len, MSG_NOSIGNAL);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return 0; // still connecting, or the send buffer is full
+        if (errno == ECONNREFUSED)
+            STAT_ADD(dev->w->connect_errors, 1);
+        return -1;
+    }
+    STAT_ADD(dev->w->bytes_out, n);
+    return (int32_t)n;
+}
+
+// sky_client_recv_fn
+static int32_t device_recv(uint8_t *buff, uint32_t buff_len, void *rpc_handle) {
+    struct device_t *dev = rpc_handle;
+    ssize_t n = recv(dev->fd, buff, buff_len, 0);
+    if (n < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    if (n == 0 && !retry_ms)
+        return -1; // connection closed by the server
+    STAT_ADD(dev->w->bytes_in, n);
+    return (int32_t)n;
+}
+
+// MAC address of the synthetic access point at grid point (i, j)
+static void grid_mac(int32_t i, int32_t j, uint8_t *mac) {
+    uint32_t h = ((uint32_t)i * 73856093u) ^ ((uint32_t)j * 19349663u);
+    mac[0] = 0x02; // locally administered
+    mac[1] = (uint8_t)(h >> 24);
+    mac[2] = (uint8_t)(h >> 16);
+    mac[3] = (uint8_t)(h >> 8);
+    mac[4] = (uint8_t)h;
+    mac[5] = (uint8_t)(i ^ j);
+}
+
+// move the device on its random walk and scan the access points around it
+static uint8_t walk_and_scan(struct device_t *dev, uint64_t now) {
+    double dt = (now - dev->walked_at) / 1e6;
+    dev->walked_at = now;
+    dev->heading += ((double)rand_r(&dev->w->seed) / RAND_MAX - 0.5) * 0.5;
+    dev->x += cos(dev->heading) * WALK_SPEED * dt;
+    dev->y += sin(dev->heading) * WALK_SPEED * dt;
+
+    struct ap_t found[64];
+    uint32_t count = 0, i, k;
+    int32_t gi = (int32_t)floor(dev->x / GRID_SPACING), gj = (int32_t)floor(dev->y / GRID_SPACING);
+    int32_t r = (int32_t)(SCAN_RANGE / GRID_SPACING) + 1, di, dj;
+    for (di = -r; di <= r; di++) {
+        for (dj = -r; dj <= r && count < 64; dj++) {
+            double ax = (gi + di) * GRID_SPACING, ay = (gj + dj) * GRID_SPACING;
+            double d = hypot(ax - dev->x, ay - dev->y);
+            if (d > SCAN_RANGE)
+                continue;
+            // log-distance path loss, with a little noise
+            double rssi = -35 - 30 * log10(d + 1) + (rand_r(&dev->w->seed) % 5) - 2;
+            grid_mac(gi + di, gj + dj, found[count].MAC);
+            found[count].rssi = (int8_t)(rssi < -100 ? -100 : rssi);
+            found[count].flag = (((gi + di + gj + dj) & 1) ? BAND_5G : BAND_2_4G) << 1;
+            count++;
+        }
+    }
+    // keep the strongest
+    for (i = 0; i < count && i < SCAN_APS; i++) {
+        uint32_t best = i;
+        for (k = i + 1; k < count; k++)
+            if (found[k].rssi > found[best].rssi)
+                best = k;
+        struct ap_t t = found[i];
+        found[i] = found[best];
+        found[best] = t;
+        dev->aps[i] = found[i];
+    }
+    return (uint8_t)i;
+}
+
+static void start_query(struct device_t *dev, uint64_t now) {
+    struct worker_t *w = dev->w;
+    struct location_rq_t *rq = &dev->rq;
+    rq->header.version = version;
+    rq->ap_count = walk_and_scan(dev, now);
+    if (version == SKY_PROTOCOL_VERSION_2 && ++dev->request_id == 0)
+        dev->request_id = 1;
+    rq->request_id = (version == SKY_PROTOCOL_VERSION_2) ? dev->request_id : 0;
+    if (!sky_client_start(&dev->client, rq, &dev->rsp, url, (uint32_t)(now / 1000), timeout_ms))
+        return;
+    dev->busy = true;
+    dev->seq++;
+    dev->started = now;
+    // poll once the deadline passed, in case nothing arrives
+    timer_push(w, now + (uint64_t)timeout_ms * 1000 + 1000, dev);
+    sky_client_poll(&dev->client, (uint32_t)(now / 1000));
+}
+
+// sky_client_done_fn
+static void query_done(sky_client_t *client, struct location_rsp_t *rsp, enum SKY_STATUS status) {
+    struct device_t *dev = client->ctx;
+    struct worker_t *w = dev->w;
+    uint64_t now = now_us();
+
+    if (status == SKY_OK && rsp != NULL) {
+        uint8_t type = rsp->payload_ext.payload.type;
+        if (type == LOCATION_RQ_SUCCESS || type == LOCATION_RQ_ADDR_SUCCESS)
+            STAT_ADD(w->requests, 1);
+        else
+            STAT_ADD(w->rejected, 1);
+        STAT_ADD(w->hist[hist_bucket(now - dev->started)], 1);
+    } else {
+        STAT_ADD(w->failures, 1);
+        STAT_ADD(w->status[(uint32_t)status < STATUS_CLASSES ? (uint32_t)status : STATUS_CLASSES - 1], 1);
+        close_device(dev); // the stream may hold a part of the response; reconnect
+    }
+
+    dev->busy = false;
+    dev->seq++;
+    if (period_us == 0) {
+        dev->next_at = status == SKY_OK ? now : now + FAILURE_BACKOFF;
+    } else {
+        dev->next_at += period_us;
+        if (dev->next_at < now) {
+            STAT_ADD(w->late, 1);
+            dev->next_at = now;
+        }
+    }
+    timer_push(w, dev->next_at, dev);
+}
+
+// start the queries which are due and poll the ones past their deadline; returns the time (ms)
+// until the next timer, or -1
+static int run_timers(struct worker_t *w) {
+    uint64_t now = now_us();
+    while (w->timer_count > 0 && w->timers[0].due <= now) {
+        struct timer_t_ t = timer_pop(w);
+        if (t.seq != t.dev->seq)
+            continue; // the device moved on since
+        if (t.dev->busy)
+            sky_client_poll(&t.dev->client, (uint32_t)(now / 1000));
+        else if (!stop)
+            start_query(t.dev, now);
+    }
+    if (w->timer_count == 0)
+        return -1;
+    return (int)((w->timers[0].due - now + 999) / 1000);
+}
+
+static void *work(void *arg) {
+    struct worker_t *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    uint32_t i;
+    while (!stop) {
+        int timeout = run_timers(w);
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, (timeout < 0 || timeout > 100) ? 100 : timeout);
+        uint32_t now = (uint32_t)(now_us() / 1000);
+        int k;
+        for (k = 0; k < n; k++) {
+            struct device_t *dev = events[k].data.ptr;
+            if (dev->busy)
+                sky_client_poll(&dev->client, now);
+            else if (events[k].events & (EPOLLHUP | EPOLLERR))
+                close_device(dev);
+        }
+    }
+    for (i = 0; i < w->device_count; i++)
+        close_device(&w->devices[i]);
+    return NULL;
+}
+
+static void init_device(struct worker_t *w, struct device_t *dev, uint32_t index, uint64_t first_at) {
+    memset(dev, 0, sizeof(*dev));
+    dev->w = w;
+    dev->fd = -1;
+    dev->next_at = first_at;
+    dev->walked_at = first_at;
+    // devices start scattered over a few km
+    dev->x = (double)rand_r(&w->seed) / RAND_MAX * 3000;
+    dev->y = (double)rand_r(&w->seed) / RAND_MAX * 3000;
+    dev->heading = (double)rand_r(&w->seed) / RAND_MAX * 2 * M_PI;
+    dev->mac[0] = 0x5c;
+    dev->mac[1] = 0xcf;
+    dev->mac[2] = (uint8_t)(index >> 24);
+    dev->mac[3] = (uint8_t)(index >> 16);
+    dev->mac[4] = (uint8_t)(index >> 8);
+    dev->mac[5] = (uint8_t)index;
+    dev->ip[0] = 10;
+    dev->ip[1] = (uint8_t)(index >> 16);
+    dev->ip[2] = (uint8_t)(index >> 8);
+    dev->ip[3] = (uint8_t)index;
+
+    struct location_rq_t *rq = &dev->rq;
+    rq->key = keys[index % key_count];
+    rq->payload_ext.payload.sw_version = 1;
+    rq->payload_ext.payload.type = LOCATION_RQ_ADDR;
+    rq->mac_count = 1;
+    rq->mac = dev->mac;
+    rq->ip_count = 1;
+    rq->ip_type = DATA_TYPE_IPV4;
+    rq->ip_addr = dev->ip;
+    rq->aps = dev->aps;
+
+    sky_client_init(&dev->client, dev->buff, sizeof(dev->buff), device_send, device_recv, dev, query_done, dev);
+    if (retry_ms)
+        sky_client_set_datagram(&dev->client, retry_ms);
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static void print_percentiles(const uint64_t *hist, uint64_t total) {
+    printf("latency us p50 %llu, p90 %llu, p99 %llu, p99.9 %llu",
+            (unsigned long long)hist_percentile(hist, total, 0.5),
+            (unsigned long long)hist_percentile(hist, total, 0.9),
+            (unsigned long long)hist_percentile(hist, total, 0.99),
+            (unsigned long long)hist_percentile(hist, total, 0.999));
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s -k partner_id:aes_key_hex [-k ...] [-u elg://host:port/] [-n devices]\n"
+            "       [-q requests_per_s] [-d duration_s] [-T timeout_ms] [-v protocol_version]\n"
+            "       [-U retry_timeout_ms] [-t threads] [-s stats_interval_s] [-c capture_file]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t devices = 1000, threads = 1, interval = 5, duration = 0;
+    const char *capture_file = NULL;
+    sky_capture_writer_t capture;
+    bool ok = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "k:u:n:q:d:T:v:U:t:s:c:")) != -1) {
+        switch (opt) {
+        case 'k':
+            ok &= key_count < MAX_KEYS && parse_key(optarg, &keys[key_count]);
+            key_count++;
+            break;
+        case 'u':
+            ok &= strlen(optarg) < sizeof(url);
+            if (ok)
+                strcpy(url, optarg);
+            break;
+        case 'n':
+            devices = (uint32_t)atol(optarg);
+            break;
+        case 'q':
+            qps = atof(optarg);
+            break;
+        case 'd':
+            duration = (uint32_t)atol(optarg);
+            break;
+        case 'T':
+            timeout_ms = (uint32_t)atol(optarg);
+            break;
+        case 'v':
+            version = (uint32_t)atol(optarg);
+            break;
+        case 'U':
+            retry_ms = (uint32_t)atol(optarg);
+            ok &= retry_ms > 0;
+            break;
+        case 't':
+            threads = (uint32_t)atol(optarg);
+            break;
+        case 's':
+            interval = (uint32_t)atol(optarg);
+            break;
+        case 'c':
+            capture_file = optarg;
+            break;
+        default:
+            ok = false;
+            break;
+        }
+    }
+    if (!ok || key_count == 0 || devices == 0 || threads == 0 || threads > devices || interval == 0
+            || timeout_ms == 0 || qps < 0 || (version != SKY_PROTOCOL_VERSION && version != SKY_PROTOCOL_VERSION_2)
+            || (retry_ms && version != SKY_PROTOCOL_VERSION_2)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!resolve(url)) {
+        fprintf(stderr, "cannot resolve %s\n", url);
+        return 1;
+    }
+    if (capture_file != NULL) {
+        if (!sky_capture_open(&capture, capture_file, SKY_CAPTURE_ALL)) {
+            fprintf(stderr, "cannot open capture file %s\n", capture_file);
+            return 1;
+        }
+        sky_set_capture(sky_capture_frame, &capture);
+    }
+    if (qps > 0)
+        period_us = (uint64_t)(devices * 1e6 / qps);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    struct worker_t *workers = calloc(threads, sizeof(*workers));
+    if (workers == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    uint64_t start = now_us();
+    uint32_t i, d;
+    for (i = 0; i < threads; i++) {
+        struct worker_t *w = &workers[i];
+        uint32_t first = (uint32_t)((uint64_t)devices * i / threads);
+        w->device_count = (uint32_t)((uint64_t)devices * (i + 1) / threads) - first;
+        w->devices = calloc(w->device_count, sizeof(*w->devices));
+        w->seed = 12345 + i;
+        w->epfd = epoll_create1(0);
+        if (w->devices == NULL || w->epfd < 0) {
+            perror("setup");
+            return 1;
+        }
+        for (d = 0; d < w->device_count; d++) {
+            // spread the first queries over one period (or 100 ms), so that the devices do not
+            // start in lock step
+            uint64_t spread = period_us ? period_us : 100000;
+            init_device(w, &w->devices[d], first + d, start + spread * (first + d) / devices);
+            timer_push(w, w->devices[d].next_at, &w->devices[d]);
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    printf("elg_loadgen: %u devices, %u threads, %s %s v%u, %s\n", devices, threads, url,
+            retry_ms ? "udp" : "tcp", version, qps > 0 ? "open loop" : "closed loop");
+    fflush(stdout);
+
+    // report every interval
+    uint64_t hist[HIST_BUCKETS], last[HIST_BUCKETS], delta[HIST_BUCKETS];
+    uint64_t last_requests = 0, last_failures = 0, last_in = 0, last_out = 0;
+    uint64_t from = start;
+    uint32_t b;
+    memset(last, 0, sizeof(last));
+    while (!stop) {
+        while (!stop && now_us() - from < (uint64_t)interval * 1000000) {
+            usleep(100000);
+            if (duration > 0 && now_us() - start >= (uint64_t)duration * 1000000)
+                stop = 1;
+        }
+        uint64_t requests = 0, failures = 0, in = 0, out = 0, total = 0;
+        memset(hist, 0, sizeof(hist));
+        for (i = 0; i < threads; i++) {
+            requests += STAT_GET(workers[i].requests) + STAT_GET(workers[i].rejected);
+            failures += STAT_GET(workers[i].failures);
+            in += STAT_GET(workers[i].bytes_in);
+            out += STAT_GET(workers[i].bytes_out);
+            for (b = 0; b < HIST_BUCKETS; b++)
+                hist[b] += STAT_GET(workers[i].hist[b]);
+        }
+        for (b = 0; b < HIST_BUCKETS; b++) {
+            delta[b] = hist[b] - last[b];
+            total += delta[b];
+        }
+        uint64_t now = now_us();
+        double secs = (now - from) / 1e6;
+        printf("%.0f req/s, %llu failed, out %.1f KB/s, in %.1f KB/s, ",
+                (requests - last_requests) / secs, (unsigned long long)(failures - last_failures),
+                (out - last_out) / secs / 1024, (in - last_in) / secs / 1024);
+        print_percentiles(delta, total);
+        printf("\n");
+        fflush(stdout);
+        memcpy(last, hist, sizeof(last));
+        last_requests = requests;
+        last_failures = failures;
+        last_in = in;
+        last_out = out;
+        from = now;
+    }
+    for (i = 0; i < threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    if (capture_file != NULL) {
+        sky_set_capture(NULL, NULL);
+        if (!sky_capture_close(&capture))
+            fprintf(stderr, "failed to write capture file %s\n", capture_file);
+    }
+
+    // summary of the whole run
+    uint64_t requests = 0, rejected = 0, failures = 0, connects = 0, connect_errors = 0, late = 0;
+    uint64_t in = 0, out = 0, total = 0, status[STATUS_CLASSES];
+    double secs = (now_us() - start) / 1e6;
+    memset(hist, 0, sizeof(hist));
+    memset(status, 0, sizeof(status));
+    for (i = 0; i < threads; i++) {
+        struct worker_t *w = &workers[i];
+        requests += w->requests;
+        rejected += w->rejected;
+        failures += w->failures;
+        connects += w->connects;
+        connect_errors += w->connect_errors;
+        late += w->late;
+        in += w->bytes_in;
+        out += w->bytes_out;
+        for (b = 0; b < HIST_BUCKETS; b++)
+            hist[b] += w->hist[b];
+        for (b = 0; b < STATUS_CLASSES; b++)
+            status[b] += w->status[b];
+    }
+    for (b = 0; b < HIST_BUCKETS; b++)
+        total += hist[b];
+    printf("\n%.1f s: %llu located (%.0f/s), %llu without location, %llu failed, %llu late starts\n", secs,
+            (unsigned long long)requests, requests / secs, (unsigned long long)rejected,
+            (unsigned long long)failures, (unsigned long long)late);
+    printf("%llu connects (%llu failed), %llu bytes out (%.0f per request), %llu bytes in\n",
+            (unsigned long long)connects, (unsigned long long)connect_errors, (unsigned long long)out,
+            total + failures ? (double)out / (total + failures) : 0.0, (unsigned long long)in);
+    print_percentiles(hist, total);
+    printf("\n");
+    for (b = 0; b < STATUS_CLASSES; b++) {
+        if (status[b] == 0)
+            continue;
+        const char *name = status_name(b);
+        if (name != NULL)
+            printf("  %-16s %llu\n", name, (unsigned long long)status[b]);
+        else if (b == STATUS_CLASSES - 1)
+            printf("  %-16s %llu\n", "other", (unsigned long long)status[b]);
+        else
+            printf("  status %-9u %llu\n", b, (unsigned long long)status[b]);
+    }
+    return failures > 0;
+}
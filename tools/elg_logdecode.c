@@ -0,0 +1,290 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ * Decodes the binary log records (sky_log.h) which the device sends over
+ * serial: the format strings are looked up by their addresses in the ELF
+ * file of the firmware which wrote them, and formatted with the arguments
+ * of the records. Text between the records is passed through as it is.
+ * Records missing from the sequence (dropped by the device because its
+ * ring was full, or lost) are reported.
+ *
+ * build (host, linux):
+ *   gcc -O2 -I../elg_client_demo -o elg_logdecode elg_logdecode.c
+ *
+ * usage:
+ *   elg_logdecode -e firmware.elf [serial_capture]
+ *   e.g. stty -F /dev/ttyUSB0 115200 raw && elg_logdecode -e elg_client_demo.ino.elf < /dev/ttyUSB0
+ ************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "sky_log.h"
+
+#define MAX_SECTIONS    256
+#define READ_SIZE       4096
+
+typedef struct {
+    uint64_t addr;
+    uint64_t size;
+    const char *data;
+} section_t;
+
+static section_t sections[MAX_SECTIONS];
+static int section_count;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s -e firmware.elf [serial_capture]\n", prog);
+    exit(1);
+}
+
+// load the allocated sections of the ELF file (32 or 64 bit, little endian)
+static bool load_elf(const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0)
+        return false;
+    char *elf = malloc(st.st_size);
+    if (elf == NULL || read(fd, elf, st.st_size) != st.st_size) {
+        close(fd);
+        return false;
+    }
+    close(fd);
+    if (st.st_size < EI_NIDENT || memcmp(elf, ELFMAG, SELFMAG) != 0 || elf[EI_DATA] != ELFDATA2LSB)
+        return false;
+
+    uint64_t shoff, shnum, shentsize;
+    if (elf[EI_CLASS] == ELFCLASS32) {
+        const Elf32_Ehdr *eh = (const Elf32_Ehdr *)elf;
+        shoff = eh->e_shoff, shnum = eh->e_shnum, shentsize = eh->e_shentsize;
+    } else if (elf[EI_CLASS] == ELFCLASS64) {
+        const Elf64_Ehdr *eh = (const Elf64_Ehdr *)elf;
+        shoff = eh->e_shoff, shnum = eh->e_shnum, shentsize = eh->e_shentsize;
+    } else {
+        return false;
+    }
+    if (shoff + shnum * shentsize > (uint64_t)st.st_size)
+        return false;
+    for (uint64_t i = 0; i < shnum && section_count < MAX_SECTIONS; i++) {
+        const char *sh = elf + shoff + i * shentsize;
+        uint64_t type, flags, addr, offset, size;
+        if (elf[EI_CLASS] == ELFCLASS32) {
+            const Elf32_Shdr *s = (const Elf32_Shdr *)sh;
+            type = s->sh_type, flags = s->sh_flags, addr = s->sh_addr, offset = s->sh_offset, size = s->sh_size;
+        } else {
+            const Elf64_Shdr *s = (const Elf64_Shdr *)sh;
+            type = s->sh_type, flags = s->sh_flags, addr = s->sh_addr, offset = s->sh_offset, size = s->sh_size;
+        }
+        if (!(flags & SHF_ALLOC) || type == SHT_NOBITS || offset + size > (uint64_t)st.st_size)
+            continue;
+        sections[section_count].addr = addr;
+        sections[section_count].size = size;
+        sections[section_count].data = elf + offset;
+        section_count++;
+    }
+    return section_count > 0;
+}
+
+// returns the string at the (32 bit) address in the firmware, or NULL
+static const char *elf_string(uint32_t addr) {
+    for (int i = 0; i < section_count; i++) {
+        const section_t *s = &sections[i];
+        if ((s->addr & 0xffffffff) <= addr && addr - (s->addr & 0xffffffff) < s->size) {
+            uint64_t off = addr - (s->addr & 0xffffffff);
+            if (memchr(s->data + off, '\0', s->size - off) == NULL)
+                return NULL;
+            return s->data + off;
+        }
+    }
+    return NULL;
+}
+
+// print fmt with the arguments of a record, as printf() would have on the device
+static void print_format(const char *fmt, const uint32_t *args, uint32_t nargs) {
+    uint32_t a = 0;
+    char spec[32];
+    const char *p = fmt;
+    while (*p != '\0') {
+        if (*p != '%') {
+            putchar(*p++);
+            continue;
+        }
+        if (p[1] == '%') {
+            putchar('%');
+            p += 2;
+            continue;
+        }
+        // %[flags][width][.precision][length]conversion
+        size_t n = strspn(p + 1, "-+ #0123456789.") + 1;
+        int longs = 0;
+        while (p[n] == 'l' || p[n] == 'h' || p[n] == 'z' || p[n] == 'j' || p[n] == 't') {
+            longs += (p[n] == 'l');
+            n++;
+        }
+        char conv = p[n];
+        if (conv == '\0' || n + 3 > sizeof(spec)) {
+            fputs(p, stdout);
+            return;
+        }
+        // the spec without the length modifiers, which the arguments do not have
+        size_t flags = strspn(p + 1, "-+ #0123456789.") + 1;
+        memcpy(spec, p, flags);
+        p += n + 1;
+        bool is_double = (conv == 'f' || conv == 'F' || conv == 'e' || conv == 'E' || conv == 'g'
+                || conv == 'G') && longs > 0;
+        if (a + (is_double ? 2 : 1) > nargs) {
+            fputs("<?>", stdout);
+            continue;
+        }
+        switch (conv) {
+        case 'd': case 'i':
+            spec[flags] = conv, spec[flags + 1] = '\0';
+            printf(spec, (int32_t)args[a++]);
+            break;
+        case 'u': case 'x': case 'X': case 'o': case 'c':
+            spec[flags] = conv, spec[flags + 1] = '\0';
+            printf(spec, args[a++]);
+            break;
+        case 'p':
+            printf("0x%08x", args[a++]);
+            break;
+        case 's': {
+            const char *s = elf_string(args[a++]);
+            spec[flags] = 's', spec[flags + 1] = '\0';
+            printf(spec, s != NULL ? s : "<?>");
+            break;
+        }
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': {
+            double d;
+            if (is_double) {
+                uint64_t u = (uint64_t)args[a + 1] << 32 | args[a];
+                memcpy(&d, &u, sizeof(d));
+                a += 2;
+            } else {
+                float f;
+                memcpy(&f, &args[a++], sizeof(f));
+                d = f;
+            }
+            spec[flags] = conv, spec[flags + 1] = '\0';
+            printf(spec, d);
+            break;
+        }
+        default:
+            fputs("<?>", stdout);
+            a++;
+            break;
+        }
+    }
+}
+
+static void print_record(const sky_log_record_t *r, const uint32_t *args, const uint8_t *data) {
+    static const char levels[] = "?EWID";
+    const char *fmt = elf_string(r->fmt);
+    uint32_t nargs = r->kind_nargs & 0x0f, i;
+
+    printf("[%6u.%03u] %c ", r->time / 1000, r->time % 1000, levels[r->level]);
+    switch (r->kind_nargs >> 4) {
+    case SKY_LOG_KIND_FORMAT:
+        print_format(fmt, args, nargs);
+        putchar('\n');
+        break;
+    case SKY_LOG_KIND_HEX:
+        printf("%s (%u bytes):\n", fmt, r->len);
+        for (i = 0; i < r->len; i++)
+            printf("%02X%c", data[i], (i % 16 == 15 || i + 1 == r->len) ? '\n' : ' ');
+        break;
+    case SKY_LOG_KIND_TEXT:
+        printf("%s%.*s\n", fmt, (int)r->len, (const char *)data);
+        break;
+    }
+}
+
+// returns the length of a valid record at the start of buff, 0 if more bytes are needed, or -1 if
+// it is no record
+static int32_t record_len(const uint8_t *buff, size_t len) {
+    sky_log_record_t r;
+    if (len < sizeof(r))
+        return (len < 2 || buff[1] == SKY_LOG_SYNC1) ? 0 : -1;
+    memcpy(&r, buff, sizeof(r));
+    uint32_t nargs = r.kind_nargs & 0x0f, kind = r.kind_nargs >> 4;
+    if (r.sync[0] != SKY_LOG_SYNC0 || r.sync[1] != SKY_LOG_SYNC1
+            || r.level < SKY_LOG_LEVEL_ERROR || r.level > SKY_LOG_LEVEL_DEBUG
+            || kind > SKY_LOG_KIND_TEXT || nargs > SKY_LOG_MAX_ARGS || r.len > SKY_LOG_DATA_MAX
+            || (kind != SKY_LOG_KIND_FORMAT && nargs != 0) || elf_string(r.fmt) == NULL)
+        return -1;
+    size_t n = sizeof(r) + nargs * sizeof(uint32_t) + ((r.len + 3) & ~3u);
+    return (len < n) ? 0 : (int32_t)n;
+}
+
+int main(int argc, char **argv) {
+    const char *elf_path = NULL;
+    static uint8_t buff[2 * SKY_LOG_RECORD_MAX + READ_SIZE];
+    size_t len = 0;
+    bool eof = false, first = true;
+    uint16_t next_seq = 0;
+    int opt, fd = STDIN_FILENO;
+
+    while ((opt = getopt(argc, argv, "e:")) != -1) {
+        if (opt == 'e')
+            elf_path = optarg;
+        else
+            usage(argv[0]);
+    }
+    if (elf_path == NULL)
+        usage(argv[0]);
+    if (!load_elf(elf_path)) {
+        fprintf(stderr, "cannot read the sections of %s\n", elf_path);
+        return 1;
+    }
+    if (optind < argc && (fd = open(argv[optind], O_RDONLY)) < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    while (!eof || len > 0) {
+        if (!eof && len < sizeof(buff) - READ_SIZE) {
+            ssize_t n = read(fd, buff + len, READ_SIZE);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                eof = true;
+            else
+                len += n;
+        }
+        size_t pos = 0;
+        while (pos < len) {
+            uint8_t *sync = memchr(buff + pos, SKY_LOG_SYNC0, len - pos);
+            size_t text = (sync != NULL) ? (size_t)(sync - buff) - pos : len - pos;
+            fwrite(buff + pos, 1, text, stdout);
+            pos += text;
+            if (pos == len)
+                break;
+            int32_t n = record_len(buff + pos, len - pos);
+            if (n == 0 && !eof)
+                break; // wait for the rest of the record
+            if (n <= 0) {
+                putchar(buff[pos++]); // text after all
+                continue;
+            }
+            sky_log_record_t r;
+            memcpy(&r, buff + pos, sizeof(r));
+            if (!first && r.seq != next_seq)
+                printf("[%u records dropped]\n", (uint16_t)(r.seq - next_seq));
+            first = false;
+            next_seq = r.seq + 1;
+            uint32_t args[SKY_LOG_MAX_ARGS];
+            memcpy(args, buff + pos + sizeof(r), (r.kind_nargs & 0x0f) * sizeof(uint32_t));
+            print_record(&r, args, buff + pos + sizeof(r) + (r.kind_nargs & 0x0f) * sizeof(uint32_t));
+            pos += n;
+        }
+        memmove(buff, buff + pos, len - pos);
+        len -= pos;
+        fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,322 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ * Replays a capture file of ELG traffic (sky_capture.h), memory mapped:
+ *
+ *   decode  plain request frames go through the batch decoder
+ *           (sky_batch_decode(), up to -b frames per batch) and plain
+ *           response frames through sky_decode_resp_bin(); with a key file
+ *           (-f), encrypted request frames are also decrypted and decoded
+ *   send    encrypted request frames are sent to the server (-u) over TCP,
+ *           one at a time, each waiting for the whole response frame
+ *
+ * Frames are replayed at full speed, or paced (-p speed) by the times they
+ * were captured at, speed times as fast. Frames/s, MB/s and failures are
+ * printed at the end.
+ *
+ * build (host, linux):
+ *   gcc -O2 -pthread -I../elg_client_demo -o elg_replay elg_replay.c sky_capture.c sky_batch.c \
+ *       sky_keystore.c ../elg_client_demo/sky_protocol.c ../elg_client_demo/sky_crypt.c \
+ *       ../elg_client_demo/mauth.c ../elg_client_demo/hmac256.c ../elg_client_demo/aes.c
+ *
+ * usage:
+ *   elg_replay [-m decode|send] [-u elg://host:port/] [-f key_file] [-p speed] [-b batch]
+ *              [-i iterations] capture_file
+ ************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "sky_crypt.h"
+#include "sky_batch.h"
+#include "sky_capture.h"
+#include "sky_keystore.h"
+
+#define MAX_BATCH       4096
+#define RECV_TIMEOUT_S  5
+
+struct replay_t {
+    sky_capture_map_t map;
+    double speed;           // 0 for full speed
+    uint64_t start_us;      // replay time of the first frame
+    uint64_t first_us;      // capture time of the first frame
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t failed;
+};
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// returns the time (us) until the frame captured at time_us is due, or 0 when it is
+static uint64_t replay_due_in(const struct replay_t *r, uint64_t time_us) {
+    if (r->speed <= 0 || time_us < r->first_us)
+        return 0;
+    uint64_t due = r->start_us + (uint64_t)((time_us - r->first_us) / r->speed);
+    uint64_t now = now_us();
+    return due > now ? due - now : 0;
+}
+
+static void replay_wait(const struct replay_t *r, uint64_t time_us) {
+    uint64_t wait = replay_due_in(r, time_us);
+    if (wait > 0)
+        usleep(wait);
+}
+
+// batch of plain request frames
+struct batch_t {
+    sky_batch_t batch;
+    uint8_t *buffs[MAX_BATCH];
+    uint32_t lens[MAX_BATCH];
+    uint32_t count;
+};
+
+static void flush_batch(struct replay_t *r, struct batch_t *b) {
+    if (b->count == 0)
+        return;
+    sky_batch_reset(&b->batch);
+    int32_t n = sky_batch_decode(&b->batch, b->buffs, b->lens, b->count);
+    r->failed += (n < 0) ? b->count : b->count - n;
+    b->count = 0;
+}
+
+static void run_decode(struct replay_t *r, sky_keystore_t *keystore, uint32_t batch_size) {
+    static uint8_t buff[SKY_PROT_BUFF_LEN];
+    static struct batch_t b;
+    struct location_rq_t rq;
+    struct location_rsp_t rsp;
+    uint64_t i;
+    sky_batch_init(&b.batch);
+    for (i = 0; i < r->map.count; i++) {
+        sky_capture_record_t *rec = sky_capture_get(&r->map, i);
+        uint8_t *frame = sky_capture_frame_data(rec);
+        if (r->speed > 0 && replay_due_in(r, rec->time_us) > 0) {
+            flush_batch(r, &b); // decode what arrived before waiting
+            replay_wait(r, rec->time_us);
+        }
+        switch (rec->kind) {
+        case SKY_CAPTURE_RQ_PLAIN:
+            b.buffs[b.count] = frame;
+            b.lens[b.count] = rec->len;
+            if (++b.count == batch_size)
+                flush_batch(r, &b);
+            break;
+        case SKY_CAPTURE_RSP_PLAIN:
+            memset(&rsp, 0, sizeof(rsp));
+            if (sky_decode_resp_bin(frame, rec->len, &rsp) < 0)
+                r->failed++;
+            break;
+        case SKY_CAPTURE_RQ_CIPHER: {
+            if (keystore == NULL || rec->len > sizeof(buff))
+                continue;
+            // decrypt a copy, the capture is replayed again on the next iteration
+            uint32_t header_len = 0;
+            memcpy(buff, frame, rec->len);
+            const struct sky_key_t *key = sky_keystore_lookup_rq(keystore, buff, rec->len);
+            memset(&rq, 0, sizeof(rq));
+            if (key == NULL || sky_get_frame_len(buff, rec->len, true, &header_len) != (int32_t)rec->len
+                    || sky_aes_decrypt(buff + header_len, rec->len - header_len - sizeof(sky_checksum_t),
+                            (uint8_t *)key->aes_key, buff + header_len - sizeof(rq.header.iv)) != 0
+                    || sky_decode_req_bin(buff, rec->len, &rq) < 0)
+                r->failed++;
+            break;
+        }
+        default:
+            continue; // encrypted responses need the key of their request
+        }
+        r->frames++;
+        r->bytes += rec->len;
+    }
+    flush_batch(r, &b);
+    sky_batch_free(&b.batch);
+}
+
+static int connect_server(const char *url) {
+    char host[HOST_SIZE], port[PORT_SIZE];
+    uint16_t port_num;
+    struct addrinfo hints, *res;
+    if (!sky_parse_url((char *)url, host, &port_num))
+        return -1;
+    snprintf(port, sizeof(port), "%u", port_num);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+    int fd = socket(res->ai_family, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    struct timeval tv = { RECV_TIMEOUT_S, 0 };
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+// send the frame and receive the whole response frame; returns false when fails
+static bool exchange(int fd, const uint8_t *frame, uint32_t len, uint64_t *received) {
+    uint8_t buff[SKY_PROT_BUFF_LEN];
+    uint32_t got = 0, header_len = 0;
+    int32_t frame_len;
+    if (send(fd, frame, len, MSG_NOSIGNAL) != (ssize_t)len)
+        return false;
+    while ((frame_len = sky_get_frame_len(buff, got, false, &header_len)) == 0 || got < (uint32_t)frame_len) {
+        if (frame_len < 0 || frame_len > (int32_t)sizeof(buff))
+            return false;
+        // read no byte beyond the frame
+        uint32_t want = frame_len > 0 ? frame_len - got
+                : (got < sizeof(sky_rsp_header_t) ? sizeof(sky_rsp_header_t) - got : 1);
+        ssize_t n = recv(fd, buff + got, want, 0);
+        if (n <= 0)
+            return false;
+        got += n;
+    }
+    *received += got;
+    return frame_len > 0;
+}
+
+static void run_send(struct replay_t *r, const char *url, uint64_t *received, uint64_t *max_us, uint64_t *total_us) {
+    int fd = -1;
+    uint64_t i;
+    for (i = 0; i < r->map.count; i++) {
+        sky_capture_record_t *rec = sky_capture_get(&r->map, i);
+        if (rec->kind != SKY_CAPTURE_RQ_CIPHER)
+            continue;
+        replay_wait(r, rec->time_us);
+        if (fd < 0 && (fd = connect_server(url)) < 0) {
+            fprintf(stderr, "cannot connect to %s\n", url);
+            r->failed++;
+            return;
+        }
+        uint64_t start = now_us();
+        if (!exchange(fd, sky_capture_frame_data(rec), rec->len, received)) {
+            r->failed++;
+            close(fd); // the stream may hold a part of the response; reconnect
+            fd = -1;
+            continue;
+        }
+        uint64_t us = now_us() - start;
+        *total_us += us;
+        if (us > *max_us)
+            *max_us = us;
+        r->frames++;
+        r->bytes += rec->len;
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-m decode|send] [-u elg://host:port/] [-f key_file] [-p speed] [-b batch]\n"
+            "       [-i iterations] capture_file\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    const char *mode = "decode", *key_file = NULL;
+    char url[URL_SIZE] = "elg://127.0.0.1:9755/";
+    uint32_t batch_size = 64, iterations = 1, i;
+    struct replay_t r;
+    sky_keystore_t keystore;
+    sky_keystore_reader_t reader;
+    int opt;
+    memset(&r, 0, sizeof(r));
+    while ((opt = getopt(argc, argv, "m:u:f:p:b:i:")) != -1) {
+        switch (opt) {
+        case 'm':
+            mode = optarg;
+            break;
+        case 'u':
+            snprintf(url, sizeof(url), "%s", optarg);
+            break;
+        case 'f':
+            key_file = optarg;
+            break;
+        case 'p':
+            r.speed = atof(optarg);
+            break;
+        case 'b':
+            batch_size = (uint32_t)atol(optarg);
+            break;
+        case 'i':
+            iterations = (uint32_t)atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    bool send_mode = strcmp(mode, "send") == 0;
+    if (optind != argc - 1 || (!send_mode && strcmp(mode, "decode") != 0) || batch_size == 0
+            || batch_size > MAX_BATCH || iterations == 0 || r.speed < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!sky_capture_map(&r.map, argv[optind])) {
+        fprintf(stderr, "cannot read capture file %s\n", argv[optind]);
+        return 1;
+    }
+    if (key_file != NULL) {
+        uint32_t line;
+        sky_keystore_init(&keystore);
+        int32_t n = sky_keystore_load(&keystore, key_file, &line);
+        if (n == SKY_KEYSTORE_NO_FILE) {
+            fprintf(stderr, "cannot open key file %s: %s\n", key_file, strerror(errno));
+            return 1;
+        }
+        if (n < 0) {
+            fprintf(stderr, "cannot load keys from %s (line %u)\n", key_file, line);
+            return 1;
+        }
+        sky_keystore_register(&keystore, &reader);
+    }
+    uint64_t kinds[SKY_CAPTURE_RSP_PLAIN + 1];
+    memset(kinds, 0, sizeof(kinds));
+    for (i = 0; i < r.map.count; i++)
+        kinds[sky_capture_get(&r.map, i)->kind]++;
+    printf("%llu frames: %llu plain requests, %llu encrypted requests, %llu encrypted responses, %llu plain responses\n",
+            (unsigned long long)r.map.count, (unsigned long long)kinds[SKY_CAPTURE_RQ_PLAIN],
+            (unsigned long long)kinds[SKY_CAPTURE_RQ_CIPHER], (unsigned long long)kinds[SKY_CAPTURE_RSP_CIPHER],
+            (unsigned long long)kinds[SKY_CAPTURE_RSP_PLAIN]);
+    if (r.map.count > 0)
+        r.first_us = sky_capture_get(&r.map, 0)->time_us;
+
+    uint64_t received = 0, max_us = 0, total_us = 0;
+    uint64_t start = now_us();
+    for (i = 0; i < iterations; i++) {
+        r.start_us = now_us();
+        if (send_mode)
+            run_send(&r, url, &received, &max_us, &total_us);
+        else
+            run_decode(&r, key_file != NULL ? &keystore : NULL, batch_size);
+    }
+    double secs = (now_us() - start) / 1e6;
+
+    printf("%s: %llu frames in %.3f s, %.0f frames/s, %.1f MB/s, %llu failed\n", mode,
+            (unsigned long long)r.frames, secs, r.frames / secs, r.bytes / secs / (1024 * 1024),
+            (unsigned long long)r.failed);
+    if (send_mode && r.frames > 0)
+        printf("%llu bytes received, latency us mean %llu, max %llu\n", (unsigned long long)received,
+                (unsigned long long)(total_us / r.frames), (unsigned long long)max_us);
+
+    if (key_file != NULL) {
+        sky_keystore_unregister(&keystore, &reader);
+        sky_keystore_destroy(&keystore);
+    }
+    sky_capture_unmap(&r.map);
+    return r.failed > 0;
+}
@@ -0,0 +1,225 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ * Throughput of the request pipeline (sky_pipeline.h) from 1 to N decode
+ * workers, against decrypting, decoding, encoding and encrypting on one
+ * thread. The main thread is the reader: it copies encrypted requests of
+ * 5 to 30 access points into buffers of its pool and submits them.
+ *
+ * build (host, linux):
+ *   gcc -O2 -pthread -DAES_TLS=__thread -I../elg_client_demo -o pipeline_bench pipeline_bench.c \
+ *       sky_pipeline.c sky_keystore.c ../elg_client_demo/sky_protocol.c ../elg_client_demo/sky_crypt.c \
+ *       ../elg_client_demo/mauth.c ../elg_client_demo/hmac256.c ../elg_client_demo/aes.c
+ *
+ * usage:
+ *   pipeline_bench [-n requests] [-t max_workers] [-e workers_per_encoder]
+ ************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include "sky_crypt.h"
+#include "sky_pipeline.h"
+
+#define SAMPLES     64
+#define PARTNER_ID  2
+
+static uint8_t samples[SAMPLES][SKY_PROT_BUFF_LEN];
+static uint32_t sample_lens[SAMPLES];
+static uint64_t completed;
+static uint64_t failed;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// encrypted version 2 requests with random access points
+static bool make_samples(const struct sky_key_t *key) {
+    static uint8_t mac[MAC_SIZE] = {0x5c, 0xcf, 0x7f, 0x01, 0x02, 0x03};
+    static uint8_t ip[IPV4_SIZE] = {192, 168, 1, 2};
+    struct ap_t aps[MAX_APS];
+    uint32_t i, j;
+    srand(1);
+    for (i = 0; i < SAMPLES; i++) {
+        struct location_rq_t rq;
+        uint32_t header_len = 0;
+        memset(&rq, 0, sizeof(rq));
+        rq.key = *key;
+        rq.header.version = SKY_PROTOCOL_VERSION_2;
+        rq.request_id = i + 1;
+        rq.payload_ext.payload.sw_version = 1;
+        rq.payload_ext.payload.type = LOCATION_RQ_ADDR;
+        rq.mac_count = 1;
+        rq.mac = mac;
+        rq.ip_count = 1;
+        rq.ip_type = DATA_TYPE_IPV4;
+        rq.ip_addr = ip;
+        rq.ap_count = 5 + i % 26;
+        rq.aps = aps;
+        for (j = 0; j < rq.ap_count; j++) {
+            uint32_t k;
+            for (k = 0; k < MAC_SIZE; k++)
+                aps[j].MAC[k] = (uint8_t)rand();
+            aps[j].rssi = (int8_t)(-40 - rand() % 50);
+            aps[j].flag = BAND_2_4G << 1;
+        }
+        int32_t n = sky_encode_req_bin(samples[i], SKY_PROT_BUFF_LEN, &rq);
+        if (n < 0 || sky_get_frame_len(samples[i], n, true, &header_len) != n
+                || sky_aes_encrypt(samples[i] + header_len, n - header_len - sizeof(sky_checksum_t),
+                        rq.key.aes_key, samples[i] + header_len - sizeof(rq.header.iv)) != 0)
+            return false;
+        sample_lens[i] = n;
+    }
+    return true;
+}
+
+static bool handle(void *ctx, struct location_rq_t *rq, struct location_rsp_t *rsp) {
+    (void)ctx;
+    rsp->payload_ext.payload.sw_version = 1;
+    rsp->payload_ext.payload.type = LOCATION_RQ_ADDR_SUCCESS;
+    rsp->location_ext.mac_len = rq->mac_count * MAC_SIZE;
+    rsp->location_ext.mac = rq->mac;
+    rsp->location_ext.ip_type = rq->ip_type;
+    rsp->location_ext.ip_len = rq->ip_count * IPV4_SIZE;
+    rsp->location_ext.ip_addr = rq->ip_addr;
+    rsp->location.lat = 42.3601;
+    rsp->location.lon = -71.0589;
+    rsp->location.hpe = 25.0f;
+    return true;
+}
+
+static void done(void *ctx, void *conn, sky_buff_t *rsp, int32_t status) {
+    (void)ctx;
+    (void)conn;
+    (void)status;
+    if (rsp != NULL)
+        sky_buff_release(rsp);
+    else
+        __atomic_fetch_add(&failed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&completed, 1, __ATOMIC_RELEASE);
+}
+
+// requests/s on one thread without the pipeline
+static double run_single(sky_keystore_t *keystore, uint32_t requests) {
+    sky_buff_t *b = malloc(sizeof(*b));
+    uint8_t out[SKY_PROT_BUFF_LEN];
+    uint32_t i;
+    sky_keystore_reader_t reader;
+    sky_keystore_register(keystore, &reader);
+    double start = now_s();
+    for (i = 0; i < requests; i++) {
+        struct location_rq_t rq;
+        uint32_t s = i % SAMPLES, header_len = 0;
+        memcpy(b->data, samples[s], sample_lens[s]);
+        const struct sky_key_t *key = sky_keystore_lookup_rq(keystore, b->data, sample_lens[s]);
+        sky_get_frame_len(b->data, sample_lens[s], true, &header_len);
+        memcpy(b->aes_key, key->aes_key, sizeof(b->aes_key));
+        sky_aes_decrypt(b->data + header_len, sample_lens[s] - header_len - sizeof(sky_checksum_t),
+                b->aes_key, b->data + header_len - sizeof(rq.header.iv));
+        memset(&rq, 0, sizeof(rq));
+        memset(&b->rsp, 0, sizeof(b->rsp));
+        if (sky_decode_req_bin(b->data, sample_lens[s], &rq) < 0 || !handle(NULL, &rq, &b->rsp))
+            failed++;
+        b->rsp.header.version = rq.header.version;
+        b->rsp.request_id = rq.request_id;
+        int32_t n = sky_encode_resp_bin(out, sizeof(out), &b->rsp);
+        sky_get_frame_len(out, n, false, &header_len);
+        sky_aes_encrypt(out + header_len, n - header_len - sizeof(sky_checksum_t), b->aes_key,
+                out + header_len - sizeof(b->rsp.header.iv));
+        sky_keystore_quiescent(keystore, &reader);
+    }
+    double elapsed = now_s() - start;
+    sky_keystore_unregister(keystore, &reader);
+    free(b);
+    return requests / elapsed;
+}
+
+// requests/s through the pipeline
+static double run_pipeline(sky_keystore_t *keystore, sky_buff_pool_t *pool, uint32_t requests,
+        uint32_t workers, uint32_t encoders) {
+    sky_pipeline_t p;
+    uint32_t i;
+    completed = 0;
+    if (!sky_pipeline_start(&p, workers, encoders, keystore, handle, done, NULL)) {
+        fprintf(stderr, "failed to start the pipeline\n");
+        exit(1);
+    }
+    double start = now_s();
+    for (i = 0; i < requests; i++) {
+        uint32_t s = i % SAMPLES;
+        sky_buff_t *b;
+        while ((b = sky_buff_get(pool)) == NULL)
+            sched_yield();
+        memcpy(b->data, samples[s], sample_lens[s]);
+        b->len = sample_lens[s];
+        while (!sky_pipeline_submit(&p, b))
+            sched_yield();
+    }
+    while (__atomic_load_n(&completed, __ATOMIC_ACQUIRE) < requests)
+        sched_yield();
+    double elapsed = now_s() - start;
+    sky_pipeline_stop(&p);
+    return requests / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t requests = 200000, max_workers = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN), per_encoder = 2;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:e:")) != -1) {
+        switch (opt) {
+        case 'n':
+            requests = (uint32_t)atol(optarg);
+            break;
+        case 't':
+            max_workers = (uint32_t)atol(optarg);
+            break;
+        case 'e':
+            per_encoder = (uint32_t)atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n requests] [-t max_workers] [-e workers_per_encoder]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (requests == 0 || max_workers == 0 || per_encoder == 0) {
+        fprintf(stderr, "usage: %s [-n requests] [-t max_workers] [-e workers_per_encoder]\n", argv[0]);
+        return 1;
+    }
+
+    struct sky_key_t key;
+    sky_keystore_t keystore;
+    sky_buff_pool_t pool;
+    uint32_t i, w;
+    memset(&key, 0, sizeof(key));
+    key.partner_id = PARTNER_ID;
+    for (i = 0; i < sizeof(key.aes_key); i++)
+        key.aes_key[i] = (uint8_t)i;
+    sky_keystore_init(&keystore);
+    if (sky_keystore_set(&keystore, &key, 1) != 1 || !make_samples(&key)
+            || !sky_buff_pool_init(&pool, 2 * SKY_PIPELINE_RING)) {
+        fprintf(stderr, "setup failed\n");
+        return 1;
+    }
+
+    double single = run_single(&keystore, requests);
+    printf("%u requests, %u cores\n", requests, (unsigned int)sysconf(_SC_NPROCESSORS_ONLN));
+    printf("single thread:          %10.0f req/s\n", single);
+    double base = 0;
+    for (w = 1; w <= max_workers; w = (w < max_workers && 2 * w > max_workers) ? max_workers : 2 * w) {
+        uint32_t encoders = (w + per_encoder - 1) / per_encoder;
+        double rate = run_pipeline(&keystore, &pool, requests, w, encoders);
+        if (base == 0)
+            base = rate;
+        printf("%3u workers, %2u encoders: %10.0f req/s, %.2fx\n", w, encoders, rate, rate / base);
+    }
+    if (failed > 0)
+        printf("%llu requests failed\n", (unsigned long long)failed);
+
+    sky_buff_pool_free(&pool);
+    sky_keystore_destroy(&keystore);
+    return failed > 0;
+}
@@ -0,0 +1,240 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ * Batch request decoder, see sky_batch.h
+ ************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include "sky_batch.h"
+
+#define BATCH_MIN_CAPACITY  256
+
+// grow the ncols columns (of element sizes sizes) to hold at least need + 1 rows
+static bool batch_grow(void **cols[], const size_t *sizes, uint32_t ncols, uint32_t *capacity, uint32_t need) {
+    if (need <= *capacity)
+        return true;
+    uint32_t c = *capacity ? *capacity : BATCH_MIN_CAPACITY;
+    while (c < need)
+        c *= 2;
+    uint32_t i;
+    for (i = 0; i < ncols; i++) {
+        void *p = realloc(*cols[i], (size_t)(c + 1) * sizes[i]);
+        if (p == NULL)
+            return false; // the columns grown so far keep their rows
+        *cols[i] = p;
+    }
+    *capacity = c;
+    return true;
+}
+
+static bool batch_grow_requests(sky_batch_requests_t *t, uint32_t need) {
+    void **cols[] = { (void **)&t->type, (void **)&t->partner_id, (void **)&t->request_id,
+            (void **)&t->ap_start, (void **)&t->cell_start, (void **)&t->gps_start };
+    const size_t sizes[] = { sizeof(*t->type), sizeof(*t->partner_id), sizeof(*t->request_id),
+            sizeof(*t->ap_start), sizeof(*t->cell_start), sizeof(*t->gps_start) };
+    return batch_grow(cols, sizes, sizeof(sizes) / sizeof(sizes[0]), &t->capacity, need);
+}
+
+static bool batch_grow_aps(sky_batch_aps_t *t, uint32_t need) {
+    void **cols[] = { (void **)&t->mac, (void **)&t->rssi, (void **)&t->band, (void **)&t->connected,
+            (void **)&t->rq };
+    const size_t sizes[] = { sizeof(*t->mac), sizeof(*t->rssi), sizeof(*t->band), sizeof(*t->connected),
+            sizeof(*t->rq) };
+    return batch_grow(cols, sizes, sizeof(sizes) / sizeof(sizes[0]), &t->capacity, need);
+}
+
+static bool batch_grow_cells(sky_batch_cells_t *t, uint32_t need) {
+    void **cols[] = { (void **)&t->type, (void **)&t->mcc, (void **)&t->mnc, (void **)&t->area,
+            (void **)&t->id, (void **)&t->rssi, (void **)&t->age, (void **)&t->rq };
+    const size_t sizes[] = { sizeof(*t->type), sizeof(*t->mcc), sizeof(*t->mnc), sizeof(*t->area),
+            sizeof(*t->id), sizeof(*t->rssi), sizeof(*t->age), sizeof(*t->rq) };
+    return batch_grow(cols, sizes, sizeof(sizes) / sizeof(sizes[0]), &t->capacity, need);
+}
+
+static bool batch_grow_gps(sky_batch_gps_t *t, uint32_t need) {
+    void **cols[] = { (void **)&t->lat, (void **)&t->lon, (void **)&t->hpe, (void **)&t->alt,
+            (void **)&t->speed, (void **)&t->age, (void **)&t->nsat, (void **)&t->fix, (void **)&t->rq };
+    const size_t sizes[] = { sizeof(*t->lat), sizeof(*t->lon), sizeof(*t->hpe), sizeof(*t->alt),
+            sizeof(*t->speed), sizeof(*t->age), sizeof(*t->nsat), sizeof(*t->fix), sizeof(*t->rq) };
+    return batch_grow(cols, sizes, sizeof(sizes) / sizeof(sizes[0]), &t->capacity, need);
+}
+
+static inline uint64_t batch_mac(const uint8_t *m) {
+    return ((uint64_t)m[0] << 40) | ((uint64_t)m[1] << 32) | ((uint64_t)m[2] << 24)
+            | ((uint64_t)m[3] << 16) | ((uint64_t)m[4] << 8) | m[5];
+}
+
+static void batch_add_cell(sky_batch_cells_t *t, uint8_t type, uint16_t mcc, uint16_t mnc, uint16_t area,
+        uint32_t id, int8_t rssi, uint32_t age, uint32_t rq) {
+    uint32_t i = t->count++;
+    t->type[i] = type;
+    t->mcc[i] = mcc;
+    t->mnc[i] = mnc;
+    t->area[i] = area;
+    t->id[i] = id;
+    t->rssi[i] = rssi;
+    t->age[i] = age;
+    t->rq[i] = rq;
+}
+
+// append the rows of the request packet; returns false when out of memory
+static bool batch_decode_one(sky_batch_t *batch, uint8_t *buff, uint32_t len) {
+    sky_batch_requests_t *requests = &batch->requests;
+    uint32_t r = requests->count;
+    struct location_rq_t rq;
+    struct ap_t compact[MAX_APS];
+    struct ap_t *aps = NULL;
+    int32_t ap_count = 0;
+    uint32_t i;
+
+    if (!batch_grow_requests(requests, r + 1))
+        return false;
+    requests->type[r] = REQ_PAYLOAD_TYPE_NONE;
+    requests->partner_id[r] = sky_get_partner_id_from_rq_header(buff, len);
+    requests->request_id[r] = 0;
+    requests->ap_start[r] = batch->aps.count;
+    requests->cell_start[r] = batch->cells.count;
+    requests->gps_start[r] = batch->gps.count;
+
+    memset(&rq, 0, sizeof(rq));
+    if (sky_decode_req_bin(buff, len, &rq) < 0)
+        goto done; // a request row without access points, cells or gps
+
+    if (rq.ap_type == DATA_TYPE_AP_COMPACT && rq.ap_compact != NULL) {
+        ap_count = sky_decode_ap_compact(rq.ap_compact, rq.ap_compact_len, rq.ap_count, compact, MAX_APS);
+        aps = compact;
+    } else if (rq.aps != NULL) {
+        ap_count = rq.ap_count;
+        aps = rq.aps;
+    }
+    if (ap_count < 0)
+        goto done;
+    uint32_t cell_count = rq.gsm_count + rq.cdma_count + rq.umts_count + rq.lte_count;
+    if (!batch_grow_aps(&batch->aps, batch->aps.count + ap_count)
+            || !batch_grow_cells(&batch->cells, batch->cells.count + cell_count)
+            || !batch_grow_gps(&batch->gps, batch->gps.count + rq.gps_count))
+        return false;
+
+    requests->type[r] = rq.payload_ext.payload.type;
+    requests->request_id[r] = rq.request_id;
+
+    sky_batch_aps_t *a = &batch->aps;
+    for (i = 0; i < (uint32_t)ap_count; i++) {
+        uint32_t j = a->count++;
+        a->mac[j] = batch_mac(aps[i].MAC);
+        a->rssi[j] = aps[i].rssi;
+        a->band[j] = (aps[i].flag >> 1) & 0x07;
+        a->connected[j] = aps[i].flag & 0x01;
+        a->rq[j] = r;
+    }
+
+    // the cells and gps fixes point into the packet and may be unaligned
+    sky_batch_cells_t *c = &batch->cells;
+    for (i = 0; i < rq.gsm_count; i++) {
+        struct gsm_t gsm;
+        memcpy(&gsm, (const uint8_t *)rq.gsms + i * sizeof(gsm), sizeof(gsm));
+        batch_add_cell(c, DATA_TYPE_GSM, gsm.mcc, gsm.mnc, gsm.lac, gsm.ci, gsm.rssi, gsm.age, r);
+    }
+    for (i = 0; i < rq.cdma_count; i++) {
+        struct cdma_t cdma;
+        memcpy(&cdma, (const uint8_t *)rq.cdmas + i * sizeof(cdma), sizeof(cdma));
+        batch_add_cell(c, DATA_TYPE_CDMA, 0, cdma.sid, cdma.nid, cdma.bsid, cdma.rssi, cdma.age, r);
+    }
+    for (i = 0; i < rq.umts_count; i++) {
+        struct umts_t umts;
+        memcpy(&umts, (const uint8_t *)rq.umtss + i * sizeof(umts), sizeof(umts));
+        batch_add_cell(c, DATA_TYPE_UMTS, umts.mcc, umts.mnc, umts.lac, umts.ci, umts.rssi, umts.age, r);
+    }
+    for (i = 0; i < rq.lte_count; i++) {
+        struct lte_t lte;
+        memcpy(&lte, (const uint8_t *)rq.ltes + i * sizeof(lte), sizeof(lte));
+        batch_add_cell(c, DATA_TYPE_LTE, lte.mcc, lte.mnc, 0, lte.eucid, lte.rssi, lte.age, r);
+    }
+
+    sky_batch_gps_t *g = &batch->gps;
+    for (i = 0; i < rq.gps_count; i++) {
+        struct gps_t gps;
+        uint32_t j = g->count++;
+        memcpy(&gps, (const uint8_t *)rq.gps + i * sizeof(gps), sizeof(gps));
+        g->lat[j] = gps.lat;
+        g->lon[j] = gps.lon;
+        g->hpe[j] = gps.hpe;
+        g->alt[j] = gps.alt;
+        g->speed[j] = gps.speed;
+        g->age[j] = gps.age;
+        g->nsat[j] = gps.nsat;
+        g->fix[j] = gps.fix;
+        g->rq[j] = r;
+    }
+
+done:
+    requests->ap_start[r + 1] = batch->aps.count;
+    requests->cell_start[r + 1] = batch->cells.count;
+    requests->gps_start[r + 1] = batch->gps.count;
+    requests->count++;
+    return true;
+}
+
+void sky_batch_init(sky_batch_t *batch) {
+    memset(batch, 0, sizeof(*batch));
+}
+
+void sky_batch_reset(sky_batch_t *batch) {
+    batch->requests.count = 0;
+    batch->aps.count = 0;
+    batch->cells.count = 0;
+    batch->gps.count = 0;
+    if (batch->requests.capacity > 0) {
+        batch->requests.ap_start[0] = 0;
+        batch->requests.cell_start[0] = 0;
+        batch->requests.gps_start[0] = 0;
+    }
+}
+
+void sky_batch_free(sky_batch_t *batch) {
+    sky_batch_requests_t *r = &batch->requests;
+    sky_batch_aps_t *a = &batch->aps;
+    sky_batch_cells_t *c = &batch->cells;
+    sky_batch_gps_t *g = &batch->gps;
+    free(r->type);
+    free(r->partner_id);
+    free(r->request_id);
+    free(r->ap_start);
+    free(r->cell_start);
+    free(r->gps_start);
+    free(a->mac);
+    free(a->rssi);
+    free(a->band);
+    free(a->connected);
+    free(a->rq);
+    free(c->type);
+    free(c->mcc);
+    free(c->mnc);
+    free(c->area);
+    free(c->id);
+    free(c->rssi);
+    free(c->age);
+    free(c->rq);
+    free(g->lat);
+    free(g->lon);
+    free(g->hpe);
+    free(g->alt);
+    free(g->speed);
+    free(g->age);
+    free(g->nsat);
+    free(g->fix);
+    free(g->rq);
+    sky_batch_init(batch);
+}
+
+int32_t sky_batch_decode(sky_batch_t *batch, uint8_t * const *buffs, const uint32_t *lens, uint32_t count) {
+    int32_t decoded = 0;
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        if (!batch_decode_one(batch, buffs[i], lens[i]))
+            return -1;
+        if (batch->requests.type[batch->requests.count - 1] != REQ_PAYLOAD_TYPE_NONE)
+            decoded++;
+    }
+    return decoded;
+}
@@ -0,0 +1,101 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ * Batch request decoder for server side analytics: decodes many (decrypted)
+ * location requests and appends their access points, cells and gps fixes
+ * to columns (struct of arrays), so that lookups and aggregation over
+ * thousands of requests run over contiguous arrays.
+ *
+ * Every packet gets a request row, also when it fails to decode, so the
+ * request index of a row is the index of its packet since the last reset.
+ * The rows of request r are [ap_start[r], ap_start[r + 1]) in the access
+ * point columns, and likewise for cells and gps fixes.
+ *
+ * Access point deltas (LOCATION_RQ_DELTA) need the baseline scan and are
+ * not expanded; compact access points are.
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_BATCH_H
+#define SKY_BATCH_H
+
+#include "sky_protocol.h"
+
+typedef struct {
+    uint32_t count;
+    uint32_t capacity;
+    uint8_t *type;        // payload type, REQ_PAYLOAD_TYPE_NONE when the packet failed to decode
+    uint32_t *partner_id;
+    uint32_t *request_id;
+    uint32_t *ap_start;   // count + 1 entries
+    uint32_t *cell_start; // count + 1 entries
+    uint32_t *gps_start;  // count + 1 entries
+} sky_batch_requests_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t *mac;       // MAC address in the low 48 bits, first byte most significant
+    int8_t *rssi;
+    uint8_t *band;       // BAND_UNKNOWN, BAND_2_4G or BAND_5G
+    uint8_t *connected;  // 1 if the device is connected to the access point
+    uint32_t *rq;        // request index
+} sky_batch_aps_t;
+
+// gsm, umts and lte cells; cdma cells with mcc 0, sid as mnc, nid as area and bsid as id
+typedef struct {
+    uint32_t count;
+    uint32_t capacity;
+    uint8_t *type;  // DATA_TYPE_GSM, DATA_TYPE_CDMA, DATA_TYPE_UMTS or DATA_TYPE_LTE
+    uint16_t *mcc;
+    uint16_t *mnc;
+    uint16_t *area; // lac, nid, or 0 for lte
+    uint32_t *id;   // ci, bsid or eucid
+    int8_t *rssi;
+    uint32_t *age;
+    uint32_t *rq;   // request index
+} sky_batch_cells_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t capacity;
+    double *lat;
+    double *lon;
+    float *hpe;
+    float *alt;
+    float *speed;
+    uint32_t *age;
+    uint8_t *nsat;
+    uint8_t *fix;
+    uint32_t *rq;   // request index
+} sky_batch_gps_t;
+
+typedef struct {
+    sky_batch_requests_t requests;
+    sky_batch_aps_t aps;
+    sky_batch_cells_t cells;
+    sky_batch_gps_t gps;
+} sky_batch_t;
+
+// initialize an empty batch
+void sky_batch_init(sky_batch_t *batch);
+
+// remove all rows, keeping the memory for the next packets
+void sky_batch_reset(sky_batch_t *batch);
+
+// free the memory of the batch
+void sky_batch_free(sky_batch_t *batch);
+
+// decode count decrypted request packets (buffs[i] of lens[i] bytes) and append their rows
+// returns the number of packets decoded, or -1 when out of memory (the batch keeps the rows of
+// the packets before)
+int32_t sky_batch_decode(sky_batch_t *batch, uint8_t * const *buffs, const uint32_t *lens, uint32_t count);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,203 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ * Capture files of ELG traffic, see sky_capture.h
+ ************************************************/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sky_capture.h"
+
+#define CAPTURE_ALIGN(n)    (((n) + 7) & ~(uint64_t)7)
+
+// returns the offset of the record after the one at offset, or 0 when that one is not complete
+static uint64_t capture_next(const uint8_t *data, uint64_t size, uint64_t offset) {
+    sky_capture_record_t r;
+    if (offset + sizeof(r) > size)
+        return 0;
+    memcpy(&r, data + offset, sizeof(r));
+    if (r.kind < SKY_CAPTURE_RQ_PLAIN || r.kind > SKY_CAPTURE_RSP_PLAIN || r.len > size - offset - sizeof(r))
+        return 0;
+    uint64_t next = CAPTURE_ALIGN(offset + sizeof(r) + r.len);
+    return next <= size ? next : 0;
+}
+
+// read the index of the trailer; returns false when the file has no valid one
+static bool capture_read_index(sky_capture_map_t *m) {
+    sky_capture_trailer_t t;
+    uint64_t i;
+    if (m->size < sizeof(sky_capture_header_t) + sizeof(t))
+        return false;
+    memcpy(&t, m->data + m->size - sizeof(t), sizeof(t));
+    if (memcmp(t.magic, SKY_CAPTURE_INDEX_MAGIC, sizeof(t.magic)) != 0
+            || t.index_offset < sizeof(sky_capture_header_t) || t.index_offset % 8 != 0
+            || t.index_offset > m->size - sizeof(t)
+            || t.count != (m->size - sizeof(t) - t.index_offset) / sizeof(uint64_t))
+        return false;
+    const uint64_t *index = (const uint64_t *)(m->data + t.index_offset);
+    for (i = 0; i < t.count; i++) {
+        if (index[i] % 8 != 0 || index[i] < sizeof(sky_capture_header_t)
+                || capture_next(m->data, t.index_offset, index[i]) == 0)
+            return false;
+    }
+    m->index = index;
+    m->count = t.count;
+    m->end = t.index_offset;
+    return true;
+}
+
+// build the index by scanning the records; returns false when out of memory
+static bool capture_scan(sky_capture_map_t *m) {
+    uint64_t offset = sizeof(sky_capture_header_t), next, capacity = 0;
+    m->count = 0;
+    while ((next = capture_next(m->data, m->size, offset)) != 0) {
+        if (m->count == capacity) {
+            uint64_t *more;
+            capacity = capacity ? 2 * capacity : 1024;
+            if ((more = realloc(m->scanned, capacity * sizeof(*more))) == NULL)
+                return false;
+            m->scanned = more;
+        }
+        m->scanned[m->count++] = offset;
+        offset = next;
+    }
+    m->index = m->scanned;
+    m->end = offset;
+    return true;
+}
+
+bool sky_capture_map(sky_capture_map_t *m, const char *path) {
+    struct stat st;
+    sky_capture_header_t h;
+    memset(m, 0, sizeof(*m));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(h)) {
+        close(fd);
+        return false;
+    }
+    m->size = st.st_size;
+    m->data = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m->data == MAP_FAILED) {
+        m->data = NULL;
+        return false;
+    }
+    memcpy(&h, m->data, sizeof(h));
+    if (memcmp(h.magic, SKY_CAPTURE_MAGIC, sizeof(h.magic)) != 0 || h.version != SKY_CAPTURE_VERSION
+            || (!capture_read_index(m) && !capture_scan(m))) {
+        sky_capture_unmap(m);
+        return false;
+    }
+    madvise(m->data, m->size, MADV_SEQUENTIAL);
+    return true;
+}
+
+void sky_capture_unmap(sky_capture_map_t *m) {
+    if (m->data != NULL)
+        munmap(m->data, m->size);
+    free(m->scanned);
+    memset(m, 0, sizeof(*m));
+}
+
+static bool capture_append_index(sky_capture_writer_t *w, uint64_t offset) {
+    if (w->count == w->capacity) {
+        uint64_t *more;
+        uint64_t capacity = w->capacity ? 2 * w->capacity : 1024;
+        if ((more = realloc(w->index, capacity * sizeof(*more))) == NULL)
+            return false;
+        w->index = more;
+        w->capacity = capacity;
+    }
+    w->index[w->count++] = offset;
+    return true;
+}
+
+bool sky_capture_open(sky_capture_writer_t *w, const char *path, uint32_t kinds) {
+    sky_capture_map_t m;
+    uint64_t i;
+    memset(w, 0, sizeof(*w));
+    w->kinds = kinds;
+    pthread_mutex_init(&w->lock, NULL);
+
+    if (sky_capture_map(&m, path)) {
+        // append: keep the records, drop the index (or an incomplete record) after them
+        for (i = 0; i < m.count; i++) {
+            if (!capture_append_index(w, m.index[i])) {
+                sky_capture_unmap(&m);
+                return false;
+            }
+        }
+        w->end = m.end;
+        sky_capture_unmap(&m);
+        if (truncate(path, w->end) != 0 || (w->f = fopen(path, "r+b")) == NULL
+                || fseeko(w->f, w->end, SEEK_SET) != 0)
+            return false;
+        return true;
+    }
+    if (access(path, F_OK) == 0)
+        return false; // not a capture file, leave it alone
+    sky_capture_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SKY_CAPTURE_MAGIC, sizeof(h.magic));
+    h.version = SKY_CAPTURE_VERSION;
+    if ((w->f = fopen(path, "wb")) == NULL)
+        return false;
+    if (fwrite(&h, sizeof(h), 1, w->f) != 1) {
+        fclose(w->f);
+        w->f = NULL;
+        return false;
+    }
+    w->end = sizeof(h);
+    return true;
+}
+
+void sky_capture_frame(void *ctx, uint8_t kind, const uint8_t *buff, uint32_t len) {
+    static const uint8_t pad[8];
+    sky_capture_writer_t *w = ctx;
+    sky_capture_record_t r;
+    struct timespec ts;
+    if ((w->kinds & SKY_CAPTURE_KIND_BIT(kind)) == 0)
+        return;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    memset(&r, 0, sizeof(r));
+    r.time_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    r.len = len;
+    r.kind = kind;
+    uint64_t padded = CAPTURE_ALIGN(sizeof(r) + len);
+
+    pthread_mutex_lock(&w->lock);
+    if (!w->failed) {
+        if (fwrite(&r, sizeof(r), 1, w->f) != 1 || fwrite(buff, 1, len, w->f) != len
+                || fwrite(pad, 1, padded - sizeof(r) - len, w->f) != padded - sizeof(r) - len
+                || !capture_append_index(w, w->end))
+            w->failed = true;
+        w->end += padded;
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+bool sky_capture_close(sky_capture_writer_t *w) {
+    sky_capture_trailer_t t;
+    bool ok = !w->failed && w->f != NULL;
+    if (ok) {
+        memset(&t, 0, sizeof(t));
+        t.index_offset = w->end;
+        t.count = w->count;
+        memcpy(t.magic, SKY_CAPTURE_INDEX_MAGIC, sizeof(t.magic));
+        ok = fwrite(w->index, sizeof(*w->index), w->count, w->f) == w->count
+                && fwrite(&t, sizeof(t), 1, w->f) == 1;
+    }
+    if (w->f != NULL && fclose(w->f) != 0)
+        ok = false;
+    free(w->index);
+    pthread_mutex_destroy(&w->lock);
+    memset(w, 0, sizeof(*w));
+    return ok;
+}
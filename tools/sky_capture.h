@@ -0,0 +1,113 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ * Capture files of ELG traffic: the frames which the client library hands
+ * to its capture hook (sky_set_capture()), with timestamps, for replaying
+ * field traffic into the decoders or a server (see elg_replay.c).
+ *
+ * file layout (host byte order, all parts 8 byte aligned):
+ *   header   sky_capture_header_t
+ *   records  sky_capture_record_t followed by len bytes of the frame, padded
+ *   index    uint64_t offset of every record
+ *   trailer  sky_capture_trailer_t
+ *
+ * Records are only ever appended. The index and trailer are written when
+ * the writer closes, and replaced by the next writer which appends to the
+ * file; a file without them (e.g. the writer crashed) is read by scanning
+ * the records up to the last complete one.
+ *
+ * Note: plain frames hold the location data unencrypted.
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_CAPTURE_H
+#define SKY_CAPTURE_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include "sky_protocol.h"
+
+#define SKY_CAPTURE_MAGIC       "SKYCAP1"
+#define SKY_CAPTURE_INDEX_MAGIC "SKYIDX1"
+#define SKY_CAPTURE_VERSION     1
+
+// kinds mask for sky_capture_open()
+#define SKY_CAPTURE_KIND_BIT(kind)  (1u << (kind))
+#define SKY_CAPTURE_ALL     (SKY_CAPTURE_KIND_BIT(SKY_CAPTURE_RQ_PLAIN) | SKY_CAPTURE_KIND_BIT(SKY_CAPTURE_RQ_CIPHER) \
+        | SKY_CAPTURE_KIND_BIT(SKY_CAPTURE_RSP_CIPHER) | SKY_CAPTURE_KIND_BIT(SKY_CAPTURE_RSP_PLAIN))
+
+typedef struct {
+    char magic[8];      // SKY_CAPTURE_MAGIC
+    uint32_t version;   // SKY_CAPTURE_VERSION
+    uint32_t reserved;
+} sky_capture_header_t;
+
+typedef struct {
+    uint64_t time_us;   // wall clock time of the capture, us since the epoch
+    uint32_t len;       // bytes of the frame which follows
+    uint8_t kind;       // enum SKY_CAPTURE_KIND
+    uint8_t reserved[3];
+} sky_capture_record_t;
+
+typedef struct {
+    uint64_t index_offset; // offset of the index, which is also the end of the records
+    uint64_t count;        // # of records
+    char magic[8];         // SKY_CAPTURE_INDEX_MAGIC
+} sky_capture_trailer_t;
+
+typedef struct {
+    FILE *f;
+    uint32_t kinds;      // mask of the kinds of frames recorded
+    uint64_t end;        // offset of the end of the records
+    uint64_t *index;
+    uint64_t count;
+    uint64_t capacity;
+    bool failed;         // a write failed, no more frames are recorded
+    pthread_mutex_t lock;
+} sky_capture_writer_t;
+
+typedef struct {
+    uint8_t *data;       // mapped file, private copy on write (the decoders work in place)
+    size_t size;
+    const uint64_t *index;
+    uint64_t count;
+    uint64_t end;        // offset of the end of the records
+    uint64_t *scanned;   // index built by scanning, when the file has none
+} sky_capture_map_t;
+
+// create the capture file, or open it to append; records the frames of the kinds in the mask
+// (e.g. SKY_CAPTURE_ALL)
+// returns false when fails
+bool sky_capture_open(sky_capture_writer_t *w, const char *path, uint32_t kinds);
+
+// record a frame; a sky_capture_fn for sky_set_capture() with the writer as context, which
+// may be called by several threads
+void sky_capture_frame(void *ctx, uint8_t kind, const uint8_t *buff, uint32_t len);
+
+// write the index and close the file
+// returns false when a write failed
+bool sky_capture_close(sky_capture_writer_t *w);
+
+// map a capture file for reading
+// returns false when fails (not a capture file)
+bool sky_capture_map(sky_capture_map_t *m, const char *path);
+
+void sky_capture_unmap(sky_capture_map_t *m);
+
+// returns record i of the mapped file; its frame follows it
+static inline sky_capture_record_t *sky_capture_get(const sky_capture_map_t *m, uint64_t i) {
+    return (sky_capture_record_t *)(m->data + m->index[i]);
+}
+
+static inline uint8_t *sky_capture_frame_data(sky_capture_record_t *r) {
+    return (uint8_t *)(r + 1);
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,282 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ * Partner key store for servers, see sky_keystore.h
+ ************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "sky_keystore.h"
+
+#define KEYSTORE_LINE_LEN   2048
+
+// partner id 0 is never valid (sky_get_partner_id_from_rq_header() returns it for bad headers),
+// so it marks the empty slots
+struct sky_keystore_slot_t {
+    uint32_t partner_id;
+    uint32_t index; // in sky_keystore_table_t::keys
+};
+
+struct sky_keystore_table_t {
+    uint32_t mask;
+    uint32_t shift;
+    uint32_t count;
+    struct sky_keystore_slot_t *slots; // 8 slots per cache line, at most half of them used
+    struct sky_key_t *keys;
+};
+
+static inline uint32_t keystore_hash(const struct sky_keystore_table_t *t, uint32_t partner_id) {
+    return (partner_id * 2654435761u) >> t->shift; // Fibonacci hashing, partner ids are often sequential
+}
+
+static void keystore_free_table(struct sky_keystore_table_t *t) {
+    if (t == NULL)
+        return;
+    free(t->slots);
+    free(t->keys);
+    free(t);
+}
+
+// dup returns the index of a key whose partner id an earlier key has, when there is one (may be NULL)
+static struct sky_keystore_table_t *keystore_build_table(const struct sky_key_t *keys, uint32_t key_count,
+        uint32_t *dup) {
+    if (key_count > SKY_KEYSTORE_MAX_KEYS)
+        return NULL;
+    struct sky_keystore_table_t *t = calloc(1, sizeof(*t));
+    if (t == NULL)
+        return NULL;
+    uint32_t capacity = 16, bits = 4;
+    while (capacity < 2 * key_count) {
+        capacity <<= 1;
+        bits++;
+    }
+    t->mask = capacity - 1;
+    t->shift = 32 - bits;
+    t->count = key_count;
+    t->slots = aligned_alloc(64, capacity * sizeof(*t->slots));
+    t->keys = malloc((key_count > 0 ? key_count : 1) * sizeof(*t->keys));
+    if (t->slots == NULL || t->keys == NULL) {
+        keystore_free_table(t);
+        return NULL;
+    }
+    memset(t->slots, 0, capacity * sizeof(*t->slots));
+    memcpy(t->keys, keys, key_count * sizeof(*t->keys));
+
+    uint32_t i;
+    for (i = 0; i < key_count; i++) {
+        uint32_t partner_id = keys[i].partner_id;
+        uint32_t s = keystore_hash(t, partner_id);
+        if (partner_id == 0) {
+            keystore_free_table(t);
+            return NULL;
+        }
+        while (t->slots[s].partner_id != 0) {
+            if (t->slots[s].partner_id == partner_id) {
+                if (dup != NULL)
+                    *dup = i;
+                keystore_free_table(t);
+                return NULL;
+            }
+            s = (s + 1) & t->mask;
+        }
+        t->slots[s].partner_id = partner_id;
+        t->slots[s].index = i;
+    }
+    return t;
+}
+
+// wait until every online reader has passed a quiescent state; called with the lock held
+static void keystore_synchronize(sky_keystore_t *ks) {
+    uint64_t epoch = __atomic_add_fetch(&ks->epoch, 1, __ATOMIC_SEQ_CST);
+    sky_keystore_reader_t *r;
+    for (r = ks->readers; r != NULL; r = r->next) {
+        for (;;) {
+            uint64_t e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+            if (e == 0 || e >= epoch)
+                break;
+            sched_yield();
+        }
+    }
+}
+
+void sky_keystore_init(sky_keystore_t *ks) {
+    ks->table = NULL;
+    ks->epoch = 1;
+    ks->readers = NULL;
+    pthread_mutex_init(&ks->lock, NULL);
+}
+
+void sky_keystore_destroy(sky_keystore_t *ks) {
+    keystore_free_table(ks->table);
+    ks->table = NULL;
+    pthread_mutex_destroy(&ks->lock);
+}
+
+// swap the table t in and free the old one once no reader can see it
+static void keystore_replace(sky_keystore_t *ks, struct sky_keystore_table_t *t) {
+    pthread_mutex_lock(&ks->lock);
+    struct sky_keystore_table_t *old = __atomic_exchange_n(&ks->table, t, __ATOMIC_SEQ_CST);
+    keystore_synchronize(ks);
+    pthread_mutex_unlock(&ks->lock);
+    keystore_free_table(old);
+}
+
+int32_t sky_keystore_set(sky_keystore_t *ks, const struct sky_key_t *keys, uint32_t key_count) {
+    struct sky_keystore_table_t *t = keystore_build_table(keys, key_count, NULL);
+    if (t == NULL)
+        return -1;
+    keystore_replace(ks, t);
+    return (int32_t)key_count;
+}
+
+// parse "partner_id aes_key_hex [keyid [relay_url [relay_cred]]]"; returns false when malformed
+static bool keystore_parse_line(char *line, struct sky_key_t *key) {
+    char *save = NULL;
+    char *id = strtok_r(line, " \t\r\n", &save);
+    char *hex = strtok_r(NULL, " \t\r\n", &save);
+    char *keyid = strtok_r(NULL, " \t\r\n", &save);
+    char *url = strtok_r(NULL, " \t\r\n", &save);
+    char *cred = strtok_r(NULL, " \t\r\n", &save);
+    char *end = NULL;
+    uint32_t i;
+
+    memset(key, 0, sizeof(*key));
+    if (id == NULL || hex == NULL || strtok_r(NULL, " \t\r\n", &save) != NULL)
+        return false;
+    unsigned long partner_id = strtoul(id, &end, 10);
+    if (*end != '\0' || partner_id == 0 || partner_id > UINT32_MAX)
+        return false;
+    key->partner_id = (uint32_t)partner_id;
+    if (strlen(hex) != 2 * sizeof(key->aes_key))
+        return false;
+    for (i = 0; i < sizeof(key->aes_key); i++) {
+        unsigned int b;
+        if (sscanf(hex + 2 * i, "%2x", &b) != 1)
+            return false;
+        key->aes_key[i] = (uint8_t)b;
+    }
+    if (keyid != NULL) {
+        if (strlen(keyid) >= sizeof(key->keyid))
+            return false;
+        strcpy(key->keyid, keyid);
+    }
+    if (url != NULL) {
+        if (strlen(url) >= sizeof(key->relay.srv.url) || (cred != NULL && strlen(cred) >= sizeof(key->relay.srv.cred)))
+            return false;
+        strcpy(key->relay.srv.url, url);
+        if (cred != NULL)
+            strcpy(key->relay.srv.cred, cred);
+        key->relay.valid = 1;
+    }
+    return true;
+}
+
+int32_t sky_keystore_load(sky_keystore_t *ks, const char *path, uint32_t *line) {
+    FILE *f = fopen(path, "r");
+    char buff[KEYSTORE_LINE_LEN];
+    struct sky_key_t *keys = NULL;
+    uint32_t *lines = NULL; // of the keys
+    uint32_t key_count = 0, capacity = 0, n = 0, dup = UINT32_MAX;
+    struct sky_keystore_table_t *t;
+    int32_t ret = -1;
+
+    *line = 0;
+    if (f == NULL)
+        return SKY_KEYSTORE_NO_FILE;
+    while (fgets(buff, sizeof(buff), f) != NULL) {
+        n++;
+        size_t len = strlen(buff);
+        if (len == sizeof(buff) - 1 && buff[len - 1] != '\n') {
+            *line = n; // too long
+            goto done;
+        }
+        char *p = buff + strspn(buff, " \t\r\n");
+        if (*p == '\0' || *p == '#')
+            continue;
+        if (key_count == capacity) {
+            struct sky_key_t *more;
+            uint32_t *more_lines;
+            capacity = capacity ? 2 * capacity : 64;
+            if (capacity > SKY_KEYSTORE_MAX_KEYS || (more = realloc(keys, capacity * sizeof(*keys))) == NULL)
+                goto done;
+            keys = more;
+            if ((more_lines = realloc(lines, capacity * sizeof(*lines))) == NULL)
+                goto done;
+            lines = more_lines;
+        }
+        if (!keystore_parse_line(p, &keys[key_count])) {
+            *line = n;
+            goto done;
+        }
+        lines[key_count++] = n;
+    }
+    t = keystore_build_table(keys, key_count, &dup);
+    if (t == NULL) {
+        if (dup < key_count)
+            *line = lines[dup];
+        goto done;
+    }
+    keystore_replace(ks, t);
+    ret = (int32_t)key_count;
+done:
+    fclose(f);
+    free(keys);
+    free(lines);
+    return ret;
+}
+
+void sky_keystore_register(sky_keystore_t *ks, sky_keystore_reader_t *reader) {
+    pthread_mutex_lock(&ks->lock);
+    reader->epoch = __atomic_load_n(&ks->epoch, __ATOMIC_SEQ_CST);
+    reader->next = ks->readers;
+    ks->readers = reader;
+    pthread_mutex_unlock(&ks->lock);
+}
+
+void sky_keystore_unregister(sky_keystore_t *ks, sky_keystore_reader_t *reader) {
+    sky_keystore_reader_t **r;
+    pthread_mutex_lock(&ks->lock);
+    for (r = &ks->readers; *r != NULL; r = &(*r)->next) {
+        if (*r == reader) {
+            *r = reader->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ks->lock);
+}
+
+void sky_keystore_quiescent(sky_keystore_t *ks, sky_keystore_reader_t *reader) {
+    // the release store orders all earlier key reads before it
+    __atomic_store_n(&reader->epoch, __atomic_load_n(&ks->epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+void sky_keystore_offline(sky_keystore_t *ks, sky_keystore_reader_t *reader) {
+    (void)ks; // for symmetry with sky_keystore_online()
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+void sky_keystore_online(sky_keystore_t *ks, sky_keystore_reader_t *reader) {
+    __atomic_store_n(&reader->epoch, __atomic_load_n(&ks->epoch, __ATOMIC_ACQUIRE), __ATOMIC_SEQ_CST);
+    // a reload must see the reader online before the reader loads the table
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+const struct sky_key_t *sky_keystore_lookup(sky_keystore_t *ks, uint32_t partner_id) {
+    const struct sky_keystore_table_t *t = __atomic_load_n(&ks->table, __ATOMIC_ACQUIRE);
+    if (t == NULL || partner_id == 0)
+        return NULL;
+    uint32_t s = keystore_hash(t, partner_id);
+    for (;;) {
+        const struct sky_keystore_slot_t *slot = &t->slots[s];
+        if (slot->partner_id == partner_id)
+            return &t->keys[slot->index];
+        if (slot->partner_id == 0)
+            return NULL;
+        s = (s + 1) & t->mask;
+    }
+}
+
+const struct sky_key_t *sky_keystore_lookup_rq(sky_keystore_t *ks, uint8_t *buff, uint32_t buff_len) {
+    return sky_keystore_lookup(ks, sky_get_partner_id_from_rq_header(buff, buff_len));
+}
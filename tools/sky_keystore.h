@@ -0,0 +1,88 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ * Partner key store for servers: finds the key of the partner id in a
+ * request header in a hash table with open addressing. Lookups take no
+ * locks; a reload builds a new table, swaps it in atomically and frees the
+ * old one once every reader thread has passed a quiescent state (QSBR), so
+ * keys can be rotated while requests are being decoded.
+ *
+ * Every thread that looks up keys registers a sky_keystore_reader_t, and
+ * announces a quiescent state with sky_keystore_quiescent() when it holds
+ * no key pointers anymore (e.g. once per event loop iteration), or goes
+ * offline while it blocks for a long time.
+ *
+ * key file: one key per line as
+ *   partner_id aes_key_hex [keyid [relay_url [relay_cred]]]
+ * lines starting with '#' and blank lines are ignored.
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_KEYSTORE_H
+#define SKY_KEYSTORE_H
+
+#include <pthread.h>
+#include "sky_protocol.h"
+
+#define SKY_KEYSTORE_MAX_KEYS   (1 << 20)
+#define SKY_KEYSTORE_NO_FILE    (-2)    // sky_keystore_load(): the key file cannot be opened (see errno)
+
+struct sky_keystore_table_t;
+
+typedef struct sky_keystore_reader_s {
+    uint64_t epoch; // epoch of the last quiescent state, 0 while offline
+    struct sky_keystore_reader_s *next;
+} sky_keystore_reader_t;
+
+typedef struct sky_keystore_s {
+    struct sky_keystore_table_t *table;
+    uint64_t epoch;
+    pthread_mutex_t lock; // reloads and reader registration
+    sky_keystore_reader_t *readers;
+} sky_keystore_t;
+
+// initialize an empty key store
+void sky_keystore_init(sky_keystore_t *ks);
+
+// free the key store; no reader may use it anymore
+void sky_keystore_destroy(sky_keystore_t *ks);
+
+// replace the keys with the key_count keys, and wait until no reader can see the old ones
+// not to be called by an online reader, it would wait for itself
+// returns the number of keys, or -1 when fails (duplicate partner id, out of memory), leaving the
+// old keys in place
+int32_t sky_keystore_set(sky_keystore_t *ks, const struct sky_key_t *keys, uint32_t key_count);
+
+// replace the keys with the keys in the key file, see above
+// returns the number of keys, SKY_KEYSTORE_NO_FILE or -1 when fails, leaving the old keys in place;
+// line returns the line number of a malformed line or of a duplicate partner id (0 for other failures)
+int32_t sky_keystore_load(sky_keystore_t *ks, const char *path, uint32_t *line);
+
+// register the calling thread as a reader; it is online from now on
+void sky_keystore_register(sky_keystore_t *ks, sky_keystore_reader_t *reader);
+
+// unregister the calling thread
+void sky_keystore_unregister(sky_keystore_t *ks, sky_keystore_reader_t *reader);
+
+// the calling thread holds no key pointers anymore
+void sky_keystore_quiescent(sky_keystore_t *ks, sky_keystore_reader_t *reader);
+
+// the calling thread holds no key pointers, and looks up no keys until sky_keystore_online()
+void sky_keystore_offline(sky_keystore_t *ks, sky_keystore_reader_t *reader);
+void sky_keystore_online(sky_keystore_t *ks, sky_keystore_reader_t *reader);
+
+// returns the key of the partner, or NULL for an unknown partner
+// the key stays valid until the next quiescent state of the calling thread
+const struct sky_key_t *sky_keystore_lookup(sky_keystore_t *ks, uint32_t partner_id);
+
+// returns the key of the partner in the (unencrypted) request header, or NULL for an unknown partner
+const struct sky_key_t *sky_keystore_lookup_rq(sky_keystore_t *ks, uint8_t *buff, uint32_t buff_len);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
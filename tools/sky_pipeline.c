@@ -0,0 +1,339 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ * Multi-core request pipeline for servers, see sky_pipeline.h
+ *
+ * The workers and encoders decrypt and encrypt in parallel; build aes.c
+ * with -DAES_TLS=__thread.
+ ************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include "sky_crypt.h"
+#include "sky_pipeline.h"
+
+// spin, then yield, then sleep while there is nothing to do
+static void pipeline_idle(uint32_t *idle) {
+    if (++*idle < 64)
+        return;
+    if (*idle < 1024)
+        sched_yield();
+    else
+        usleep(50);
+}
+
+bool sky_spsc_init(sky_spsc_t *ring, uint32_t capacity) {
+    memset(ring, 0, sizeof(*ring));
+    ring->slots = calloc(capacity, sizeof(*ring->slots));
+    ring->mask = capacity - 1;
+    return ring->slots != NULL && (capacity & ring->mask) == 0;
+}
+
+void sky_spsc_free(sky_spsc_t *ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+bool sky_spsc_push(sky_spsc_t *ring, void *data) {
+    uint32_t tail = ring->tail; // only written by this thread
+    if (tail - ring->head_cache > ring->mask) {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->head_cache > ring->mask)
+            return false;
+    }
+    ring->slots[tail & ring->mask] = data;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void *sky_spsc_pop(sky_spsc_t *ring) {
+    uint32_t head = ring->head; // only written by this thread
+    if (head == ring->tail_cache) {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head == ring->tail_cache)
+            return NULL;
+    }
+    void *data = ring->slots[head & ring->mask];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return data;
+}
+
+bool sky_mpmc_init(sky_mpmc_t *ring, uint32_t capacity) {
+    uint32_t i;
+    memset(ring, 0, sizeof(*ring));
+    ring->cells = calloc(capacity, sizeof(*ring->cells));
+    ring->mask = capacity - 1;
+    if (ring->cells == NULL || (capacity & ring->mask) != 0)
+        return false;
+    for (i = 0; i < capacity; i++)
+        ring->cells[i].seq = i;
+    return true;
+}
+
+void sky_mpmc_free(sky_mpmc_t *ring) {
+    free(ring->cells);
+    ring->cells = NULL;
+}
+
+// a cell is free for position pos when its seq is pos, and holds the data of position pos when
+// its seq is pos + 1
+bool sky_mpmc_push(sky_mpmc_t *ring, void *data) {
+    uint32_t pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+    struct sky_mpmc_cell_t *cell;
+    for (;;) {
+        cell = &ring->cells[pos & ring->mask];
+        int32_t diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return false; // full
+        } else {
+            pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->data = data;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void *sky_mpmc_pop(sky_mpmc_t *ring) {
+    uint32_t pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+    struct sky_mpmc_cell_t *cell;
+    for (;;) {
+        cell = &ring->cells[pos & ring->mask];
+        int32_t diff = (int32_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->dequeue_pos, &pos, pos + 1, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return NULL; // empty
+        } else {
+            pos = __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    void *data = cell->data;
+    __atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    return data;
+}
+
+bool sky_buff_pool_init(sky_buff_pool_t *pool, uint32_t count) {
+    uint32_t capacity = 1, i;
+    memset(pool, 0, sizeof(*pool));
+    while (capacity < count)
+        capacity <<= 1;
+    // the return ring holds every buffer, so releasing never fails
+    if (count == 0 || !sky_mpmc_init(&pool->returned, capacity))
+        return false;
+    pool->buffs = aligned_alloc(SKY_CACHE_LINE, ((count * sizeof(sky_buff_t) + SKY_CACHE_LINE - 1)
+            / SKY_CACHE_LINE) * SKY_CACHE_LINE);
+    if (pool->buffs == NULL) {
+        sky_mpmc_free(&pool->returned);
+        return false;
+    }
+    pool->count = count;
+    pool->owner = pthread_self();
+    for (i = 0; i < count; i++) {
+        pool->buffs[i].pool = pool;
+        pool->buffs[i].next = pool->free;
+        pool->free = &pool->buffs[i];
+    }
+    return true;
+}
+
+void sky_buff_pool_free(sky_buff_pool_t *pool) {
+    free(pool->buffs);
+    sky_mpmc_free(&pool->returned);
+    memset(pool, 0, sizeof(*pool));
+}
+
+sky_buff_t *sky_buff_get(sky_buff_pool_t *pool) {
+    sky_buff_t *b = pool->free;
+    if (b == NULL) {
+        // take back the buffers released by other threads
+        while ((b = sky_mpmc_pop(&pool->returned)) != NULL) {
+            b->next = pool->free;
+            pool->free = b;
+        }
+        b = pool->free;
+        if (b == NULL)
+            return NULL;
+    }
+    pool->free = b->next;
+    b->len = 0;
+    b->status = 0;
+    b->conn = NULL;
+    return b;
+}
+
+void sky_buff_release(sky_buff_t *buff) {
+    sky_buff_pool_t *pool = buff->pool;
+    if (pthread_equal(pool->owner, pthread_self())) {
+        buff->next = pool->free;
+        pool->free = buff;
+    } else {
+        sky_mpmc_push(&pool->returned, buff);
+    }
+}
+
+// decrypt and decode the request in b and let the handler fill in the response
+static bool pipeline_decode(sky_pipeline_t *p, sky_buff_t *b) {
+    struct location_rq_t rq;
+    uint32_t header_len = 0;
+    const struct sky_key_t *key = sky_keystore_lookup_rq(p->keystore, b->data, b->len);
+    if (key == NULL || sky_get_frame_len(b->data, b->len, true, &header_len) != (int32_t)b->len)
+        return false;
+    memcpy(b->aes_key, key->aes_key, sizeof(b->aes_key));
+    if (sky_aes_decrypt(b->data + header_len, b->len - header_len - sizeof(sky_checksum_t),
+            b->aes_key, b->data + header_len - sizeof(rq.header.iv)) != 0)
+        return false;
+    memset(&rq, 0, sizeof(rq));
+    if (sky_decode_req_bin(b->data, b->len, &rq) < 0)
+        return false;
+    memset(&b->rsp, 0, sizeof(b->rsp));
+    b->rsp.header.version = rq.header.version;
+    b->rsp.request_id = rq.request_id;
+    return p->handle(p->ctx, &rq, &b->rsp);
+}
+
+static void *pipeline_work(void *arg) {
+    struct sky_pipeline_worker_t *w = arg;
+    sky_pipeline_t *p = w->pipeline;
+    sky_keystore_reader_t reader;
+    uint32_t idle = 0;
+    sky_keystore_register(p->keystore, &reader);
+    for (;;) {
+        sky_buff_t *b = sky_mpmc_pop(&p->input);
+        if (b == NULL) {
+            if (__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE))
+                break;
+            // no keys are held while idle
+            sky_keystore_offline(p->keystore, &reader);
+            pipeline_idle(&idle);
+            sky_keystore_online(p->keystore, &reader);
+            continue;
+        }
+        idle = 0;
+        b->status = pipeline_decode(p, b) ? 0 : -1;
+        sky_keystore_quiescent(p->keystore, &reader);
+        while (!sky_spsc_push(&w->out, b))
+            pipeline_idle(&idle);
+        idle = 0;
+    }
+    sky_keystore_unregister(p->keystore, &reader);
+    return NULL;
+}
+
+// encode and encrypt the response to the request in b; returns the response or NULL when fails
+static sky_buff_t *pipeline_encode(struct sky_pipeline_encoder_t *e, sky_buff_t *b) {
+    sky_buff_t *r;
+    uint32_t idle = 0, header_len = 0;
+    if (b->status != 0)
+        return NULL;
+    while ((r = sky_buff_get(&e->pool)) == NULL)
+        pipeline_idle(&idle); // wait for the done callback to release responses
+    int32_t n = sky_encode_resp_bin(r->data, sizeof(r->data), &b->rsp);
+    if (n < 0 || sky_get_frame_len(r->data, n, false, &header_len) != n
+            || sky_aes_encrypt(r->data + header_len, n - header_len - sizeof(sky_checksum_t),
+                    b->aes_key, r->data + header_len - sizeof(b->rsp.header.iv)) != 0) {
+        sky_buff_release(r);
+        return NULL;
+    }
+    r->len = n;
+    r->conn = b->conn;
+    return r;
+}
+
+static void *pipeline_encode_loop(void *arg) {
+    struct sky_pipeline_encoder_t *e = arg;
+    sky_pipeline_t *p = e->pipeline;
+    uint32_t idle = 0, i;
+    e->pool.owner = pthread_self();
+    for (;;) {
+        bool busy = false;
+        bool done = __atomic_load_n(&p->workers_done, __ATOMIC_ACQUIRE);
+        // the rings of workers index, index + encoder_count, ...
+        for (i = e->index; i < p->worker_count; i += p->encoder_count) {
+            sky_buff_t *b = sky_spsc_pop(&p->workers[i].out);
+            if (b == NULL)
+                continue;
+            busy = true;
+            sky_buff_t *r = pipeline_encode(e, b);
+            void *conn = b->conn;
+            sky_buff_release(b);
+            p->done(p->ctx, conn, r, r != NULL ? 0 : -1);
+        }
+        if (busy) {
+            idle = 0;
+        } else if (done) {
+            break; // every ring was empty after the workers stopped
+        } else {
+            pipeline_idle(&idle);
+        }
+    }
+    return NULL;
+}
+
+bool sky_pipeline_start(sky_pipeline_t *p, uint32_t worker_count, uint32_t encoder_count,
+        sky_keystore_t *keystore, sky_pipeline_handler_fn handle, sky_pipeline_done_fn done, void *ctx) {
+    uint32_t i;
+    memset(p, 0, sizeof(*p));
+    if (worker_count == 0 || encoder_count == 0 || encoder_count > worker_count)
+        return false;
+    p->worker_count = worker_count;
+    p->encoder_count = encoder_count;
+    p->keystore = keystore;
+    p->handle = handle;
+    p->done = done;
+    p->ctx = ctx;
+    p->workers = calloc(worker_count, sizeof(*p->workers));
+    p->encoders = calloc(encoder_count, sizeof(*p->encoders));
+    if (p->workers == NULL || p->encoders == NULL || !sky_mpmc_init(&p->input, SKY_PIPELINE_RING))
+        return false;
+    for (i = 0; i < worker_count; i++) {
+        p->workers[i].pipeline = p;
+        p->workers[i].index = i;
+        if (!sky_spsc_init(&p->workers[i].out, SKY_PIPELINE_RING))
+            return false;
+    }
+    for (i = 0; i < encoder_count; i++) {
+        // enough responses for the rings of its workers, and as many on the way to the clients
+        uint32_t rings = (worker_count - i + encoder_count - 1) / encoder_count;
+        p->encoders[i].pipeline = p;
+        p->encoders[i].index = i;
+        if (!sky_buff_pool_init(&p->encoders[i].pool, 2 * rings * SKY_PIPELINE_RING))
+            return false;
+    }
+    for (i = 0; i < encoder_count; i++)
+        if (pthread_create(&p->encoders[i].thread, NULL, pipeline_encode_loop, &p->encoders[i]) != 0)
+            return false;
+    for (i = 0; i < worker_count; i++)
+        if (pthread_create(&p->workers[i].thread, NULL, pipeline_work, &p->workers[i]) != 0)
+            return false;
+    return true;
+}
+
+bool sky_pipeline_submit(sky_pipeline_t *p, sky_buff_t *rq) {
+    return sky_mpmc_push(&p->input, rq);
+}
+
+void sky_pipeline_stop(sky_pipeline_t *p) {
+    uint32_t i;
+    __atomic_store_n(&p->stop, true, __ATOMIC_RELEASE);
+    for (i = 0; i < p->worker_count; i++)
+        pthread_join(p->workers[i].thread, NULL);
+    __atomic_store_n(&p->workers_done, true, __ATOMIC_RELEASE);
+    for (i = 0; i < p->encoder_count; i++)
+        pthread_join(p->encoders[i].thread, NULL);
+    for (i = 0; i < p->worker_count; i++)
+        sky_spsc_free(&p->workers[i].out);
+    for (i = 0; i < p->encoder_count; i++)
+        sky_buff_pool_free(&p->encoders[i].pool);
+    sky_mpmc_free(&p->input);
+    free(p->workers);
+    free(p->encoders);
+    memset(p, 0, sizeof(*p));
+}
@@ -0,0 +1,163 @@
+/************************************************
+ * Company: Skyhook Wireless
+ *
+ * Multi-core request pipeline for servers:
+ *
+ *   reader threads --MPMC ring--> decode workers --SPSC rings--> encoders --> done callback
+ *
+ * Reader threads take a buffer from their own pool, read a whole request
+ * frame into it and submit it. A pool of decode workers looks up the key of
+ * the partner (sky_keystore_t), decrypts and decodes the request, and calls
+ * the handler to fill in the response. Every worker hands its requests on
+ * through its own SPSC ring to one of the encoders, which encodes and
+ * encrypts the response into a buffer of its own pool and passes it to the
+ * done callback.
+ *
+ * Buffers are SKY_PROT_BUFF_LEN bytes, preallocated per thread and
+ * recycled: a buffer released by its owner thread goes back to the free
+ * list directly, one released by another thread through the lock-free
+ * return ring of its pool.
+ *
+ * Requests are spread over the workers, so the responses to requests
+ * pipelined on one connection may complete out of order; version 2
+ * clients match them by request id.
+ ************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SKY_PIPELINE_H
+#define SKY_PIPELINE_H
+
+#include <pthread.h>
+#include "sky_protocol.h"
+#include "sky_keystore.h"
+
+#define SKY_CACHE_LINE      64
+#define SKY_PIPELINE_RING   1024 // requests queued per ring
+
+// single producer single consumer ring of pointers
+typedef struct {
+    void **slots;
+    uint32_t mask;
+    uint32_t head __attribute__((aligned(SKY_CACHE_LINE))); // next to pop, written by the consumer
+    uint32_t tail_cache;                                     // consumer's copy of tail
+    uint32_t tail __attribute__((aligned(SKY_CACHE_LINE))); // next to push, written by the producer
+    uint32_t head_cache;                                     // producer's copy of head
+} sky_spsc_t;
+
+// multi producer multi consumer ring of pointers (bounded queue with per slot sequence numbers)
+struct sky_mpmc_cell_t {
+    uint32_t seq;
+    void *data;
+};
+
+typedef struct {
+    struct sky_mpmc_cell_t *cells;
+    uint32_t mask;
+    uint32_t enqueue_pos __attribute__((aligned(SKY_CACHE_LINE)));
+    uint32_t dequeue_pos __attribute__((aligned(SKY_CACHE_LINE)));
+} sky_mpmc_t;
+
+struct sky_buff_pool_s;
+
+// request or response buffer
+typedef struct sky_buff_s {
+    uint8_t data[SKY_PROT_BUFF_LEN];
+    uint32_t len;
+    int32_t status;                 // 0, or -1 when the request failed to decrypt, decode or encode
+    void *conn;                     // connection of the request, passed on to the response
+    struct sky_buff_pool_s *pool;   // owner
+    struct sky_buff_s *next;        // in the free list of the owner
+    uint8_t aes_key[16];            // key of the partner, for encrypting the response
+    struct location_rsp_t rsp;      // response filled in by the handler, may point into data
+} sky_buff_t;
+
+typedef struct sky_buff_pool_s {
+    sky_buff_t *buffs;
+    uint32_t count;
+    pthread_t owner;
+    sky_buff_t *free;  // used by the owner thread only
+    sky_mpmc_t returned; // released by other threads
+} sky_buff_pool_t;
+
+// fills in the response to the decoded request; returns false to fail the request
+// called on a worker thread
+typedef bool (*sky_pipeline_handler_fn)(void *ctx, struct location_rq_t *rq, struct location_rsp_t *rsp);
+
+// takes the encrypted response frame in rsp (rsp->len bytes, release it with sky_buff_release()),
+// or rsp NULL and status -1 when the request failed
+// called on an encoder thread
+typedef void (*sky_pipeline_done_fn)(void *ctx, void *conn, sky_buff_t *rsp, int32_t status);
+
+struct sky_pipeline_s;
+
+struct sky_pipeline_worker_t {
+    struct sky_pipeline_s *pipeline;
+    pthread_t thread;
+    sky_spsc_t out; // to the encoder
+    uint32_t index;
+};
+
+struct sky_pipeline_encoder_t {
+    struct sky_pipeline_s *pipeline;
+    pthread_t thread;
+    sky_buff_pool_t pool; // response buffers
+    uint32_t index;
+};
+
+typedef struct sky_pipeline_s {
+    uint32_t worker_count;
+    uint32_t encoder_count;
+    sky_keystore_t *keystore;
+    sky_pipeline_handler_fn handle;
+    sky_pipeline_done_fn done;
+    void *ctx;
+    sky_mpmc_t input;
+    struct sky_pipeline_worker_t *workers;
+    struct sky_pipeline_encoder_t *encoders;
+    volatile bool stop;         // workers stop once the input is empty
+    volatile bool workers_done; // encoders stop once their rings are empty
+} sky_pipeline_t;
+
+bool sky_spsc_init(sky_spsc_t *ring, uint32_t capacity); // capacity is a power of 2
+void sky_spsc_free(sky_spsc_t *ring);
+bool sky_spsc_push(sky_spsc_t *ring, void *data);        // false when full
+void *sky_spsc_pop(sky_spsc_t *ring);                    // NULL when empty
+
+bool sky_mpmc_init(sky_mpmc_t *ring, uint32_t capacity); // capacity is a power of 2
+void sky_mpmc_free(sky_mpmc_t *ring);
+bool sky_mpmc_push(sky_mpmc_t *ring, void *data);        // false when full
+void *sky_mpmc_pop(sky_mpmc_t *ring);                    // NULL when empty
+
+// allocate count buffers for the calling thread, which becomes the owner of the pool
+bool sky_buff_pool_init(sky_buff_pool_t *pool, uint32_t count);
+
+// free the buffers; none may be in use anymore
+void sky_buff_pool_free(sky_buff_pool_t *pool);
+
+// returns a free buffer of the pool of the calling thread, or NULL when all are in use
+sky_buff_t *sky_buff_get(sky_buff_pool_t *pool);
+
+// give the buffer back to its pool; may be called by any thread
+void sky_buff_release(sky_buff_t *buff);
+
+// start worker_count decode workers and encoder_count encoders
+// returns false when fails
+bool sky_pipeline_start(sky_pipeline_t *p, uint32_t worker_count, uint32_t encoder_count,
+        sky_keystore_t *keystore, sky_pipeline_handler_fn handle, sky_pipeline_done_fn done, void *ctx);
+
+// submit the request frame in rq (rq->len bytes, rq->conn set by the caller); the pipeline
+// releases rq
+// returns false when the pipeline is full, the caller keeps rq then
+bool sky_pipeline_submit(sky_pipeline_t *p, sky_buff_t *rq);
+
+// stop the threads once the submitted requests are done, and free the pipeline
+void sky_pipeline_stop(sky_pipeline_t *p);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif